@@ -1,43 +1,343 @@
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define NAM_LUT_X86
+#if defined(__GNUC__) || defined(__clang__)
+// Compiles the kernel for these features whatever the target, so the choice can be made when the program runs.
+#define NAM_TARGET(features) __attribute__((target(features)))
+#else
+// MSVC will emit intrinsics in any function.
+#define NAM_TARGET(features)
+#endif
+#endif
+
 #include "activations.h"
 
+namespace
+{
+// Solves the n x n system a * x = b in place (Gaussian elimination with partial pivoting); x ends up in b.
+void _solve(double a[4][4], double b[4], const int n)
+{
+  for (int col = 0; col < n; col++)
+  {
+    int pivot = col;
+    for (int row = col + 1; row < n; row++)
+      if (std::fabs(a[row][col]) > std::fabs(a[pivot][col]))
+        pivot = row;
+    std::swap(a[col], a[pivot]);
+    std::swap(b[col], b[pivot]);
+    for (int row = col + 1; row < n; row++)
+    {
+      const double factor = a[row][col] / a[col][col];
+      for (int k = col; k < n; k++)
+        a[row][k] -= factor * a[col][k];
+      b[row] -= factor * b[col];
+    }
+  }
+  for (int row = n - 1; row >= 0; row--)
+  {
+    for (int k = row + 1; k < n; k++)
+      b[row] -= a[row][k] * b[k];
+    b[row] /= a[row][row];
+  }
+}
+
+#ifdef NAM_LUT_X86
+// Each lane's entry (index in [0, 32)) of a 32-entry table
+NAM_TARGET("avx512f") inline __m512 _select(const float* table, const __m512i index)
+{
+  return _mm512_permutex2var_ps(_mm512_loadu_ps(table), index, _mm512_loadu_ps(table + 16));
+}
+
+NAM_TARGET("avx2,fma") inline __m256 _select(const float* table, const __m256i index)
+{
+  // permutevar8x32 only looks at the low three bits; bits 3 and 4 pick the quarter via the blends' sign test.
+  const __m256 bit3 = _mm256_castsi256_ps(_mm256_slli_epi32(index, 28));
+  const __m256 bit4 = _mm256_castsi256_ps(_mm256_slli_epi32(index, 27));
+  const __m256 low = _mm256_blendv_ps(_mm256_permutevar8x32_ps(_mm256_loadu_ps(table), index),
+                                      _mm256_permutevar8x32_ps(_mm256_loadu_ps(table + 8), index), bit3);
+  const __m256 high = _mm256_blendv_ps(_mm256_permutevar8x32_ps(_mm256_loadu_ps(table + 16), index),
+                                       _mm256_permutevar8x32_ps(_mm256_loadu_ps(table + 24), index), bit3);
+  return _mm256_blendv_ps(low, high, bit4);
+}
+#endif
+
+// Which ActivationLUT kernel this machine can run
+enum class LUTKernel
+{
+  kScalar,
+  kAVX2,
+  kAVX512
+};
+
+LUTKernel _get_lut_kernel()
+{
+#if defined(NAM_LUT_X86) && (defined(__GNUC__) || defined(__clang__))
+  // Needed because this may run from a static constructor.
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return LUTKernel::kAVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return LUTKernel::kAVX2;
+#elif defined(NAM_LUT_X86) && defined(__AVX512F__)
+  return LUTKernel::kAVX512;
+#elif defined(NAM_LUT_X86) && defined(__AVX2__)
+  return LUTKernel::kAVX2;
+#endif
+  return LUTKernel::kScalar;
+}
+
+const LUTKernel _LUT_KERNEL = _get_lut_kernel();
+}; // namespace
+
 nam::activations::ActivationTanh _TANH = nam::activations::ActivationTanh();
 nam::activations::ActivationFastTanh _FAST_TANH = nam::activations::ActivationFastTanh();
 nam::activations::ActivationHardTanh _HARD_TANH = nam::activations::ActivationHardTanh();
 nam::activations::ActivationReLU _RELU = nam::activations::ActivationReLU();
 nam::activations::ActivationSigmoid _SIGMOID = nam::activations::ActivationSigmoid();
+nam::activations::ActivationFastSigmoid _FAST_SIGMOID = nam::activations::ActivationFastSigmoid();
+nam::activations::ActivationHardSigmoid _HARD_SIGMOID = nam::activations::ActivationHardSigmoid();
+nam::activations::ActivationLUT _LUT_TANH =
+  nam::activations::ActivationLUT(nam::activations::ActivationLUT::Function::kTanh);
+nam::activations::ActivationLUT _LUT_SIGMOID =
+  nam::activations::ActivationLUT(nam::activations::ActivationLUT::Function::kSigmoid);
 
-bool nam::activations::Activation::using_fast_tanh = false;
+const std::unordered_map<std::string, nam::activations::Activation*> nam::activations::Activation::_activations = {
+  {"Tanh", &_TANH},       {"Hardtanh", &_HARD_TANH}, {"Fasttanh", &_FAST_TANH},       {"LUTtanh", &_LUT_TANH},
+  {"ReLU", &_RELU},       {"Sigmoid", &_SIGMOID},    {"LUTsigmoid", &_LUT_SIGMOID}};
 
-std::unordered_map<std::string, nam::activations::Activation*> nam::activations::Activation::_activations =
-  {{"Tanh", &_TANH}, {"Hardtanh", &_HARD_TANH}, {"Fasttanh", &_FAST_TANH}, {"ReLU", &_RELU}, {"Sigmoid", &_SIGMOID}};
+std::atomic<nam::activations::Precision> nam::activations::Activation::_default_precision{
+  nam::activations::Precision::kAccurate};
 
-nam::activations::Activation* tanh_bak = nullptr;
+const char* nam::activations::get_precision_name(const Precision precision)
+{
+  switch (precision)
+  {
+    case Precision::kAccurate: return "accurate";
+    case Precision::kFast: return "fast";
+    case Precision::kLUT: return "lut";
+    case Precision::kHardClip: return "hard-clip";
+    default: return "unknown";
+  }
+}
 
-nam::activations::Activation* nam::activations::Activation::get_activation(const std::string name)
+nam::activations::Precision nam::activations::get_precision(const std::string& name)
+{
+  for (const Precision precision : {Precision::kAccurate, Precision::kFast, Precision::kLUT, Precision::kHardClip})
+    if (name == get_precision_name(precision))
+      return precision;
+  throw std::runtime_error("Unrecognized activation precision " + name);
+}
+
+nam::activations::ActivationLUT::ActivationLUT(const Function function, const Interpolation interpolation,
+                                               const float max_x)
+: _function(function)
+, _interpolation(interpolation)
 {
-  if (_activations.find(name) == _activations.end())
-    return nullptr;
+  const bool sigmoid = function == Function::kSigmoid;
+  // By default, as far as the function is still visibly (>2e-7) short of its limit in float
+  this->_max_x = max_x > 0.0f ? max_x : (sigmoid ? 16.0f : 8.0f);
+  this->_input_scale = sigmoid ? 0.5f : 1.0f;
+  this->_output_scale = sigmoid ? 0.5f : 1.0f;
+  this->_output_offset = sigmoid ? 0.5f : 0.0f;
+  this->_max_t = this->_max_x * this->_input_scale;
+  this->_inv_width = (float)kNumSegments / this->_max_t;
 
-  return _activations[name];
+  const int order = interpolation == Interpolation::kCubic ? 4 : 2;
+  const double pi = std::acos(-1.0);
+  const double width = (double)this->_max_t / kNumSegments;
+  for (int segment = 0; segment < kNumSegments; segment++)
+  {
+    // Interpolate at the Chebyshev nodes of the segment.
+    double vandermonde[4][4];
+    double coefficients[4];
+    for (int node = 0; node < order; node++)
+    {
+      const double t = 0.5 - 0.5 * std::cos((2.0 * node + 1.0) * pi / (2.0 * order));
+      double power = 1.0;
+      for (int k = 0; k < order; k++, power *= t)
+        vandermonde[node][k] = power;
+      coefficients[node] = std::tanh((segment + t) * width);
+    }
+    _solve(vandermonde, coefficients, order);
+    for (int k = 0; k < 4; k++)
+      this->_coefficients[k][segment] = k < order ? (float)coefficients[k] : 0.0f;
+  }
+  // Exactly through the origin, so that the polynomial is never negative and restoring the sign is just an OR
+  this->_coefficients[0][0] = 0.0f;
 }
 
-void nam::activations::Activation::enable_fast_tanh()
+float nam::activations::ActivationLUT::evaluate(const float x) const
+{
+  float t = std::fabs(x) * this->_input_scale;
+  // Also catches NaN, like the SIMD min does
+  if (!(t < this->_max_t))
+    t = this->_max_t;
+  const float position = t * this->_inv_width;
+  const int i = std::min((int)position, kNumSegments - 1);
+  const float u = position - (float)i;
+  const float(&c)[4][kNumSegments] = this->_coefficients;
+  const float y = ((c[3][i] * u + c[2][i]) * u + c[1][i]) * u + c[0][i];
+  return std::copysign(y, x) * this->_output_scale + this->_output_offset;
+}
+
+void nam::activations::ActivationLUT::apply(float* data, long size)
 {
-  nam::activations::Activation::using_fast_tanh = true;
+  long pos = 0;
+#ifdef NAM_LUT_X86
+  if (_LUT_KERNEL == LUTKernel::kAVX512)
+    pos = this->_apply_avx512(data, size);
+  else if (_LUT_KERNEL == LUTKernel::kAVX2)
+    pos = this->_apply_avx2(data, size);
+#endif
+  for (; pos < size; pos++)
+    data[pos] = this->evaluate(data[pos]);
+}
 
-  if (_activations["Tanh"] != _activations["Fasttanh"])
+#ifdef NAM_LUT_X86
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC 12's AVX-512 intrinsics start from _mm512_undefined_*(), which trips this.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+NAM_TARGET("avx512f") long nam::activations::ActivationLUT::_apply_avx512(float* data, const long size) const
+{
+  const bool cubic = this->_interpolation == Interpolation::kCubic;
+  const __m512 input_scale = _mm512_set1_ps(this->_input_scale);
+  const __m512 max_t = _mm512_set1_ps(this->_max_t);
+  const __m512 inv_width = _mm512_set1_ps(this->_inv_width);
+  const __m512 output_scale = _mm512_set1_ps(this->_output_scale);
+  const __m512 output_offset = _mm512_set1_ps(this->_output_offset);
+  const __m512i last = _mm512_set1_epi32(kNumSegments - 1);
+  const __m512i sign_mask = _mm512_set1_epi32(0x80000000);
+  long pos = 0;
+  for (; pos + 16 <= size; pos += 16)
   {
-    tanh_bak = _activations["Tanh"];
-    _activations["Tanh"] = _activations["Fasttanh"];
+    const __m512 x = _mm512_loadu_ps(data + pos);
+    const __m512i sign = _mm512_and_si512(_mm512_castps_si512(x), sign_mask);
+    // min returns its second operand for NaN, so NaN comes out as the value at max_x.
+    const __m512 t = _mm512_min_ps(_mm512_mul_ps(_mm512_abs_ps(x), input_scale), max_t);
+    const __m512 position = _mm512_mul_ps(t, inv_width);
+    const __m512i i = _mm512_min_epi32(_mm512_cvttps_epi32(position), last);
+    const __m512 u = _mm512_sub_ps(position, _mm512_cvtepi32_ps(i));
+    __m512 y;
+    if (cubic)
+    {
+      y = _mm512_fmadd_ps(_select(this->_coefficients[3], i), u, _select(this->_coefficients[2], i));
+      y = _mm512_fmadd_ps(y, u, _select(this->_coefficients[1], i));
+    }
+    else
+      y = _select(this->_coefficients[1], i);
+    y = _mm512_fmadd_ps(y, u, _select(this->_coefficients[0], i));
+    y = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(y), sign));
+    _mm512_storeu_ps(data + pos, _mm512_fmadd_ps(y, output_scale, output_offset));
   }
+  return pos;
 }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 
-void nam::activations::Activation::disable_fast_tanh()
+NAM_TARGET("avx2,fma") long nam::activations::ActivationLUT::_apply_avx2(float* data, const long size) const
 {
-  nam::activations::Activation::using_fast_tanh = false;
+  const bool cubic = this->_interpolation == Interpolation::kCubic;
+  const __m256 input_scale = _mm256_set1_ps(this->_input_scale);
+  const __m256 max_t = _mm256_set1_ps(this->_max_t);
+  const __m256 inv_width = _mm256_set1_ps(this->_inv_width);
+  const __m256 output_scale = _mm256_set1_ps(this->_output_scale);
+  const __m256 output_offset = _mm256_set1_ps(this->_output_offset);
+  const __m256i last = _mm256_set1_epi32(kNumSegments - 1);
+  const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+  long pos = 0;
+  for (; pos + 8 <= size; pos += 8)
+  {
+    const __m256 x = _mm256_loadu_ps(data + pos);
+    const __m256 sign = _mm256_and_ps(x, sign_mask);
+    const __m256 t = _mm256_min_ps(_mm256_mul_ps(_mm256_andnot_ps(sign_mask, x), input_scale), max_t);
+    const __m256 position = _mm256_mul_ps(t, inv_width);
+    const __m256i i = _mm256_min_epi32(_mm256_cvttps_epi32(position), last);
+    const __m256 u = _mm256_sub_ps(position, _mm256_cvtepi32_ps(i));
+    __m256 y;
+    if (cubic)
+    {
+      y = _mm256_fmadd_ps(_select(this->_coefficients[3], i), u, _select(this->_coefficients[2], i));
+      y = _mm256_fmadd_ps(y, u, _select(this->_coefficients[1], i));
+    }
+    else
+      y = _select(this->_coefficients[1], i);
+    y = _mm256_fmadd_ps(y, u, _select(this->_coefficients[0], i));
+    y = _mm256_or_ps(y, sign);
+    _mm256_storeu_ps(data + pos, _mm256_fmadd_ps(y, output_scale, output_offset));
+  }
+  return pos;
+}
+#endif
 
-  if (_activations["Tanh"] == _activations["Fasttanh"])
+double nam::activations::ActivationLUT::get_max_error() const
+{
+  const int num_points = 1 << 16;
+  const double extent = 1.25 * this->_max_x;
+  double max_error = 0.0;
+  for (int i = 0; i <= num_points; i++)
   {
-    _activations["Tanh"] = tanh_bak;
+    const double x = -extent + 2.0 * extent * i / num_points;
+    const double expected =
+      this->_function == Function::kSigmoid ? 1.0 / (1.0 + std::exp(-x)) : std::tanh(x);
+    max_error = std::max(max_error, std::fabs((double)this->evaluate((float)x) - expected));
   }
+  return max_error;
+}
+
+nam::activations::Activation* nam::activations::Activation::get_activation(const std::string name,
+                                                                           const Precision precision)
+{
+  if (name == "Tanh")
+  {
+    switch (precision)
+    {
+      case Precision::kFast: return &_FAST_TANH;
+      case Precision::kLUT: return &_LUT_TANH;
+      case Precision::kHardClip: return &_HARD_TANH;
+      default: return &_TANH;
+    }
+  }
+  if (name == "Sigmoid")
+  {
+    switch (precision)
+    {
+      case Precision::kFast: return &_FAST_SIGMOID;
+      case Precision::kLUT: return &_LUT_SIGMOID;
+      case Precision::kHardClip: return &_HARD_SIGMOID;
+      default: return &_SIGMOID;
+    }
+  }
+  auto it = _activations.find(name);
+  return it == _activations.end() ? nullptr : it->second;
+}
+
+nam::activations::Activation* nam::activations::Activation::get_activation(const std::string name)
+{
+  return get_activation(name, get_default_precision());
+}
+
+nam::activations::Precision nam::activations::Activation::get_default_precision()
+{
+  return _default_precision.load(std::memory_order_relaxed);
+}
+
+void nam::activations::Activation::set_default_precision(const Precision precision)
+{
+  _default_precision.store(precision, std::memory_order_relaxed);
+}
+
+void nam::activations::Activation::enable_fast_tanh()
+{
+  set_default_precision(Precision::kFast);
+}
+
+void nam::activations::Activation::disable_fast_tanh()
+{
+  set_default_precision(Precision::kAccurate);
 }
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <algorithm> // std::min, std::max
+#include <atomic>
 #include <string>
 #include <cmath> // expf
 #include <unordered_map>
+#include <vector>
 #include <Eigen/Dense>
 
+#include "profiler.h"
+
 namespace nam
 {
 namespace activations
@@ -39,27 +44,84 @@ inline float fast_sigmoid(const float x)
   return 0.5f * (fast_tanh(x * 0.5f) + 1.0f);
 }
 
+// Straight line through sigmoid(0) with the same slope, clipped to [0, 1]
+inline float hard_sigmoid(const float x)
+{
+  const float t = 0.5f + 0.25f * x;
+  return t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+}
+
+// How a model evaluates its smooth nonlinearities (tanh and sigmoid). The others (ReLU, Hardtanh, ...) are exact
+// whatever the precision.
+// * kAccurate: the standard library
+// * kFast: a rational approximation (fast_tanh(), fast_sigmoid())
+// * kLUT: piecewise cubics from a small table (ActivationLUT)
+// * kHardClip: the piecewise-linear hard_tanh() and hard_sigmoid(). This changes the model's sound, not just its
+//   precision.
+// Models bind their activations when they're constructed, so different instances can use different precisions.
+enum class Precision
+{
+  kAccurate = 0,
+  kFast,
+  kLUT,
+  kHardClip
+};
+
+// "accurate", "fast", "lut" or "hard-clip"
+const char* get_precision_name(const Precision precision);
+// Inverse of get_precision_name(); throws std::runtime_error for anything else.
+Precision get_precision(const std::string& name);
+
 
 class Activation
 {
 public:
   Activation() = default;
   virtual ~Activation() = default;
-  virtual void apply(Eigen::MatrixXf& matrix) { apply(matrix.data(), matrix.rows() * matrix.cols()); }
-  virtual void apply(Eigen::Block<Eigen::MatrixXf> block) { apply(block.data(), block.rows() * block.cols()); }
+  virtual void apply(Eigen::MatrixXf& matrix)
+  {
+    NAM_PROFILE_STAGE(kActivation);
+    apply(matrix.data(), matrix.rows() * matrix.cols());
+  }
+  virtual void apply(Eigen::Block<Eigen::MatrixXf> block)
+  {
+    NAM_PROFILE_STAGE(kActivation);
+    apply(block.data(), block.rows() * block.cols());
+  }
   virtual void apply(Eigen::Block<Eigen::MatrixXf, -1, -1, true> block)
   {
+    NAM_PROFILE_STAGE(kActivation);
     apply(block.data(), block.rows() * block.cols());
   }
+  // E.g. arena-backed matrices and their blocks
+  virtual void apply(Eigen::Ref<Eigen::MatrixXf> matrix)
+  {
+    NAM_PROFILE_STAGE(kActivation);
+    // Blocks that don't span whole columns aren't contiguous.
+    if (matrix.outerStride() == matrix.rows())
+      apply(matrix.data(), matrix.rows() * matrix.cols());
+    else
+      for (long j = 0; j < matrix.cols(); j++)
+        apply(matrix.col(j).data(), matrix.rows());
+  }
   virtual void apply(float* data, long size) {}
 
+  // The activation called `name` (e.g. "Tanh") evaluated at `precision`, or nullptr if there's no such activation.
+  // Activations are stateless and shared, and this doesn't modify anything, so it's safe to call from any thread.
+  static Activation* get_activation(const std::string name, const Precision precision);
+  // As above, at the default precision
   static Activation* get_activation(const std::string name);
+  // The precision that models get when they're constructed without one. Prefer passing a precision to get_dsp();
+  // these only change what later-constructed models get by default.
+  static Precision get_default_precision();
+  static void set_default_precision(const Precision precision);
+  // Same as set_default_precision(Precision::kFast) and (Precision::kAccurate)
   static void enable_fast_tanh();
   static void disable_fast_tanh();
-  static bool using_fast_tanh;
 
 protected:
-  static std::unordered_map<std::string, Activation*> _activations;
+  static const std::unordered_map<std::string, Activation*> _activations;
+  static std::atomic<Precision> _default_precision;
 };
 
 class ActivationTanh : public Activation
@@ -121,5 +183,91 @@ public:
     }
   }
 };
+
+class ActivationFastSigmoid : public Activation
+{
+public:
+  void apply(float* data, long size) override
+  {
+    for (long pos = 0; pos < size; pos++)
+    {
+      data[pos] = fast_sigmoid(data[pos]);
+    }
+  }
+};
+
+class ActivationHardSigmoid : public Activation
+{
+public:
+  void apply(float* data, long size) override
+  {
+    for (long pos = 0; pos < size; pos++)
+    {
+      data[pos] = hard_sigmoid(data[pos]);
+    }
+  }
+};
+
+// Tanh or sigmoid from a table of kNumSegments polynomial pieces covering [0, max_x] uniformly. Tanh is odd and
+// sigmoid(x) = (1 + tanh(x / 2)) / 2, so one tanh table serves both signs and both functions. Each piece is fit at
+// Chebyshev nodes, so it's close to the minimax polynomial for its segment. Beyond max_x the output holds at the
+// value at max_x.
+//
+// The table is small enough to live in vector registers, so the SIMD kernels select each lane's coefficients with
+// permutes rather than gathers (AVX-512F: one permutex2var per coefficient; AVX2: four permutevar8x32 and three
+// blends). On x86-64 they're compiled whatever the target flags and picked by what the CPU supports; elsewhere it's
+// the same math one sample at a time.
+//
+// Max |error| against the double-precision function, with the defaults (max_x = 8 for tanh, 16 for sigmoid):
+// * kCubic: 5.2e-6 for tanh and 2.6e-6 for sigmoid (Fasttanh is good to about 1e-4)
+// * kLinear: 3.0e-3 for tanh and 1.5e-3 for sigmoid
+// The error of other configurations is reported by get_max_error().
+class ActivationLUT : public Activation
+{
+public:
+  enum class Function
+  {
+    kTanh = 0,
+    kSigmoid
+  };
+  enum class Interpolation
+  {
+    kLinear = 0,
+    kCubic
+  };
+  static constexpr int kNumSegments = 32;
+
+  // Covers |x| <= max_x of `function`'s input.
+  ActivationLUT(const Function function, const Interpolation interpolation = Interpolation::kCubic,
+                const float max_x = -1.0f);
+  void apply(float* data, long size) override;
+  // One sample, on the scalar path
+  float evaluate(const float x) const;
+  // Max |error| against the double-precision function over [-1.25 max_x, 1.25 max_x]. Sweeps densely, so it's
+  // not for the audio thread.
+  double get_max_error() const;
+  Function get_function() const { return this->_function; };
+  Interpolation get_interpolation() const { return this->_interpolation; };
+  float get_max_x() const { return this->_max_x; };
+
+private:
+  // Coefficient k of each segment's polynomial in its local coordinate t in [0, 1), stored per coefficient so that
+  // each is one contiguous run of kNumSegments floats. Linear pieces leave 2 and 3 at zero.
+  alignas(64) float _coefficients[4][kNumSegments];
+  Function _function;
+  Interpolation _interpolation;
+  float _max_x;
+  // tanh(x * _input_scale) * _output_scale + _output_offset
+  float _input_scale;
+  float _output_scale;
+  float _output_offset;
+  // The table covers tanh over [0, _max_t], in segments of width 1 / _inv_width
+  float _max_t;
+  float _inv_width;
+
+  // SIMD kernels: each processes a prefix of data and returns how much, leaving the rest for evaluate().
+  long _apply_avx512(float* data, const long size) const;
+  long _apply_avx2(float* data, const long size) const;
+};
 }; // namespace activations
 }; // namespace nam
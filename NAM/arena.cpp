@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cstring> // memcpy, memset
+#include <new> // placement new
+#include <stdexcept>
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#include "arena.h"
+
+namespace
+{
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+size_t _round_up(const size_t x, const size_t multiple)
+{
+  return (x + multiple - 1) / multiple * multiple;
+}
+
+size_t _get_page_size()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (size_t)info.dwPageSize;
+#else
+  return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Map `bytes` (a multiple of the page size) of zeroed memory, returning nullptr on failure.
+// When `huge_pages` is requested and `bytes` is a multiple of the huge page size, try to get a huge-page-aligned
+// mapping and advise the kernel to back it with huge pages; `got_huge_pages` reports whether that happened.
+char* _map(const size_t bytes, const bool huge_pages, bool& got_huge_pages)
+{
+  got_huge_pages = false;
+#ifdef _WIN32
+  // Large pages need SeLockMemoryPrivilege; don't go there.
+  return static_cast<char*>(VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+  #if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (huge_pages && bytes % kHugePageSize == 0)
+  {
+    // Over-map so that we can trim to a huge-page boundary.
+    const size_t padded = bytes + kHugePageSize;
+    void* raw = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw != MAP_FAILED)
+    {
+      char* base = static_cast<char*>(raw);
+      char* aligned = reinterpret_cast<char*>(_round_up(reinterpret_cast<size_t>(base), kHugePageSize));
+      if (aligned > base)
+        munmap(base, aligned - base);
+      char* end = aligned + bytes;
+      if (base + padded > end)
+        munmap(end, base + padded - end);
+      got_huge_pages = madvise(aligned, bytes, MADV_HUGEPAGE) == 0;
+      return aligned;
+    }
+  }
+  #endif
+  void* raw = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return raw == MAP_FAILED ? nullptr : static_cast<char*>(raw);
+#endif
+}
+
+void _unmap(char* data, const size_t bytes)
+{
+#ifdef _WIN32
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, bytes);
+#endif
+}
+
+bool _lock(char* data, const size_t bytes)
+{
+#ifdef _WIN32
+  return VirtualLock(data, bytes) != 0;
+#else
+  return mlock(data, bytes) == 0;
+#endif
+}
+
+void _unlock(char* data, const size_t bytes)
+{
+#ifdef _WIN32
+  VirtualUnlock(data, bytes);
+#else
+  munlock(data, bytes);
+#endif
+}
+
+bool _same_options(const nam::ArenaOptions& a, const nam::ArenaOptions& b)
+{
+  return a.huge_pages == b.huge_pages && a.prefault == b.prefault && a.lock == b.lock;
+}
+}; // namespace
+
+nam::Arena::~Arena()
+{
+  this->_release_();
+}
+
+void nam::Arena::allocate_(const size_t weights_bytes, const size_t state_bytes, const ArenaOptions& options,
+                           const bool keep_state)
+{
+  const bool had_data = this->_data != nullptr;
+  const bool keep_weights = had_data && weights_bytes == this->_weights_size;
+  // The state region starts where the weights end, so it only survives if that didn't move either.
+  const bool keep_old_state = keep_state && keep_weights && state_bytes == this->_state_size;
+  const size_t bytes = weights_bytes + state_bytes;
+
+  if (had_data && bytes <= this->_capacity && _same_options(options, this->_options))
+  {
+    // Fits where we are.
+    if (!keep_weights)
+      std::memset(this->_data, 0, weights_bytes);
+    if (!keep_old_state)
+      std::memset(this->_data + weights_bytes, 0, state_bytes);
+  }
+  else
+  {
+    const size_t granularity = options.huge_pages ? kHugePageSize : _get_page_size();
+    const size_t mapped_bytes = _round_up(std::max(bytes, kAlignment), granularity);
+    bool got_huge_pages = false;
+    char* data = _map(mapped_bytes, options.huge_pages, got_huge_pages);
+    if (data == nullptr)
+      throw std::bad_alloc();
+    // Fresh mappings are already zero.
+    if (keep_weights)
+      std::memcpy(data, this->_data, weights_bytes);
+    if (keep_old_state)
+      std::memcpy(data + weights_bytes, this->_data + weights_bytes, state_bytes);
+    if (options.prefault)
+    {
+      const size_t page_size = _get_page_size();
+      for (size_t i = 0; i < mapped_bytes; i += page_size)
+        reinterpret_cast<volatile char*>(data)[i] = data[i];
+    }
+    const bool locked = options.lock && _lock(data, mapped_bytes);
+
+    this->_release_();
+    this->_data = data;
+    this->_mapped_bytes = mapped_bytes;
+    this->_capacity = mapped_bytes;
+    this->_locked = locked;
+    this->_huge_pages = got_huge_pages;
+    this->_options = options;
+  }
+  this->_weights_size = weights_bytes;
+  this->_state_size = state_bytes;
+  this->_weights_used = 0;
+  this->_state_used = 0;
+}
+
+void nam::Arena::carve_weights_(MatrixMap& matrix, const long rows, const long cols)
+{
+  float* data = this->_carve_(this->_weights_used, 0, this->_weights_size, rows * cols);
+  new (&matrix) MatrixMap(data, rows, cols);
+}
+
+void nam::Arena::carve_weights_(VectorMap& vector, const long size)
+{
+  float* data = this->_carve_(this->_weights_used, 0, this->_weights_size, size);
+  new (&vector) VectorMap(data, size);
+}
+
+void nam::Arena::carve_state_(MatrixMap& matrix, const long rows, const long cols)
+{
+  float* data = this->_carve_(this->_state_used, this->_weights_size, this->_state_size, rows * cols);
+  new (&matrix) MatrixMap(data, rows, cols);
+}
+
+void nam::Arena::carve_state_(VectorMap& vector, const long size)
+{
+  float* data = this->_carve_(this->_state_used, this->_weights_size, this->_state_size, size);
+  new (&vector) VectorMap(data, size);
+}
+
+float* nam::Arena::_carve_(size_t& used, const size_t region_start, const size_t region_size, const long num_floats)
+{
+  const size_t bytes = _round_up((size_t)num_floats * sizeof(float), kAlignment);
+  float* out = nullptr;
+  if (!this->is_measuring())
+  {
+    if (used + bytes > region_size)
+      throw std::runtime_error("Arena overflow: the model's layout changed without being re-measured");
+    out = reinterpret_cast<float*>(this->_data + region_start + used);
+  }
+  used += bytes;
+  return out;
+}
+
+void nam::Arena::_release_()
+{
+  if (this->_data == nullptr)
+    return;
+  if (this->_locked)
+    _unlock(this->_data, this->_mapped_bytes);
+  _unmap(this->_data, this->_mapped_bytes);
+  this->_data = nullptr;
+  this->_mapped_bytes = 0;
+  this->_capacity = 0;
+  this->_locked = false;
+  this->_huge_pages = false;
+}
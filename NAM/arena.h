@@ -0,0 +1,79 @@
+#pragma once
+// Per-instance memory arena that models carve their weights and state out of
+
+#include <cstddef>
+
+#include <Eigen/Dense>
+
+namespace nam
+{
+// How the memory behind an Arena is obtained.
+struct ArenaOptions
+{
+  // Ask the OS to back the arena with huge pages (transparent huge pages on Linux). Ignored where unsupported.
+  bool huge_pages = false;
+  // Touch every page when the arena is allocated so that the first real-time callbacks don't page-fault.
+  bool prefault = true;
+  // Lock the arena into RAM (mlock / VirtualLock). If the OS refuses (e.g. RLIMIT_MEMLOCK), the arena carries on
+  // unlocked; see Arena::is_locked().
+  bool lock = false;
+};
+
+// Views of arena memory. All arena allocations are cache-line aligned.
+using MatrixMap = Eigen::Map<Eigen::MatrixXf, Eigen::Aligned64>;
+using VectorMap = Eigen::Map<Eigen::VectorXf, Eigen::Aligned64>;
+
+// One cache-line-aligned block of memory per model instance, split into a weights region followed by a state region.
+//
+// Models lay themselves out in two passes over the same carve_*_() calls: first on an arena that has never been
+// allocated, which hands out null pointers and only adds up the sizes, then on the real arena after allocate_().
+// Because carving is deterministic, the same call order always lands on the same offsets.
+class Arena
+{
+public:
+  // Alignment (and granularity) of every carved allocation
+  static constexpr size_t kAlignment = 64;
+
+  Arena() = default;
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  // (Re)allocate for the given region sizes (as measured by a carving pass) and rewind for a carving pass.
+  // The weights are kept if the weights region hasn't changed size. The state is kept if `keep_state` and the state
+  // region hasn't changed size; otherwise it's zeroed.
+  void allocate_(const size_t weights_bytes, const size_t state_bytes, const ArenaOptions& options,
+                 const bool keep_state);
+  // Point `matrix` at a fresh (rows, cols) allocation from the weights or state region
+  void carve_weights_(MatrixMap& matrix, const long rows, const long cols);
+  void carve_weights_(VectorMap& vector, const long size);
+  void carve_state_(MatrixMap& matrix, const long rows, const long cols);
+  void carve_state_(VectorMap& vector, const long size);
+
+  // Whether this arena only measures (i.e. has never been allocated)
+  bool is_measuring() const { return this->_data == nullptr; };
+  bool is_locked() const { return this->_locked; };
+  bool uses_huge_pages() const { return this->_huge_pages; };
+  const ArenaOptions& get_options() const { return this->_options; };
+  // Bytes carved from each region since the last allocate_() (or ever, for a measuring arena)
+  size_t get_weights_bytes() const { return this->_weights_used; };
+  size_t get_state_bytes() const { return this->_state_used; };
+
+private:
+  char* _data = nullptr;
+  size_t _capacity = 0;
+  // Size of the weights region; the state region starts right after it.
+  size_t _weights_size = 0;
+  size_t _state_size = 0;
+  size_t _weights_used = 0;
+  size_t _state_used = 0;
+  ArenaOptions _options;
+  // How _data was mapped (for unmapping)
+  size_t _mapped_bytes = 0;
+  bool _locked = false;
+  bool _huge_pages = false;
+
+  float* _carve_(size_t& used, const size_t region_start, const size_t region_size, const long num_floats);
+  void _release_();
+};
+}; // namespace nam
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib> // getenv
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __APPLE__
+  #include <sys/sysctl.h>
+#endif
+#ifdef _WIN32
+  #include <process.h> // _getpid
+#else
+  #include <unistd.h> // getpid
+#endif
+
+#include "autotune.h"
+#include "plan.h"
+#include "resampler.h"
+#include "wavenet.h"
+
+// Candidate tile sizes are the powers of two in this range, up to the first one that covers a whole block.
+#define MIN_TILE_SIZE 16
+#define MAX_TILE_SIZE 4096
+// Each candidate is timed over at least this many frames, this many times, and scored by its best round.
+#define TUNING_FRAMES 8192
+#define TUNING_ROUNDS 3
+// Bump when what's cached changes meaning; caches from other versions are ignored.
+#define TUNING_CACHE_VERSION 1
+
+namespace
+{
+// 64-bit FNV-1a
+uint64_t _hash_string(const std::string& s)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (const char c : s)
+    hash = (hash ^ (uint8_t)c) * 0x100000001b3ull;
+  return hash;
+}
+
+// Seconds per frame that `model` takes in calls of `block_size` frames
+double _time_per_frame(nam::DSP& model, const int block_size)
+{
+  // Quiet noise, so that nothing settles into silence (or subnormals)
+  std::vector<NAM_SAMPLE> input(block_size), output(block_size);
+  unsigned int seed = 1;
+  for (NAM_SAMPLE& x : input)
+  {
+    seed = seed * 1664525u + 1013904223u;
+    x = (NAM_SAMPLE)(0.25 * ((double)(seed >> 8) / (double)(1u << 24) * 2.0 - 1.0));
+  }
+  // The first call warms up the caches (and prewarms a model that deferred it).
+  model.process(input.data(), output.data(), block_size);
+  model.finalize_(block_size);
+  double best = std::numeric_limits<double>::infinity();
+  for (int round = 0; round < TUNING_ROUNDS; round++)
+  {
+    const auto t0 = std::chrono::steady_clock::now();
+    long frames = 0;
+    for (; frames < TUNING_FRAMES; frames += block_size)
+    {
+      model.process(input.data(), output.data(), block_size);
+      model.finalize_(block_size);
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    best = std::min(best, seconds / frames);
+  }
+  return best;
+}
+}; // namespace
+
+std::filesystem::path nam::Tuner::get_default_path()
+{
+  if (const char* path = std::getenv("NAM_TUNING_CACHE"))
+    return std::filesystem::path(path);
+  std::filesystem::path directory;
+#if defined(_WIN32)
+  if (const char* local = std::getenv("LOCALAPPDATA"))
+    directory = local;
+#elif defined(__APPLE__)
+  if (const char* home = std::getenv("HOME"))
+    directory = std::filesystem::path(home) / "Library" / "Caches";
+#else
+  if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+    directory = xdg;
+  else if (const char* home = std::getenv("HOME"))
+    directory = std::filesystem::path(home) / ".cache";
+#endif
+  return directory.empty() ? directory : directory / "nam" / "tuning.json";
+}
+
+nam::Tuner::Tuner(const std::filesystem::path& path)
+: _path(path)
+{
+}
+
+nam::Tuner& nam::Tuner::get_global()
+{
+  static Tuner tuner;
+  return tuner;
+}
+
+long nam::Tuner::tune_tile_size_(DSP& model, const dspData& data, const int block_size)
+{
+  auto* wavenet = dynamic_cast<wavenet::WaveNet*>(&model);
+  auto* planned = dynamic_cast<plan::PlanDSP*>(&model);
+  if (wavenet == nullptr && planned == nullptr)
+    return 0;
+  auto get_tile_size = [&]() { return wavenet != nullptr ? wavenet->get_tile_size() : planned->get_tile_size(); };
+  auto set_tile_size = [&](const long tile_size) {
+    if (wavenet != nullptr)
+      wavenet->set_tile_size_(tile_size);
+    else
+      planned->set_tile_size_(tile_size);
+  };
+
+  std::stringstream key;
+  key << get_cpu_name() << "|tile|" << (planned != nullptr ? "plan:" : "") << get_shape(data) << "|"
+      << activations::get_precision_name(model.GetActivationPrecision()) << "|" << block_size;
+  // The model's own choice, then the powers of two
+  std::vector<long> candidates = {get_tile_size()};
+  for (long t = MIN_TILE_SIZE; t <= MAX_TILE_SIZE && t < 2 * block_size; t *= 2)
+    if (t != candidates[0])
+      candidates.push_back(t);
+  long tile_size = 0;
+  // Anything cached that couldn't have won here (e.g. a hand-edited 0) is a miss, and gets tuned over.
+  if (this->get(key.str(), tile_size) && std::find(candidates.begin(), candidates.end(), tile_size) != candidates.end())
+  {
+    if (tile_size != get_tile_size())
+    {
+      set_tile_size(tile_size);
+      model.prewarm();
+    }
+    return tile_size;
+  }
+
+  double best = std::numeric_limits<double>::infinity();
+  for (const long candidate : candidates)
+  {
+    set_tile_size(candidate);
+    const double seconds = _time_per_frame(model, block_size);
+    if (seconds < best)
+    {
+      best = seconds;
+      tile_size = candidate;
+    }
+  }
+  this->set_(key.str(), tile_size);
+  // Start over from a settled state, rather than from the timing's.
+  set_tile_size(tile_size);
+  model.prewarm();
+  return tile_size;
+}
+
+int nam::Tuner::tune_block_size(const dspData& data, const activations::Precision precision,
+                                const double sample_rate, const std::vector<int>& candidates)
+{
+  if (candidates.empty())
+    throw std::runtime_error("No block sizes to choose from");
+  std::stringstream key;
+  key << get_cpu_name() << "|block|" << get_shape(data) << "|" << activations::get_precision_name(precision) << "|";
+  if (sample_rate > 0.0)
+    key << sample_rate;
+  else
+    key << "native";
+  for (size_t i = 0; i < candidates.size(); i++)
+    key << (i == 0 ? "|" : ",") << candidates[i];
+  long block_size = 0;
+  // As with tile sizes, anything cached that isn't one of the candidates is a miss.
+  if (this->get(key.str(), block_size)
+      && std::find(candidates.begin(), candidates.end(), block_size) != candidates.end())
+    return (int)block_size;
+
+  std::unique_ptr<DSP> model = nam::get_dsp(data, precision);
+  if (sample_rate > 0.0)
+    model = std::make_unique<ResamplingDSP>(std::move(model), sample_rate);
+  double best = std::numeric_limits<double>::infinity();
+  for (const int candidate : candidates)
+  {
+    const double seconds = _time_per_frame(*model, candidate);
+    if (seconds < best)
+    {
+      best = seconds;
+      block_size = candidate;
+    }
+  }
+  this->set_(key.str(), block_size);
+  return (int)block_size;
+}
+
+bool nam::Tuner::get(const std::string& key, long& value)
+{
+  std::lock_guard<std::mutex> lock(this->_mutex);
+  this->_load_();
+  auto it = this->_entries.find(key);
+  if (it == this->_entries.end() || !it->is_number_integer())
+    return false;
+  value = it->get<long>();
+  return true;
+}
+
+bool nam::Tuner::set_(const std::string& key, const long value)
+{
+  std::lock_guard<std::mutex> lock(this->_mutex);
+  // Pick up whatever other processes have tuned since, so that saving doesn't drop it.
+  this->_loaded = false;
+  this->_load_();
+  this->_entries[key] = value;
+  return this->_save();
+}
+
+std::string nam::Tuner::get_cpu_name()
+{
+  static const std::string name = []() -> std::string {
+#if defined(__APPLE__)
+    char brand[256];
+    size_t size = sizeof(brand);
+    if (sysctlbyname("machdep.cpu.brand_string", brand, &size, nullptr, 0) == 0)
+      return std::string(brand);
+#elif defined(__linux__)
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+      if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos)
+      {
+        const size_t start = line.find_first_not_of(" \t", line.find(':') + 1);
+        return start == std::string::npos ? std::string("unknown") : line.substr(start);
+      }
+#endif
+    return "unknown";
+  }();
+  return name;
+}
+
+std::string nam::Tuner::get_shape(const dspData& data)
+{
+  std::stringstream ss;
+  ss << data.architecture << ":" << std::hex << std::setw(16) << std::setfill('0') << _hash_string(data.config.dump());
+  return ss.str();
+}
+
+void nam::Tuner::_load_()
+{
+  if (this->_loaded)
+    return;
+  this->_loaded = true;
+  if (this->_path.empty())
+    return;
+  std::ifstream file(this->_path);
+  if (!file)
+    return;
+  try
+  {
+    nlohmann::json cache;
+    file >> cache;
+    if (cache.value("version", 0) != TUNING_CACHE_VERSION)
+      return;
+    for (const auto& entry : cache.at("entries").items())
+      if (!this->_entries.contains(entry.key()))
+        this->_entries[entry.key()] = entry.value();
+  }
+  catch (const std::exception&)
+  {
+    // A broken cache is as good as none; it's rewritten on the next save.
+  }
+}
+
+bool nam::Tuner::_save() const
+{
+  if (this->_path.empty())
+    return false;
+  std::error_code error;
+  std::filesystem::create_directories(this->_path.parent_path(), error);
+  // Written to the side and moved into place, so that readers never see half of it. The name is this writer's own
+  // (by process, and by save within it), so that processes saving at once can't write into each other's.
+  static std::atomic<unsigned long> saves{0};
+#ifdef _WIN32
+  const long pid = _getpid();
+#else
+  const long pid = getpid();
+#endif
+  std::filesystem::path temporary = this->_path;
+  temporary += "." + std::to_string(pid) + "." + std::to_string(saves++) + ".tmp";
+  {
+    std::ofstream file(temporary);
+    if (!file)
+      return false;
+    nlohmann::json cache;
+    cache["version"] = TUNING_CACHE_VERSION;
+    cache["entries"] = this->_entries;
+    file << cache.dump(2) << "\n";
+    if (!file)
+    {
+      file.close();
+      std::filesystem::remove(temporary, error);
+      return false;
+    }
+  }
+  std::filesystem::rename(temporary, this->_path, error);
+  if (error)
+  {
+    std::filesystem::remove(temporary, error);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+// Picking the fastest settings for a model on this machine by trying them, and remembering the winners
+
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "dsp.h"
+
+namespace nam
+{
+// Times the candidates for a model's performance settings and keeps the winners in a JSON file, keyed by the CPU and
+// the model's shape (its architecture and config, not its weights). The first load of a shape on a machine pays for
+// the timing (a few seconds for a big WaveNet); later loads, in this process or any other, just look it up.
+//
+// Only settings that leave the output alone are tuned: how many frames a model works on at once, and how many frames
+// to call it with when latency doesn't matter. (The activations' precision changes the output, so it's left to the
+// caller.) Safe to call from many threads, though timings taken while the machine is busy are less telling.
+class Tuner
+{
+public:
+  // Where the tuning cache lives: $NAM_TUNING_CACHE, or else nam/tuning.json in the user's cache directory. Empty
+  // if there's nowhere to put it, in which case winners are only remembered for the life of the process.
+  static std::filesystem::path get_default_path();
+
+  explicit Tuner(const std::filesystem::path& path = get_default_path());
+  Tuner(const Tuner&) = delete;
+  Tuner& operator=(const Tuner&) = delete;
+
+  // The one for the whole process
+  static Tuner& get_global();
+
+  // Sets the tile size of `model` (a WaveNet or a plan::PlanDSP; see their set_tile_size_()) to the fastest for calls
+  // of `block_size` frames, from the cache or by timing the candidates on `model` itself. `data` is what it was made
+  // from. If the tile size changes, the model's state is reset and it's prewarmed again. Returns the tile size, or 0
+  // for a model that doesn't have one (which is left alone).
+  long tune_tile_size_(DSP& model, const dspData& data, const int block_size);
+  // The fastest of `candidates` to call a model made from `data` with, per frame, for when latency doesn't matter
+  // (e.g. reamping files). At `sample_rate` (through a ResamplingDSP) if positive, otherwise at the model's own rate.
+  // Times them on an instance of its own.
+  int tune_block_size(const dspData& data, const activations::Precision precision, const double sample_rate,
+                      const std::vector<int>& candidates);
+
+  // Cached winners, under keys that already include this machine's CPU
+  bool get(const std::string& key, long& value);
+  // Remembers a winner and saves the cache. Returns false if the file couldn't be written.
+  bool set_(const std::string& key, const long value);
+  const std::filesystem::path& get_path() const { return this->_path; };
+
+  // What the keys are made from
+  static std::string get_cpu_name();
+  // The architecture and a hash of the config
+  static std::string get_shape(const dspData& data);
+
+private:
+  std::filesystem::path _path;
+  std::mutex _mutex;
+  // Keys to winners
+  nlohmann::json _entries = nlohmann::json::object();
+  bool _loaded = false;
+
+  // Reads the file, keeping what's already in memory. Call with the lock held.
+  void _load_();
+  // Call with the lock held.
+  bool _save() const;
+};
+}; // namespace nam
@@ -10,8 +10,9 @@
 #include "dsp.h"
 #include "convnet.h"
 
-nam::convnet::BatchNorm::BatchNorm(const int dim, std::vector<float>::iterator& weights)
+void nam::convnet::BatchNorm::set_weights_(std::vector<float>::const_iterator& weights)
 {
+  const int dim = this->_dim;
   // Extract from param buffer
   Eigen::VectorXf running_mean(dim);
   Eigen::VectorXf running_var(dim);
@@ -28,14 +29,18 @@ nam::convnet::BatchNorm::BatchNorm(const int dim, std::vector<float>::iterator&
   float eps = *(weights++);
 
   // Convert to scale & loc
-  this->scale.resize(dim);
-  this->loc.resize(dim);
   for (int i = 0; i < dim; i++)
     this->scale(i) = _weight(i) / sqrt(eps + running_var(i));
   this->loc = _bias - this->scale.cwiseProduct(running_mean);
 }
 
-void nam::convnet::BatchNorm::process_(Eigen::MatrixXf& x, const long i_start, const long i_end) const
+void nam::convnet::BatchNorm::carve_(Arena& arena)
+{
+  arena.carve_weights_(this->scale, this->_dim);
+  arena.carve_weights_(this->loc, this->_dim);
+}
+
+void nam::convnet::BatchNorm::process_(MatrixMap& x, const long i_start, const long i_end) const
 {
   // todo using colwise?
   // #speed but conv probably dominates
@@ -46,19 +51,33 @@ void nam::convnet::BatchNorm::process_(Eigen::MatrixXf& x, const long i_start, c
   }
 }
 
-void nam::convnet::ConvNetBlock::set_weights_(const int in_channels, const int out_channels, const int _dilation,
-                                              const bool batchnorm, const std::string activation,
-                                              std::vector<float>::iterator& weights)
+void nam::convnet::ConvNetBlock::set_size_(const int in_channels, const int out_channels, const int _dilation,
+                                           const bool batchnorm, const std::string activation,
+                                           const activations::Precision precision)
 {
   this->_batchnorm = batchnorm;
   // HACK 2 kernel
-  this->conv.set_size_and_weights_(in_channels, out_channels, 2, _dilation, !batchnorm, weights);
+  this->conv.set_size_(in_channels, out_channels, 2, !batchnorm, _dilation);
+  if (this->_batchnorm)
+    this->batchnorm.set_size_(out_channels);
+  this->activation = activations::Activation::get_activation(activation, precision);
+}
+
+void nam::convnet::ConvNetBlock::set_weights_(std::vector<float>::const_iterator& weights)
+{
+  this->conv.set_weights_(weights);
+  if (this->_batchnorm)
+    this->batchnorm.set_weights_(weights);
+}
+
+void nam::convnet::ConvNetBlock::carve_(Arena& arena)
+{
+  this->conv.carve_(arena);
   if (this->_batchnorm)
-    this->batchnorm = BatchNorm(out_channels, weights);
-  this->activation = activations::Activation::get_activation(activation);
+    this->batchnorm.carve_(arena);
 }
 
-void nam::convnet::ConvNetBlock::process_(const Eigen::MatrixXf& input, Eigen::MatrixXf& output, const long i_start,
+void nam::convnet::ConvNetBlock::process_(const MatrixMap& input, MatrixMap& output, const long i_start,
                                           const long i_end) const
 {
   const long ncols = i_end - i_start;
@@ -74,50 +93,71 @@ long nam::convnet::ConvNetBlock::get_out_channels() const
   return this->conv.get_out_channels();
 }
 
-nam::convnet::_Head::_Head(const int channels, std::vector<float>::iterator& weights)
+void nam::convnet::_Head::set_weights_(std::vector<float>::const_iterator& weights)
 {
-  this->_weight.resize(channels);
-  for (int i = 0; i < channels; i++)
+  for (int i = 0; i < this->_channels; i++)
     this->_weight[i] = *(weights++);
   this->_bias = *(weights++);
 }
 
-void nam::convnet::_Head::process_(const Eigen::MatrixXf& input, Eigen::VectorXf& output, const long i_start,
+void nam::convnet::_Head::carve_(Arena& arena)
+{
+  arena.carve_weights_(this->_weight, this->_channels);
+}
+
+void nam::convnet::_Head::process_(const MatrixMap& input, NAM_SAMPLE* output, const long i_start,
                                    const long i_end) const
 {
   const long length = i_end - i_start;
-  output.resize(length);
   for (long i = 0, j = i_start; i < length; i++, j++)
-    output(i) = this->_bias + input.col(j).dot(this->_weight);
+    output[i] = this->_bias + input.col(j).dot(this->_weight);
 }
 
 nam::convnet::ConvNet::ConvNet(const int channels, const std::vector<int>& dilations, const bool batchnorm,
-                               const std::string activation, std::vector<float>& weights,
-                               const double expected_sample_rate)
+                               const std::string activation, const std::vector<float>& weights,
+                               const double expected_sample_rate, const activations::Precision precision)
 : Buffer(*std::max_element(dilations.begin(), dilations.end()), expected_sample_rate)
 {
+  this->mActivationPrecision = precision;
   this->_verify_weights(channels, dilations, batchnorm, weights.size());
   this->_blocks.resize(dilations.size());
-  std::vector<float>::iterator it = weights.begin();
   for (size_t i = 0; i < dilations.size(); i++)
-    this->_blocks[i].set_weights_(i == 0 ? 1 : channels, channels, dilations[i], batchnorm, activation, it);
-  this->_block_vals.resize(this->_blocks.size() + 1);
-  for (auto& matrix : this->_block_vals)
-    matrix.setZero();
-  std::fill(this->_input_buffer.begin(), this->_input_buffer.end(), 0.0f);
-  this->_head = _Head(channels, it);
+    this->_blocks[i].set_size_(i == 0 ? 1 : channels, channels, dilations[i], batchnorm, activation, precision);
+  for (size_t i = 0; i < this->_blocks.size() + 1; i++)
+    this->_block_vals.push_back(MatrixMap(nullptr, 0, 0));
+  this->_head.set_size_(channels);
+  this->_layout_arena_();
+
+  std::vector<float>::const_iterator it = weights.begin();
+  for (size_t i = 0; i < this->_blocks.size(); i++)
+    this->_blocks[i].set_weights_(it);
+  this->_head.set_weights_(it);
   if (it != weights.end())
     throw std::runtime_error("Didn't touch all the weights when initializing ConvNet");
 
   _prewarm_samples = 1;
   for (size_t i = 0; i < dilations.size(); i++)
     _prewarm_samples += dilations[i];
+
+  // Per sample: each block's convolution, batchnorm (a multiply-add per channel) and activation, then the head
+  for (size_t i = 0; i < this->_blocks.size(); i++)
+  {
+    const long batchnorm_multiply_adds = batchnorm ? channels : 0;
+    this->mCostEstimate.multiply_adds_per_sample += this->_blocks[i].conv.get_num_weights() + batchnorm_multiply_adds;
+    this->mCostEstimate.activations_per_sample += channels;
+  }
+  this->mCostEstimate.multiply_adds_per_sample += channels + 1;
+  // The convolutions have a kernel size of 2.
+  this->mCostEstimate.receptive_field = _prewarm_samples;
 }
 
 
 void nam::convnet::ConvNet::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
 
 {
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  NAM_PROFILE_MODEL(this->mProfiler);
   this->_update_buffers_(input, num_frames);
   // Main computation!
   const long i_start = this->_input_buffer_offset;
@@ -127,11 +167,7 @@ void nam::convnet::ConvNet::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const
     this->_block_vals[0](0, i) = this->_input_buffer[i];
   for (size_t i = 0; i < this->_blocks.size(); i++)
     this->_blocks[i].process_(this->_block_vals[i], this->_block_vals[i + 1], i_start, i_end);
-  // TODO clean up this allocation
-  this->_head.process_(this->_block_vals[this->_blocks.size()], this->_head_output, i_start, i_end);
-  // Copy to required output array (TODO tighten this up)
-  for (int s = 0; s < num_frames; s++)
-    output[s] = this->_head_output(s);
+  this->_head.process_(this->_block_vals[this->_blocks.size()], output, i_start, i_end);
 }
 
 void nam::convnet::ConvNet::_verify_weights(const int channels, const std::vector<int>& dilations, const bool batchnorm,
@@ -140,26 +176,27 @@ void nam::convnet::ConvNet::_verify_weights(const int channels, const std::vecto
   // TODO
 }
 
-void nam::convnet::ConvNet::_update_buffers_(NAM_SAMPLE* input, const int num_frames)
+void nam::convnet::ConvNet::_carve_(Arena& arena)
 {
-  this->Buffer::_update_buffers_(input, num_frames);
-
-  const size_t buffer_size = this->_input_buffer.size();
-
-  if (this->_block_vals[0].rows() != 1 || this->_block_vals[0].cols() != buffer_size)
-  {
-    this->_block_vals[0].resize(1, buffer_size);
-    this->_block_vals[0].setZero();
-  }
-
+  for (size_t i = 0; i < this->_blocks.size(); i++)
+    this->_blocks[i].carve_(arena);
+  this->_head.carve_(arena);
+  this->Buffer::_carve_(arena);
+  // Block values run alongside the input buffer.
+  arena.carve_state_(this->_block_vals[0], 1, this->_input_buffer_size);
   for (size_t i = 1; i < this->_block_vals.size(); i++)
-  {
-    if (this->_block_vals[i].rows() == this->_blocks[i - 1].get_out_channels()
-        && this->_block_vals[i].cols() == buffer_size)
-      continue; // Already has correct size
-    this->_block_vals[i].resize(this->_blocks[i - 1].get_out_channels(), buffer_size);
-    this->_block_vals[i].setZero();
-  }
+    arena.carve_state_(this->_block_vals[i], this->_blocks[i - 1].get_out_channels(), this->_input_buffer_size);
+}
+
+void nam::convnet::ConvNet::_grow_input_buffer_(const long new_buffer_size)
+{
+  // The block values run alongside the input buffer, so their history needs to be carried over too.
+  std::vector<Eigen::MatrixXf> history;
+  for (size_t k = 0; k < this->_block_vals.size() - 1; k++)
+    history.push_back(this->_block_vals[k].leftCols(this->_receptive_field));
+  this->Buffer::_grow_input_buffer_(new_buffer_size);
+  for (size_t k = 0; k < history.size(); k++)
+    this->_block_vals[k].leftCols(this->_receptive_field) = history[k];
 }
 
 void nam::convnet::ConvNet::_rewind_buffers_()
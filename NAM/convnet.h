@@ -9,6 +9,8 @@
 
 #include <Eigen/Dense>
 
+#include "dsp.h"
+
 namespace nam
 {
 namespace convnet
@@ -22,9 +24,13 @@ namespace convnet
 class BatchNorm
 {
 public:
-  BatchNorm(){};
-  BatchNorm(const int dim, std::vector<float>::iterator& weights);
-  void process_(Eigen::MatrixXf& input, const long i_start, const long i_end) const;
+  BatchNorm()
+  : scale(nullptr, 0)
+  , loc(nullptr, 0){};
+  void set_size_(const int dim) { this->_dim = dim; };
+  void set_weights_(std::vector<float>::const_iterator& weights);
+  void carve_(Arena& arena);
+  void process_(MatrixMap& input, const long i_start, const long i_end) const;
 
 private:
   // TODO simplify to just ax+b
@@ -32,17 +38,20 @@ private:
   // y = ax+b
   // a = w / sqrt(v+eps)
   // b = a * m + bias
-  Eigen::VectorXf scale;
-  Eigen::VectorXf loc;
+  VectorMap scale;
+  VectorMap loc;
+  int _dim = 0;
 };
 
 class ConvNetBlock
 {
 public:
   ConvNetBlock(){};
-  void set_weights_(const int in_channels, const int out_channels, const int _dilation, const bool batchnorm,
-                    const std::string activation, std::vector<float>::iterator& weights);
-  void process_(const Eigen::MatrixXf& input, Eigen::MatrixXf& output, const long i_start, const long i_end) const;
+  void set_size_(const int in_channels, const int out_channels, const int _dilation, const bool batchnorm,
+                 const std::string activation, const activations::Precision precision);
+  void set_weights_(std::vector<float>::const_iterator& weights);
+  void carve_(Arena& arena);
+  void process_(const MatrixMap& input, MatrixMap& output, const long i_start, const long i_end) const;
   long get_out_channels() const;
   Conv1D conv;
 
@@ -55,30 +64,36 @@ private:
 class _Head
 {
 public:
-  _Head(){};
-  _Head(const int channels, std::vector<float>::iterator& weights);
-  void process_(const Eigen::MatrixXf& input, Eigen::VectorXf& output, const long i_start, const long i_end) const;
+  _Head()
+  : _weight(nullptr, 0){};
+  void set_size_(const int channels) { this->_channels = channels; };
+  void set_weights_(std::vector<float>::const_iterator& weights);
+  void carve_(Arena& arena);
+  void process_(const MatrixMap& input, NAM_SAMPLE* output, const long i_start, const long i_end) const;
 
 private:
-  Eigen::VectorXf _weight;
+  VectorMap _weight;
   float _bias = 0.0f;
+  int _channels = 0;
 };
 
 class ConvNet : public Buffer
 {
 public:
   ConvNet(const int channels, const std::vector<int>& dilations, const bool batchnorm, const std::string activation,
-          std::vector<float>& weights, const double expected_sample_rate = -1.0);
+          const std::vector<float>& weights, const double expected_sample_rate = -1.0,
+          const activations::Precision precision = activations::Activation::get_default_precision());
   ~ConvNet() = default;
 
 protected:
   std::vector<ConvNetBlock> _blocks;
-  std::vector<Eigen::MatrixXf> _block_vals;
-  Eigen::VectorXf _head_output;
+  // Same length as the input buffer
+  std::vector<MatrixMap> _block_vals;
   _Head _head;
   void _verify_weights(const int channels, const std::vector<int>& dilations, const bool batchnorm,
                        const size_t actual_weights);
-  void _update_buffers_(NAM_SAMPLE* input, const int num_frames) override;
+  void _carve_(Arena& arena) override;
+  void _grow_input_buffer_(const long new_buffer_size) override;
   void _rewind_buffers_() override;
 
   void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
@@ -0,0 +1,93 @@
+#pragma once
+
+// Control over how the FPU treats subnormal ("denormal") floats.
+//
+// Decaying tails (e.g. WaveNet residual chains or LSTM cell states after a note ends) settle into subnormal values,
+// and multiply-adds on subnormals are many times slower on most x86 CPUs. Flush-to-zero (FTZ) rounds subnormal
+// results to zero and denormals-are-zero (DAZ) treats subnormal inputs as zero.
+
+#include <cstdint>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+  #include <xmmintrin.h>
+  #define NAM_DENORMAL_X86
+#elif defined(__aarch64__)
+  #define NAM_DENORMAL_ARM64
+#endif
+
+namespace nam
+{
+namespace denormal
+{
+// Whether this build can set FTZ/DAZ; otherwise ScopedFlushToZero is a no-op.
+#if defined(NAM_DENORMAL_X86) || defined(NAM_DENORMAL_ARM64)
+constexpr bool kSupported = true;
+#else
+constexpr bool kSupported = false;
+#endif
+
+namespace detail
+{
+#if defined(NAM_DENORMAL_X86)
+using Control = unsigned int;
+// Bit 15 is FTZ, bit 6 is DAZ.
+constexpr Control kFlushBits = 0x8040;
+inline Control get_control() { return _mm_getcsr(); }
+inline void set_control(const Control control) { _mm_setcsr(control); }
+#elif defined(NAM_DENORMAL_ARM64)
+using Control = std::uint64_t;
+// Bit 24 is FZ; AArch64 flushes both inputs and outputs with it.
+constexpr Control kFlushBits = 1ull << 24;
+inline Control get_control()
+{
+  Control fpcr;
+  __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+  return fpcr;
+}
+inline void set_control(const Control control) { __asm__ __volatile__("msr fpcr, %0" : : "r"(control)); }
+#else
+using Control = unsigned int;
+constexpr Control kFlushBits = 0;
+inline Control get_control() { return 0; }
+inline void set_control(const Control) {}
+#endif
+
+// Sets or clears the flush bits for the lifetime of the object, then restores the caller's floating-point control
+// state.
+template <bool Flush>
+class ScopedControl
+{
+public:
+  explicit ScopedControl(const bool enable = true)
+  : _active(enable && kSupported)
+  {
+    if (!this->_active)
+      return;
+    this->_saved = get_control();
+    set_control(Flush ? (this->_saved | kFlushBits) : (this->_saved & ~kFlushBits));
+  };
+  ~ScopedControl()
+  {
+    if (this->_active)
+      set_control(this->_saved);
+  };
+  ScopedControl(const ScopedControl&) = delete;
+  ScopedControl& operator=(const ScopedControl&) = delete;
+
+private:
+  const bool _active;
+  Control _saved = 0;
+};
+}; // namespace detail
+
+// Sets FTZ (and DAZ where the CPU has it) for the lifetime of the object, then restores the caller's floating-point
+// control state. Pass `enable = false` to make it do nothing.
+using ScopedFlushToZero = detail::ScopedControl<true>;
+
+// The opposite: clears FTZ/DAZ for the lifetime of the object, so that subnormals are computed in full even if
+// something else (e.g. a fast-math build's startup code, which sets them for the whole process) has turned flushing
+// on. For measuring and checking what a model's own flushing setting does. Pass `enable = false` to make it do
+// nothing.
+using ScopedAllowDenormals = detail::ScopedControl<false>;
+}; // namespace denormal
+}; // namespace nam
@@ -4,6 +4,7 @@
 #include <filesystem>
 #include <fstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -14,6 +15,9 @@
 
 constexpr const long _INPUT_BUFFER_SAFETY_FACTOR = 32;
 
+// The model this thread is prewarming on behalf of PrewarmIfPending(), if any
+thread_local const nam::DSP* _prewarming = nullptr;
+
 nam::DSP::DSP(const double expected_sample_rate)
 : mExpectedSampleRate(expected_sample_rate)
 {
@@ -36,8 +40,48 @@ void nam::DSP::prewarm()
   }
 }
 
+void nam::DSP::DeferPrewarm()
+{
+  this->_prewarm_state.store(kPrewarmPending, std::memory_order_release);
+}
+
+void nam::DSP::PrewarmIfPending()
+{
+  while (true)
+  {
+    int state = kPrewarmPending;
+    if (this->_prewarm_state.compare_exchange_strong(state, kPrewarmRunning, std::memory_order_acquire))
+    {
+      // prewarm() calls process(), which mustn't wait on itself.
+      const DSP* outer = _prewarming;
+      _prewarming = this;
+      try
+      {
+        this->prewarm();
+      }
+      catch (...)
+      {
+        // Still pending, so that whoever's waiting (or calls next) tries again instead of waiting forever
+        _prewarming = outer;
+        this->_prewarm_state.store(kPrewarmPending, std::memory_order_release);
+        throw;
+      }
+      _prewarming = outer;
+      this->_prewarm_state.store(kPrewarmDone, std::memory_order_release);
+      return;
+    }
+    if (state != kPrewarmRunning || _prewarming == this)
+      return;
+    while (this->_prewarm_state.load(std::memory_order_acquire) == kPrewarmRunning)
+      std::this_thread::yield();
+  }
+}
+
 void nam::DSP::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
 {
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  NAM_PROFILE_MODEL(this->mProfiler);
   // Default implementation is the null operation
   for (size_t i = 0; i < num_frames; i++)
     output[i] = input[i];
@@ -60,10 +104,52 @@ void nam::DSP::SetLoudness(const double loudness)
 
 void nam::DSP::finalize_(const int num_frames) {}
 
+nam::CostEstimate nam::DSP::GetCostEstimate() const
+{
+  CostEstimate cost = this->mCostEstimate;
+  cost.weight_bytes = this->mArena.get_weights_bytes();
+  cost.state_bytes = this->mArena.get_state_bytes();
+  return cost;
+}
+
+nam::profiler::Report nam::DSP::GetProfile() const
+{
+#ifdef NAM_ENABLE_PROFILER
+  return this->mProfiler.get_report();
+#else
+  return profiler::Report();
+#endif
+}
+
+void nam::DSP::ResetProfile()
+{
+#ifdef NAM_ENABLE_PROFILER
+  this->mProfiler.reset();
+#endif
+}
+
+void nam::DSP::SetMemoryOptions(const ArenaOptions& options)
+{
+  // Same layout, new memory; keep everything.
+  Arena sizing;
+  this->_carve_(sizing);
+  this->mArena.allocate_(sizing.get_weights_bytes(), sizing.get_state_bytes(), options, true);
+  this->_carve_(this->mArena);
+}
+
+void nam::DSP::_layout_arena_(const bool keep_state)
+{
+  Arena sizing;
+  this->_carve_(sizing);
+  this->mArena.allocate_(sizing.get_weights_bytes(), sizing.get_state_bytes(), this->mArena.get_options(), keep_state);
+  this->_carve_(this->mArena);
+}
+
 // Buffer =====================================================================
 
 nam::Buffer::Buffer(const int receptive_field, const double expected_sample_rate)
 : nam::DSP(expected_sample_rate)
+, _input_buffer(nullptr, 0)
 {
   this->_set_receptive_field(receptive_field);
 }
@@ -76,13 +162,18 @@ void nam::Buffer::_set_receptive_field(const int new_receptive_field)
 void nam::Buffer::_set_receptive_field(const int new_receptive_field, const int input_buffer_size)
 {
   this->_receptive_field = new_receptive_field;
-  this->_input_buffer.resize(input_buffer_size);
-  std::fill(this->_input_buffer.begin(), this->_input_buffer.end(), 0.0f);
+  this->_input_buffer_size = input_buffer_size;
   this->_reset_input_buffer();
 }
 
+void nam::Buffer::_carve_(Arena& arena)
+{
+  arena.carve_state_(this->_input_buffer, this->_input_buffer_size);
+}
+
 void nam::Buffer::_update_buffers_(NAM_SAMPLE* input, const int num_frames)
 {
+  NAM_PROFILE_STAGE(kUpdateBuffers);
   // Make sure that the buffer is big enough for the receptive field and the
   // frames needed!
   {
@@ -92,8 +183,9 @@ void nam::Buffer::_update_buffers_(NAM_SAMPLE* input, const int num_frames)
       long new_buffer_size = 2;
       while (new_buffer_size < minimum_input_buffer_size)
         new_buffer_size *= 2;
-      this->_input_buffer.resize(new_buffer_size);
-      std::fill(this->_input_buffer.begin(), this->_input_buffer.end(), 0.0f);
+      // Bring the history to the front of the buffers so that it's all that has to survive the move.
+      this->_rewind_buffers_();
+      this->_grow_input_buffer_(new_buffer_size);
     }
   }
 
@@ -109,8 +201,18 @@ void nam::Buffer::_update_buffers_(NAM_SAMPLE* input, const int num_frames)
   std::fill(this->_output_buffer.begin(), this->_output_buffer.end(), 0.0f);
 }
 
+void nam::Buffer::_grow_input_buffer_(const long new_buffer_size)
+{
+  const Eigen::VectorXf history = this->_input_buffer.head(this->_receptive_field);
+  this->_input_buffer_size = new_buffer_size;
+  // Zeroes the state (including the input buffer).
+  this->_layout_arena_();
+  this->_input_buffer.head(this->_receptive_field) = history;
+}
+
 void nam::Buffer::_rewind_buffers_()
 {
+  NAM_PROFILE_STAGE(kRewindBuffers);
   // Copy the input buffer back
   // RF-1 samples because we've got at least one new one inbound.
   for (long i = 0, j = this->_input_buffer_offset - this->_receptive_field; i < this->_receptive_field; i++, j++)
@@ -139,21 +241,33 @@ void nam::Buffer::finalize_(const int num_frames)
 nam::Linear::Linear(const int receptive_field, const bool _bias, const std::vector<float>& weights,
                     const double expected_sample_rate)
 : nam::Buffer(receptive_field, expected_sample_rate)
+, _weight(nullptr, 0)
 {
   if ((int)weights.size() != (receptive_field + (_bias ? 1 : 0)))
     throw std::runtime_error(
       "Params vector does not match expected size based "
       "on architecture parameters");
 
-  this->_weight.resize(this->_receptive_field);
+  this->_layout_arena_();
+  this->mCostEstimate.multiply_adds_per_sample = receptive_field + (_bias ? 1 : 0);
+  this->mCostEstimate.receptive_field = receptive_field;
   // Pass in in reverse order so that dot products work out of the box.
   for (int i = 0; i < this->_receptive_field; i++)
     this->_weight(i) = weights[receptive_field - 1 - i];
   this->_bias = _bias ? weights[receptive_field] : (float)0.0;
 }
 
+void nam::Linear::_carve_(Arena& arena)
+{
+  arena.carve_weights_(this->_weight, this->_receptive_field);
+  this->Buffer::_carve_(arena);
+}
+
 void nam::Linear::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
 {
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  NAM_PROFILE_MODEL(this->mProfiler);
   this->nam::Buffer::_update_buffers_(input, num_frames);
 
   // Main computation!
@@ -167,7 +281,7 @@ void nam::Linear::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_f
 
 // NN modules =================================================================
 
-void nam::Conv1D::set_weights_(std::vector<float>::iterator& weights)
+void nam::Conv1D::set_weights_(std::vector<float>::const_iterator& weights)
 {
   if (this->_weight.size() > 0)
   {
@@ -186,27 +300,26 @@ void nam::Conv1D::set_weights_(std::vector<float>::iterator& weights)
 void nam::Conv1D::set_size_(const int in_channels, const int out_channels, const int kernel_size, const bool do_bias,
                             const int _dilation)
 {
-  this->_weight.resize(kernel_size);
-  for (size_t i = 0; i < this->_weight.size(); i++)
-    this->_weight[i].resize(out_channels,
-                            in_channels); // y = Ax, input array (C,L)
-  if (do_bias)
-    this->_bias.resize(out_channels);
-  else
-    this->_bias.resize(0);
+  this->_weight.clear();
+  for (int i = 0; i < kernel_size; i++)
+    this->_weight.push_back(MatrixMap(nullptr, out_channels, in_channels)); // y = Ax, input array (C,L)
+  this->_in_channels = in_channels;
+  this->_out_channels = out_channels;
+  this->_do_bias = do_bias;
   this->_dilation = _dilation;
 }
 
-void nam::Conv1D::set_size_and_weights_(const int in_channels, const int out_channels, const int kernel_size,
-                                        const int _dilation, const bool do_bias, std::vector<float>::iterator& weights)
+void nam::Conv1D::carve_(Arena& arena)
 {
-  this->set_size_(in_channels, out_channels, kernel_size, do_bias, _dilation);
-  this->set_weights_(weights);
+  for (size_t i = 0; i < this->_weight.size(); i++)
+    arena.carve_weights_(this->_weight[i], this->_out_channels, this->_in_channels);
+  arena.carve_weights_(this->_bias, this->_do_bias ? this->_out_channels : 0);
 }
 
-void nam::Conv1D::process_(const Eigen::MatrixXf& input, Eigen::MatrixXf& output, const long i_start, const long ncols,
-                           const long j_start) const
+void nam::Conv1D::process_(const Eigen::Ref<const Eigen::MatrixXf>& input, Eigen::Ref<Eigen::MatrixXf> output,
+                           const long i_start, const long ncols, const long j_start) const
 {
+  NAM_PROFILE_STAGE(kConv1D);
   // This is the clever part ;)
   for (size_t k = 0; k < this->_weight.size(); k++)
   {
@@ -229,14 +342,19 @@ long nam::Conv1D::get_num_weights() const
 }
 
 nam::Conv1x1::Conv1x1(const int in_channels, const int out_channels, const bool _bias)
+: _weight(nullptr, out_channels, in_channels)
+, _bias(nullptr, _bias ? out_channels : 0)
 {
-  this->_weight.resize(out_channels, in_channels);
   this->_do_bias = _bias;
-  if (_bias)
-    this->_bias.resize(out_channels);
 }
 
-void nam::Conv1x1::set_weights_(std::vector<float>::iterator& weights)
+void nam::Conv1x1::carve_(Arena& arena)
+{
+  arena.carve_weights_(this->_weight, this->_weight.rows(), this->_weight.cols());
+  arena.carve_weights_(this->_bias, this->_bias.size());
+}
+
+void nam::Conv1x1::set_weights_(std::vector<float>::const_iterator& weights)
 {
   for (int i = 0; i < this->_weight.rows(); i++)
     for (int j = 0; j < this->_weight.cols(); j++)
@@ -246,8 +364,9 @@ void nam::Conv1x1::set_weights_(std::vector<float>::iterator& weights)
       this->_bias(i) = *(weights++);
 }
 
-Eigen::MatrixXf nam::Conv1x1::process(const Eigen::MatrixXf& input) const
+Eigen::MatrixXf nam::Conv1x1::process(const Eigen::Ref<const Eigen::MatrixXf>& input) const
 {
+  NAM_PROFILE_STAGE(kConv1x1);
   if (this->_do_bias)
     return (this->_weight * input).colwise() + this->_bias;
   else
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <filesystem>
 #include <iterator>
 #include <memory>
@@ -10,7 +11,10 @@
 #include <Eigen/Dense>
 
 #include "activations.h"
+#include "arena.h"
+#include "denormal.h"
 #include "json.hpp"
+#include "profiler.h"
 
 #ifdef NAM_SAMPLE_FLOAT
   #define NAM_SAMPLE float
@@ -34,6 +38,20 @@ enum EArchitectures
   kNumModels
 };
 
+// What running a model takes, worked out from its architecture rather than by running it. Multiply-adds count every
+// weight applied (a bias counts as one add) and the elementwise arithmetic between layers; activations count every
+// tanh, sigmoid, etc. evaluated. Memory is what the model's arena holds (see Arena).
+struct CostEstimate
+{
+  double multiply_adds_per_sample = 0.0;
+  double activations_per_sample = 0.0;
+  size_t weight_bytes = 0;
+  // Grows with the biggest block processed so far
+  size_t state_bytes = 0;
+  // How many input samples each output depends on; -1 if unbounded (e.g. recurrent models)
+  long receptive_field = 0;
+};
+
 class DSP
 {
 public:
@@ -45,6 +63,13 @@ public:
   // prewarm() does any required intial work required to "settle" model initial conditions
   // it can be somewhat expensive, so should not be called during realtime audio processing
   virtual void prewarm();
+  // Put off prewarm() until it's needed: the first process() (or PrewarmIfPending()) runs it first.
+  void DeferPrewarm();
+  // Run a deferred prewarm() now. If another thread is already running it, wait for it to finish instead. Safe to
+  // call from any thread, and does nothing if there's nothing deferred. If prewarm() throws, the exception reaches
+  // the thread that ran it and the prewarm stays deferred, for the next call (or a waiting thread) to try again.
+  void PrewarmIfPending();
+  bool IsPrewarmPending() const { return this->_prewarm_state.load(std::memory_order_acquire) != kPrewarmDone; };
   // process() does all of the processing requried to take `input` array and
   // fill in the required values on `output`.
   // To do this:
@@ -59,6 +84,9 @@ public:
   // Expected sample rate, in Hz.
   // TODO throw if it doesn't know.
   double GetExpectedSampleRate() const { return mExpectedSampleRate; };
+  // How many samples the output lags the input by, for hosts to compensate. Models themselves have none; wrappers that
+  // buffer (e.g. ResamplingDSP, ReblockingDSP) add some.
+  virtual int GetLatency() const { return 0; };
   // Get how loud this model is, in dB.
   // Throws a std::runtime_error if the model doesn't know how loud it is.
   double GetLoudness() const;
@@ -68,15 +96,64 @@ public:
   // This is usually defined to be the loudness to a standardized input. The trainer has its own, but you can always
   // use this to define it a different way if you like yours better.
   void SetLoudness(const double loudness);
+  // Opt in to flushing subnormal floats to zero (FTZ/DAZ) while process() runs. The caller's floating-point control
+  // state is restored before process() returns. Off by default.
+  void SetFlushDenormals(const bool flush) { mFlushDenormals = flush; };
+  bool GetFlushDenormals() const { return mFlushDenormals; };
+  // How the model's tanh and sigmoid activations are evaluated; chosen when it's constructed (see get_dsp()).
+  activations::Precision GetActivationPrecision() const { return mActivationPrecision; };
+  // Move the model's weights and state into a new arena allocated according to `options` (e.g. to lock it into RAM).
+  // Not real-time safe.
+  void SetMemoryOptions(const ArenaOptions& options);
+  // The arena that holds this model's weights and state
+  const Arena& GetArena() const { return mArena; };
+  // What the model costs to run, per sample and in memory, for placing models on cores without trying them out
+  virtual CostEstimate GetCostEstimate() const;
+  // Where process() has spent its time so far, per stage (see profiler.h). Empty unless built with
+  // NAM_ENABLE_PROFILER.
+  profiler::Report GetProfile() const;
+  // Start profiling afresh. Don't call this while the model is processing.
+  void ResetProfile();
 
 protected:
   bool mHasLoudness = false;
+  // Set by each model's constructor; GetCostEstimate() fills in the memory.
+  CostEstimate mCostEstimate;
+  // Whether process() should run with subnormals flushed to zero
+  bool mFlushDenormals = false;
+  activations::Precision mActivationPrecision = activations::Precision::kAccurate;
   // How loud is the model? In dB
   double mLoudness = 0.0;
   // What sample rate does the model expect?
   double mExpectedSampleRate;
   // How many samples should be processed during "pre-warming"
   int _prewarm_samples = 0;
+  // Whether prewarm() is deferred, and whether a thread is running it (see DeferPrewarm())
+  enum PrewarmState
+  {
+    kPrewarmDone = 0,
+    kPrewarmPending,
+    kPrewarmRunning
+  };
+  std::atomic<int> _prewarm_state{kPrewarmDone};
+  // Where the model keeps its weights and state
+  Arena mArena;
+#ifdef NAM_ENABLE_PROFILER
+  profiler::Profiler mProfiler;
+#endif
+
+  // Call at the top of process(), so that a deferred prewarm() happens before the first real block.
+  void _prewarm_if_pending_()
+  {
+    if (this->_prewarm_state.load(std::memory_order_acquire) != kPrewarmDone)
+      this->PrewarmIfPending();
+  };
+  // Carve all of the model's weights and state out of `arena` (see Arena). Models that keep buffers in the arena
+  // override this and call _layout_arena_() once their sizes are known and before setting their weights.
+  virtual void _carve_(Arena& /*arena*/) {};
+  // Measure the model, (re)allocate its arena and carve it. Weights are kept when their layout hasn't changed; the
+  // state is kept if `keep_state` and its layout hasn't changed, otherwise it's zeroed.
+  void _layout_arena_(const bool keep_state = false);
 };
 
 // Class where an input buffer is kept so that long-time effects can be
@@ -94,14 +171,20 @@ protected:
   int _receptive_field;
   // First location where we add new samples from the input
   long _input_buffer_offset;
-  std::vector<float> _input_buffer;
+  long _input_buffer_size;
+  VectorMap _input_buffer;
   std::vector<float> _output_buffer;
 
+  void _carve_(Arena& arena) override;
+  // Sets the sizes only; the most-derived class lays out the arena.
   void _set_receptive_field(const int new_receptive_field, const int input_buffer_size);
   void _set_receptive_field(const int new_receptive_field);
   void _reset_input_buffer();
   // Use this->_input_post_gain
   virtual void _update_buffers_(NAM_SAMPLE* input, int num_frames);
+  // Re-lay out the arena for a bigger input buffer, keeping the receptive field's worth of history at the front of
+  // the buffers (i.e. call right after _rewind_buffers_()).
+  virtual void _grow_input_buffer_(const long new_buffer_size);
   virtual void _rewind_buffers_();
 };
 
@@ -114,37 +197,49 @@ public:
   void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
 
 protected:
-  Eigen::VectorXf _weight;
+  VectorMap _weight;
   float _bias;
+
+  void _carve_(Arena& arena) override;
 };
 
 // NN modules =================================================================
 
+// NN modules keep their weights in the owning model's arena. They're sized on construction (or by set_size_()) and
+// can't take weights until they've been carved.
+
 class Conv1D
 {
 public:
-  Conv1D() { this->_dilation = 1; };
-  void set_weights_(std::vector<float>::iterator& weights);
+  Conv1D()
+  : _bias(nullptr, 0)
+  {
+    this->_dilation = 1;
+  };
+  void set_weights_(std::vector<float>::const_iterator& weights);
   void set_size_(const int in_channels, const int out_channels, const int kernel_size, const bool do_bias,
                  const int _dilation);
-  void set_size_and_weights_(const int in_channels, const int out_channels, const int kernel_size, const int _dilation,
-                             const bool do_bias, std::vector<float>::iterator& weights);
+  void carve_(Arena& arena);
   // Process from input to output
   //  Rightmost indices of input go from i_start to i_end,
   //  Indices on output for from j_start (to j_start + i_end - i_start)
-  void process_(const Eigen::MatrixXf& input, Eigen::MatrixXf& output, const long i_start, const long i_end,
-                const long j_start) const;
-  long get_in_channels() const { return this->_weight.size() > 0 ? this->_weight[0].cols() : 0; };
+  void process_(const Eigen::Ref<const Eigen::MatrixXf>& input, Eigen::Ref<Eigen::MatrixXf> output, const long i_start,
+                const long i_end, const long j_start) const;
+  long get_in_channels() const { return this->_in_channels; };
   long get_kernel_size() const { return this->_weight.size(); };
+  // Also the multiply-adds per output frame
   long get_num_weights() const;
-  long get_out_channels() const { return this->_weight.size() > 0 ? this->_weight[0].rows() : 0; };
+  long get_out_channels() const { return this->_out_channels; };
   int get_dilation() const { return this->_dilation; };
 
 private:
   // Gonna wing this...
   // conv[kernel](cout, cin)
-  std::vector<Eigen::MatrixXf> _weight;
-  Eigen::VectorXf _bias;
+  std::vector<MatrixMap> _weight;
+  VectorMap _bias;
+  long _in_channels = 0;
+  long _out_channels = 0;
+  bool _do_bias = false;
   int _dilation;
 };
 
@@ -153,16 +248,19 @@ class Conv1x1
 {
 public:
   Conv1x1(const int in_channels, const int out_channels, const bool _bias);
-  void set_weights_(std::vector<float>::iterator& weights);
+  void set_weights_(std::vector<float>::const_iterator& weights);
+  void carve_(Arena& arena);
   // :param input: (N,Cin) or (Cin,)
   // :return: (N,Cout) or (Cout,), respectively
-  Eigen::MatrixXf process(const Eigen::MatrixXf& input) const;
+  Eigen::MatrixXf process(const Eigen::Ref<const Eigen::MatrixXf>& input) const;
 
   long get_out_channels() const { return this->_weight.rows(); };
+  // Also the multiply-adds per frame
+  long get_num_weights() const { return this->_weight.size() + this->_bias.size(); };
 
 private:
-  Eigen::MatrixXf _weight;
-  Eigen::VectorXf _bias;
+  MatrixMap _weight;
+  VectorMap _bias;
   bool _do_bias;
 };
 
@@ -199,11 +297,22 @@ struct dspData
 void verify_config_version(const std::string version);
 
 // Takes the model file and uses it to instantiate an instance of DSP.
+// The model's activations are evaluated at `precision`; without one, it gets
+// activations::Activation::get_default_precision().
 std::unique_ptr<DSP> get_dsp(const std::filesystem::path model_file);
+std::unique_ptr<DSP> get_dsp(const std::filesystem::path model_file, const activations::Precision precision);
 // Creates an instance of DSP. Also returns a dspData struct that holds the data of the model.
 std::unique_ptr<DSP> get_dsp(const std::filesystem::path model_file, dspData& returnedConfig);
+std::unique_ptr<DSP> get_dsp(const std::filesystem::path model_file, dspData& returnedConfig,
+                             const activations::Precision precision);
 // Instantiates a DSP object from dsp_config struct.
+// With `prewarm` false, prewarming is deferred (see DSP::DeferPrewarm()).
 std::unique_ptr<DSP> get_dsp(dspData& conf);
+std::unique_ptr<DSP> get_dsp(dspData& conf, const activations::Precision precision, const bool prewarm = true);
+// Same, for data that's shared (e.g. between threads): `conf` is only read.
+std::unique_ptr<DSP> get_dsp(const dspData& conf, const activations::Precision precision, const bool prewarm = true);
+// Fills in `returnedConfig` from the JSON of a model file, without instantiating it.
+void get_dsp_data(const nlohmann::json& model, dspData& returnedConfig);
 // Legacy loader for directory-type DSPs
 std::unique_ptr<DSP> get_dsp_legacy(const std::filesystem::path dirname);
 }; // namespace nam
@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+  #include <pthread.h>
+  #include <sched.h>
+#endif
+
+#include "executor.h"
+
+// Frames per call to the model in process_async()
+#define PROCESS_ASYNC_BLOCK_SIZE 8192
+
+namespace
+{
+// The executor and worker the current thread belongs to, if any
+thread_local nam::Executor* _current_executor = nullptr;
+thread_local int _current_worker = -1;
+
+#ifdef __linux__
+// Parse a sysfs CPU list, like "0-3,8-11".
+std::vector<int> _parse_cpu_list(const std::string& list)
+{
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ','))
+  {
+    const size_t dash = range.find('-');
+    try
+    {
+      const int first = std::stoi(range.substr(0, dash));
+      const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; cpu++)
+        cpus.push_back(cpu);
+    }
+    catch (const std::exception&)
+    {
+      // Whatever this is, it's not a CPU.
+    }
+  }
+  return cpus;
+}
+
+// Each CPU's NUMA node, for the CPUs whose node sysfs knows
+std::map<int, int> _get_cpu_nodes()
+{
+  std::map<int, int> nodes;
+  // Node numbers can have gaps, but not many.
+  for (int node = 0, missing = 0; missing < 64; node++)
+  {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!file || !std::getline(file, list))
+    {
+      missing++;
+      continue;
+    }
+    missing = 0;
+    for (const int cpu : _parse_cpu_list(list))
+      nodes[cpu] = node;
+  }
+  return nodes;
+}
+#endif
+}; // namespace
+
+std::vector<nam::executor::CPU> nam::executor::get_allowed_cpus()
+{
+  std::vector<CPU> cpus;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    const std::map<int, int> nodes = _get_cpu_nodes();
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+      {
+        const auto node = nodes.find(cpu);
+        cpus.push_back({cpu, node == nodes.end() ? 0 : node->second});
+      }
+    std::stable_sort(cpus.begin(), cpus.end(), [](const CPU& a, const CPU& b) { return a.node < b.node; });
+    return cpus;
+  }
+#endif
+  for (int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); cpu++)
+    cpus.push_back({cpu, 0});
+  return cpus;
+}
+
+std::vector<nam::executor::CPU> nam::executor::place_workers(const int num_workers, const Placement placement)
+{
+  const std::vector<CPU> cpus = get_allowed_cpus();
+  std::vector<CPU> placed;
+  if (cpus.empty())
+    return placed;
+  std::vector<CPU> order;
+  if (placement == Placement::kCompact)
+    order = cpus;
+  else
+  {
+    // The first CPU of each node, then the second of each, ...
+    std::map<int, std::vector<CPU>> by_node;
+    for (const CPU& cpu : cpus)
+      by_node[cpu.node].push_back(cpu);
+    for (size_t i = 0; order.size() < cpus.size(); i++)
+      for (const auto& node : by_node)
+        if (i < node.second.size())
+          order.push_back(node.second[i]);
+  }
+  for (int i = 0; i < num_workers; i++)
+    placed.push_back(order[i % order.size()]);
+  return placed;
+}
+
+bool nam::executor::pin_thread(std::thread& thread, const int cpu)
+{
+#ifdef __linux__
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+nam::Executor::Executor(const int num_threads, const bool pin, const executor::Placement placement)
+{
+  int n = num_threads;
+  if (n <= 0)
+    n = std::max(1, (int)executor::get_allowed_cpus().size());
+  const std::vector<executor::CPU> cpus = executor::place_workers(n, placement);
+  for (int i = 0; i < n; i++)
+    this->_workers.push_back(std::make_unique<Worker>());
+  // Steal from the workers on the same node first, starting with the next one along so that thieves spread out.
+  for (int i = 0; i < n; i++)
+    for (const bool same_node : {true, false})
+      for (int offset = 1; offset < n; offset++)
+      {
+        const int victim = (i + offset) % n;
+        const bool victim_same_node = cpus.empty() || cpus[victim].node == cpus[i].node;
+        if (victim_same_node == same_node)
+          this->_workers[i]->victims.push_back(victim);
+      }
+
+  this->_pinned = pin && !cpus.empty();
+  for (int i = 0; i < n; i++)
+  {
+    this->_threads.emplace_back([this, i]() { this->_work(i); });
+    if (pin && !cpus.empty())
+      this->_pinned = executor::pin_thread(this->_threads.back(), cpus[i].id) && this->_pinned;
+  }
+}
+
+nam::Executor::~Executor()
+{
+  this->wait();
+  {
+    std::lock_guard<std::mutex> lock(this->_sleep_mutex);
+    this->_stopping = true;
+  }
+  this->_wake_up.notify_all();
+  for (std::thread& thread : this->_threads)
+    thread.join();
+}
+
+void nam::Executor::submit(std::function<void()> task)
+{
+  const int worker =
+    _current_executor == this ? _current_worker : (int)(this->_next_worker++ % this->_workers.size());
+  {
+    std::lock_guard<std::mutex> lock(this->_workers[worker]->mutex);
+    this->_workers[worker]->tasks.push_back(std::move(task));
+  }
+  this->_unfinished.fetch_add(1);
+  this->_queued.fetch_add(1);
+  // Workers check for tasks under the lock, so taking it means none of them can miss this.
+  {
+    std::lock_guard<std::mutex> lock(this->_sleep_mutex);
+  }
+  this->_wake_up.notify_one();
+}
+
+void nam::Executor::wait()
+{
+  std::unique_lock<std::mutex> lock(this->_sleep_mutex);
+  this->_all_done.wait(lock, [this]() { return this->_unfinished.load() == 0; });
+}
+
+void nam::Executor::parallel_for(const int64_t begin, const int64_t end, const int64_t grain,
+                                 const std::function<void(int64_t, int64_t)>& body)
+{
+  if (end <= begin)
+    return;
+  const int64_t chunk_size = std::max((int64_t)1, grain);
+  const int64_t num_chunks = (end - begin + chunk_size - 1) / chunk_size;
+  // Every participant takes the next chunk until there are none left, so fast ones do more.
+  std::atomic<int64_t> next_chunk{0};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto take_chunks = [&]() {
+    for (int64_t chunk; (chunk = next_chunk.fetch_add(1)) < num_chunks;)
+    {
+      const int64_t first = begin + chunk * chunk_size;
+      try
+      {
+        body(first, std::min(end, first + chunk_size));
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+
+  // Helpers share this frame, so it can't return until they've all finished (whether or not they found a chunk).
+  const int64_t num_helpers = std::min(num_chunks - 1, (int64_t)this->_workers.size());
+  std::atomic<int64_t> helpers_running{num_helpers};
+  for (int64_t i = 0; i < num_helpers; i++)
+    this->submit([&]() {
+      take_chunks();
+      helpers_running.fetch_sub(1);
+    });
+  take_chunks();
+  this->help_while_([&]() { return helpers_running.load() == 0; });
+  if (error)
+    std::rethrow_exception(error);
+}
+
+std::future<void> nam::Executor::process_async(DSP& dsp, NAM_SAMPLE* input, NAM_SAMPLE* output,
+                                               const int64_t num_frames)
+{
+  return this->async([&dsp, input, output, num_frames]() {
+    for (int64_t start = 0; start < num_frames; start += PROCESS_ASYNC_BLOCK_SIZE)
+    {
+      const int block_size = (int)std::min((int64_t)PROCESS_ASYNC_BLOCK_SIZE, num_frames - start);
+      dsp.process(input + start, output + start, block_size);
+      dsp.finalize_(block_size);
+    }
+  });
+}
+
+void nam::Executor::help_while_(const std::function<bool()>& done)
+{
+  const int worker = _current_executor == this ? _current_worker : -1;
+  while (!done())
+  {
+    if (this->_try_claim())
+    {
+      std::function<void()> task = this->_take(worker);
+      this->_run(task);
+    }
+    else
+      std::this_thread::yield();
+  }
+}
+
+bool nam::Executor::_try_claim()
+{
+  int64_t queued = this->_queued.load();
+  while (queued > 0)
+    if (this->_queued.compare_exchange_weak(queued, queued - 1))
+      return true;
+  return false;
+}
+
+std::function<void()> nam::Executor::_take(const int worker)
+{
+  const int num_workers = (int)this->_workers.size();
+  std::function<void()> task;
+  while (true)
+  {
+    // Own deque first, newest first
+    if (worker >= 0)
+    {
+      Worker& own = *this->_workers[worker];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty())
+      {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return task;
+      }
+    }
+    // Then the others' oldest: nearest first from a worker, and from anywhere else in turn
+    const std::vector<int>* victims = worker >= 0 ? &this->_workers[worker]->victims : nullptr;
+    const int num_victims = victims != nullptr ? (int)victims->size() : num_workers;
+    const int first = (int)(this->_next_worker.load() % num_workers);
+    for (int i = 0; i < num_victims; i++)
+    {
+      const int victim = victims != nullptr ? (*victims)[i] : (first + i) % num_workers;
+      Worker& other = *this->_workers[victim];
+      std::lock_guard<std::mutex> lock(other.mutex);
+      if (!other.tasks.empty())
+      {
+        task = std::move(other.tasks.front());
+        other.tasks.pop_front();
+        this->_steals.fetch_add(1, std::memory_order_relaxed);
+        return task;
+      }
+    }
+    // There's a task for our claim, but another claimant took the one we would have found while we were looking
+    // elsewhere. Look again.
+    std::this_thread::yield();
+  }
+}
+
+void nam::Executor::_run(std::function<void()>& task)
+{
+  task();
+  if (this->_unfinished.fetch_sub(1) == 1)
+  {
+    std::lock_guard<std::mutex> lock(this->_sleep_mutex);
+    this->_all_done.notify_all();
+  }
+}
+
+void nam::Executor::_work(const int worker)
+{
+  _current_executor = this;
+  _current_worker = worker;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock(this->_sleep_mutex);
+      this->_wake_up.wait(lock, [this]() { return this->_stopping || this->_queued.load() > 0; });
+      if (this->_stopping && this->_queued.load() == 0)
+        return;
+    }
+    if (this->_try_claim())
+    {
+      std::function<void()> task = this->_take(worker);
+      this->_run(task);
+    }
+  }
+}
@@ -0,0 +1,135 @@
+#pragma once
+// A work-stealing thread pool for everything that runs models in parallel (offline rendering, loading many models,
+// serving many streams), so that they share one set of workers instead of each starting threads of their own.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "dsp.h"
+
+namespace nam
+{
+namespace executor
+{
+// A logical CPU and the NUMA node it belongs to
+struct CPU
+{
+  int id;
+  int node;
+};
+
+// How workers are spread over NUMA nodes
+enum class Placement
+{
+  // Fill one node before moving on to the next, so workers share caches and memory
+  kCompact = 0,
+  // Take turns between nodes, for the most memory bandwidth
+  kSpread
+};
+
+// The CPUs this process is allowed to run on, by node and then by id. Node 0 for all of them where the topology
+// isn't known (anywhere but Linux); empty if the CPUs themselves aren't known.
+std::vector<CPU> get_allowed_cpus();
+// Which CPU each of `num_workers` workers should run on. Workers beyond the number of CPUs wrap around. Empty if the
+// CPUs aren't known.
+std::vector<CPU> place_workers(const int num_workers, const Placement placement);
+// Pin a thread to one CPU. Returns whether it worked (never, anywhere but Linux).
+bool pin_thread(std::thread& thread, const int cpu);
+}; // namespace executor
+
+// A fixed set of worker threads, each with its own deque of tasks.
+//
+// Workers take their own newest task first (it's the one whose data is most likely still in cache) and, when they run
+// out, steal the oldest task from another worker, trying the workers on their own NUMA node before the rest. Tasks
+// submitted from inside a task go to the submitting worker's deque, so work fans out from where its inputs already
+// are and only moves when another worker is idle.
+//
+// parallel_for() and help_while_() run other tasks while they wait, so tasks can use them to wait on other tasks
+// without deadlocking or leaving a core idle. (Blocking in a task, e.g. on a future, takes a worker out of the pool.)
+class Executor
+{
+public:
+  // One worker per allowed CPU if num_threads isn't positive. With `pin`, each worker is pinned to the CPU that
+  // `placement` gives it.
+  explicit Executor(const int num_threads = 0, const bool pin = false,
+                    const executor::Placement placement = executor::Placement::kCompact);
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+  // Finishes every task that's been submitted, then stops the workers.
+  ~Executor();
+
+  int get_num_threads() const { return (int)this->_workers.size(); };
+  // Whether the workers are pinned to CPUs
+  bool is_pinned() const { return this->_pinned; };
+  // How many tasks ran on a worker other than the one they were queued on
+  size_t get_num_steals() const { return this->_steals.load(std::memory_order_relaxed); };
+
+  // Queue a task. From a worker, it goes on that worker's own deque; otherwise the deques take turns. The task
+  // mustn't throw; use async() for one that might.
+  void submit(std::function<void()> task);
+  // Queue a function and get a future for what it returns (or throws).
+  template <typename F>
+  std::future<std::invoke_result_t<F>> async(F&& f)
+  {
+    auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(f));
+    auto result = task->get_future();
+    this->submit([task]() { (*task)(); });
+    return result;
+  }
+  // Block until every task submitted so far (and every task they submitted) has finished. Don't call this from a
+  // task.
+  void wait();
+  // Run body(first, last) over [begin, end) in chunks of at most `grain`, in parallel, and return when they've all
+  // finished. The calling thread runs chunks too. If a chunk throws, the first exception is rethrown here once the
+  // others have finished.
+  void parallel_for(const int64_t begin, const int64_t end, const int64_t grain,
+                    const std::function<void(int64_t, int64_t)>& body);
+  // Run `num_frames` of `input` through `dsp` into `output` on a worker (in blocks, finalizing each), for offline
+  // jobs. Nothing else may use `dsp`, `input` or `output` until the future is ready.
+  std::future<void> process_async(DSP& dsp, NAM_SAMPLE* input, NAM_SAMPLE* output, const int64_t num_frames);
+  // Run queued tasks on this thread until `done()` is true. For waiting on something the executor's tasks will do,
+  // from inside one of them.
+  void help_while_(const std::function<bool()>& done);
+
+private:
+  struct Worker
+  {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+    // Where to steal from, nearest first
+    std::vector<int> victims;
+  };
+
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::vector<std::thread> _threads;
+  bool _pinned = false;
+  std::atomic<size_t> _next_worker{0};
+  std::atomic<size_t> _steals{0};
+  // Tasks submitted but not yet claimed by a thread that will run them. A claim is always backed by a task in some
+  // deque, because tasks are queued before they're counted.
+  std::atomic<int64_t> _queued{0};
+  // Submitted but not yet finished
+  std::atomic<int64_t> _unfinished{0};
+  bool _stopping = false;
+  // What idle workers sleep on, and what wait() waits on
+  std::mutex _sleep_mutex;
+  std::condition_variable _wake_up;
+  std::condition_variable _all_done;
+
+  // Claim one queued task, if there are any.
+  bool _try_claim();
+  // Take a claimed task; `worker` is the caller's deque, or -1 if it doesn't have one.
+  std::function<void()> _take(const int worker);
+  void _run(std::function<void()>& task);
+  void _work(const int worker);
+};
+}; // namespace nam
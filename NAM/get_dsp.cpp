@@ -81,54 +81,69 @@ std::vector<float> GetWeights(nlohmann::json const& j, const std::filesystem::pa
 }
 
 std::unique_ptr<DSP> get_dsp(const std::filesystem::path config_filename)
+{
+  return get_dsp(config_filename, activations::Activation::get_default_precision());
+}
+
+std::unique_ptr<DSP> get_dsp(const std::filesystem::path config_filename, const activations::Precision precision)
 {
   dspData temp;
-  return get_dsp(config_filename, temp);
+  return get_dsp(config_filename, temp, precision);
 }
 
 std::unique_ptr<DSP> get_dsp(const std::filesystem::path config_filename, dspData& returnedConfig)
 {
-  if (!std::filesystem::exists(config_filename))
-    throw std::runtime_error("Config JSON doesn't exist!\n");
-  std::ifstream i(config_filename);
-  nlohmann::json j;
-  i >> j;
-  verify_config_version(j["version"]);
-
-  auto architecture = j["architecture"];
-  nlohmann::json config = j["config"];
-  std::vector<float> weights = GetWeights(j, config_filename);
-
-  // Assign values to returnedConfig
-  returnedConfig.version = j["version"];
-  returnedConfig.architecture = j["architecture"];
-  returnedConfig.config = j["config"];
-  returnedConfig.metadata = j["metadata"];
-  returnedConfig.weights = weights;
+  return get_dsp(config_filename, returnedConfig, activations::Activation::get_default_precision());
+}
+
+void get_dsp_data(const nlohmann::json& j, dspData& returnedConfig)
+{
+  verify_config_version(j.at("version"));
+  returnedConfig.version = j.at("version");
+  returnedConfig.architecture = j.at("architecture");
+  returnedConfig.config = j.at("config");
+  returnedConfig.metadata = j.find("metadata") != j.end() ? j["metadata"] : nlohmann::json();
+  returnedConfig.weights = GetWeights(j, "");
   if (j.find("sample_rate") != j.end())
     returnedConfig.expected_sample_rate = j["sample_rate"];
   else
   {
     returnedConfig.expected_sample_rate = -1.0;
   }
+}
 
+std::unique_ptr<DSP> get_dsp(const std::filesystem::path config_filename, dspData& returnedConfig,
+                             const activations::Precision precision)
+{
+  if (!std::filesystem::exists(config_filename))
+    throw std::runtime_error("Config JSON doesn't exist!\n");
+  std::ifstream i(config_filename);
+  nlohmann::json j;
+  i >> j;
+  get_dsp_data(j, returnedConfig);
 
-  /*Copy to a new dsp_config object for get_dsp below,
-   since not sure if weights actually get modified as being non-const references on some
-   model constructors inside get_dsp(dsp_config& conf).
-   We need to return unmodified version of dsp_config via returnedConfig.*/
-  dspData conf = returnedConfig;
-
-  return get_dsp(conf);
+  // Instantiating doesn't modify returnedConfig, so it's returned as it was read.
+  return get_dsp(returnedConfig, precision);
 }
 
 std::unique_ptr<DSP> get_dsp(dspData& conf)
+{
+  return get_dsp(conf, activations::Activation::get_default_precision());
+}
+
+std::unique_ptr<DSP> get_dsp(dspData& conf, const activations::Precision precision, const bool prewarm)
+{
+  return get_dsp(static_cast<const dspData&>(conf), precision, prewarm);
+}
+
+std::unique_ptr<DSP> get_dsp(const dspData& conf, const activations::Precision precision, const bool prewarm)
 {
   verify_config_version(conf.version);
 
-  auto& architecture = conf.architecture;
-  nlohmann::json& config = conf.config;
-  std::vector<float>& weights = conf.weights;
+  // Only const accessors below (json's operator[] adds missing keys), so that shared data can be read as it is.
+  const std::string& architecture = conf.architecture;
+  const nlohmann::json& config = conf.config;
+  const std::vector<float>& weights = conf.weights;
   bool haveLoudness = false;
   double loudness = 0.0;
 
@@ -136,7 +151,7 @@ std::unique_ptr<DSP> get_dsp(dspData& conf)
   {
     if (conf.metadata.find("loudness") != conf.metadata.end())
     {
-      loudness = conf.metadata["loudness"];
+      loudness = conf.metadata.at("loudness");
       haveLoudness = true;
     }
   }
@@ -145,44 +160,47 @@ std::unique_ptr<DSP> get_dsp(dspData& conf)
   std::unique_ptr<DSP> out = nullptr;
   if (architecture == "Linear")
   {
-    const int receptive_field = config["receptive_field"];
-    const bool _bias = config["bias"];
+    const int receptive_field = config.at("receptive_field");
+    const bool _bias = config.at("bias");
     out = std::make_unique<Linear>(receptive_field, _bias, weights, expectedSampleRate);
   }
   else if (architecture == "ConvNet")
   {
-    const int channels = config["channels"];
-    const bool batchnorm = config["batchnorm"];
+    const int channels = config.at("channels");
+    const bool batchnorm = config.at("batchnorm");
     std::vector<int> dilations;
-    for (size_t i = 0; i < config["dilations"].size(); i++)
-      dilations.push_back(config["dilations"][i]);
-    const std::string activation = config["activation"];
-    out = std::make_unique<convnet::ConvNet>(channels, dilations, batchnorm, activation, weights, expectedSampleRate);
+    for (size_t i = 0; i < config.at("dilations").size(); i++)
+      dilations.push_back(config.at("dilations").at(i));
+    const std::string activation = config.at("activation");
+    out = std::make_unique<convnet::ConvNet>(
+      channels, dilations, batchnorm, activation, weights, expectedSampleRate, precision);
   }
   else if (architecture == "LSTM")
   {
-    const int num_layers = config["num_layers"];
-    const int input_size = config["input_size"];
-    const int hidden_size = config["hidden_size"];
-    out = std::make_unique<lstm::LSTM>(num_layers, input_size, hidden_size, weights, expectedSampleRate);
+    const int num_layers = config.at("num_layers");
+    const int input_size = config.at("input_size");
+    const int hidden_size = config.at("hidden_size");
+    out = std::make_unique<lstm::LSTM>(num_layers, input_size, hidden_size, weights, expectedSampleRate, precision);
   }
   else if (architecture == "WaveNet")
   {
     std::vector<wavenet::LayerArrayParams> layer_array_params;
-    for (size_t i = 0; i < config["layers"].size(); i++)
+    for (size_t i = 0; i < config.at("layers").size(); i++)
     {
-      nlohmann::json layer_config = config["layers"][i];
+      const nlohmann::json& layer_config = config.at("layers").at(i);
       std::vector<int> dilations;
-      for (size_t j = 0; j < layer_config["dilations"].size(); j++)
-        dilations.push_back(layer_config["dilations"][j]);
-      layer_array_params.push_back(
-        wavenet::LayerArrayParams(layer_config["input_size"], layer_config["condition_size"], layer_config["head_size"],
-                                  layer_config["channels"], layer_config["kernel_size"], dilations,
-                                  layer_config["activation"], layer_config["gated"], layer_config["head_bias"]));
+      for (size_t j = 0; j < layer_config.at("dilations").size(); j++)
+        dilations.push_back(layer_config.at("dilations").at(j));
+      layer_array_params.push_back(wavenet::LayerArrayParams(
+        layer_config.at("input_size"), layer_config.at("condition_size"), layer_config.at("head_size"),
+        layer_config.at("channels"), layer_config.at("kernel_size"), dilations, layer_config.at("activation"),
+        layer_config.at("gated"), layer_config.at("head_bias")));
     }
-    const bool with_head = config["head"] == NULL;
-    const float head_scale = config["head_scale"];
-    out = std::make_unique<wavenet::WaveNet>(layer_array_params, head_scale, with_head, weights, expectedSampleRate);
+    const nlohmann::json head = config.find("head") != config.end() ? config.at("head") : nlohmann::json();
+    const bool with_head = head == NULL;
+    const float head_scale = config.at("head_scale");
+    out = std::make_unique<wavenet::WaveNet>(
+      layer_array_params, head_scale, with_head, weights, expectedSampleRate, precision);
   }
   else
   {
@@ -194,7 +212,10 @@ std::unique_ptr<DSP> get_dsp(dspData& conf)
   }
 
   // "pre-warm" the model to settle initial conditions
-  out->prewarm();
+  if (prewarm)
+    out->prewarm();
+  else
+    out->DeferPrewarm();
 
   return out;
 }
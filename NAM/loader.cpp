@@ -0,0 +1,44 @@
+#include <chrono>
+#include <mutex>
+
+#include "loader.h"
+
+std::vector<nam::LoadResult> nam::load_many(const std::vector<std::filesystem::path>& paths, Executor& executor,
+                                            const LoadOptions& options)
+{
+  std::vector<LoadResult> results(paths.size());
+  ModelCache& cache = options.cache != nullptr ? *options.cache : ModelCache::get_global();
+  std::mutex progress_mutex;
+  size_t num_done = 0;
+
+  executor.parallel_for(0, (int64_t)paths.size(), 1, [&](const int64_t first, const int64_t last) {
+    for (int64_t i = first; i < last; i++)
+    {
+      LoadResult& result = results[i];
+      result.path = paths[i];
+      const auto start = std::chrono::steady_clock::now();
+      try
+      {
+        const std::shared_ptr<const dspData> data = cache.get_data(paths[i]);
+        result.model = get_dsp(*data, options.precision, options.prewarm == PrewarmMode::kNow);
+      }
+      catch (const std::exception& e)
+      {
+        result.error = e.what();
+      }
+      result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      // Workers only get to these once there's nothing left to load.
+      if (result.model != nullptr && options.prewarm == PrewarmMode::kBackground)
+      {
+        DSP* model = result.model.get();
+        result.prewarmed = executor.async([model]() { model->PrewarmIfPending(); }).share();
+      }
+      if (options.on_progress)
+      {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        options.on_progress(result, ++num_done, paths.size());
+      }
+    }
+  });
+  return results;
+}
@@ -0,0 +1,57 @@
+#pragma once
+// Loading many models at once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "dsp.h"
+#include "executor.h"
+#include "model_cache.h"
+
+namespace nam
+{
+// When the models from load_many() get prewarmed
+enum class PrewarmMode
+{
+  // Before load_many() returns, like get_dsp()
+  kNow = 0,
+  // On each model's first process() (see DSP::DeferPrewarm())
+  kLazy,
+  // On the executor, after the loading. A process() that comes first waits for it (or does it, if it hasn't started).
+  kBackground
+};
+
+// What became of one file
+struct LoadResult
+{
+  std::filesystem::path path;
+  // nullptr if it failed, with `error` saying why
+  std::unique_ptr<DSP> model;
+  std::string error;
+  // Time spent reading, parsing and constructing it (and prewarming, with kNow)
+  double seconds = 0.0;
+  // With PrewarmMode::kBackground, ready once the model's been prewarmed. Don't destroy the model before then.
+  std::shared_future<void> prewarmed;
+};
+
+struct LoadOptions
+{
+  activations::Precision precision = activations::Activation::get_default_precision();
+  PrewarmMode prewarm = PrewarmMode::kLazy;
+  // Where to get parsed models from; ModelCache::get_global() if null
+  ModelCache* cache = nullptr;
+  // Called as each file finishes (whether or not it loaded), with how many have so far. Calls come from the
+  // executor's threads, but one at a time.
+  std::function<void(const LoadResult& result, size_t num_done, size_t num_files)> on_progress;
+};
+
+// Load every file in parallel on `executor`, returning a result for each, in order. Failures don't stop the rest.
+// Files with the same contents are parsed once (through the cache), but each gets its own instance.
+std::vector<LoadResult> load_many(const std::vector<std::filesystem::path>& paths, Executor& executor,
+                                  const LoadOptions& options = LoadOptions());
+}; // namespace nam
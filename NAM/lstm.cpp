@@ -4,15 +4,30 @@
 
 #include "lstm.h"
 
-nam::lstm::LSTMCell::LSTMCell(const int input_size, const int hidden_size, std::vector<float>::iterator& weights)
+nam::lstm::LSTMCell::LSTMCell(const int input_size, const int hidden_size, const activations::Precision precision)
+: _w(nullptr, 4 * hidden_size, input_size + hidden_size)
+, _b(nullptr, 4 * hidden_size)
+, _xh(nullptr, input_size + hidden_size)
+, _ifgo(nullptr, 4 * hidden_size)
+, _c(nullptr, hidden_size)
+, _sigmoid(activations::Activation::get_activation("Sigmoid", precision))
+, _tanh(activations::Activation::get_activation("Tanh", precision))
 {
-  // Resize arrays
-  this->_w.resize(4 * hidden_size, input_size + hidden_size);
-  this->_b.resize(4 * hidden_size);
-  this->_xh.resize(input_size + hidden_size);
-  this->_ifgo.resize(4 * hidden_size);
-  this->_c.resize(hidden_size);
+}
 
+void nam::lstm::LSTMCell::carve_(Arena& arena)
+{
+  arena.carve_weights_(this->_w, this->_w.rows(), this->_w.cols());
+  arena.carve_weights_(this->_b, this->_b.size());
+  arena.carve_state_(this->_xh, this->_xh.size());
+  arena.carve_state_(this->_ifgo, this->_ifgo.size());
+  arena.carve_state_(this->_c, this->_c.size());
+}
+
+void nam::lstm::LSTMCell::set_weights_(std::vector<float>::const_iterator& weights)
+{
+  const long input_size = this->_get_input_size();
+  const long hidden_size = this->_get_hidden_size();
   // Assign in row-major because that's how PyTorch goes.
   for (int i = 0; i < this->_w.rows(); i++)
     for (int j = 0; j < this->_w.cols(); j++)
@@ -26,14 +41,15 @@ nam::lstm::LSTMCell::LSTMCell(const int input_size, const int hidden_size, std::
     this->_c[i] = *(weights++);
 }
 
-void nam::lstm::LSTMCell::process_(const Eigen::VectorXf& x)
+void nam::lstm::LSTMCell::process_(const Eigen::Ref<const Eigen::VectorXf>& x)
 {
+  NAM_PROFILE_STAGE(kLSTMCell);
   const long hidden_size = this->_get_hidden_size();
   const long input_size = this->_get_input_size();
   // Assign inputs
   this->_xh(Eigen::seq(0, input_size - 1)) = x;
   // The matmul
-  this->_ifgo = this->_w * this->_xh + this->_b;
+  this->_ifgo.noalias() = this->_w * this->_xh + this->_b;
   // Elementwise updates (apply nonlinearities here)
   const long i_offset = 0;
   const long f_offset = hidden_size;
@@ -41,49 +57,67 @@ void nam::lstm::LSTMCell::process_(const Eigen::VectorXf& x)
   const long o_offset = 3 * hidden_size;
   const long h_offset = input_size;
 
-  if (activations::Activation::using_fast_tanh)
-  {
-    for (auto i = 0; i < hidden_size; i++)
-      this->_c[i] =
-        activations::fast_sigmoid(this->_ifgo[i + f_offset]) * this->_c[i]
-        + activations::fast_sigmoid(this->_ifgo[i + i_offset]) * activations::fast_tanh(this->_ifgo[i + g_offset]);
+  // Gates i and f are next to each other.
+  this->_sigmoid->apply(this->_ifgo.data() + i_offset, 2 * hidden_size);
+  this->_tanh->apply(this->_ifgo.data() + g_offset, hidden_size);
+  this->_sigmoid->apply(this->_ifgo.data() + o_offset, hidden_size);
 
-    for (int i = 0; i < hidden_size; i++)
-      this->_xh[i + h_offset] =
-        activations::fast_sigmoid(this->_ifgo[i + o_offset]) * activations::fast_tanh(this->_c[i]);
-  }
-  else
-  {
-    for (auto i = 0; i < hidden_size; i++)
-      this->_c[i] = activations::sigmoid(this->_ifgo[i + f_offset]) * this->_c[i]
-                    + activations::sigmoid(this->_ifgo[i + i_offset]) * tanhf(this->_ifgo[i + g_offset]);
-
-    for (int i = 0; i < hidden_size; i++)
-      this->_xh[i + h_offset] = activations::sigmoid(this->_ifgo[i + o_offset]) * tanhf(this->_c[i]);
-  }
+  this->_c = this->_ifgo.segment(f_offset, hidden_size).cwiseProduct(this->_c)
+             + this->_ifgo.segment(i_offset, hidden_size).cwiseProduct(this->_ifgo.segment(g_offset, hidden_size));
+  // h = o * tanh(c), worked out in place
+  auto h = this->_xh.segment(h_offset, hidden_size);
+  h = this->_c;
+  this->_tanh->apply(h.data(), hidden_size);
+  h.array() *= this->_ifgo.segment(o_offset, hidden_size).array();
 }
 
-nam::lstm::LSTM::LSTM(const int num_layers, const int input_size, const int hidden_size, std::vector<float>& weights,
-                      const double expected_sample_rate)
+nam::lstm::LSTM::LSTM(const int num_layers, const int input_size, const int hidden_size,
+                      const std::vector<float>& weights, const double expected_sample_rate,
+                      const activations::Precision precision)
 : DSP(expected_sample_rate)
+, _head_weight(nullptr, hidden_size)
+, _input(nullptr, 1)
 {
-  this->_input.resize(1);
-  std::vector<float>::iterator it = weights.begin();
+  this->mActivationPrecision = precision;
   for (int i = 0; i < num_layers; i++)
-    this->_layers.push_back(LSTMCell(i == 0 ? input_size : hidden_size, hidden_size, it));
-  this->_head_weight.resize(hidden_size);
+    this->_layers.push_back(LSTMCell(i == 0 ? input_size : hidden_size, hidden_size, precision));
+  this->_layout_arena_();
+
+  std::vector<float>::const_iterator it = weights.begin();
+  for (size_t i = 0; i < this->_layers.size(); i++)
+    this->_layers[i].set_weights_(it);
   for (int i = 0; i < hidden_size; i++)
     this->_head_weight[i] = *(it++);
   this->_head_bias = *(it++);
   assert(it == weights.end());
+
+  for (size_t i = 0; i < this->_layers.size(); i++)
+  {
+    this->mCostEstimate.multiply_adds_per_sample += this->_layers[i].get_multiply_adds();
+    this->mCostEstimate.activations_per_sample += this->_layers[i].get_activations();
+  }
+  this->mCostEstimate.multiply_adds_per_sample += hidden_size + 1;
+  // Everything it's ever heard is in its state.
+  this->mCostEstimate.receptive_field = -1;
 }
 
 void nam::lstm::LSTM::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
 {
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  NAM_PROFILE_MODEL(this->mProfiler);
   for (size_t i = 0; i < num_frames; i++)
     output[i] = this->_process_sample(input[i]);
 }
 
+void nam::lstm::LSTM::_carve_(Arena& arena)
+{
+  for (size_t i = 0; i < this->_layers.size(); i++)
+    this->_layers[i].carve_(arena);
+  arena.carve_weights_(this->_head_weight, this->_head_weight.size());
+  arena.carve_state_(this->_input, this->_input.size());
+}
+
 float nam::lstm::LSTM::_process_sample(const float x)
 {
   if (this->_layers.size() == 0)
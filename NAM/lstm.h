@@ -22,25 +22,38 @@ namespace lstm
 class LSTMCell
 {
 public:
-  LSTMCell(const int input_size, const int hidden_size, std::vector<float>::iterator& weights);
-  Eigen::VectorXf get_hidden_state() const { return this->_xh(Eigen::placeholders::lastN(this->_get_hidden_size())); };
-  void process_(const Eigen::VectorXf& x);
+  LSTMCell(const int input_size, const int hidden_size, const activations::Precision precision);
+  // Also sets the initial hidden and cell states
+  void set_weights_(std::vector<float>::const_iterator& weights);
+  void carve_(Arena& arena);
+  Eigen::Ref<const Eigen::VectorXf> get_hidden_state() const
+  {
+    return this->_xh(Eigen::placeholders::lastN(this->_get_hidden_size()));
+  };
+  void process_(const Eigen::Ref<const Eigen::VectorXf>& x);
+  // Per step: the gates' matrix product and biases, and the cell and hidden state updates
+  long get_multiply_adds() const { return this->_w.size() + this->_b.size() + 3 * this->_get_hidden_size(); };
+  // Per step: sigmoids for i, f and o, and tanhs for g and the cell state
+  long get_activations() const { return 5 * this->_get_hidden_size(); };
 
 private:
   // Parameters
   // xh -> ifgo
   // (dx+dh) -> (4*dh)
-  Eigen::MatrixXf _w;
-  Eigen::VectorXf _b;
+  MatrixMap _w;
+  VectorMap _b;
 
   // State
   // Concatenated input and hidden state
-  Eigen::VectorXf _xh;
+  VectorMap _xh;
   // Input, Forget, Cell, Output gates
-  Eigen::VectorXf _ifgo;
+  VectorMap _ifgo;
 
   // Cell state
-  Eigen::VectorXf _c;
+  VectorMap _c;
+
+  activations::Activation* _sigmoid;
+  activations::Activation* _tanh;
 
   long _get_hidden_size() const { return this->_b.size() / 4; };
   long _get_input_size() const { return this->_xh.size() - this->_get_hidden_size(); };
@@ -50,21 +63,23 @@ private:
 class LSTM : public DSP
 {
 public:
-  LSTM(const int num_layers, const int input_size, const int hidden_size, std::vector<float>& weights,
-       const double expected_sample_rate = -1.0);
+  LSTM(const int num_layers, const int input_size, const int hidden_size, const std::vector<float>& weights,
+       const double expected_sample_rate = -1.0,
+       const activations::Precision precision = activations::Activation::get_default_precision());
   ~LSTM() = default;
 
 protected:
-  Eigen::VectorXf _head_weight;
+  VectorMap _head_weight;
   float _head_bias;
   void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
   std::vector<LSTMCell> _layers;
 
+  void _carve_(Arena& arena) override;
   float _process_sample(const float x);
 
   // Input to the LSTM.
   // Since this is assumed to not be a parametric model, its shape should be (1,)
-  Eigen::VectorXf _input;
+  VectorMap _input;
 };
 }; // namespace lstm
 }; // namespace nam
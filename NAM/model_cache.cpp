@@ -0,0 +1,195 @@
+#include <cstring> // memcpy
+#include <fstream>
+#include <stdexcept>
+
+#include "model_cache.h"
+
+namespace
+{
+// 64-bit FNV-1a over 8-byte words (with a shift to carry the high bits down), then the leftover bytes
+uint64_t _hash_bytes(const std::string& bytes)
+{
+  constexpr uint64_t kPrime = 0x100000001b3ull;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const char* data = bytes.data();
+  const size_t size = bytes.size();
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+  {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * kPrime;
+    hash ^= hash >> 29;
+  }
+  for (; i < size; i++)
+    hash = (hash ^ (uint8_t)data[i]) * kPrime;
+  return hash;
+}
+
+// Roughly what parsed data takes up
+size_t _get_bytes(const nam::dspData& data)
+{
+  return sizeof(data) + data.weights.capacity() * sizeof(float) + data.config.dump().size()
+         + data.metadata.dump().size();
+}
+}; // namespace
+
+nam::ModelCache::ModelCache(const size_t budget_bytes)
+: _budget_bytes(budget_bytes)
+{
+}
+
+nam::ModelCache& nam::ModelCache::get_global()
+{
+  static ModelCache cache;
+  return cache;
+}
+
+std::shared_ptr<const nam::dspData> nam::ModelCache::get_data(const std::filesystem::path& model_file)
+{
+  std::error_code error;
+  const std::filesystem::path canonical = std::filesystem::canonical(model_file, error);
+  if (error)
+    throw std::runtime_error("Config JSON doesn't exist!\n");
+  const auto modified = std::filesystem::last_write_time(canonical, error);
+  if (error)
+    throw std::runtime_error("Can't read " + canonical.string());
+  const uintmax_t size = std::filesystem::file_size(canonical, error);
+  if (error)
+    throw std::runtime_error("Can't read " + canonical.string());
+
+  // Unchanged since it was last hashed?
+  {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    const auto file = this->_files.find(canonical.string());
+    if (file != this->_files.end() && file->second.modified == modified && file->second.size == size)
+      if (auto data = this->_find(file->second.key))
+        return data;
+  }
+
+  std::ifstream stream(canonical, std::ios::binary);
+  std::string contents(size, '\0');
+  if (!stream.read(&contents[0], (std::streamsize)size))
+    throw std::runtime_error("Can't read " + canonical.string());
+  const Key key{_hash_bytes(contents), (uint64_t)size};
+  std::promise<std::shared_ptr<const dspData>> promise;
+  {
+    // The same model may be cached under another name, or being parsed for someone else right now.
+    std::unique_lock<std::mutex> lock(this->_mutex);
+    this->_files[canonical.string()] = {modified, size, key};
+    if (auto data = this->_find(key))
+      return data;
+    const auto loading = this->_loading.find(key);
+    if (loading != this->_loading.end())
+    {
+      std::shared_future<std::shared_ptr<const dspData>> parsing = loading->second;
+      this->_stats.hits++;
+      lock.unlock();
+      return parsing.get();
+    }
+    this->_loading[key] = promise.get_future().share();
+  }
+
+  std::shared_ptr<const dspData> data;
+  try
+  {
+    auto parsed = std::make_shared<dspData>();
+    get_dsp_data(nlohmann::json::parse(contents), *parsed);
+    data = std::move(parsed);
+  }
+  catch (...)
+  {
+    // Whoever's waiting on this gets the same error.
+    promise.set_exception(std::current_exception());
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_loading.erase(key);
+    this->_forget_files_(key);
+    throw;
+  }
+  const size_t bytes = _get_bytes(*data);
+  {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    this->_loading.erase(key);
+    this->_stats.misses++;
+    this->_lru.push_front(key);
+    this->_entries[key] = {data, bytes, this->_lru.begin()};
+    this->_stats.bytes += bytes;
+    this->_evict_();
+  }
+  promise.set_value(data);
+  return data;
+}
+
+std::unique_ptr<nam::DSP> nam::ModelCache::get_dsp(const std::filesystem::path& model_file)
+{
+  return this->get_dsp(model_file, activations::Activation::get_default_precision());
+}
+
+std::unique_ptr<nam::DSP> nam::ModelCache::get_dsp(const std::filesystem::path& model_file,
+                                                   const activations::Precision precision, const bool prewarm)
+{
+  const std::shared_ptr<const dspData> data = this->get_data(model_file);
+  return nam::get_dsp(*data, precision, prewarm);
+}
+
+void nam::ModelCache::set_budget_(const size_t budget_bytes)
+{
+  std::lock_guard<std::mutex> lock(this->_mutex);
+  this->_budget_bytes = budget_bytes;
+  this->_evict_();
+}
+
+size_t nam::ModelCache::get_budget() const
+{
+  std::lock_guard<std::mutex> lock(this->_mutex);
+  return this->_budget_bytes;
+}
+
+nam::ModelCache::Stats nam::ModelCache::get_stats() const
+{
+  std::lock_guard<std::mutex> lock(this->_mutex);
+  Stats stats = this->_stats;
+  stats.num_entries = this->_entries.size();
+  return stats;
+}
+
+void nam::ModelCache::clear_()
+{
+  std::lock_guard<std::mutex> lock(this->_mutex);
+  this->_entries.clear();
+  this->_lru.clear();
+  this->_files.clear();
+  this->_stats.bytes = 0;
+}
+
+std::shared_ptr<const nam::dspData> nam::ModelCache::_find(const Key& key)
+{
+  const auto entry = this->_entries.find(key);
+  if (entry == this->_entries.end())
+    return nullptr;
+  this->_lru.splice(this->_lru.begin(), this->_lru, entry->second.position);
+  this->_stats.hits++;
+  return entry->second.data;
+}
+
+void nam::ModelCache::_evict_()
+{
+  while (this->_stats.bytes > this->_budget_bytes && !this->_lru.empty())
+  {
+    const auto entry = this->_entries.find(this->_lru.back());
+    this->_stats.bytes -= entry->second.bytes;
+    this->_entries.erase(entry);
+    this->_forget_files_(this->_lru.back());
+    this->_lru.pop_back();
+    this->_stats.evictions++;
+  }
+}
+
+void nam::ModelCache::_forget_files_(const Key& key)
+{
+  for (auto file = this->_files.begin(); file != this->_files.end();)
+    if (file->second.key == key)
+      file = this->_files.erase(file);
+    else
+      ++file;
+}
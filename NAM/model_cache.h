@@ -0,0 +1,113 @@
+#pragma once
+// Parsed models, shared between everything in the process that loads the same model
+
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "dsp.h"
+
+namespace nam
+{
+// Keeps parsed model files (their dspData) so that loading a model that's been loaded before skips reading and
+// parsing its JSON.
+//
+// Models are identified by their contents, so copies of a capture under different names share one entry. A file
+// whose size and modification time haven't changed since it was last hashed isn't read again at all. The data is
+// immutable and shared: every caller gets the same dspData, and it lives as long as anyone holds it, even after it's
+// evicted. Instances made from it still copy the weights into their own arenas (so that each can be locked, put on
+// huge pages, or live on its own NUMA node; see Arena).
+//
+// When the data held goes over the budget, the least recently used entries are dropped. Safe to call from many
+// threads; files are read and parsed outside the lock, and a model that's already being parsed is waited for rather
+// than parsed again.
+class ModelCache
+{
+public:
+  static constexpr size_t kDefaultBudgetBytes = (size_t)256 << 20;
+
+  struct Stats
+  {
+    // Requests answered from the cache, and those that had to parse
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t num_entries = 0;
+    // What the entries are estimated to take up
+    size_t bytes = 0;
+  };
+
+  explicit ModelCache(const size_t budget_bytes = kDefaultBudgetBytes);
+  ModelCache(const ModelCache&) = delete;
+  ModelCache& operator=(const ModelCache&) = delete;
+
+  // The one for the whole process
+  static ModelCache& get_global();
+
+  // The parsed contents of a model file. Throws like get_dsp() if it can't be read or isn't a model.
+  std::shared_ptr<const dspData> get_data(const std::filesystem::path& model_file);
+  // A new instance of a model file's model (like get_dsp(), but parsing the file only if it's new). A hit still
+  // pays for constructing the instance (copying the weights into its arena) and, unless `prewarm` is false,
+  // prewarming it; with `prewarm` false that's put off until its first process() (see DSP::DeferPrewarm()).
+  std::unique_ptr<DSP> get_dsp(const std::filesystem::path& model_file);
+  std::unique_ptr<DSP> get_dsp(const std::filesystem::path& model_file, const activations::Precision precision,
+                               const bool prewarm = true);
+
+  // Evicts as needed to fit a new budget.
+  void set_budget_(const size_t budget_bytes);
+  size_t get_budget() const;
+  Stats get_stats() const;
+  // Drop every entry (holders keep theirs).
+  void clear_();
+
+private:
+  // Contents: a hash of the file and its size
+  struct Key
+  {
+    uint64_t hash;
+    uint64_t size;
+    bool operator==(const Key& other) const { return this->hash == other.hash && this->size == other.size; };
+  };
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const { return (size_t)(key.hash ^ (key.size * 0x9e3779b97f4a7c15ull)); };
+  };
+  struct Entry
+  {
+    std::shared_ptr<const dspData> data;
+    size_t bytes;
+    // Where it is in _lru
+    std::list<Key>::iterator position;
+  };
+  // What a path held when it was last hashed
+  struct FileState
+  {
+    std::filesystem::file_time_type modified;
+    uintmax_t size;
+    Key key;
+  };
+
+  mutable std::mutex _mutex;
+  size_t _budget_bytes;
+  std::unordered_map<Key, Entry, KeyHash> _entries;
+  // Most recently used first
+  std::list<Key> _lru;
+  // Only paths of models that are cached (or being parsed), so that it doesn't grow with every path ever asked for
+  std::unordered_map<std::string, FileState> _files;
+  // Models being parsed, for anyone else who wants them meanwhile
+  std::unordered_map<Key, std::shared_future<std::shared_ptr<const dspData>>, KeyHash> _loading;
+  Stats _stats;
+
+  // Looks up and marks as used; nullptr if it isn't cached. Call with the lock held.
+  std::shared_ptr<const dspData> _find(const Key& key);
+  // Call with the lock held.
+  void _evict_();
+  // Drops the paths that hold the model under `key`. Call with the lock held.
+  void _forget_files_(const Key& key);
+};
+}; // namespace nam
@@ -0,0 +1,856 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "plan.h"
+
+namespace
+{
+using nam::plan::Op;
+using nam::plan::OpType;
+using nam::plan::Plan;
+
+// Hands out a model's weights in order, and complains if there are too few or too many.
+class WeightReader
+{
+public:
+  WeightReader(const std::vector<float>& weights)
+  : _weights(weights)
+  {
+  }
+  float next_()
+  {
+    if (this->_position >= this->_weights.size())
+      throw std::runtime_error("Weight mismatch: the model expects more weights than were provided");
+    return this->_weights[this->_position++];
+  }
+  // Appends `count` weights to `dst`.
+  void read_(std::vector<float>& dst, const long count)
+  {
+    for (long i = 0; i < count; i++)
+      dst.push_back(this->next_());
+  }
+  // Appends an (out x in) matrix that's flattened row-major (as PyTorch does), column-major.
+  void read_matrix_(std::vector<float>& dst, const long out_channels, const long in_channels)
+  {
+    const size_t start = dst.size();
+    dst.resize(start + out_channels * in_channels);
+    for (long i = 0; i < out_channels; i++)
+      for (long j = 0; j < in_channels; j++)
+        dst[start + j * out_channels + i] = this->next_();
+  }
+  // Appends a convolution's taps, which are flattened by output channel, input channel, then tap.
+  void read_taps_(std::vector<float>& dst, const long out_channels, const long in_channels, const long kernel_size)
+  {
+    const size_t start = dst.size();
+    const long tap_size = out_channels * in_channels;
+    dst.resize(start + kernel_size * tap_size);
+    for (long i = 0; i < out_channels; i++)
+      for (long j = 0; j < in_channels; j++)
+        for (long k = 0; k < kernel_size; k++)
+          dst[start + k * tap_size + j * out_channels + i] = this->next_();
+  }
+  void check_done() const
+  {
+    if (this->_position != this->_weights.size())
+    {
+      std::stringstream ss;
+      ss << "Weight mismatch: assigned " << this->_position << " weights, but " << this->_weights.size()
+         << " were provided.";
+      throw std::runtime_error(ss.str());
+    }
+  }
+
+private:
+  const std::vector<float>& _weights;
+  size_t _position = 0;
+};
+
+Op make_op(const OpType type, const std::vector<int>& inputs)
+{
+  Op op;
+  op.type = type;
+  op.inputs = inputs;
+  return op;
+}
+
+Op make_conv(const int input, const long kernel_size, const long dilation, const bool bias)
+{
+  Op op = make_op(kernel_size == 1 && dilation == 1 ? OpType::kConv1x1 : OpType::kConv1D, {input});
+  op.kernel_size = kernel_size;
+  op.dilation = dilation;
+  op.bias = bias;
+  return op;
+}
+
+// Conv1x1 (out x in) with its (optional) bias
+Op read_conv1x1(WeightReader& reader, const int input, const long in_channels, const long out_channels,
+                const bool bias)
+{
+  Op op = make_conv(input, 1, 1, bias);
+  reader.read_matrix_(op.weights, out_channels, in_channels);
+  if (bias)
+    reader.read_(op.weights, out_channels);
+  return op;
+}
+
+void lower_linear(Plan& plan, const nlohmann::json& config, WeightReader& reader)
+{
+  const long receptive_field = config.at("receptive_field");
+  const bool bias = config.at("bias");
+  // weights[m] multiplies the input from m frames ago, so the oldest tap comes last.
+  Op conv = make_op(OpType::kConv1D, {plan.input});
+  conv.kernel_size = receptive_field;
+  conv.bias = bias;
+  conv.weights.resize(receptive_field);
+  for (long m = 0; m < receptive_field; m++)
+    conv.weights[receptive_field - 1 - m] = reader.next_();
+  if (bias)
+    reader.read_(conv.weights, 1);
+  plan.output = plan.add_op_(conv, 1);
+  plan.prewarm_samples = 0;
+}
+
+void lower_convnet(Plan& plan, const nlohmann::json& config, WeightReader& reader)
+{
+  const long channels = config.at("channels");
+  const bool batchnorm = config.at("batchnorm");
+  const std::string activation = config.at("activation");
+  int x = plan.input;
+  long in_channels = 1;
+  plan.prewarm_samples = 1;
+  for (size_t i = 0; i < config.at("dilations").size(); i++)
+  {
+    const long dilation = config.at("dilations").at(i);
+    // Blocks have a kernel size of 2 and only need a bias without the batchnorm.
+    Op conv = make_conv(x, 2, dilation, !batchnorm);
+    reader.read_taps_(conv.weights, channels, in_channels, 2);
+    if (!batchnorm)
+      reader.read_(conv.weights, channels);
+    x = plan.add_op_(conv, channels);
+    if (batchnorm)
+    {
+      std::vector<float> running_mean, running_var, weight, bias;
+      reader.read_(running_mean, channels);
+      reader.read_(running_var, channels);
+      reader.read_(weight, channels);
+      reader.read_(bias, channels);
+      const float eps = reader.next_();
+      Op affine = make_op(OpType::kAffine, {x});
+      affine.weights.resize(2 * channels);
+      for (long c = 0; c < channels; c++)
+      {
+        const float scale = weight[c] / std::sqrt(eps + running_var[c]);
+        affine.weights[c] = scale;
+        affine.weights[channels + c] = bias[c] - scale * running_mean[c];
+      }
+      x = plan.add_op_(affine, channels);
+    }
+    Op act = make_op(OpType::kActivation, {x});
+    act.activation = activation;
+    x = plan.add_op_(act, channels);
+    in_channels = channels;
+    plan.prewarm_samples += dilation;
+  }
+  plan.output = plan.add_op_(read_conv1x1(reader, x, channels, 1, true), 1);
+}
+
+void lower_lstm(Plan& plan, const nlohmann::json& config, WeightReader& reader)
+{
+  const int num_layers = config.at("num_layers");
+  const long input_size = config.at("input_size");
+  const long hidden_size = config.at("hidden_size");
+  if (input_size != 1)
+    throw std::runtime_error("Plans only run LSTMs with one input channel");
+  int x = plan.input;
+  for (int i = 0; i < num_layers; i++)
+  {
+    const long in_channels = i == 0 ? input_size : hidden_size;
+    Op step = make_op(OpType::kLSTMStep, {x});
+    reader.read_matrix_(step.weights, 4 * hidden_size, in_channels + hidden_size);
+    // The biases, then the initial hidden and cell states
+    reader.read_(step.weights, 6 * hidden_size);
+    x = plan.add_op_(step, hidden_size);
+  }
+  plan.output = plan.add_op_(read_conv1x1(reader, x, hidden_size, 1, true), 1);
+  plan.prewarm_samples = 0;
+}
+
+void lower_wavenet(Plan& plan, const nlohmann::json& config, WeightReader& reader)
+{
+  if (config.contains("head") && !config.at("head").is_null())
+    throw std::runtime_error("Head not implemented!");
+  const nlohmann::json& arrays = config.at("layers");
+  int layer_input = plan.input;
+  long layer_input_channels = 1;
+  int head = -1;
+  long head_channels = 0;
+  plan.prewarm_samples = 1;
+  for (size_t i = 0; i < arrays.size(); i++)
+  {
+    const nlohmann::json& params = arrays.at(i);
+    const long input_size = params.at("input_size");
+    const long condition_size = params.at("condition_size");
+    const long head_size = params.at("head_size");
+    const long channels = params.at("channels");
+    const long kernel_size = params.at("kernel_size");
+    const std::string activation = params.at("activation");
+    const bool gated = params.at("gated");
+    const bool head_bias = params.at("head_bias");
+    if (input_size != layer_input_channels || condition_size != 1)
+      throw std::runtime_error("Plans only run WaveNets whose layer arrays chain from a mono input");
+    if (i > 0 && channels != head_channels)
+    {
+      std::stringstream ss;
+      ss << "channels of layer " << i << " (" << channels << ") doesn't match head_size of preceding layer ("
+         << head_channels << "!\n";
+      throw std::runtime_error(ss.str());
+    }
+    const long z_channels = gated ? 2 * channels : channels;
+
+    int x = plan.add_op_(read_conv1x1(reader, layer_input, input_size, channels, false), channels);
+    for (size_t j = 0; j < params.at("dilations").size(); j++)
+    {
+      const long dilation = params.at("dilations").at(j);
+      Op conv = make_conv(x, kernel_size, dilation, true);
+      reader.read_taps_(conv.weights, z_channels, channels, kernel_size);
+      reader.read_(conv.weights, z_channels);
+      // The mix-in runs first so that the convolution can be fused with the add.
+      const int mixin = plan.add_op_(read_conv1x1(reader, plan.input, condition_size, z_channels, false), z_channels);
+      const int z = plan.add_op_(conv, z_channels);
+      int g = plan.add_op_(make_op(OpType::kAdd, {z, mixin}), z_channels);
+      Op act = make_op(OpType::kActivation, {g});
+      act.activation = activation;
+      g = plan.add_op_(act, z_channels);
+      if (gated)
+      {
+        Op gate = make_op(OpType::kGate, {g});
+        gate.activation = "Sigmoid";
+        g = plan.add_op_(gate, channels);
+      }
+      // The first array's head input starts at zero.
+      head = head < 0 ? g : plan.add_op_(make_op(OpType::kAdd, {head, g}), channels);
+      const int residual = plan.add_op_(read_conv1x1(reader, g, channels, channels, true), channels);
+      x = plan.add_op_(make_op(OpType::kAdd, {x, residual}), channels);
+      plan.prewarm_samples += dilation * (kernel_size - 1);
+    }
+    if (head < 0)
+      throw std::runtime_error("Plans don't run WaveNet layer arrays without layers");
+    head = plan.add_op_(read_conv1x1(reader, head, channels, head_size, head_bias), head_size);
+    head_channels = head_size;
+    layer_input = x;
+    layer_input_channels = channels;
+  }
+  if (head_channels != 1)
+    throw std::runtime_error("Plans only run WaveNets with a mono output");
+  Op head_scale = make_op(OpType::kAffine, {head});
+  head_scale.weights = {reader.next_(), 0.0f};
+  plan.output = plan.add_op_(head_scale, 1);
+}
+
+// Drops the ops that are flagged and renumbers none of the values.
+void remove_ops(Plan& plan, const std::vector<bool>& remove)
+{
+  std::vector<Op> kept;
+  for (size_t i = 0; i < plan.ops.size(); i++)
+    if (!remove[i])
+      kept.push_back(std::move(plan.ops[i]));
+  plan.ops = std::move(kept);
+}
+
+bool is_conv(const Op& op)
+{
+  return op.type == OpType::kConv1D || op.type == OpType::kConv1x1;
+}
+}; // namespace
+
+const char* nam::plan::get_op_name(const OpType type)
+{
+  switch (type)
+  {
+    case OpType::kConv1D: return "conv1d";
+    case OpType::kConv1x1: return "conv1x1";
+    case OpType::kAffine: return "affine";
+    case OpType::kActivation: return "activation";
+    case OpType::kGate: return "gate";
+    case OpType::kAdd: return "add";
+    case OpType::kLSTMStep: return "lstm_step";
+  }
+  return "unknown";
+}
+
+// Plan =======================================================================
+
+int nam::plan::Plan::add_value_(const long channels)
+{
+  Value value;
+  value.channels = channels;
+  this->values.push_back(value);
+  return (int)this->values.size() - 1;
+}
+
+int nam::plan::Plan::add_op_(Op op, const long channels)
+{
+  op.output = this->add_value_(channels);
+  if (op.type == OpType::kConv1D)
+  {
+    long& lookback = this->values[op.inputs[0]].lookback;
+    lookback = std::max(lookback, op.dilation * (op.kernel_size - 1));
+  }
+  this->ops.push_back(std::move(op));
+  return this->ops.back().output;
+}
+
+std::vector<int> nam::plan::Plan::get_producers() const
+{
+  std::vector<int> producers(this->values.size(), -1);
+  for (size_t i = 0; i < this->ops.size(); i++)
+    producers[this->ops[i].output] = (int)i;
+  return producers;
+}
+
+std::vector<int> nam::plan::Plan::get_num_reads() const
+{
+  std::vector<int> num_reads(this->values.size(), 0);
+  for (const Op& op : this->ops)
+  {
+    for (const int input : op.inputs)
+      num_reads[input]++;
+    if (op.addend >= 0)
+      num_reads[op.addend]++;
+  }
+  num_reads[this->output]++;
+  return num_reads;
+}
+
+void nam::plan::Plan::fold_affines_()
+{
+  const std::vector<int> producers = this->get_producers();
+  const std::vector<int> num_reads = this->get_num_reads();
+  std::vector<bool> remove(this->ops.size(), false);
+  for (size_t i = 0; i < this->ops.size(); i++)
+  {
+    const Op& affine = this->ops[i];
+    if (affine.type != OpType::kAffine)
+      continue;
+    const int x = affine.inputs[0];
+    const int p = producers[x];
+    if (p < 0 || num_reads[x] != 1)
+      continue;
+    Op& conv = this->ops[p];
+    if (!is_conv(conv) || !conv.activation.empty() || conv.addend >= 0)
+      continue;
+    // scale * (W * x + b) + shift: scale W's rows and the bias, and shift the bias.
+    const long channels = this->values[x].channels;
+    const long num_taps_weights = (long)conv.weights.size() - (conv.bias ? channels : 0);
+    if (!conv.bias)
+    {
+      conv.weights.resize(num_taps_weights + channels, 0.0f);
+      conv.bias = true;
+    }
+    for (long k = 0; k < num_taps_weights; k++)
+      conv.weights[k] *= affine.weights[k % channels];
+    for (long c = 0; c < channels; c++)
+    {
+      float& bias = conv.weights[num_taps_weights + c];
+      bias = affine.weights[c] * bias + affine.weights[channels + c];
+    }
+    conv.output = affine.output;
+    remove[i] = true;
+  }
+  remove_ops(*this, remove);
+}
+
+void nam::plan::Plan::fuse_adds_()
+{
+  // Fusing changes who produces what, so go one add at a time.
+  bool fused = true;
+  while (fused)
+  {
+    fused = false;
+    const std::vector<int> producers = this->get_producers();
+    const std::vector<int> num_reads = this->get_num_reads();
+    for (size_t i = 0; i < this->ops.size() && !fused; i++)
+    {
+      const Op& add = this->ops[i];
+      if (add.type != OpType::kAdd || !add.activation.empty())
+        continue;
+      // Of the operands that a convolution writes, fuse into the later one so that the other is ready by then.
+      int best = -1;
+      for (int operand = 0; operand < 2; operand++)
+      {
+        const int x = add.inputs[operand];
+        const int other = add.inputs[1 - operand];
+        const int p = producers[x];
+        if (p < 0 || num_reads[x] != 1 || x == other || producers[other] >= p)
+          continue;
+        const Op& conv = this->ops[p];
+        if (!is_conv(conv) || !conv.activation.empty() || conv.addend >= 0 || conv.inputs[0] == other)
+          continue;
+        if (best < 0 || p > producers[add.inputs[best]])
+          best = operand;
+      }
+      if (best < 0)
+        continue;
+      Op& conv = this->ops[producers[add.inputs[best]]];
+      conv.addend = add.inputs[1 - best];
+      conv.output = add.output;
+      std::vector<bool> remove(this->ops.size(), false);
+      remove[i] = true;
+      remove_ops(*this, remove);
+      fused = true;
+    }
+  }
+}
+
+void nam::plan::Plan::fuse_activations_()
+{
+  const std::vector<int> producers = this->get_producers();
+  const std::vector<int> num_reads = this->get_num_reads();
+  std::vector<bool> remove(this->ops.size(), false);
+  for (size_t i = 0; i < this->ops.size(); i++)
+  {
+    const Op& act = this->ops[i];
+    if (act.type != OpType::kActivation)
+      continue;
+    const int x = act.inputs[0];
+    const int p = producers[x];
+    if (p < 0 || num_reads[x] != 1)
+      continue;
+    Op& producer = this->ops[p];
+    const bool can_fuse = is_conv(producer) || producer.type == OpType::kAffine || producer.type == OpType::kAdd;
+    if (!can_fuse || !producer.activation.empty())
+      continue;
+    producer.activation = act.activation;
+    producer.output = act.output;
+    remove[i] = true;
+  }
+  remove_ops(*this, remove);
+}
+
+void nam::plan::Plan::remove_dead_ops_()
+{
+  // Going backwards, an op is dead once nothing that's still alive reads its output.
+  std::vector<int> num_reads(this->values.size(), 0);
+  num_reads[this->output]++;
+  std::vector<bool> remove(this->ops.size(), false);
+  for (size_t i = this->ops.size(); i-- > 0;)
+  {
+    const Op& op = this->ops[i];
+    if (num_reads[op.output] == 0)
+    {
+      remove[i] = true;
+      continue;
+    }
+    for (const int input : op.inputs)
+      num_reads[input]++;
+    if (op.addend >= 0)
+      num_reads[op.addend]++;
+  }
+  remove_ops(*this, remove);
+
+  for (Value& value : this->values)
+    value.lookback = 0;
+  for (const Op& op : this->ops)
+    if (op.type == OpType::kConv1D)
+    {
+      long& lookback = this->values[op.inputs[0]].lookback;
+      lookback = std::max(lookback, op.dilation * (op.kernel_size - 1));
+    }
+}
+
+void nam::plan::Plan::optimize_()
+{
+  this->fold_affines_();
+  this->fuse_adds_();
+  this->fuse_activations_();
+  this->remove_dead_ops_();
+}
+
+nam::CostEstimate nam::plan::Plan::get_cost_estimate() const
+{
+  CostEstimate cost;
+  bool recurrent = false;
+  long receptive_field = 1;
+  for (const Op& op : this->ops)
+  {
+    const long out_channels = this->values[op.output].channels;
+    const long in_channels = this->values[op.inputs[0]].channels;
+    switch (op.type)
+    {
+      case OpType::kConv1D:
+      case OpType::kConv1x1:
+        cost.multiply_adds_per_sample += op.kernel_size * out_channels * in_channels;
+        cost.multiply_adds_per_sample += (op.bias ? out_channels : 0) + (op.addend >= 0 ? out_channels : 0);
+        receptive_field += op.dilation * (op.kernel_size - 1);
+        break;
+      case OpType::kAffine:
+      case OpType::kAdd: cost.multiply_adds_per_sample += out_channels; break;
+      case OpType::kActivation: cost.activations_per_sample += out_channels; break;
+      case OpType::kGate:
+        cost.multiply_adds_per_sample += out_channels;
+        cost.activations_per_sample += out_channels;
+        break;
+      case OpType::kLSTMStep:
+        // As LSTMCell counts it
+        cost.multiply_adds_per_sample += 4 * out_channels * (in_channels + out_channels) + 7 * out_channels;
+        cost.activations_per_sample += 5 * out_channels;
+        recurrent = true;
+        break;
+    }
+    if (!op.activation.empty() && op.type != OpType::kActivation && op.type != OpType::kGate)
+      cost.activations_per_sample += out_channels;
+  }
+  cost.receptive_field = recurrent ? -1 : receptive_field;
+  return cost;
+}
+
+nam::plan::Plan nam::plan::lower(const dspData& data)
+{
+  verify_config_version(data.version);
+  Plan plan;
+  plan.input = plan.add_value_(1);
+  WeightReader reader(data.weights);
+  if (data.architecture == "Linear")
+    lower_linear(plan, data.config, reader);
+  else if (data.architecture == "ConvNet")
+    lower_convnet(plan, data.config, reader);
+  else if (data.architecture == "LSTM")
+    lower_lstm(plan, data.config, reader);
+  else if (data.architecture == "WaveNet")
+    lower_wavenet(plan, data.config, reader);
+  else
+    throw std::runtime_error("Unrecognized architecture");
+  reader.check_done();
+  return plan;
+}
+
+// PlanDSP ====================================================================
+
+nam::plan::PlanDSP::PlanDSP(Plan plan, const double expected_sample_rate, const activations::Precision precision,
+                            const long tile_size)
+: DSP(expected_sample_rate)
+, _plan(std::move(plan))
+, _tile_size(tile_size)
+{
+  this->mActivationPrecision = precision;
+  for (const Op& op : this->_plan.ops)
+  {
+    Kernel kernel;
+    if (op.type == OpType::kLSTMStep)
+    {
+      kernel.sigmoid = activations::Activation::get_activation("Sigmoid", precision);
+      kernel.tanh = activations::Activation::get_activation("Tanh", precision);
+    }
+    else if (!op.activation.empty())
+      kernel.activation = activations::Activation::get_activation(op.activation, precision);
+    this->_kernels.push_back(kernel);
+  }
+  this->set_tile_size_(tile_size);
+  this->_prewarm_samples = this->_plan.prewarm_samples;
+  this->mCostEstimate = this->_plan.get_cost_estimate();
+}
+
+void nam::plan::PlanDSP::set_tile_size_(const long tile_size)
+{
+  if (tile_size < 1)
+    throw std::runtime_error("Plan tile size must be positive");
+  this->_tile_size = tile_size;
+  // The slots and rings are sized by the tile.
+  this->_storage.clear();
+  this->_slots.clear();
+  this->_rings.clear();
+  this->_plan_storage_();
+  this->_layout_arena_();
+  this->_t = 0;
+
+  for (size_t i = 0; i < this->_plan.ops.size(); i++)
+  {
+    const Op& op = this->_plan.ops[i];
+    Kernel& kernel = this->_kernels[i];
+    kernel.weights = Eigen::Map<const Eigen::VectorXf>(op.weights.data(), op.weights.size());
+    if (op.type == OpType::kLSTMStep)
+    {
+      // The initial hidden and cell states are the last weights.
+      const long hidden_size = kernel.c.size();
+      kernel.xh.tail(hidden_size) = kernel.weights.segment(kernel.weights.size() - 2 * hidden_size, hidden_size);
+      kernel.c = kernel.weights.tail(hidden_size);
+    }
+  }
+}
+
+void nam::plan::PlanDSP::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
+{
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  NAM_PROFILE_MODEL(this->mProfiler);
+  for (long start = 0; start < num_frames; start += this->_tile_size)
+  {
+    const long tile_frames = std::min(this->_tile_size, num_frames - start);
+    this->_position = this->_t + start;
+    float* x = this->_get_data(this->_plan.input);
+    for (long j = 0; j < tile_frames; j++)
+      x[j] = (float)input[start + j];
+    this->_mirror_(this->_plan.input, tile_frames);
+    for (size_t i = 0; i < this->_plan.ops.size(); i++)
+    {
+      this->_run_(this->_plan.ops[i], this->_kernels[i], tile_frames);
+      this->_mirror_(this->_plan.ops[i].output, tile_frames);
+    }
+    const float* y = this->_get_data(this->_plan.output);
+    for (long j = 0; j < tile_frames; j++)
+      output[start + j] = y[j];
+  }
+}
+
+void nam::plan::PlanDSP::finalize_(const int num_frames)
+{
+  this->DSP::finalize_(num_frames);
+  this->_t += num_frames;
+}
+
+void nam::plan::PlanDSP::_carve_(Arena& arena)
+{
+  for (size_t i = 0; i < this->_plan.ops.size(); i++)
+  {
+    const Op& op = this->_plan.ops[i];
+    Kernel& kernel = this->_kernels[i];
+    arena.carve_weights_(kernel.weights, op.weights.size());
+    if (op.type == OpType::kLSTMStep)
+    {
+      const long input_size = this->_plan.values[op.inputs[0]].channels;
+      const long hidden_size = this->_plan.values[op.output].channels;
+      arena.carve_state_(kernel.xh, input_size + hidden_size);
+      arena.carve_state_(kernel.ifgo, 4 * hidden_size);
+      arena.carve_state_(kernel.c, hidden_size);
+    }
+  }
+  for (size_t i = 0; i < this->_slots.size(); i++)
+    arena.carve_state_(this->_slots[i], this->_slots[i].rows(), this->_slots[i].cols());
+  for (size_t i = 0; i < this->_rings.size(); i++)
+    arena.carve_state_(this->_rings[i], this->_rings[i].rows(), this->_rings[i].cols());
+}
+
+void nam::plan::PlanDSP::_plan_storage_()
+{
+  const std::vector<Value>& values = this->_plan.values;
+  const std::vector<Op>& ops = this->_plan.ops;
+  // The last op that reads each value; the plan's output is read after all of them.
+  std::vector<long> last_read(values.size(), -1);
+  for (size_t i = 0; i < ops.size(); i++)
+  {
+    for (const int input : ops[i].inputs)
+      last_read[input] = i;
+    if (ops[i].addend >= 0)
+      last_read[ops[i].addend] = i;
+  }
+  last_read[this->_plan.output] = ops.size();
+
+  this->_storage.assign(values.size(), Storage());
+  std::vector<int> free_slots;
+  // Big enough for every value that's in the slot at some point
+  std::vector<long> slot_channels;
+  // Puts the value in a ring if something looks back on it, and otherwise in a free slot (or `slot` if given).
+  auto place = [&](const int value, const int slot) {
+    if (values[value].lookback > 0)
+    {
+      // Twice the size, so that every window is contiguous
+      long size = 1;
+      while (size < values[value].lookback + this->_tile_size)
+        size *= 2;
+      this->_storage[value].ring = (int)this->_rings.size();
+      this->_rings.push_back(MatrixMap(nullptr, values[value].channels, 2 * size));
+      return;
+    }
+    int s = slot;
+    if (s < 0 && !free_slots.empty())
+    {
+      s = free_slots.back();
+      free_slots.pop_back();
+    }
+    if (s < 0)
+    {
+      s = (int)slot_channels.size();
+      slot_channels.push_back(0);
+    }
+    slot_channels[s] = std::max(slot_channels[s], values[value].channels);
+    this->_storage[value].slot = s;
+  };
+
+  place(this->_plan.input, -1);
+  for (size_t i = 0; i < ops.size(); i++)
+  {
+    const Op& op = ops[i];
+    // Elementwise ops, and convolutions onto their addend, can write over a value that they read for the last time.
+    std::vector<int> candidates;
+    if (op.type == OpType::kAdd || op.type == OpType::kActivation || op.type == OpType::kAffine)
+      candidates = op.inputs;
+    else if (is_conv(op) && op.addend >= 0 && op.inputs[0] != op.addend)
+      candidates.push_back(op.addend);
+    int taken = -1;
+    for (const int x : candidates)
+      if (this->_storage[x].slot >= 0 && last_read[x] == (long)i && values[x].channels == values[op.output].channels
+          && values[op.output].lookback == 0)
+      {
+        taken = x;
+        break;
+      }
+    place(op.output, taken >= 0 ? this->_storage[taken].slot : -1);
+
+    // Free the slots of the values that this was the last to read.
+    std::vector<int> reads = op.inputs;
+    if (op.addend >= 0)
+      reads.push_back(op.addend);
+    std::sort(reads.begin(), reads.end());
+    reads.erase(std::unique(reads.begin(), reads.end()), reads.end());
+    for (const int x : reads)
+      if (x != taken && this->_storage[x].slot >= 0 && last_read[x] == (long)i)
+        free_slots.push_back(this->_storage[x].slot);
+  }
+  for (const long channels : slot_channels)
+    this->_slots.push_back(MatrixMap(nullptr, channels, this->_tile_size));
+}
+
+float* nam::plan::PlanDSP::_get_data(const int value, const long lookback)
+{
+  const Storage& storage = this->_storage[value];
+  if (storage.slot >= 0)
+    return this->_slots[storage.slot].data();
+  MatrixMap& ring = this->_rings[storage.ring];
+  const long mask = ring.cols() / 2 - 1;
+  return ring.data() + ((this->_position - lookback) & mask) * ring.rows();
+}
+
+void nam::plan::PlanDSP::_mirror_(const int value, const long num_frames)
+{
+  const Storage& storage = this->_storage[value];
+  if (storage.ring < 0)
+    return;
+  MatrixMap& ring = this->_rings[storage.ring];
+  const long size = ring.cols() / 2;
+  const long start = this->_position & (size - 1);
+  // The window may run over into the second half, which then goes to the start of the first.
+  const long first = std::min(num_frames, size - start);
+  ring.middleCols(start + size, first) = ring.middleCols(start, first);
+  if (first < num_frames)
+    ring.leftCols(num_frames - first) = ring.middleCols(size, num_frames - first);
+}
+
+void nam::plan::PlanDSP::_run_(const Op& op, Kernel& kernel, const long num_frames)
+{
+  using ConstFrames = Eigen::Map<const Eigen::MatrixXf>;
+  const std::vector<Value>& values = this->_plan.values;
+  const long out_channels = values[op.output].channels;
+  const long in_channels = values[op.inputs[0]].channels;
+  float* out_data = this->_get_data(op.output);
+  Eigen::Map<Eigen::MatrixXf> out(out_data, out_channels, num_frames);
+  const float* in_data = this->_get_data(op.inputs[0]);
+  switch (op.type)
+  {
+    case OpType::kConv1D:
+    case OpType::kConv1x1:
+    {
+      NAM_PROFILE_STAGE(kConv1D);
+      const long tap_size = out_channels * in_channels;
+      if (op.addend >= 0 && this->_get_data(op.addend) != out_data)
+        out = ConstFrames(this->_get_data(op.addend), out_channels, num_frames);
+      if (tap_size == 1 && op.dilation == 1 && op.kernel_size > 1)
+      {
+        // One channel (e.g. an IR): each frame's taps are a contiguous window, so it's a dot product per frame.
+        const float* window = this->_get_data(op.inputs[0], op.kernel_size - 1);
+        const auto weight = kernel.weights.head(op.kernel_size);
+        for (long j = 0; j < num_frames; j++)
+        {
+          const float y = weight.dot(Eigen::Map<const Eigen::VectorXf>(window + j, op.kernel_size));
+          out(0, j) = op.addend >= 0 ? out(0, j) + y : y;
+        }
+      }
+      else
+        for (long k = 0; k < op.kernel_size; k++)
+        {
+          const ConstFrames weight(kernel.weights.data() + k * tap_size, out_channels, in_channels);
+          const long lookback = op.dilation * (op.kernel_size - 1 - k);
+          const ConstFrames input(this->_get_data(op.inputs[0], lookback), in_channels, num_frames);
+          if (k == 0 && op.addend < 0)
+            out.noalias() = weight * input;
+          else
+            out.noalias() += weight * input;
+        }
+      if (op.bias)
+        out.colwise() += kernel.weights.segment(op.kernel_size * tap_size, out_channels);
+      break;
+    }
+    case OpType::kAffine:
+    {
+      const ConstFrames input(in_data, in_channels, num_frames);
+      out = (input.array().colwise() * kernel.weights.head(out_channels).array()).colwise()
+            + kernel.weights.tail(out_channels).array();
+      break;
+    }
+    case OpType::kActivation:
+      if (in_data != out_data)
+        out = ConstFrames(in_data, in_channels, num_frames);
+      kernel.activation->apply(out_data, out_channels * num_frames);
+      return;
+    case OpType::kGate:
+    {
+      const ConstFrames input(in_data, in_channels, num_frames);
+      out = input.bottomRows(out_channels);
+      kernel.activation->apply(out_data, out_channels * num_frames);
+      out.array() *= input.topRows(out_channels).array();
+      return;
+    }
+    case OpType::kAdd:
+      out = ConstFrames(in_data, out_channels, num_frames)
+            + ConstFrames(this->_get_data(op.inputs[1]), out_channels, num_frames);
+      break;
+    case OpType::kLSTMStep: this->_run_lstm_step_(op, kernel, num_frames); return;
+  }
+  if (kernel.activation != nullptr)
+    kernel.activation->apply(out_data, out_channels * num_frames);
+}
+
+void nam::plan::PlanDSP::_run_lstm_step_(const Op& op, Kernel& kernel, const long num_frames)
+{
+  NAM_PROFILE_STAGE(kLSTMCell);
+  const long input_size = this->_plan.values[op.inputs[0]].channels;
+  const long hidden_size = this->_plan.values[op.output].channels;
+  const Eigen::Map<const Eigen::MatrixXf> w(kernel.weights.data(), 4 * hidden_size, input_size + hidden_size);
+  const auto b = kernel.weights.segment(w.size(), 4 * hidden_size);
+  const Eigen::Map<const Eigen::MatrixXf> input(this->_get_data(op.inputs[0]), input_size, num_frames);
+  Eigen::Map<Eigen::MatrixXf> output(this->_get_data(op.output), hidden_size, num_frames);
+  auto h = kernel.xh.tail(hidden_size);
+  // As LSTMCell::process_(), a frame at a time
+  for (long j = 0; j < num_frames; j++)
+  {
+    kernel.xh.head(input_size) = input.col(j);
+    kernel.ifgo.noalias() = w * kernel.xh + b;
+    kernel.sigmoid->apply(kernel.ifgo.data(), 2 * hidden_size);
+    kernel.tanh->apply(kernel.ifgo.data() + 2 * hidden_size, hidden_size);
+    kernel.sigmoid->apply(kernel.ifgo.data() + 3 * hidden_size, hidden_size);
+    kernel.c = kernel.ifgo.segment(hidden_size, hidden_size).cwiseProduct(kernel.c)
+               + kernel.ifgo.head(hidden_size).cwiseProduct(kernel.ifgo.segment(2 * hidden_size, hidden_size));
+    h = kernel.c;
+    kernel.tanh->apply(h.data(), hidden_size);
+    h.array() *= kernel.ifgo.tail(hidden_size).array();
+    output.col(j) = h;
+  }
+}
+
+std::unique_ptr<nam::DSP> nam::plan::get_dsp(const dspData& data, const activations::Precision precision,
+                                             const bool prewarm)
+{
+  Plan plan = lower(data);
+  plan.optimize_();
+  std::unique_ptr<DSP> out = std::make_unique<PlanDSP>(std::move(plan), data.expected_sample_rate, precision);
+  if (data.metadata.is_object() && data.metadata.contains("loudness"))
+    out->SetLoudness(data.metadata.at("loudness").get<double>());
+  // "pre-warm" the model to settle initial conditions
+  if (prewarm)
+    out->prewarm();
+  else
+    out->DeferPrewarm();
+  return out;
+}
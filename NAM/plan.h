@@ -0,0 +1,164 @@
+#pragma once
+// Models as a small graph of ops that one executor runs, whatever the architecture
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "dsp.h"
+
+namespace nam
+{
+namespace plan
+{
+enum class OpType
+{
+  // Dilated convolution over time. Its input keeps enough frames from before the current tile to look back on.
+  kConv1D = 0,
+  // The same matrix applied to every frame
+  kConv1x1,
+  // Per-channel scale and shift (e.g. a batchnorm)
+  kAffine,
+  kActivation,
+  // The first half of the channels times the (gate) activation of the second half
+  kGate,
+  kAdd,
+  // One LSTM layer, a frame at a time
+  kLSTMStep
+};
+
+const char* get_op_name(const OpType type);
+
+// An array of `channels` x frames, written by one op and read by others
+struct Value
+{
+  long channels = 0;
+  // How many frames from before the current tile its readers look back on
+  long lookback = 0;
+};
+
+struct Op
+{
+  OpType type;
+  std::vector<int> inputs;
+  int output = -1;
+  // Laid out as the kernels read them:
+  // * kConv1D: kernel_size column-major (out x in) matrices, the oldest tap first, then the biases if `bias`
+  // * kConv1x1: a column-major (out x in) matrix, then the biases if `bias`
+  // * kAffine: the scales, then the shifts
+  // * kLSTMStep: the column-major (4H x (I + H)) matrix, the 4H biases, then the initial hidden and cell states
+  std::vector<float> weights;
+  long kernel_size = 1;
+  long dilation = 1;
+  bool bias = false;
+  // The function of a kActivation or kGate. On the other ops, an activation fused onto the output (none if empty).
+  std::string activation;
+  // From fusing an add into a convolution: the value that the output starts as, so that the op's result is added
+  // to it (-1 for none)
+  int addend = -1;
+};
+
+// A model as the ops that make it up, in the order that they run. Every value but the input is written by exactly
+// one op.
+class Plan
+{
+public:
+  std::vector<Value> values;
+  std::vector<Op> ops;
+  int input = -1;
+  int output = -1;
+  // Frames of silence that settle the model (as many as its own DSP class prewarms with)
+  int prewarm_samples = 0;
+
+  int add_value_(const long channels);
+  // Appends `op` with a new output value of `channels` and returns the value.
+  int add_op_(Op op, const long channels);
+
+  // The passes, which optimize_() runs in this order:
+  // Fold per-channel affines into the convolution before them.
+  void fold_affines_();
+  // Turn conv + add into a convolution that adds onto the other operand.
+  void fuse_adds_();
+  // Apply activations in place at the end of the op that feeds them.
+  void fuse_activations_();
+  // Drop ops whose outputs nothing reads.
+  void remove_dead_ops_();
+  void optimize_();
+
+  // The op that writes each value (-1 for the input and for values that nothing writes anymore)
+  std::vector<int> get_producers() const;
+  // How many times each value is read (as an input or an addend, or as the plan's output)
+  std::vector<int> get_num_reads() const;
+  // Per frame, after fusion
+  CostEstimate get_cost_estimate() const;
+};
+
+// Lower a model's config and weights. Throws std::runtime_error for an architecture or config it doesn't know.
+Plan lower(const dspData& data);
+
+// Runs a plan over tiles of up to `tile_size` frames. Values that nothing looks back on live in a few tile-sized
+// slots, each reused once the value in it has been read for the last time (or taken over in place by an op that
+// reads it last). Values with lookback live in rings that keep their history.
+class PlanDSP : public DSP
+{
+public:
+  PlanDSP(Plan plan, const double expected_sample_rate,
+          const activations::Precision precision = activations::Activation::get_default_precision(),
+          const long tile_size = 64);
+  void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
+  void finalize_(const int num_frames) override;
+  const Plan& get_plan() const { return this->_plan; };
+  long get_tile_size() const { return this->_tile_size; };
+  // Changing the tile size re-lays out the arena and so resets the model's state; prewarm() again afterwards.
+  void set_tile_size_(const long tile_size);
+  // How many tile-sized slots the values share
+  long get_num_slots() const { return (long)this->_slots.size(); };
+
+private:
+  struct Storage
+  {
+    // Into _slots, or -1 if it's in a ring
+    int slot = -1;
+    // Into _rings
+    int ring = -1;
+  };
+  // What each op needs at run time besides its description
+  struct Kernel
+  {
+    VectorMap weights{nullptr, 0};
+    activations::Activation* activation = nullptr;
+    // kLSTMStep: its activations, the concatenated input and hidden state, the gates and the cell state
+    activations::Activation* sigmoid = nullptr;
+    activations::Activation* tanh = nullptr;
+    VectorMap xh{nullptr, 0};
+    VectorMap ifgo{nullptr, 0};
+    VectorMap c{nullptr, 0};
+  };
+
+  Plan _plan;
+  long _tile_size;
+  std::vector<Storage> _storage;
+  std::vector<Kernel> _kernels;
+  std::vector<MatrixMap> _slots;
+  std::vector<MatrixMap> _rings;
+  // Frames finalized so far, and the frame that the tile being run starts at
+  long _t = 0;
+  long _position = 0;
+
+  void _carve_(Arena& arena) override;
+  // Assign the values to slots and rings
+  void _plan_storage_();
+  // Where the value's current tile starts, or for a value in a ring, the window `lookback` frames before it
+  float* _get_data(const int value, const long lookback = 0);
+  // Copy the tile just written into the ring's other half
+  void _mirror_(const int value, const long num_frames);
+  void _run_(const Op& op, Kernel& kernel, const long num_frames);
+  void _run_lstm_step_(const Op& op, Kernel& kernel, const long num_frames);
+};
+
+// Like nam::get_dsp(), but runs the model as a plan.
+std::unique_ptr<DSP> get_dsp(const dspData& data, const activations::Precision precision, const bool prewarm = true);
+}; // namespace plan
+}; // namespace nam
@@ -0,0 +1,111 @@
+#include <iomanip>
+#include <sstream>
+
+#include "profiler.h"
+
+namespace
+{
+// Something unique to each live thread
+uintptr_t _get_thread_token()
+{
+  static thread_local char token;
+  return reinterpret_cast<uintptr_t>(&token);
+}
+}; // namespace
+
+const char* nam::profiler::get_stage_name(const Stage stage)
+{
+  switch (stage)
+  {
+    case kConv1D: return "Conv1D::process_";
+    case kConv1x1: return "Conv1x1::process";
+    case kActivation: return "Activation::apply";
+    case kLayerArray: return "_LayerArray::process_";
+    case kRewindBuffers: return "_rewind_buffers_";
+    case kUpdateBuffers: return "Buffer::_update_buffers_";
+    case kLSTMCell: return "LSTMCell::process_";
+    default: return "(unknown)";
+  }
+}
+
+std::string nam::profiler::Report::to_string() const
+{
+  std::stringstream ss;
+  if (!this->enabled)
+  {
+    ss << "Profiling is off (build with NAM_ENABLE_PROFILER)\n";
+    return ss.str();
+  }
+  ss << std::left << std::setw(28) << "stage" << std::right << std::setw(12) << "calls" << std::setw(14) << "total ms"
+     << std::setw(12) << "mean us" << "\n";
+  for (int i = 0; i < kNumStages; i++)
+  {
+    const StageStats& stats = this->stages[i];
+    if (stats.calls == 0)
+      continue;
+    const double totalMs = 1.0e-6 * stats.nanoseconds;
+    const double meanUs = 1.0e-3 * stats.nanoseconds / stats.calls;
+    ss << std::left << std::setw(28) << get_stage_name((Stage)i) << std::right << std::setw(12) << stats.calls
+       << std::fixed << std::setprecision(3) << std::setw(14) << totalMs << std::setw(12) << meanUs << "\n";
+  }
+  ss << "threads: " << this->num_threads;
+  if (this->dropped_calls > 0)
+    ss << " (" << this->dropped_calls << " process() calls from further threads weren't counted)";
+  ss << "\n";
+  return ss.str();
+}
+
+nam::profiler::Report nam::profiler::Profiler::get_report() const
+{
+  Report report;
+#ifdef NAM_ENABLE_PROFILER
+  report.enabled = true;
+#endif
+  for (const Slot& slot : this->_slots)
+  {
+    if (slot.owner.load(std::memory_order_acquire) == 0)
+      continue;
+    report.num_threads++;
+    for (int i = 0; i < kNumStages; i++)
+    {
+      report.stages[i].calls += slot.calls[i].load(std::memory_order_relaxed);
+      report.stages[i].nanoseconds += slot.nanoseconds[i].load(std::memory_order_relaxed);
+    }
+  }
+  report.dropped_calls = this->_dropped_calls.load(std::memory_order_relaxed);
+  return report;
+}
+
+void nam::profiler::Profiler::reset()
+{
+  for (Slot& slot : this->_slots)
+  {
+    for (int i = 0; i < kNumStages; i++)
+    {
+      slot.calls[i].store(0, std::memory_order_relaxed);
+      slot.nanoseconds[i].store(0, std::memory_order_relaxed);
+    }
+  }
+  this->_dropped_calls.store(0, std::memory_order_relaxed);
+}
+
+nam::profiler::Profiler::Slot* nam::profiler::Profiler::get_slot_()
+{
+  const uintptr_t token = _get_thread_token();
+  for (Slot& slot : this->_slots)
+  {
+    uintptr_t owner = slot.owner.load(std::memory_order_acquire);
+    if (owner == token)
+      return &slot;
+    if (owner == 0 && slot.owner.compare_exchange_strong(owner, token, std::memory_order_acq_rel))
+      return &slot;
+  }
+  this->_dropped_calls.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+nam::profiler::Profiler::Slot*& nam::profiler::get_current_slot()
+{
+  static thread_local Profiler::Slot* slot = nullptr;
+  return slot;
+}
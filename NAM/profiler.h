@@ -0,0 +1,155 @@
+#pragma once
+
+// Opt-in per-stage timing of the hot path.
+//
+// Build everything (the NAM sources and whatever includes them) with NAM_ENABLE_PROFILER defined to turn it on. With
+// it off, the NAM_PROFILE_*() macros expand to nothing and models carry no profiler.
+//
+// Each model owns a Profiler. DSP::process() binds the calling thread to one of that profiler's per-thread slots, and
+// every instrumented stage called underneath adds its call count and time to that slot. A slot is only ever written
+// by the thread that claimed it, so recording is plain relaxed loads and stores: no locks and no read-modify-writes.
+// Times are inclusive, so nested stages (e.g. Conv1D inside a WaveNet layer array) are counted in both.
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace nam
+{
+namespace profiler
+{
+enum Stage
+{
+  kConv1D = 0,
+  kConv1x1,
+  kActivation,
+  kLayerArray,
+  kRewindBuffers,
+  kUpdateBuffers,
+  kLSTMCell,
+  kNumStages
+};
+
+// E.g. "Conv1D::process_"
+const char* get_stage_name(const Stage stage);
+
+struct StageStats
+{
+  uint64_t calls = 0;
+  uint64_t nanoseconds = 0;
+};
+
+// A snapshot of a model's profile
+struct Report
+{
+  // Whether this build was compiled with NAM_ENABLE_PROFILER; if not, everything else is zero.
+  bool enabled = false;
+  std::array<StageStats, kNumStages> stages;
+  // How many threads have called process()
+  int num_threads = 0;
+  // process() calls from threads that didn't get a slot, and so weren't counted
+  uint64_t dropped_calls = 0;
+
+  // A table with one row per stage that was called
+  std::string to_string() const;
+};
+
+class Profiler
+{
+public:
+  // Threads beyond this many that call process() on the same model aren't counted.
+  static constexpr int kMaxThreads = 8;
+
+  Profiler() = default;
+  Profiler(const Profiler&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+
+  // Sum over all threads. Safe to call while the model is processing, though stages in flight won't be included.
+  Report get_report() const;
+  // Zero the counts. Don't call this while the model is processing or some counts may survive.
+  void reset();
+
+  // Where a thread's counts go
+  struct alignas(64) Slot
+  {
+    // Identifies the thread that owns this slot; 0 if unclaimed.
+    std::atomic<uintptr_t> owner{0};
+    std::array<std::atomic<uint64_t>, kNumStages> calls{};
+    std::array<std::atomic<uint64_t>, kNumStages> nanoseconds{};
+
+    void add(const Stage stage, const uint64_t ns)
+    {
+      // Only the owning thread writes, so no read-modify-write is needed.
+      this->calls[stage].store(this->calls[stage].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      this->nanoseconds[stage].store(this->nanoseconds[stage].load(std::memory_order_relaxed) + ns,
+                                     std::memory_order_relaxed);
+    };
+  };
+
+  // The calling thread's slot, claiming one if needed. Returns nullptr if they're all taken.
+  Slot* get_slot_();
+
+private:
+  std::array<Slot, kMaxThreads> _slots;
+  std::atomic<uint64_t> _dropped_calls{0};
+};
+
+// The slot that stages on this thread record into (nullptr when not inside an instrumented process())
+Profiler::Slot*& get_current_slot();
+
+// Binds the calling thread to `profiler` for its lifetime, then restores whatever it was bound to before (so that
+// models that run other models are fine).
+class ScopedModel
+{
+public:
+  explicit ScopedModel(Profiler& profiler)
+  : _previous(get_current_slot())
+  {
+    get_current_slot() = profiler.get_slot_();
+  };
+  ~ScopedModel() { get_current_slot() = this->_previous; };
+  ScopedModel(const ScopedModel&) = delete;
+  ScopedModel& operator=(const ScopedModel&) = delete;
+
+private:
+  Profiler::Slot* const _previous;
+};
+
+// Times its own lifetime as one call of `stage`
+class ScopedStage
+{
+public:
+  explicit ScopedStage(const Stage stage)
+  : _slot(get_current_slot())
+  , _stage(stage)
+  {
+    if (this->_slot != nullptr)
+      this->_start = std::chrono::steady_clock::now();
+  };
+  ~ScopedStage()
+  {
+    if (this->_slot == nullptr)
+      return;
+    const auto elapsed = std::chrono::steady_clock::now() - this->_start;
+    this->_slot->add(this->_stage, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  };
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+  Profiler::Slot* const _slot;
+  const Stage _stage;
+  std::chrono::steady_clock::time_point _start;
+};
+}; // namespace profiler
+}; // namespace nam
+
+#ifdef NAM_ENABLE_PROFILER
+  #define NAM_PROFILE_MODEL(model_profiler) const nam::profiler::ScopedModel _nam_profile_model(model_profiler)
+  #define NAM_PROFILE_STAGE(stage) const nam::profiler::ScopedStage _nam_profile_stage(nam::profiler::stage)
+#else
+  #define NAM_PROFILE_MODEL(model_profiler)
+  #define NAM_PROFILE_STAGE(stage)
+#endif
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "reblocking.h"
+
+nam::ReblockingDSP::ReblockingDSP(std::unique_ptr<DSP> model, const int block_size, const Mode mode)
+: DSP(model != nullptr ? model->GetExpectedSampleRate() : -1.0)
+, _model(std::move(model))
+, _block_size(block_size)
+, _mode(mode)
+, _input_fifo(block_size > 0 ? block_size : 1)
+, _output_fifo(block_size > 0 ? 2 * block_size : 1)
+{
+  if (this->_model == nullptr)
+    throw std::runtime_error("ReblockingDSP needs a model");
+  if (block_size < 1)
+    throw std::runtime_error("ReblockingDSP block size must be positive");
+  this->mActivationPrecision = this->_model->GetActivationPrecision();
+  if (this->_model->HasLoudness())
+    this->SetLoudness(this->_model->GetLoudness());
+  if (mode == Mode::kZeroLatency)
+    return;
+
+  // Whatever's left over after the last whole block is at most block_size - 1 samples, so starting the output that
+  // far ahead means it never runs dry.
+  this->_latency = block_size - 1;
+  this->_block_input.assign(block_size, 0.0);
+  this->_block_output.assign(block_size, 0.0);
+  this->_output_fifo.write_(this->_block_output.data(), this->_latency);
+}
+
+void nam::ReblockingDSP::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
+{
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  if (this->_mode == Mode::kZeroLatency)
+  {
+    for (int start = 0; start < num_frames; start += this->_block_size)
+    {
+      const int frames = std::min(this->_block_size, num_frames - start);
+      this->_model->process(input + start, output + start, frames);
+      this->_model->finalize_(frames);
+    }
+    return;
+  }
+
+  const size_t block_size = this->_block_size;
+  size_t position = 0;
+  while (position < (size_t)num_frames)
+  {
+    // Up to the end of the block that's filling up
+    const size_t room = block_size - this->_input_fifo.get_read_available();
+    const size_t frames = this->_input_fifo.write_(input + position, std::min(room, num_frames - position));
+    if (this->_input_fifo.get_read_available() == block_size)
+    {
+      this->_input_fifo.read_(this->_block_input.data(), block_size);
+      this->_model->process(this->_block_input.data(), this->_block_output.data(), this->_block_size);
+      this->_model->finalize_(this->_block_size);
+      this->_output_fifo.write_(this->_block_output.data(), block_size);
+    }
+    // The latency guarantees enough, but don't read junk if that's ever wrong.
+    const size_t available = this->_output_fifo.read_(output + position, frames);
+    std::fill(output + position + available, output + position + frames, 0.0);
+    position += frames;
+  }
+}
+
+void nam::ReblockingDSP::prewarm()
+{
+  this->_model->prewarm();
+}
+
+nam::CostEstimate nam::ReblockingDSP::GetCostEstimate() const
+{
+  CostEstimate estimate = this->_model->GetCostEstimate();
+  estimate.state_bytes += (this->_input_fifo.get_capacity() + this->_output_fifo.get_capacity()
+                           + this->_block_input.capacity() + this->_block_output.capacity())
+                          * sizeof(NAM_SAMPLE);
+  return estimate;
+}
@@ -0,0 +1,57 @@
+#pragma once
+// Running a model at one block size, whatever block sizes the host calls with
+
+#include <memory>
+#include <vector>
+
+#include "dsp.h"
+#include "ring_buffer.h"
+
+namespace nam
+{
+// Runs a model in blocks of `block_size` frames (e.g. one picked by Tuner::tune_block_size()) however the host's
+// blocks fall, so that the model isn't called with tiny blocks or with block sizes that keep changing.
+//
+// process() always returns exactly as many frames as it's given. Only kFixedLatency mode fully delivers on the above:
+// the model only ever sees whole blocks, because the input is buffered through a FIFO until there's a block, and the
+// output comes back through another, GetLatency() = block_size - 1 samples late (plus the model's own latency).
+//
+// kZeroLatency mode can't hold anything back, so it only caps how many frames the model sees at once: calls longer
+// than `block_size` are split into whole blocks and a partial one. Shorter calls reach the model at the host's size,
+// so a host with small or changing block sizes still calls the model with them (and e.g. WaveNet's tiles still run
+// ragged).
+//
+// Nothing is allocated after construction, so process() is real-time safe if the model's is.
+class ReblockingDSP : public DSP
+{
+public:
+  enum class Mode
+  {
+    kZeroLatency = 0,
+    kFixedLatency
+  };
+
+  ReblockingDSP(std::unique_ptr<DSP> model, const int block_size, const Mode mode = Mode::kFixedLatency);
+  void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
+  void prewarm() override;
+  // The model's, plus the FIFOs
+  CostEstimate GetCostEstimate() const override;
+  int GetLatency() const override { return this->_latency + this->_model->GetLatency(); };
+  int GetBlockSize() const { return this->_block_size; };
+  Mode GetMode() const { return this->_mode; };
+  DSP& GetModel() { return *this->_model; };
+
+private:
+  std::unique_ptr<DSP> _model;
+  const int _block_size;
+  const Mode _mode;
+  // What this adds (not counting the model's)
+  int _latency = 0;
+  // kFixedLatency: input waiting for a whole block, and output waiting to go out
+  SPSCRingBuffer<NAM_SAMPLE> _input_fifo;
+  SPSCRingBuffer<NAM_SAMPLE> _output_fifo;
+  // One block, on its way into and out of the model
+  std::vector<NAM_SAMPLE> _block_input;
+  std::vector<NAM_SAMPLE> _block_output;
+};
+}; // namespace nam
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric> // std::gcd
+#include <stdexcept>
+
+#include "resampler.h"
+
+// Half the filter length, in samples at the lower of the two rates
+#define HALF_TAPS 48
+// Kaiser window shape; about 80 dB of stopband
+#define KAISER_BETA 8.0
+// Middle of the transition band, as a fraction of the lower Nyquist frequency
+#define CUTOFF 0.95
+// What models that don't say were trained at
+#define LEGACY_MODEL_SAMPLE_RATE 48000.0
+
+namespace
+{
+constexpr double kPi = 3.14159265358979323846;
+
+// Zeroth-order modified Bessel function of the first kind, for the Kaiser window
+double _bessel_i0(const double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 50 && term > 1.0e-12 * sum; k++)
+  {
+    const double half_x_over_k = 0.5 * x / k;
+    term *= half_x_over_k * half_x_over_k;
+    sum += term;
+  }
+  return sum;
+}
+
+double _sinc(const double x)
+{
+  return x == 0.0 ? 1.0 : std::sin(kPi * x) / (kPi * x);
+}
+}; // namespace
+
+nam::resampling::Resampler::Resampler(const double input_rate, const double output_rate)
+{
+  if (input_rate <= 0.0 || output_rate <= 0.0)
+    throw std::runtime_error("Resampler needs positive sample rates");
+  const bool integer_rates = input_rate == std::floor(input_rate) && output_rate == std::floor(output_rate);
+  if (integer_rates)
+  {
+    const int64_t gcd = std::gcd((int64_t)input_rate, (int64_t)output_rate);
+    this->_step_denominator = (int64_t)output_rate / gcd;
+    this->_step = (int64_t)input_rate / gcd;
+  }
+  else
+  {
+    this->_step_denominator = (int64_t)1 << 32;
+    this->_step = (int64_t)std::llround(input_rate / output_rate * (double)this->_step_denominator);
+  }
+  this->_exact_phases = this->_step_denominator <= kMaxPhases;
+  this->_num_phases = this->_exact_phases ? (int)this->_step_denominator : kMaxPhases;
+
+  // Cutoff in cycles per input sample. When going down, the filter has to be longer (in input samples) to be as
+  // sharp relative to the output rate.
+  const double down = std::max(1.0, input_rate / output_rate);
+  const double cutoff = 0.5 * CUTOFF / down;
+  this->_num_taps = 2 * (int)std::ceil(HALF_TAPS * down);
+  const int half = this->_num_taps / 2;
+  this->_phases.resize(this->_num_taps, this->_num_phases + 1);
+  const double i0_beta = _bessel_i0(KAISER_BETA);
+  for (int p = 0; p <= this->_num_phases; p++)
+  {
+    const double fraction = (double)p / this->_num_phases;
+    double sum = 0.0;
+    for (int i = 0; i < this->_num_taps; i++)
+    {
+      // Distance from the output's time to input i of the window (which starts half - 1 samples back)
+      const double t = fraction - (double)(i - half + 1);
+      const double u = t / half;
+      const double window = std::abs(u) < 1.0 ? _bessel_i0(KAISER_BETA * std::sqrt(1.0 - u * u)) / i0_beta : 0.0;
+      const double tap = 2.0 * cutoff * _sinc(2.0 * cutoff * t) * window;
+      this->_phases(i, p) = (float)tap;
+      sum += tap;
+    }
+    // Unity gain at DC for every phase
+    this->_phases.col(p) /= (float)sum;
+  }
+  this->reset_();
+}
+
+void nam::resampling::Resampler::reset_()
+{
+  // Silence before the first input, so that the first outputs have a full window
+  const long half = this->_num_taps / 2;
+  this->_history.assign(std::max(this->_history.size(), (size_t)this->_num_taps), 0.0f);
+  this->_history_size = half - 1;
+  this->_index = half - 1;
+  this->_position = 0;
+}
+
+int nam::resampling::Resampler::get_max_output(const int num_input) const
+{
+  return (int)(((int64_t)num_input * this->_step_denominator + this->_step - 1) / this->_step) + 1;
+}
+
+int nam::resampling::Resampler::process_(const NAM_SAMPLE* input, const int num_input, NAM_SAMPLE* output)
+{
+  const long half = this->_num_taps / 2;
+  if ((long)this->_history.size() < this->_history_size + num_input)
+    this->_history.resize(this->_history_size + num_input);
+  for (int i = 0; i < num_input; i++)
+    this->_history[this->_history_size + i] = (float)input[i];
+  this->_history_size += num_input;
+
+  int num_output = 0;
+  // Each output needs the half - 1 inputs before it and half from its time on.
+  while (this->_index + half < this->_history_size)
+  {
+    const Eigen::Map<const Eigen::VectorXf> window(this->_history.data() + this->_index - half + 1, this->_num_taps);
+    float y;
+    if (this->_exact_phases)
+      y = window.dot(this->_phases.col(this->_position));
+    else
+    {
+      const double phase = (double)this->_position * this->_num_phases / (double)this->_step_denominator;
+      const int p = (int)phase;
+      const float a = (float)(phase - p);
+      y = (1.0f - a) * window.dot(this->_phases.col(p)) + a * window.dot(this->_phases.col(p + 1));
+    }
+    output[num_output++] = (NAM_SAMPLE)y;
+    this->_position += this->_step;
+    this->_index += (long)(this->_position / this->_step_denominator);
+    this->_position %= this->_step_denominator;
+  }
+
+  // Drop what no later output will look at.
+  const long keep_from = this->_index - half + 1;
+  auto history = this->_history.begin();
+  std::copy(history + keep_from, history + this->_history_size, history);
+  this->_history_size -= keep_from;
+  this->_index -= keep_from;
+  return num_output;
+}
+
+nam::ResamplingDSP::ResamplingDSP(std::unique_ptr<DSP> model, const double sample_rate)
+: DSP(sample_rate)
+, _model(std::move(model))
+{
+  if (this->_model == nullptr)
+    throw std::runtime_error("ResamplingDSP needs a model");
+  this->mActivationPrecision = this->_model->GetActivationPrecision();
+  if (this->_model->HasLoudness())
+    this->SetLoudness(this->_model->GetLoudness());
+  const double expected_rate = this->_model->GetExpectedSampleRate();
+  this->_model_sample_rate = expected_rate > 0.0 ? expected_rate : LEGACY_MODEL_SAMPLE_RATE;
+  if (this->_model_sample_rate == sample_rate)
+    return;
+
+  this->_up = std::make_unique<resampling::Resampler>(sample_rate, this->_model_sample_rate);
+  this->_down = std::make_unique<resampling::Resampler>(this->_model_sample_rate, sample_rate);
+  // After k inputs, the up-converter has made at least (k - its lookahead) * ratio - 1 model samples, and the
+  // down-converter has turned u of those into at least (u - its lookahead) / ratio - 1. Starting the FIFO that far
+  // ahead means it never runs dry. The conversions are centred on each output's time, so this is also the delay.
+  const double ratio = this->_up->get_ratio();
+  this->_latency =
+    (int)std::ceil(this->_up->get_lookahead() + (this->_down->get_lookahead() + 1.0) / ratio + 1.0) + 1;
+  this->_fifo.assign(this->_latency, 0.0);
+  this->_fifo_size = this->_latency;
+}
+
+void nam::ResamplingDSP::prewarm()
+{
+  this->_model->prewarm();
+}
+
+nam::CostEstimate nam::ResamplingDSP::GetCostEstimate() const
+{
+  CostEstimate estimate = this->_model->GetCostEstimate();
+  if (this->_up == nullptr)
+    return estimate;
+  // Model samples per sample here
+  const double ratio = this->_up->get_ratio();
+  estimate.multiply_adds_per_sample = estimate.multiply_adds_per_sample * ratio
+                                      + this->_up->get_multiply_adds_per_output() * ratio
+                                      + this->_down->get_multiply_adds_per_output();
+  estimate.activations_per_sample *= ratio;
+  estimate.weight_bytes += this->_up->get_weights_bytes() + this->_down->get_weights_bytes();
+  estimate.state_bytes += this->_up->get_state_bytes() + this->_down->get_state_bytes()
+                          + (this->_model_input.capacity() + this->_model_output.capacity() + this->_fifo.capacity())
+                              * sizeof(NAM_SAMPLE);
+  // Each filter reaches back half its length: the up-converter's at this rate, the down-converter's at the model's.
+  if (estimate.receptive_field >= 0)
+    estimate.receptive_field = (long)std::ceil((estimate.receptive_field + this->_down->get_num_taps() / 2) / ratio
+                                               + this->_up->get_num_taps() / 2);
+  return estimate;
+}
+
+void nam::ResamplingDSP::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
+{
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  if (this->_up == nullptr)
+  {
+    this->_model->process(input, output, num_frames);
+    this->_model->finalize_(num_frames);
+    return;
+  }
+
+  // Only grows for the biggest block yet
+  const size_t max_model_frames = this->_up->get_max_output(num_frames);
+  if (this->_model_input.size() < max_model_frames)
+  {
+    this->_model_input.resize(max_model_frames);
+    this->_model_output.resize(max_model_frames);
+  }
+  const int model_frames = this->_up->process_(input, num_frames, this->_model_input.data());
+  if (model_frames > 0)
+  {
+    this->_model->process(this->_model_input.data(), this->_model_output.data(), model_frames);
+    this->_model->finalize_(model_frames);
+  }
+  const size_t max_fifo_size = this->_fifo_size + this->_down->get_max_output(model_frames);
+  if (this->_fifo.size() < max_fifo_size)
+    this->_fifo.resize(max_fifo_size);
+  NAM_SAMPLE* fifo_end = this->_fifo.data() + this->_fifo_size;
+  this->_fifo_size += this->_down->process_(this->_model_output.data(), model_frames, fifo_end);
+
+  // The latency guarantees enough, but don't read junk if that's ever wrong.
+  const long available = std::min((long)num_frames, this->_fifo_size);
+  std::copy(this->_fifo.begin(), this->_fifo.begin() + available, output);
+  std::fill(output + available, output + num_frames, 0.0);
+  std::copy(this->_fifo.begin() + available, this->_fifo.begin() + this->_fifo_size, this->_fifo.begin());
+  this->_fifo_size -= available;
+}
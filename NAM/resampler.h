@@ -0,0 +1,109 @@
+#pragma once
+// Streaming sample-rate conversion, and a DSP that runs a model at the rate it was trained at
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "dsp.h"
+
+namespace nam
+{
+namespace resampling
+{
+// Polyphase windowed-sinc conversion of a continuous stream from one sample rate to another.
+//
+// Output k is the band-limited input evaluated at input time k * input_rate / output_rate: one dot product of the
+// input around that time with one phase of a Kaiser-windowed sinc. Integer rates step exactly (e.g. 44100 -> 48000
+// cycles through 160 phases). When the reduced ratio needs more than kMaxPhases phases, or a rate isn't an integer,
+// the output is interpolated between the nearest two of kMaxPhases phases and the step is held to 2^-32 of a sample.
+//
+// The passband is flat to 0.9 of the lower of the two Nyquist frequencies (19.8 kHz between 44.1 and 48 kHz), and
+// the stopband starts at that Nyquist frequency, about 80 dB down.
+class Resampler
+{
+public:
+  static constexpr int kMaxPhases = 256;
+
+  Resampler(const double input_rate, const double output_rate);
+  // Consumes all of `input` and writes the outputs that are now complete, returning how many. `output` needs room
+  // for get_max_output(num_input) of them. Allocates only if num_input is bigger than it's been before.
+  int process_(const NAM_SAMPLE* input, const int num_input, NAM_SAMPLE* output);
+  // Most outputs that num_input inputs can complete
+  int get_max_output(const int num_input) const;
+  // How many input samples each output waits for beyond its own time (half the filter)
+  int get_lookahead() const { return this->_num_taps / 2; };
+  // Outputs per input
+  double get_ratio() const { return (double)this->_step_denominator / (double)this->_step; };
+  int get_num_taps() const { return this->_num_taps; };
+  // Per output: one dot product, or two and a blend when interpolating between phases
+  int get_multiply_adds_per_output() const
+  {
+    return this->_exact_phases ? this->_num_taps : 2 * this->_num_taps + 2;
+  };
+  size_t get_weights_bytes() const { return this->_phases.size() * sizeof(float); };
+  size_t get_state_bytes() const { return this->_history.capacity() * sizeof(float); };
+  // Back to silence
+  void reset_();
+
+private:
+  // One column of taps per phase, ordered oldest input first. Column p is for outputs p / _num_phases of the way
+  // from one input sample to the next; the extra last column is phase 0 one sample later, for interpolating.
+  Eigen::MatrixXf _phases;
+  int _num_taps;
+  int _num_phases;
+  // Each output advances the input position by _step / _step_denominator samples.
+  int64_t _step;
+  int64_t _step_denominator;
+  // Whether the position always lands exactly on a phase
+  bool _exact_phases;
+
+  // Input history, oldest first; _history_size of it is valid.
+  std::vector<float> _history;
+  long _history_size;
+  // The next output is at input _index (into _history) plus _position / _step_denominator.
+  long _index;
+  int64_t _position;
+};
+}; // namespace resampling
+
+// Runs a model at its expected sample rate on audio at another rate, converting on the way in and out.
+//
+// process() always returns exactly as many frames as it's given. To be sure of having them, the output starts with
+// GetLatency() samples of silence, which covers what the filters wait for; after that the output is the model's,
+// delayed by exactly GetLatency() samples. Models that don't know their rate predate recording it and are taken to
+// be 48 kHz, like every model trained back then. If the rates already match, this just passes through to the model,
+// without delay.
+class ResamplingDSP : public DSP
+{
+public:
+  ResamplingDSP(std::unique_ptr<DSP> model, const double sample_rate);
+  void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
+  void prewarm() override;
+  // The model's costs, per sample at this DSP's rate, plus the conversions'
+  CostEstimate GetCostEstimate() const override;
+  // Delay from input to output, in samples at this DSP's (not the model's) sample rate
+  int GetLatency() const override { return this->_latency; };
+  // Whether the rates differ, so that there's anything to convert
+  bool IsResampling() const { return this->_up != nullptr; };
+  // What the model runs at
+  double GetModelSampleRate() const { return this->_model_sample_rate; };
+  DSP& GetModel() { return *this->_model; };
+
+private:
+  std::unique_ptr<DSP> _model;
+  double _model_sample_rate;
+  // To the model's rate and back; null when passing through
+  std::unique_ptr<resampling::Resampler> _up;
+  std::unique_ptr<resampling::Resampler> _down;
+  // Audio at the model's rate
+  std::vector<NAM_SAMPLE> _model_input;
+  std::vector<NAM_SAMPLE> _model_output;
+  // Converted back, waiting to go out; _fifo_size of it is valid.
+  std::vector<NAM_SAMPLE> _fifo;
+  long _fifo_size = 0;
+  int _latency = 0;
+};
+}; // namespace nam
@@ -0,0 +1,94 @@
+#pragma once
+// Bounded, lock-free queue between exactly one producer thread and one consumer thread
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace nam
+{
+// All memory is allocated up front, and neither side ever blocks or allocates, so it's safe to use from a real-time
+// thread. Waiting (for room or for data) is up to the caller.
+//
+// The producer only calls write_() and close_(); the consumer only calls read_(). The get_*() and is_closed()
+// queries are safe from either side. Each side keeps a cached copy of the other's index so that it only touches the
+// other side's cache line when it looks like it's out of room or data.
+template <typename T>
+class SPSCRingBuffer
+{
+public:
+  // Holds at least `capacity` values (rounded up to a power of two).
+  explicit SPSCRingBuffer(const size_t capacity)
+  {
+    if (capacity == 0)
+      throw std::runtime_error("SPSCRingBuffer needs a non-zero capacity");
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    this->_buffer.resize(size);
+    this->_mask = size - 1;
+  };
+  SPSCRingBuffer(const SPSCRingBuffer&) = delete;
+  SPSCRingBuffer& operator=(const SPSCRingBuffer&) = delete;
+
+  size_t get_capacity() const { return this->_buffer.size(); };
+  // How much the consumer could read right now
+  size_t get_read_available() const
+  {
+    return this->_write_index.load(std::memory_order_acquire) - this->_read_index.load(std::memory_order_acquire);
+  };
+  // How much the producer could write right now
+  size_t get_write_available() const { return this->get_capacity() - this->get_read_available(); };
+  // Whether the producer is done. Check this *before* get_read_available() to know that what's available is all
+  // there will ever be.
+  bool is_closed() const { return this->_closed.load(std::memory_order_acquire); };
+
+  // Producer: copies in as many of the `count` values as fit and returns how many that was.
+  size_t write_(const T* data, const size_t count)
+  {
+    const size_t write_index = this->_write_index.load(std::memory_order_relaxed);
+    if (this->get_capacity() - (write_index - this->_producer_read_index) < count)
+      this->_producer_read_index = this->_read_index.load(std::memory_order_acquire);
+    const size_t n = std::min(count, this->get_capacity() - (write_index - this->_producer_read_index));
+    const size_t start = write_index & this->_mask;
+    const size_t first = std::min(n, this->get_capacity() - start);
+    std::copy(data, data + first, this->_buffer.begin() + start);
+    std::copy(data + first, data + n, this->_buffer.begin());
+    this->_write_index.store(write_index + n, std::memory_order_release);
+    return n;
+  };
+
+  // Consumer: copies out up to `count` values and returns how many there were.
+  size_t read_(T* data, const size_t count)
+  {
+    const size_t read_index = this->_read_index.load(std::memory_order_relaxed);
+    if (this->_consumer_write_index - read_index < count)
+      this->_consumer_write_index = this->_write_index.load(std::memory_order_acquire);
+    const size_t n = std::min(count, this->_consumer_write_index - read_index);
+    const size_t start = read_index & this->_mask;
+    const size_t first = std::min(n, this->get_capacity() - start);
+    std::copy(this->_buffer.begin() + start, this->_buffer.begin() + start + first, data);
+    std::copy(this->_buffer.begin(), this->_buffer.begin() + (n - first), data + first);
+    this->_read_index.store(read_index + n, std::memory_order_release);
+    return n;
+  };
+
+  // Producer: nothing more is coming.
+  void close_() { this->_closed.store(true, std::memory_order_release); };
+
+private:
+  std::vector<T> _buffer;
+  size_t _mask = 0;
+
+  // Indices count every value ever written or read; they're only reduced to positions (with _mask) on access.
+  // Producer's line
+  alignas(64) std::atomic<size_t> _write_index{0};
+  size_t _producer_read_index = 0;
+  // Consumer's line
+  alignas(64) std::atomic<size_t> _read_index{0};
+  size_t _consumer_write_index = 0;
+  alignas(64) std::atomic<bool> _closed{false};
+};
+}; // namespace nam
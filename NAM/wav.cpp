@@ -5,6 +5,7 @@
 //  Created by Steven Atkinson on 12/31/22.
 //
 
+#include <algorithm>
 #include <cstring> // strncmp
 #include <cmath> // pow
 #include <fstream>
@@ -14,8 +15,40 @@
 #include <unordered_set>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64)
+  #include <immintrin.h>
+  #define NAM_PCM_X86
+  #if defined(__GNUC__) || defined(__clang__)
+    // Lets one function use instructions that the rest of the build doesn't assume
+    #define NAM_TARGET(features) __attribute__((target(features)))
+  #else
+    #define NAM_TARGET(features)
+  #endif
+#endif
+
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <io.h> // _chsize_s
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 #include "wav.h"
 
+// What Writer puts before the samples: RIFF header, a 28-byte JUNK chunk that becomes ds64 if the file turns out to
+// need RF64, a 16-byte fmt chunk and the data chunk's header. It also leaves the samples 16-byte aligned.
+#define HEADER_BYTES 80
+// Reader::Read() lets go of the pages it has passed in steps this big
+#define RELEASE_BYTES (64 << 20)
+// Load() reads PCM in blocks this big and converts each while it's in cache
+#define LOAD_BLOCK_BYTES (3 << 16)
+
 bool idIsNotJunk(char* id)
 {
   return strncmp(id, "RIFF", 4) == 0 || strncmp(id, "WAVE", 4) == 0 || strncmp(id, "fmt ", 4) == 0
@@ -222,7 +255,7 @@ dsp::wav::LoadReturnCode dsp::wav::Load(const char* fileName, std::vector<float>
     else if (bitsPerSample == 24)
       dsp::wav::_LoadSamples24(wavFile, subchunk2Size, audio);
     else if (bitsPerSample == 32)
-      dsp::wav::_LoadSamples32(wavFile, subchunk2Size, audio);
+      dsp::wav::_LoadSamples(wavFile, subchunk2Size, dsp::wav::SampleFormat::PCM32, audio);
     else
     {
       std::cerr << "Error: Unsupported bits per sample for PCM files: " << bitsPerSample << std::endl;
@@ -239,36 +272,41 @@ dsp::wav::LoadReturnCode dsp::wav::Load(const char* fileName, std::vector<float>
   return dsp::wav::LoadReturnCode::SUCCESS;
 }
 
-void dsp::wav::_LoadSamples16(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples)
+void dsp::wav::_LoadSamples(std::ifstream& wavFile, const int chunkSize, const SampleFormat format,
+                            std::vector<float>& samples)
 {
-  // Allocate an array to hold the samples
-  std::vector<short> tmp(chunkSize / 2); // 16 bits (2 bytes) per sample
-
-  // Read the samples from the file into the array
-  wavFile.read(reinterpret_cast<char*>(tmp.data()), chunkSize);
+  const int bytesPerSample = GetBytesPerSample(format);
+  samples.resize(chunkSize / bytesPerSample);
+  if (format == SampleFormat::FLOAT32)
+  {
+    // Already what we want
+    wavFile.read(reinterpret_cast<char*>(samples.data()), samples.size() * sizeof(float));
+    samples.resize(wavFile.gcount() / sizeof(float));
+    return;
+  }
+  std::vector<uint8_t> block(LOAD_BLOCK_BYTES);
+  const size_t blockSamples = LOAD_BLOCK_BYTES / bytesPerSample;
+  for (size_t start = 0; start < samples.size();)
+  {
+    const size_t wanted = std::min(blockSamples, samples.size() - start);
+    wavFile.read(reinterpret_cast<char*>(block.data()), wanted * bytesPerSample);
+    const size_t got = wavFile.gcount() / bytesPerSample;
+    DecodeSamples(block.data(), format, got, samples.data() + start);
+    start += got;
+    // The file is shorter than it said.
+    if (got < wanted)
+      samples.resize(start);
+  }
+}
 
-  // Copy into the return array
-  const float scale = 1.0 / ((double)(1 << 15));
-  samples.resize(tmp.size());
-  for (auto i = 0; i < samples.size(); i++)
-    samples[i] = scale * ((float)tmp[i]); // 2^16
+void dsp::wav::_LoadSamples16(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples)
+{
+  _LoadSamples(wavFile, chunkSize, SampleFormat::PCM16, samples);
 }
 
 void dsp::wav::_LoadSamples24(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples)
 {
-  // Allocate an array to hold the samples
-  std::vector<int> tmp(chunkSize / 3); // 24 bits (3 bytes) per sample
-  // Read in and convert the samples
-  for (int& x : tmp)
-  {
-    x = dsp::wav::_ReadSigned24BitInt(wavFile);
-  }
-
-  // Copy into the return array
-  const float scale = 1.0 / ((double)(1 << 23));
-  samples.resize(tmp.size());
-  for (auto i = 0; i < samples.size(); i++)
-    samples[i] = scale * ((float)tmp[i]);
+  _LoadSamples(wavFile, chunkSize, SampleFormat::PCM24, samples);
 }
 
 int dsp::wav::_ReadSigned24BitInt(std::ifstream& stream)
@@ -295,8 +333,567 @@ int dsp::wav::_ReadSigned24BitInt(std::ifstream& stream)
 
 void dsp::wav::_LoadSamples32(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples)
 {
-  // NOTE: 32-bit is float.
-  samples.resize(chunkSize / 4); // 32 bits (4 bytes) per sample
-  // Read the samples from the file into the array
-  wavFile.read(reinterpret_cast<char*>(samples.data()), chunkSize);
+  _LoadSamples(wavFile, chunkSize, SampleFormat::FLOAT32, samples);
+}
+
+int dsp::wav::GetBytesPerSample(const SampleFormat format)
+{
+  switch (format)
+  {
+    case SampleFormat::PCM16: return 2;
+    case SampleFormat::PCM24: return 3;
+    default: return 4;
+  }
+}
+
+namespace
+{
+// WAV is little-endian, as is everything this runs on.
+uint64_t _ReadLittleEndian(const uint8_t* where, const int numBytes)
+{
+  uint64_t value = 0;
+  for (int i = numBytes - 1; i >= 0; i--)
+    value = (value << 8) | where[i];
+  return value;
+}
+
+void _WriteLittleEndian(uint8_t* where, uint64_t value, const int numBytes)
+{
+  for (int i = 0; i < numBytes; i++, value >>= 8)
+    where[i] = (uint8_t)(value & 0xff);
+}
+
+// Full scale of each PCM format, and the most positive value as a float. (2^31 - 1 isn't a float, so 32-bit tops out
+// at the largest float below it.)
+constexpr float kScale16 = 32768.0f;
+constexpr float kScale24 = 8388608.0f;
+constexpr float kScale32 = 2147483648.0f;
+constexpr float kMax16 = 32767.0f;
+constexpr float kMax24 = 8388607.0f;
+constexpr float kMax32 = 2147483520.0f;
+
+// std::max() with the limit first gives back the limit for NaN, so NaN comes out as negative full scale, as it does
+// from _ToInt().
+float _Clip(const float x, const float scale, const float max)
+{
+  return std::min(max, std::max(-scale, x * scale));
+}
+
+void _DecodeScalar(const uint8_t* source, const dsp::wav::SampleFormat format, const size_t begin, const size_t end,
+                   float* destination)
+{
+  switch (format)
+  {
+    case dsp::wav::SampleFormat::PCM16:
+      for (size_t i = begin; i < end; i++)
+        destination[i] = (float)(int16_t)_ReadLittleEndian(source + 2 * i, 2) * (1.0f / kScale16);
+      break;
+    case dsp::wav::SampleFormat::PCM24:
+      for (size_t i = begin; i < end; i++)
+      {
+        // Into the top of an int, which is the sample times 2^8, so the sign comes with it
+        const int32_t value = (int32_t)((uint32_t)_ReadLittleEndian(source + 3 * i, 3) << 8);
+        destination[i] = (float)value * (1.0f / kScale32);
+      }
+      break;
+    case dsp::wav::SampleFormat::PCM32:
+      for (size_t i = begin; i < end; i++)
+        destination[i] = (float)(int32_t)_ReadLittleEndian(source + 4 * i, 4) * (1.0f / kScale32);
+      break;
+    case dsp::wav::SampleFormat::FLOAT32:
+      memcpy(destination + begin, source + 4 * begin, (end - begin) * sizeof(float));
+      break;
+  }
+}
+
+void _EncodeScalar(const float* source, const dsp::wav::SampleFormat format, const size_t begin, const size_t end,
+                   uint8_t* destination)
+{
+  switch (format)
+  {
+    case dsp::wav::SampleFormat::PCM16:
+      for (size_t i = begin; i < end; i++)
+        _WriteLittleEndian(destination + 2 * i, (uint64_t)std::lrint(_Clip(source[i], kScale16, kMax16)), 2);
+      break;
+    case dsp::wav::SampleFormat::PCM24:
+      for (size_t i = begin; i < end; i++)
+        _WriteLittleEndian(destination + 3 * i, (uint64_t)std::lrint(_Clip(source[i], kScale24, kMax24)), 3);
+      break;
+    case dsp::wav::SampleFormat::PCM32:
+      for (size_t i = begin; i < end; i++)
+        _WriteLittleEndian(destination + 4 * i, (uint64_t)std::lrint(_Clip(source[i], kScale32, kMax32)), 4);
+      break;
+    case dsp::wav::SampleFormat::FLOAT32:
+      memcpy(destination + 4 * begin, source + begin, (end - begin) * sizeof(float));
+      break;
+  }
+}
+
+#ifdef NAM_PCM_X86
+// 24-bit samples go four to a 128-bit lane, each lane loading 16 bytes for the 12 it uses. Stopping this many
+// samples short of the end keeps the last load (and store) inside the buffer.
+  #define PCM24_SLACK 2
+
+// Return how many samples they did; the scalar versions do the rest.
+NAM_TARGET("avx2") size_t _DecodeAVX2(const uint8_t* source, const dsp::wav::SampleFormat format,
+                                      const size_t numSamples, float* destination)
+{
+  size_t i = 0;
+  switch (format)
+  {
+    case dsp::wav::SampleFormat::PCM16:
+    {
+      const __m256 scale = _mm256_set1_ps(1.0f / kScale16);
+      for (; i + 8 <= numSamples; i += 8)
+      {
+        const __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(source + 2 * i)));
+        _mm256_storeu_ps(destination + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+      }
+      break;
+    }
+    case dsp::wav::SampleFormat::PCM24:
+    {
+      // Each sample's three bytes to the top of its int, as in _DecodeScalar()
+      const __m256i spread = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3,
+                                              4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+      const __m256 scale = _mm256_set1_ps(1.0f / kScale32);
+      for (; i + 8 + PCM24_SLACK <= numSamples; i += 8)
+      {
+        const uint8_t* bytes = source + 3 * i;
+        const __m128i low = _mm_loadu_si128((const __m128i*)bytes);
+        const __m128i high = _mm_loadu_si128((const __m128i*)(bytes + 12));
+        const __m256i packed = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        const __m256i x = _mm256_shuffle_epi8(packed, spread);
+        _mm256_storeu_ps(destination + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+      }
+      break;
+    }
+    case dsp::wav::SampleFormat::PCM32:
+    {
+      const __m256 scale = _mm256_set1_ps(1.0f / kScale32);
+      for (; i + 8 <= numSamples; i += 8)
+      {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(source + 4 * i));
+        _mm256_storeu_ps(destination + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+      }
+      break;
+    }
+    case dsp::wav::SampleFormat::FLOAT32: break;
+  }
+  return i;
+}
+
+// Rounds to nearest like lrint(), and clips like _Clip()
+NAM_TARGET("avx2") inline __m256i _ToInt(const float* source, const __m256 scale, const __m256 max)
+{
+  const __m256 x = _mm256_mul_ps(_mm256_loadu_ps(source), scale);
+  // The SIMD min/max give back their second operand when either is NaN.
+  return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(x, _mm256_sub_ps(_mm256_setzero_ps(), scale)), max));
+}
+
+NAM_TARGET("avx2") size_t _EncodeAVX2(const float* source, const dsp::wav::SampleFormat format,
+                                      const size_t numSamples, uint8_t* destination)
+{
+  size_t i = 0;
+  switch (format)
+  {
+    case dsp::wav::SampleFormat::PCM16:
+    {
+      const __m256 scale = _mm256_set1_ps(kScale16);
+      const __m256 max = _mm256_set1_ps(kMax16);
+      for (; i + 8 <= numSamples; i += 8)
+      {
+        const __m256i x = _ToInt(source + i, scale, max);
+        const __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+        _mm_storeu_si128((__m128i*)(destination + 2 * i), packed);
+      }
+      break;
+    }
+    case dsp::wav::SampleFormat::PCM24:
+    {
+      // The low three bytes of each int, packed into the first 12 bytes of its lane
+      const __m256i gather = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6,
+                                              8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+      const __m256 scale = _mm256_set1_ps(kScale24);
+      const __m256 max = _mm256_set1_ps(kMax24);
+      for (; i + 8 + PCM24_SLACK <= numSamples; i += 8)
+      {
+        const __m256i x = _mm256_shuffle_epi8(_ToInt(source + i, scale, max), gather);
+        uint8_t* bytes = destination + 3 * i;
+        // The second store overwrites the first's 4 spare bytes.
+        _mm_storeu_si128((__m128i*)bytes, _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*)(bytes + 12), _mm256_extracti128_si256(x, 1));
+      }
+      break;
+    }
+    case dsp::wav::SampleFormat::PCM32:
+    {
+      const __m256 scale = _mm256_set1_ps(kScale32);
+      const __m256 max = _mm256_set1_ps(kMax32);
+      for (; i + 8 <= numSamples; i += 8)
+        _mm256_storeu_si256((__m256i*)(destination + 4 * i), _ToInt(source + i, scale, max));
+      break;
+    }
+    case dsp::wav::SampleFormat::FLOAT32: break;
+  }
+  return i;
+}
+#endif
+
+bool _UseAVX2()
+{
+#if defined(NAM_PCM_X86) && (defined(__GNUC__) || defined(__clang__))
+  // Needed because this may run from a static constructor.
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#elif defined(NAM_PCM_X86) && defined(__AVX2__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+const bool _USE_AVX2 = _UseAVX2();
+
+// Sets the length of an open file, reserving the disk space for it where the platform can
+bool _SetFileSize(FILE* file, const int64_t size)
+{
+  if (fflush(file) != 0)
+    return false;
+#ifdef _WIN32
+  return _chsize_s(_fileno(file), size) == 0;
+#else
+  if (ftruncate(fileno(file), (off_t)size) != 0)
+    return false;
+  #ifdef __linux__
+  // Best effort; it's only to keep the file in one piece.
+  (void)posix_fallocate(fileno(file), 0, (off_t)size);
+  #endif
+  return true;
+#endif
+}
+}; // namespace
+
+void dsp::wav::DecodeSamples(const uint8_t* source, const SampleFormat format, const size_t numSamples,
+                             float* destination)
+{
+  size_t done = 0;
+#ifdef NAM_PCM_X86
+  if (_USE_AVX2)
+    done = _DecodeAVX2(source, format, numSamples, destination);
+#endif
+  _DecodeScalar(source, format, done, numSamples, destination);
+}
+
+void dsp::wav::EncodeSamples(const float* source, const SampleFormat format, const size_t numSamples,
+                             uint8_t* destination)
+{
+  size_t done = 0;
+#ifdef NAM_PCM_X86
+  if (_USE_AVX2)
+    done = _EncodeAVX2(source, format, numSamples, destination);
+#endif
+  _EncodeScalar(source, format, done, numSamples, destination);
+}
+
+dsp::wav::Reader::~Reader()
+{
+  Close();
+}
+
+dsp::wav::LoadReturnCode dsp::wav::Reader::Open(const char* fileName)
+{
+  Close();
+#ifdef _WIN32
+  HANDLE file =
+    CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return LoadReturnCode::ERROR_OPENING;
+  mFileHandle = file;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+  {
+    Close();
+    return LoadReturnCode::ERROR_INVALID_FILE;
+  }
+  mMappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mMappingHandle != nullptr)
+    mMapping = (const uint8_t*)MapViewOfFile(mMappingHandle, FILE_MAP_READ, 0, 0, 0);
+  if (mMapping == nullptr)
+  {
+    Close();
+    return LoadReturnCode::ERROR_OPENING;
+  }
+  mMappingSize = (size_t)size.QuadPart;
+#else
+  const int file = open(fileName, O_RDONLY);
+  if (file < 0)
+    return LoadReturnCode::ERROR_OPENING;
+  struct stat status;
+  if (fstat(file, &status) != 0 || status.st_size == 0)
+  {
+    close(file);
+    return LoadReturnCode::ERROR_INVALID_FILE;
+  }
+  void* mapping = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  // The mapping keeps the file open.
+  close(file);
+  if (mapping == MAP_FAILED)
+    return LoadReturnCode::ERROR_OPENING;
+  madvise(mapping, (size_t)status.st_size, MADV_SEQUENTIAL);
+  mMapping = (const uint8_t*)mapping;
+  mMappingSize = (size_t)status.st_size;
+#endif
+
+  const LoadReturnCode rc = _ReadHeader();
+  if (rc != LoadReturnCode::SUCCESS)
+    Close();
+  return rc;
+}
+
+void dsp::wav::Reader::Close()
+{
+#ifdef _WIN32
+  if (mMapping != nullptr)
+    UnmapViewOfFile(mMapping);
+  if (mMappingHandle != nullptr)
+    CloseHandle(mMappingHandle);
+  if (mFileHandle != nullptr)
+    CloseHandle(mFileHandle);
+  mFileHandle = nullptr;
+  mMappingHandle = nullptr;
+#else
+  if (mMapping != nullptr)
+    munmap((void*)mMapping, mMappingSize);
+#endif
+  mMapping = nullptr;
+  mMappingSize = 0;
+  mData = nullptr;
+  mNumChannels = 0;
+  mNumFrames = 0;
+  mPosition = 0;
+  mReleasedBytes = 0;
+}
+
+dsp::wav::LoadReturnCode dsp::wav::Reader::_ReadHeader()
+{
+  // FYI: https://www.mmsp.ece.mcgill.ca/Documents/AudioFormats/WAVE/WAVE.html, and EBU Tech 3306 for RF64
+  const uint8_t* file = mMapping;
+  if (mMappingSize < 12)
+    return LoadReturnCode::ERROR_INVALID_FILE;
+  const bool rf64 = strncmp((const char*)file, "RF64", 4) == 0;
+  if (!rf64 && strncmp((const char*)file, "RIFF", 4) != 0)
+    return LoadReturnCode::ERROR_NOT_RIFF;
+  if (strncmp((const char*)file + 8, "WAVE", 4) != 0)
+    return LoadReturnCode::ERROR_NOT_WAVE;
+
+  bool haveFormat = false;
+  uint64_t rf64DataSize = 0;
+  size_t offset = 12;
+  while (offset + 8 <= mMappingSize)
+  {
+    const char* id = (const char*)file + offset;
+    const uint8_t* body = file + offset + 8;
+    const uint64_t chunkSize = _ReadLittleEndian(file + offset + 4, 4);
+    const uint64_t available = mMappingSize - offset - 8;
+    if (strncmp(id, "ds64", 4) == 0 && chunkSize >= 16 && available >= 16)
+      rf64DataSize = _ReadLittleEndian(body + 8, 8);
+    else if (strncmp(id, "fmt ", 4) == 0)
+    {
+      if (chunkSize < 16 || available < 16)
+        return LoadReturnCode::ERROR_INVALID_FILE;
+      unsigned int audioFormat = (unsigned int)_ReadLittleEndian(body, 2);
+      mNumChannels = (int)_ReadLittleEndian(body + 2, 2);
+      mSampleRate = (double)_ReadLittleEndian(body + 4, 4);
+      const unsigned int bitsPerSample = (unsigned int)_ReadLittleEndian(body + 14, 2);
+      // Extensible files give the real format as the start of their sub-format GUID.
+      if (audioFormat == 0xfffe)
+      {
+        if (chunkSize < 40 || available < 40)
+          return LoadReturnCode::ERROR_UNSUPPORTED_FORMAT_EXTENSIBLE;
+        audioFormat = (unsigned int)_ReadLittleEndian(body + 24, 2);
+      }
+      switch (audioFormat)
+      {
+        case 1:
+          if (bitsPerSample == 16)
+            mFormat = SampleFormat::PCM16;
+          else if (bitsPerSample == 24)
+            mFormat = SampleFormat::PCM24;
+          else if (bitsPerSample == 32)
+            mFormat = SampleFormat::PCM32;
+          else
+            return LoadReturnCode::ERROR_UNSUPPORTED_BITS_PER_SAMPLE;
+          break;
+        case 3:
+          if (bitsPerSample != 32)
+            return LoadReturnCode::ERROR_UNSUPPORTED_BITS_PER_SAMPLE;
+          mFormat = SampleFormat::FLOAT32;
+          break;
+        case 6: return LoadReturnCode::ERROR_UNSUPPORTED_FORMAT_ALAW;
+        case 7: return LoadReturnCode::ERROR_UNSUPPORTED_FORMAT_MULAW;
+        default: return LoadReturnCode::ERROR_INVALID_FILE;
+      }
+      if (mNumChannels <= 0)
+        return LoadReturnCode::ERROR_INVALID_FILE;
+      haveFormat = true;
+    }
+    else if (strncmp(id, "data", 4) == 0)
+    {
+      if (!haveFormat)
+        return LoadReturnCode::ERROR_MISSING_FMT;
+      uint64_t dataSize = rf64 && chunkSize == 0xffffffff ? rf64DataSize : chunkSize;
+      // Recorders that never finished their header leave the size short or at its maximum; the file knows better.
+      if (dataSize > available || (!rf64 && dataSize == 0))
+        dataSize = available;
+      mData = body;
+      mNumFrames = (int64_t)(dataSize / (mNumChannels * GetBytesPerSample(mFormat)));
+      mPosition = 0;
+      mReleasedBytes = 0;
+      return LoadReturnCode::SUCCESS;
+    }
+    // Chunks are padded to an even size.
+    offset += 8 + chunkSize + (chunkSize & 1);
+  }
+  return haveFormat ? LoadReturnCode::ERROR_INVALID_FILE : LoadReturnCode::ERROR_MISSING_FMT;
+}
+
+const float* dsp::wav::Reader::GetFloatData() const
+{
+  if (mFormat != SampleFormat::FLOAT32 || ((uintptr_t)mData % alignof(float)) != 0)
+    return nullptr;
+  return (const float*)mData;
+}
+
+int64_t dsp::wav::Reader::Read(float* interleaved, const int64_t numFrames)
+{
+  const int64_t n = std::max<int64_t>(0, std::min(numFrames, mNumFrames - mPosition));
+  if (n == 0)
+    return 0;
+  const int bytesPerSample = GetBytesPerSample(mFormat);
+  const size_t numSamples = (size_t)n * mNumChannels;
+  const uint8_t* source = mData + (size_t)mPosition * mNumChannels * bytesPerSample;
+  DecodeSamples(source, mFormat, numSamples, interleaved);
+  mPosition += n;
+
+#ifndef _WIN32
+  // Drop the pages behind, which are only ever read once, so that memory stays flat however long the file is.
+  const size_t consumed = (size_t)(source - mMapping) + numSamples * bytesPerSample;
+  if (consumed > mReleasedBytes + RELEASE_BYTES)
+  {
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t end = consumed / pageSize * pageSize;
+    madvise((void*)(mMapping + mReleasedBytes), end - mReleasedBytes, MADV_DONTNEED);
+    mReleasedBytes = end;
+  }
+#endif
+  return n;
+}
+
+void dsp::wav::Reader::Seek(const int64_t frame)
+{
+  mPosition = std::max<int64_t>(0, std::min(frame, mNumFrames));
+}
+
+dsp::wav::Writer::~Writer()
+{
+  if (mFile != nullptr)
+    Close();
+}
+
+bool dsp::wav::Writer::Open(const char* fileName, const double sampleRate, const int numChannels,
+                            const SampleFormat format, const int64_t expectedFrames)
+{
+  if (mFile != nullptr)
+    Close();
+  if (numChannels <= 0 || sampleRate <= 0.0)
+    return false;
+  mFile = fopen(fileName, "wb");
+  if (mFile == nullptr)
+    return false;
+  setvbuf(mFile, nullptr, _IOFBF, 1 << 20);
+  mSampleRate = sampleRate;
+  mNumChannels = numChannels;
+  mFormat = format;
+  mNumFrames = 0;
+  mFailed = false;
+  // A header for no samples yet; Close() fills in the sizes.
+  std::vector<uint8_t> header = _MakeHeader();
+  mFailed = fwrite(header.data(), 1, header.size(), mFile) != header.size();
+  mReservedFrames = std::max<int64_t>(0, expectedFrames);
+  if (mReservedFrames > 0 && !mFailed)
+    mFailed = !_SetFileSize(mFile, HEADER_BYTES + mReservedFrames * numChannels * GetBytesPerSample(format));
+  return !mFailed;
+}
+
+std::vector<uint8_t> dsp::wav::Writer::_MakeHeader() const
+{
+  const int bytesPerSample = GetBytesPerSample(mFormat);
+  const uint64_t dataBytes = (uint64_t)mNumFrames * mNumChannels * bytesPerSample;
+  const uint64_t riffBytes = HEADER_BYTES - 8 + dataBytes + (dataBytes & 1);
+  const bool rf64 = riffBytes > 0xffffffff;
+  std::vector<uint8_t> header(HEADER_BYTES, 0);
+  uint8_t* h = header.data();
+  memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+  _WriteLittleEndian(h + 4, rf64 ? 0xffffffff : riffBytes, 4);
+  memcpy(h + 8, "WAVE", 4);
+  memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+  _WriteLittleEndian(h + 16, 28, 4);
+  if (rf64)
+  {
+    _WriteLittleEndian(h + 20, riffBytes, 8);
+    _WriteLittleEndian(h + 28, dataBytes, 8);
+    _WriteLittleEndian(h + 36, (uint64_t)mNumFrames, 8);
+    // No table of other big chunks
+  }
+  memcpy(h + 48, "fmt ", 4);
+  _WriteLittleEndian(h + 52, 16, 4);
+  _WriteLittleEndian(h + 56, mFormat == SampleFormat::FLOAT32 ? 3 : 1, 2);
+  _WriteLittleEndian(h + 58, mNumChannels, 2);
+  _WriteLittleEndian(h + 60, (uint64_t)mSampleRate, 4);
+  _WriteLittleEndian(h + 64, (uint64_t)mSampleRate * mNumChannels * bytesPerSample, 4);
+  _WriteLittleEndian(h + 68, mNumChannels * bytesPerSample, 2);
+  _WriteLittleEndian(h + 70, 8 * bytesPerSample, 2);
+  memcpy(h + 72, "data", 4);
+  _WriteLittleEndian(h + 76, rf64 ? 0xffffffff : dataBytes, 4);
+  return header;
+}
+
+bool dsp::wav::Writer::Write(const float* interleaved, const int64_t numFrames)
+{
+  if (mFile == nullptr || mFailed)
+    return false;
+  const int bytesPerSample = GetBytesPerSample(mFormat);
+  const size_t numSamples = (size_t)numFrames * mNumChannels;
+  if (mBuffer.size() < numSamples * bytesPerSample)
+    mBuffer.resize(numSamples * bytesPerSample);
+  uint8_t* destination = mBuffer.data();
+  EncodeSamples(interleaved, mFormat, numSamples, destination);
+  if (fwrite(destination, bytesPerSample, numSamples, mFile) != numSamples)
+    mFailed = true;
+  else
+    mNumFrames += numFrames;
+  return !mFailed;
+}
+
+bool dsp::wav::Writer::Close()
+{
+  if (mFile == nullptr)
+    return false;
+  const uint64_t dataBytes = (uint64_t)mNumFrames * mNumChannels * GetBytesPerSample(mFormat);
+  // Odd-sized chunks get a pad byte.
+  if (!mFailed && (dataBytes & 1) == 1)
+    mFailed = fputc(0, mFile) == EOF;
+  // Trim what was reserved but not written
+  if (!mFailed && mReservedFrames > mNumFrames)
+    mFailed = !_SetFileSize(mFile, HEADER_BYTES + dataBytes + (dataBytes & 1));
+  if (!mFailed)
+  {
+    const std::vector<uint8_t> header = _MakeHeader();
+    mFailed = fseek(mFile, 0, SEEK_SET) != 0 || fwrite(header.data(), 1, header.size(), mFile) != header.size();
+  }
+  if (fclose(mFile) != 0)
+    mFailed = true;
+  mFile = nullptr;
+  return !mFailed;
 }
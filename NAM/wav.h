@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <string>
 #include <vector>
@@ -40,11 +42,120 @@ std::string GetMsgForLoadReturnCode(LoadReturnCode rc);
 // Returns: as per return cases above
 LoadReturnCode Load(const char* fileName, std::vector<float>& audio, double& sampleRate);
 
+// How a WAV file stores its samples
+enum class SampleFormat
+{
+  PCM16 = 0,
+  PCM24,
+  PCM32,
+  FLOAT32
+};
+
+int GetBytesPerSample(const SampleFormat format);
+
+// Converts numSamples samples as a WAV file stores them to float, with full scale at +/-1.
+void DecodeSamples(const uint8_t* source, const SampleFormat format, const size_t numSamples, float* destination);
+// And back, rounding to the nearest step and clipping to full scale for PCM.
+void EncodeSamples(const float* source, const SampleFormat format, const size_t numSamples, uint8_t* destination);
+
+// Streams a WAV (or RF64) file with any number of channels, without reading it all into memory.
+//
+// The file is memory-mapped. 32-bit float data can be used in place through GetFloatData(); every format can be
+// converted to float a block at a time with Read(), which also lets the pages it has passed go, so that a long file
+// is read in constant memory.
+class Reader
+{
+public:
+  Reader() = default;
+  ~Reader();
+  Reader(const Reader&) = delete;
+  Reader& operator=(const Reader&) = delete;
+
+  // Maps the file and reads its header. Returns: as per Load(), except that any number of channels is fine and
+  // "extensible" files of PCM or float are read too. Prints nothing.
+  LoadReturnCode Open(const char* fileName);
+  void Close();
+  bool IsOpen() const { return mData != nullptr; };
+
+  int GetNumChannels() const { return mNumChannels; };
+  double GetSampleRate() const { return mSampleRate; };
+  SampleFormat GetFormat() const { return mFormat; };
+  int64_t GetNumFrames() const { return mNumFrames; };
+
+  // All of the interleaved samples, in place, if they're 32-bit float (and aligned for it); otherwise nullptr.
+  const float* GetFloatData() const;
+  // Converts up to numFrames interleaved frames from the read position to float and moves past them. Returns how many.
+  int64_t Read(float* interleaved, const int64_t numFrames);
+  int64_t GetPosition() const { return mPosition; };
+  void Seek(const int64_t frame);
+
+private:
+  // The whole file
+  const uint8_t* mMapping = nullptr;
+  size_t mMappingSize = 0;
+#ifdef _WIN32
+  void* mFileHandle = nullptr;
+  void* mMappingHandle = nullptr;
+#endif
+  // The samples
+  const uint8_t* mData = nullptr;
+  int mNumChannels = 0;
+  double mSampleRate = 0.0;
+  SampleFormat mFormat = SampleFormat::FLOAT32;
+  int64_t mNumFrames = 0;
+  int64_t mPosition = 0;
+  // Pages before this have been let go
+  size_t mReleasedBytes = 0;
+
+  LoadReturnCode _ReadHeader();
+};
+
+// Writes a WAV file a block at a time.
+//
+// The file is sized for the frames it's expected to hold when it's opened, so that a long render isn't growing it
+// as it goes, and trimmed to what was written when it's closed, which is also when the header gets its sizes. Files
+// whose data outgrows 4 GiB are written as RF64.
+class Writer
+{
+public:
+  Writer() = default;
+  // Closes the file if it's still open
+  ~Writer();
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+
+  // Returns false if the file can't be created.
+  bool Open(const char* fileName, const double sampleRate, const int numChannels, const SampleFormat format,
+            const int64_t expectedFrames = 0);
+  // Appends interleaved frames, converting from float (and clipping, for PCM). Returns false on error.
+  bool Write(const float* interleaved, const int64_t numFrames);
+  // Finishes the header. Returns false if anything failed since Open().
+  bool Close();
+  bool IsOpen() const { return mFile != nullptr; };
+  int64_t GetNumFrames() const { return mNumFrames; };
+
+private:
+  FILE* mFile = nullptr;
+  double mSampleRate = 0.0;
+  int mNumChannels = 0;
+  SampleFormat mFormat = SampleFormat::FLOAT32;
+  int64_t mNumFrames = 0;
+  int64_t mReservedFrames = 0;
+  bool mFailed = false;
+  // Conversion space, so that Write() doesn't allocate after the first call
+  std::vector<uint8_t> mBuffer;
+
+  // For the samples written so far
+  std::vector<uint8_t> _MakeHeader() const;
+};
+
+// Load samples, in any format
+void _LoadSamples(std::ifstream& wavFile, const int chunkSize, const SampleFormat format, std::vector<float>& samples);
 // Load samples, 16-bit
 void _LoadSamples16(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples);
 // Load samples, 24-bit
 void _LoadSamples24(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples);
-// Load samples, 32-bit
+// Load samples, 32-bit float
 void _LoadSamples32(std::ifstream& wavFile, const int chunkSize, std::vector<float>& samples);
 
 // Read in a 24-bit sample and convert it to an int
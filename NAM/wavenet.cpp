@@ -12,67 +12,81 @@ nam::wavenet::_DilatedConv::_DilatedConv(const int in_channels, const int out_ch
   this->set_size_(in_channels, out_channels, kernel_size, bias, dilation);
 }
 
-void nam::wavenet::_Layer::set_weights_(std::vector<float>::iterator& weights)
+void nam::wavenet::_Layer::set_weights_(std::vector<float>::const_iterator& weights)
 {
   this->_conv.set_weights_(weights);
   this->_input_mixin.set_weights_(weights);
   this->_1x1.set_weights_(weights);
 }
 
-void nam::wavenet::_Layer::process_(const Eigen::MatrixXf& input, const Eigen::MatrixXf& condition,
-                                    Eigen::MatrixXf& head_input, Eigen::MatrixXf& output, const long i_start,
-                                    const long j_start)
+void nam::wavenet::_Layer::carve_(Arena& arena, const long max_frames)
 {
-  const long ncols = condition.cols();
+  this->_conv.carve_(arena);
+  this->_input_mixin.carve_(arena);
+  this->_1x1.carve_(arena);
+  arena.carve_state_(this->_z, this->_conv.get_out_channels(), max_frames);
+}
+
+void nam::wavenet::_Layer::process_(const MatrixMap& input, const MatrixMap& condition, MatrixMap& head_input,
+                                    MatrixMap& output, const long i_start, const long j_start, const long num_frames)
+{
+  const long ncols = num_frames;
   const long channels = this->get_channels();
   // Input dilated conv
   this->_conv.process_(input, this->_z, i_start, ncols, 0);
   // Mix-in condition
-  this->_z += this->_input_mixin.process(condition);
+  this->_z.leftCols(ncols) += this->_input_mixin.process(condition.leftCols(ncols));
 
-  this->_activation->apply(this->_z);
+  this->_activation->apply(this->_z.leftCols(ncols));
 
   if (this->_gated)
   {
-    activations::Activation::get_activation("Sigmoid")->apply(this->_z.block(channels, 0, channels, this->_z.cols()));
+    this->_gate_activation->apply(this->_z.block(channels, 0, channels, ncols));
 
-    this->_z.topRows(channels).array() *= this->_z.bottomRows(channels).array();
+    this->_z.topLeftCorner(channels, ncols).array() *= this->_z.block(channels, 0, channels, ncols).array();
     // this->_z.topRows(channels) = this->_z.topRows(channels).cwiseProduct(
     //   this->_z.bottomRows(channels)
     // );
   }
 
-  head_input += this->_z.topRows(channels);
-  output.middleCols(j_start, ncols) = input.middleCols(i_start, ncols) + this->_1x1.process(this->_z.topRows(channels));
+  head_input.leftCols(ncols) += this->_z.topLeftCorner(channels, ncols);
+  output.middleCols(j_start, ncols) =
+    input.middleCols(i_start, ncols) + this->_1x1.process(this->_z.topLeftCorner(channels, ncols));
 }
 
-void nam::wavenet::_Layer::set_num_frames_(const long num_frames)
+long nam::wavenet::_Layer::get_multiply_adds() const
 {
-  if (this->_z.rows() == this->_conv.get_out_channels() && this->_z.cols() == num_frames)
-    return; // Already has correct size
+  const long channels = this->get_channels();
+  const long gating = this->_gated ? channels : 0;
+  // The 1x1's output is added to the input, and the activations to the head input.
+  return this->_conv.get_num_weights() + this->_input_mixin.get_num_weights() + gating
+         + this->_1x1.get_num_weights() + 2 * channels;
+}
 
-  this->_z.resize(this->_conv.get_out_channels(), num_frames);
-  this->_z.setZero();
+long nam::wavenet::_Layer::get_activations() const
+{
+  const long channels = this->get_channels();
+  return this->_conv.get_out_channels() + (this->_gated ? channels : 0);
 }
 
 // LayerArray =================================================================
 
 #define LAYER_ARRAY_BUFFER_SIZE 65536
+// Bounds on the number of frames that WaveNet pushes through all of its layers at once
+#define WAVENET_MIN_TILE_SIZE 32
+#define WAVENET_MAX_TILE_SIZE 4096
 
 nam::wavenet::_LayerArray::_LayerArray(const int input_size, const int condition_size, const int head_size,
                                        const int channels, const int kernel_size, const std::vector<int>& dilations,
-                                       const std::string activation, const bool gated, const bool head_bias)
+                                       const std::string activation, const bool gated, const bool head_bias,
+                                       const activations::Precision precision)
 : _rechannel(input_size, channels, false)
 , _head_rechannel(channels, head_size, head_bias)
 {
   for (size_t i = 0; i < dilations.size(); i++)
-    this->_layers.push_back(_Layer(condition_size, channels, kernel_size, dilations[i], activation, gated));
-  const long receptive_field = this->_get_receptive_field();
+    this->_layers.push_back(_Layer(condition_size, channels, kernel_size, dilations[i], activation, gated, precision));
   for (size_t i = 0; i < dilations.size(); i++)
-  {
-    this->_layer_buffers.push_back(Eigen::MatrixXf(channels, LAYER_ARRAY_BUFFER_SIZE + receptive_field - 1));
-    this->_layer_buffers[i].setZero();
-  }
+    this->_layer_buffers.push_back(MatrixMap(nullptr, 0, 0));
   this->_buffer_start = this->_get_receptive_field() - 1;
 }
 
@@ -89,6 +103,22 @@ long nam::wavenet::_LayerArray::get_receptive_field() const
   return result;
 }
 
+long nam::wavenet::_LayerArray::get_multiply_adds() const
+{
+  long result = this->_rechannel.get_num_weights() + this->_head_rechannel.get_num_weights();
+  for (size_t i = 0; i < this->_layers.size(); i++)
+    result += this->_layers[i].get_multiply_adds();
+  return result;
+}
+
+long nam::wavenet::_LayerArray::get_activations() const
+{
+  long result = 0;
+  for (size_t i = 0; i < this->_layers.size(); i++)
+    result += this->_layers[i].get_activations();
+  return result;
+}
+
 void nam::wavenet::_LayerArray::prepare_for_frames_(const long num_frames)
 {
   // Example:
@@ -102,19 +132,22 @@ void nam::wavenet::_LayerArray::prepare_for_frames_(const long num_frames)
     this->_rewind_buffers_();
 }
 
-void nam::wavenet::_LayerArray::process_(const Eigen::MatrixXf& layer_inputs, const Eigen::MatrixXf& condition,
-                                         Eigen::MatrixXf& head_inputs, Eigen::MatrixXf& layer_outputs,
-                                         Eigen::MatrixXf& head_outputs)
+void nam::wavenet::_LayerArray::process_(const MatrixMap& layer_inputs, const MatrixMap& condition,
+                                         MatrixMap& head_inputs, MatrixMap& layer_outputs, MatrixMap& head_outputs,
+                                         const long start, const long num_frames)
 {
-  this->_layer_buffers[0].middleCols(this->_buffer_start, layer_inputs.cols()) = this->_rechannel.process(layer_inputs);
+  NAM_PROFILE_STAGE(kLayerArray);
+  const long buffer_start = this->_buffer_start + start;
+  this->_layer_buffers[0].middleCols(buffer_start, num_frames) =
+    this->_rechannel.process(layer_inputs.leftCols(num_frames));
   const size_t last_layer = this->_layers.size() - 1;
   for (size_t i = 0; i < this->_layers.size(); i++)
   {
     this->_layers[i].process_(this->_layer_buffers[i], condition, head_inputs,
-                              i == last_layer ? layer_outputs : this->_layer_buffers[i + 1], this->_buffer_start,
-                              i == last_layer ? 0 : this->_buffer_start);
+                              i == last_layer ? layer_outputs : this->_layer_buffers[i + 1], buffer_start,
+                              i == last_layer ? 0 : buffer_start, num_frames);
   }
-  head_outputs = this->_head_rechannel.process(head_inputs);
+  head_outputs.leftCols(num_frames) = this->_head_rechannel.process(head_inputs.leftCols(num_frames));
 }
 
 void nam::wavenet::_LayerArray::set_num_frames_(const long num_frames)
@@ -129,11 +162,9 @@ void nam::wavenet::_LayerArray::set_num_frames_(const long num_frames)
        << "); copy errors could occur!\n";
     throw std::runtime_error(ss.str().c_str());
   }
-  for (size_t i = 0; i < this->_layers.size(); i++)
-    this->_layers[i].set_num_frames_(num_frames);
 }
 
-void nam::wavenet::_LayerArray::set_weights_(std::vector<float>::iterator& weights)
+void nam::wavenet::_LayerArray::set_weights_(std::vector<float>::const_iterator& weights)
 {
   this->_rechannel.set_weights_(weights);
   for (size_t i = 0; i < this->_layers.size(); i++)
@@ -141,6 +172,17 @@ void nam::wavenet::_LayerArray::set_weights_(std::vector<float>::iterator& weigh
   this->_head_rechannel.set_weights_(weights);
 }
 
+void nam::wavenet::_LayerArray::carve_(Arena& arena, const long max_frames)
+{
+  this->_rechannel.carve_(arena);
+  for (size_t i = 0; i < this->_layers.size(); i++)
+    this->_layers[i].carve_(arena, max_frames);
+  this->_head_rechannel.carve_(arena);
+  const long buffer_size = LAYER_ARRAY_BUFFER_SIZE + this->_get_receptive_field() - 1;
+  for (size_t i = 0; i < this->_layer_buffers.size(); i++)
+    arena.carve_state_(this->_layer_buffers[i], this->_layers[i].get_channels(), buffer_size);
+}
+
 long nam::wavenet::_LayerArray::_get_channels() const
 {
   return this->_layers.size() > 0 ? this->_layers[0].get_channels() : 0;
@@ -159,6 +201,7 @@ void nam::wavenet::_LayerArray::_rewind_buffers_()
 // Consider wrapping instead...
 // Can make this smaller--largest dilation, not receptive field!
 {
+  NAM_PROFILE_STAGE(kRewindBuffers);
   const long start = this->_get_receptive_field() - 1;
   for (size_t i = 0; i < this->_layer_buffers.size(); i++)
   {
@@ -170,10 +213,11 @@ void nam::wavenet::_LayerArray::_rewind_buffers_()
 
 // Head =======================================================================
 
-nam::wavenet::_Head::_Head(const int input_size, const int num_layers, const int channels, const std::string activation)
+nam::wavenet::_Head::_Head(const int input_size, const int num_layers, const int channels, const std::string activation,
+                           const activations::Precision precision)
 : _channels(channels)
 , _head(num_layers > 0 ? channels : input_size, 1, true)
-, _activation(activations::Activation::get_activation(activation))
+, _activation(activations::Activation::get_activation(activation, precision))
 {
   assert(num_layers > 0);
   int dx = input_size;
@@ -186,7 +230,7 @@ nam::wavenet::_Head::_Head(const int input_size, const int num_layers, const int
   }
 }
 
-void nam::wavenet::_Head::set_weights_(std::vector<float>::iterator& weights)
+void nam::wavenet::_Head::set_weights_(std::vector<float>::const_iterator& weights)
 {
   for (size_t i = 0; i < this->_layers.size(); i++)
     this->_layers[i].set_weights_(weights);
@@ -231,12 +275,16 @@ void nam::wavenet::_Head::_apply_activation_(Eigen::MatrixXf& x)
 // WaveNet ====================================================================
 
 nam::wavenet::WaveNet::WaveNet(const std::vector<nam::wavenet::LayerArrayParams>& layer_array_params,
-                               const float head_scale, const bool with_head, std::vector<float> weights,
-                               const double expected_sample_rate)
+                               const float head_scale, const bool with_head, const std::vector<float>& weights,
+                               const double expected_sample_rate, const activations::Precision precision)
 : DSP(expected_sample_rate)
 , _num_frames(0)
+, _tile_size(0)
+, _condition(nullptr, 0, 0)
 , _head_scale(head_scale)
+, _head_output(nullptr, 1, 0) // Mono output!
 {
+  this->mActivationPrecision = precision;
   if (with_head)
     throw std::runtime_error("Head not implemented!");
   for (size_t i = 0; i < layer_array_params.size(); i++)
@@ -244,10 +292,10 @@ nam::wavenet::WaveNet::WaveNet(const std::vector<nam::wavenet::LayerArrayParams>
     this->_layer_arrays.push_back(nam::wavenet::_LayerArray(
       layer_array_params[i].input_size, layer_array_params[i].condition_size, layer_array_params[i].head_size,
       layer_array_params[i].channels, layer_array_params[i].kernel_size, layer_array_params[i].dilations,
-      layer_array_params[i].activation, layer_array_params[i].gated, layer_array_params[i].head_bias));
-    this->_layer_array_outputs.push_back(Eigen::MatrixXf(layer_array_params[i].channels, 0));
+      layer_array_params[i].activation, layer_array_params[i].gated, layer_array_params[i].head_bias, precision));
+    this->_layer_array_outputs.push_back(MatrixMap(nullptr, layer_array_params[i].channels, 0));
     if (i == 0)
-      this->_head_arrays.push_back(Eigen::MatrixXf(layer_array_params[i].channels, 0));
+      this->_head_arrays.push_back(MatrixMap(nullptr, layer_array_params[i].channels, 0));
     if (i > 0)
       if (layer_array_params[i].channels != layer_array_params[i - 1].head_size)
       {
@@ -256,14 +304,24 @@ nam::wavenet::WaveNet::WaveNet(const std::vector<nam::wavenet::LayerArrayParams>
            << ") doesn't match head_size of preceding layer (" << layer_array_params[i - 1].head_size << "!\n";
         throw std::runtime_error(ss.str().c_str());
       }
-    this->_head_arrays.push_back(Eigen::MatrixXf(layer_array_params[i].head_size, 0));
+    this->_head_arrays.push_back(MatrixMap(nullptr, layer_array_params[i].head_size, 0));
   }
-  this->_head_output.resize(1, 0); // Mono output!
+  this->_tile_size = this->_get_default_tile_size();
+  this->_layout_arena_();
   this->set_weights_(weights);
 
   _prewarm_samples = 1;
   for (size_t i = 0; i < this->_layer_arrays.size(); i++)
     _prewarm_samples += this->_layer_arrays[i].get_receptive_field();
+
+  for (size_t i = 0; i < this->_layer_arrays.size(); i++)
+  {
+    this->mCostEstimate.multiply_adds_per_sample += this->_layer_arrays[i].get_multiply_adds();
+    this->mCostEstimate.activations_per_sample += this->_layer_arrays[i].get_activations();
+  }
+  // The head scale
+  this->mCostEstimate.multiply_adds_per_sample += 1;
+  this->mCostEstimate.receptive_field = _prewarm_samples;
 }
 
 void nam::wavenet::WaveNet::finalize_(const int num_frames)
@@ -272,9 +330,9 @@ void nam::wavenet::WaveNet::finalize_(const int num_frames)
   this->_advance_buffers_(num_frames);
 }
 
-void nam::wavenet::WaveNet::set_weights_(std::vector<float>& weights)
+void nam::wavenet::WaveNet::set_weights_(const std::vector<float>& weights)
 {
-  std::vector<float>::iterator it = weights.begin();
+  std::vector<float>::const_iterator it = weights.begin();
   for (size_t i = 0; i < this->_layer_arrays.size(); i++)
     this->_layer_arrays[i].set_weights_(it);
   // this->_head.set_params_(it);
@@ -293,6 +351,18 @@ void nam::wavenet::WaveNet::set_weights_(std::vector<float>& weights)
   }
 }
 
+void nam::wavenet::WaveNet::_carve_(Arena& arena)
+{
+  for (size_t i = 0; i < this->_layer_arrays.size(); i++)
+    this->_layer_arrays[i].carve_(arena, this->_tile_size);
+  arena.carve_state_(this->_condition, this->_get_condition_dim(), this->_tile_size);
+  for (size_t i = 0; i < this->_head_arrays.size(); i++)
+    arena.carve_state_(this->_head_arrays[i], this->_head_arrays[i].rows(), this->_tile_size);
+  for (size_t i = 0; i < this->_layer_array_outputs.size(); i++)
+    arena.carve_state_(this->_layer_array_outputs[i], this->_layer_array_outputs[i].rows(), this->_tile_size);
+  arena.carve_state_(this->_head_output, this->_head_output.rows(), this->_tile_size);
+}
+
 void nam::wavenet::WaveNet::_advance_buffers_(const int num_frames)
 {
   for (size_t i = 0; i < this->_layer_arrays.size(); i++)
@@ -315,17 +385,34 @@ void nam::wavenet::WaveNet::_set_condition_array(NAM_SAMPLE* input, const int nu
 
 void nam::wavenet::WaveNet::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames)
 {
+  this->_prewarm_if_pending_();
+  const denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);
+  NAM_PROFILE_MODEL(this->mProfiler);
   this->_set_num_frames_(num_frames);
   this->_prepare_for_frames_(num_frames);
+
+  // Push one time tile at a time through all of the layer arrays. Each layer's dilated lookback reaches into columns
+  // that were written by the preceding tiles (or previous buffers), so the result doesn't depend on the tile size.
+  for (long start = 0; start < num_frames; start += this->_tile_size)
+  {
+    const long tile_frames = std::min(this->_tile_size, num_frames - start);
+    this->_process_tile_(input + start, output + start, start, tile_frames);
+  }
+}
+
+void nam::wavenet::WaveNet::_process_tile_(NAM_SAMPLE* input, NAM_SAMPLE* output, const long start,
+                                           const long num_frames)
+{
   this->_set_condition_array(input, num_frames);
 
   // Main layer arrays:
   // Layer-to-layer
   // Sum on head output
-  this->_head_arrays[0].setZero();
+  this->_head_arrays[0].leftCols(num_frames).setZero();
   for (size_t i = 0; i < this->_layer_arrays.size(); i++)
     this->_layer_arrays[i].process_(i == 0 ? this->_condition : this->_layer_array_outputs[i - 1], this->_condition,
-                                    this->_head_arrays[i], this->_layer_array_outputs[i], this->_head_arrays[i + 1]);
+                                    this->_head_arrays[i], this->_layer_array_outputs[i], this->_head_arrays[i + 1],
+                                    start, num_frames);
   // this->_head.process_(
   //   this->_head_input,
   //   this->_head_output
@@ -343,19 +430,35 @@ void nam::wavenet::WaveNet::process(NAM_SAMPLE* input, NAM_SAMPLE* output, const
   }
 }
 
+void nam::wavenet::WaveNet::set_tile_size_(const long tile_size)
+{
+  if (tile_size < 1)
+    throw std::runtime_error("WaveNet tile size must be positive");
+  this->_tile_size = tile_size;
+  // The short arrays hold one tile.
+  this->_layout_arena_();
+}
+
+long nam::wavenet::WaveNet::_get_default_tile_size() const
+{
+  // Per layer, a tile touches its input, the dilated conv output (up to twice the channels if gated) and its output;
+  // budget for about four times the widest layer array's channels per frame.
+  const long l2_budget_bytes = 512 * 1024;
+  long channels = 1;
+  for (size_t i = 0; i < this->_layer_array_outputs.size(); i++)
+    channels = std::max(channels, (long)this->_layer_array_outputs[i].rows());
+  const long bytes_per_frame = 4 * channels * (long)sizeof(float);
+  long tile_size = WAVENET_MIN_TILE_SIZE;
+  while (2 * tile_size * bytes_per_frame <= l2_budget_bytes && 2 * tile_size <= WAVENET_MAX_TILE_SIZE)
+    tile_size *= 2;
+  return tile_size;
+}
+
 void nam::wavenet::WaveNet::_set_num_frames_(const long num_frames)
 {
   if (num_frames == this->_num_frames)
     return;
 
-  this->_condition.resize(this->_get_condition_dim(), num_frames);
-  for (size_t i = 0; i < this->_head_arrays.size(); i++)
-    this->_head_arrays[i].resize(this->_head_arrays[i].rows(), num_frames);
-  for (size_t i = 0; i < this->_layer_array_outputs.size(); i++)
-    this->_layer_array_outputs[i].resize(this->_layer_array_outputs[i].rows(), num_frames);
-  this->_head_output.resize(this->_head_output.rows(), num_frames);
-  this->_head_output.setZero();
-
   for (size_t i = 0; i < this->_layer_arrays.size(); i++)
     this->_layer_arrays[i].set_num_frames_(num_frames);
   // this->_head.set_num_frames_(num_frames);
@@ -24,21 +24,30 @@ class _Layer
 {
 public:
   _Layer(const int condition_size, const int channels, const int kernel_size, const int dilation,
-         const std::string activation, const bool gated)
+         const std::string activation, const bool gated, const activations::Precision precision)
   : _conv(channels, gated ? 2 * channels : channels, kernel_size, true, dilation)
   , _input_mixin(condition_size, gated ? 2 * channels : channels, false)
   , _1x1(channels, channels, true)
-  , _activation(activations::Activation::get_activation(activation))
+  , _z(nullptr, 0, 0)
+  , _activation(activations::Activation::get_activation(activation, precision))
+  , _gate_activation(activations::Activation::get_activation("Sigmoid", precision))
   , _gated(gated){};
-  void set_weights_(std::vector<float>::iterator& weights);
+  void set_weights_(std::vector<float>::const_iterator& weights);
+  // The internal state holds up to `max_frames` frames.
+  void carve_(Arena& arena, const long max_frames);
   // :param `input`: from previous layer
   // :param `output`: to next layer
-  void process_(const Eigen::MatrixXf& input, const Eigen::MatrixXf& condition, Eigen::MatrixXf& head_input,
-                Eigen::MatrixXf& output, const long i_start, const long j_start);
-  void set_num_frames_(const long num_frames);
+  // Processes `num_frames` columns, reading `input` from `i_start` and writing `output` from `j_start`. `condition`
+  // and `head_input` are read from/accumulated on starting at their first column.
+  void process_(const MatrixMap& input, const MatrixMap& condition, MatrixMap& head_input, MatrixMap& output,
+                const long i_start, const long j_start, const long num_frames);
   long get_channels() const { return this->_conv.get_in_channels(); };
   int get_dilation() const { return this->_conv.get_dilation(); };
   long get_kernel_size() const { return this->_conv.get_kernel_size(); };
+  // Per frame: the convolutions, plus the gating, residual and head sums
+  long get_multiply_adds() const;
+  // Per frame: the activation over all of the convolution's outputs, then (if gated) the sigmoid over the gates
+  long get_activations() const;
 
 private:
   // The dilated convolution at the front of the block
@@ -48,9 +57,11 @@ private:
   // The post-activation 1x1 convolution
   Conv1x1 _1x1;
   // The internal state
-  Eigen::MatrixXf _z;
+  MatrixMap _z;
 
   activations::Activation* _activation;
+  // Only used if gated
+  activations::Activation* _gate_activation;
   const bool _gated;
 };
 
@@ -90,7 +101,7 @@ class _LayerArray
 public:
   _LayerArray(const int input_size, const int condition_size, const int head_size, const int channels,
               const int kernel_size, const std::vector<int>& dilations, const std::string activation, const bool gated,
-              const bool head_bias);
+              const bool head_bias, const activations::Precision precision);
 
   void advance_buffers_(const int num_frames);
 
@@ -101,18 +112,26 @@ public:
   void prepare_for_frames_(const long num_frames);
 
   // All arrays are "short".
-  void process_(const Eigen::MatrixXf& layer_inputs, // Short
-                const Eigen::MatrixXf& condition, // Short
-                Eigen::MatrixXf& layer_outputs, // Short
-                Eigen::MatrixXf& head_inputs, // Sum up on this.
-                Eigen::MatrixXf& head_outputs // post head-rechannel
-  );
+  // `start` is the offset (in frames) of this tile from the start of the buffer that's being processed; only the
+  // first `num_frames` columns of the short arrays are used.
+  void process_(const MatrixMap& layer_inputs, // Short
+                const MatrixMap& condition, // Short
+                MatrixMap& layer_outputs, // Short
+                MatrixMap& head_inputs, // Sum up on this.
+                MatrixMap& head_outputs, // post head-rechannel
+                const long start, const long num_frames);
+  // Check that a buffer of `num_frames` fits.
   void set_num_frames_(const long num_frames);
-  void set_weights_(std::vector<float>::iterator& it);
+  void set_weights_(std::vector<float>::const_iterator& it);
+  // The short arrays handed to process_() hold up to `max_frames` frames.
+  void carve_(Arena& arena, const long max_frames);
 
   // "Zero-indexed" receptive field.
   // E.g. a 1x1 convolution has a z.i.r.f. of zero.
   long get_receptive_field() const;
+  // Per frame, over the rechannels and every layer
+  long get_multiply_adds() const;
+  long get_activations() const;
 
 private:
   long _buffer_start;
@@ -122,7 +141,7 @@ private:
   // Buffers in between layers.
   // buffer [i] is the input to layer [i].
   // the last layer outputs to a short array provided by outside.
-  std::vector<Eigen::MatrixXf> _layer_buffers;
+  std::vector<MatrixMap> _layer_buffers;
   // The layer objects
   std::vector<_Layer> _layers;
 
@@ -143,8 +162,9 @@ private:
 class _Head
 {
 public:
-  _Head(const int input_size, const int num_layers, const int channels, const std::string activation);
-  void set_weights_(std::vector<float>::iterator& weights);
+  _Head(const int input_size, const int num_layers, const int channels, const std::string activation,
+        const activations::Precision precision);
+  void set_weights_(std::vector<float>::const_iterator& weights);
   // NOTE: the head transforms the provided input by applying a nonlinearity
   // to it in-place!
   void process_(Eigen::MatrixXf& inputs, Eigen::MatrixXf& outputs);
@@ -169,34 +189,48 @@ class WaveNet : public DSP
 {
 public:
   WaveNet(const std::vector<LayerArrayParams>& layer_array_params, const float head_scale, const bool with_head,
-          std::vector<float> weights, const double expected_sample_rate = -1.0);
+          const std::vector<float>& weights, const double expected_sample_rate = -1.0,
+          const activations::Precision precision = activations::Activation::get_default_precision());
   ~WaveNet() = default;
 
   void finalize_(const int num_frames) override;
-  void set_weights_(std::vector<float>& weights);
+  void set_weights_(const std::vector<float>& weights);
+  // Buffers larger than the tile size are processed one time tile at a time through all of the layers so that the
+  // arrays passed between layers stay in cache.
+  long get_tile_size() const { return this->_tile_size; };
+  // Changing the tile size re-lays out the arena and so resets the model's state; prewarm() again afterwards.
+  void set_tile_size_(const long tile_size);
 
 private:
   long _num_frames;
+  // Number of frames pushed through all of the layers at once.
+  long _tile_size;
   std::vector<_LayerArray> _layer_arrays;
   // Their outputs
-  std::vector<Eigen::MatrixXf> _layer_array_outputs;
+  std::vector<MatrixMap> _layer_array_outputs;
   // Head _head;
 
   // Element-wise arrays:
-  Eigen::MatrixXf _condition;
+  // These hold one tile.
+  MatrixMap _condition;
   // One more than total layer arrays
-  std::vector<Eigen::MatrixXf> _head_arrays;
+  std::vector<MatrixMap> _head_arrays;
   float _head_scale;
-  Eigen::MatrixXf _head_output;
+  MatrixMap _head_output;
 
   void _advance_buffers_(const int num_frames);
+  void _carve_(Arena& arena) override;
   void _prepare_for_frames_(const long num_frames);
   void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override;
+  // Process one time tile of `num_frames` starting `start` frames into the current buffer.
+  void _process_tile_(NAM_SAMPLE* input, NAM_SAMPLE* output, const long start, const long num_frames);
 
+  // A tile size whose per-layer working set fits comfortably in L2.
+  long _get_default_tile_size() const;
   virtual int _get_condition_dim() const { return 1; };
   // Fill in the "condition" array that's fed into the various parts of the net.
   virtual void _set_condition_array(NAM_SAMPLE* input, const int num_frames);
-  // Ensure that all buffer arrays are the right size for this num_frames
+  // Ensure that the buffer arrays can take this num_frames
   void _set_num_frames_(const long num_frames);
 };
 }; // namespace wavenet
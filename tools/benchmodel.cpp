@@ -4,10 +4,28 @@
   #include <malloc.h> // For other platforms
 #endif
 
+#ifdef __linux__
+  #include <sched.h>
+#endif
+
+#include <algorithm>
 #include <iostream>
+#include <iomanip>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
 
+#include "json.hpp"
 #include "NAM/dsp.h"
+#include "NAM/plan.h"
+#include "NAM/resampler.h"
+#include "NAM/wav.h"
+#include "perf_counters.h"
 
 using std::chrono::duration;
 using std::chrono::duration_cast;
@@ -15,62 +33,478 @@ using std::chrono::high_resolution_clock;
 using std::chrono::milliseconds;
 
 #define AUDIO_BUFFER_SIZE 64
+#define MAX_BLOCK_SIZE 8192
 
-double buffer[AUDIO_BUFFER_SIZE];
+double buffer[MAX_BLOCK_SIZE];
 
-int main(int argc, char* argv[])
+struct BenchmarkOptions
 {
-  if (argc > 1)
-  {
-    const char* modelPath = argv[1];
+  std::string modelPath;
+  // Audio that's fed to the model (looped as needed). Empty means a synthetic signal.
+  std::string inputPath;
+  std::vector<int> blockSizes;
+  // How much audio to time for each block size, in seconds
+  double seconds = 5.0;
+  // How much audio to run through the model before timing, in seconds
+  double warmupSeconds = 0.5;
+  // CPU to pin to; -1 means whichever one we start on.
+  int cpu = -1;
+  // Where to write the JSON report ("-" is stdout); empty means don't.
+  std::string jsonPath;
+  bool denormalTail = false;
+  // Print the per-stage profile for each block size (needs a NAM_ENABLE_PROFILER build)
+  bool profile = false;
+  // Run the model as an execution plan (plan.h) instead of through its own class
+  bool plan = false;
+  nam::activations::Precision precision = nam::activations::Precision::kFast;
+  // Run at this rate, converting to and from the model's; 0 means at the model's rate.
+  double sampleRate = 0.0;
+};
 
-    std::cout << "Loading model " << modelPath << "\n";
+struct BlockSizeResult
+{
+  int blockSize;
+  long numCalls;
+  // Wall time per call, in microseconds, sorted
+  std::vector<double> latencies;
+  double totalSeconds;
+  double audioSeconds;
+  // Hardware counters over the timed calls (including the little bit of harness around each one)
+  PerfCounters::Readings counters;
+};
 
-    // Turn on fast tanh approximation
-    nam::activations::Activation::enable_fast_tanh();
+void printUsage()
+{
+  std::cerr << "Usage: benchmodel <model_path> [--input <wav>] [--block-sizes <n,n,...>] [--seconds <s>]\n"
+            << "                  [--warmup <s>] [--cpu <n>] [--json <path|->] [--denormal-tail] [--profile]\n"
+            << "                  [--plan]\n"
+            << "                  [--precision <accurate|fast|lut|hard-clip>] [--sample-rate <hz>]\n";
+}
 
-    std::unique_ptr<nam::DSP> model;
+bool parseArgs(int argc, char* argv[], BenchmarkOptions& options)
+{
+  if (argc < 2)
+    return false;
+  options.modelPath = argv[1];
+  for (int i = 2; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    // Values that don't parse (numbers, precisions) throw.
+    try
+    {
+      if (arg == "--denormal-tail")
+        options.denormalTail = true;
+      else if (arg == "--profile")
+        options.profile = true;
+      else if (arg == "--plan")
+        options.plan = true;
+      else if (!hasValue)
+        return false;
+      else if (arg == "--input")
+        options.inputPath = argv[++i];
+      else if (arg == "--seconds")
+        options.seconds = std::stod(argv[++i]);
+      else if (arg == "--warmup")
+        options.warmupSeconds = std::stod(argv[++i]);
+      else if (arg == "--precision")
+        options.precision = nam::activations::get_precision(argv[++i]);
+      else if (arg == "--sample-rate")
+        options.sampleRate = std::stod(argv[++i]);
+      else if (arg == "--cpu")
+        options.cpu = std::stoi(argv[++i]);
+      else if (arg == "--json")
+        options.jsonPath = argv[++i];
+      else if (arg == "--block-sizes")
+      {
+        std::stringstream ss(argv[++i]);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+          const int blockSize = std::stoi(item);
+          if (blockSize < 1 || blockSize > MAX_BLOCK_SIZE)
+            return false;
+          options.blockSizes.push_back(blockSize);
+        }
+      }
+      else
+        return false;
+    }
+    catch (const std::exception&)
+    {
+      std::cerr << "Invalid value for " << arg << ": " << argv[i] << "\n";
+      return false;
+    }
+  }
+  if (options.blockSizes.empty())
+    for (int blockSize = 1; blockSize <= MAX_BLOCK_SIZE; blockSize *= 2)
+      options.blockSizes.push_back(blockSize);
+  return true;
+}
 
-    model.reset();
-    model = std::move(nam::get_dsp(modelPath));
+// Pin this thread to `cpu` (or the CPU it's on now, if -1). Returns the CPU pinned to, or -1 if we couldn't.
+int pinToCpu(const int cpu)
+{
+#ifdef __linux__
+  const int target = cpu >= 0 ? cpu : sched_getcpu();
+  if (target < 0)
+    return -1;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(target, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0 ? target : -1;
+#else
+  return -1;
+#endif
+}
 
-    if (model == nullptr)
-    {
-      std::cerr << "Failed to load model\n";
+// Guitar-ish stand-in when no input file is given: decaying plucked partials, one note every half second.
+std::vector<NAM_SAMPLE> makeSyntheticInput(const double sampleRate)
+{
+  const size_t numSamples = (size_t)(4.0 * sampleRate);
+  const double noteSeconds = 0.5;
+  const double frequencies[] = {82.41, 110.0, 146.83, 196.0, 246.94, 329.63, 196.0, 110.0};
+  std::vector<NAM_SAMPLE> audio(numSamples);
+  for (size_t i = 0; i < numSamples; i++)
+  {
+    const double t = (double)i / sampleRate;
+    const int note = (int)(t / noteSeconds);
+    const double tNote = t - note * noteSeconds;
+    const double f = frequencies[note % 8];
+    double x = 0.0;
+    for (int harmonic = 1; harmonic <= 6; harmonic++)
+      x += std::sin(2.0 * M_PI * f * harmonic * tNote) / harmonic;
+    audio[i] = (NAM_SAMPLE)(0.3 * x * std::exp(-6.0 * tNote));
+  }
+  return audio;
+}
 
-      exit(1);
+BlockSizeResult benchmarkBlockSize(nam::DSP& model, const std::vector<NAM_SAMPLE>& input, const double sampleRate,
+                                   const int blockSize, const BenchmarkOptions& options, PerfCounters& counters)
+{
+  const long warmupCalls = std::max(1L, (long)(options.warmupSeconds * sampleRate / blockSize));
+  const long numCalls = std::max(1L, (long)(options.seconds * sampleRate / blockSize));
+  size_t position = 0;
+  std::vector<NAM_SAMPLE> block(blockSize);
+  auto nextBlock = [&]() {
+    for (int i = 0; i < blockSize; i++)
+    {
+      block[i] = input[position];
+      position = (position + 1) % input.size();
     }
+  };
+
+  for (long i = 0; i < warmupCalls; i++)
+  {
+    nextBlock();
+    model.process(block.data(), buffer, blockSize);
+    model.finalize_(blockSize);
+  }
 
+  BlockSizeResult result;
+  result.blockSize = blockSize;
+  result.numCalls = numCalls;
+  result.latencies.resize(numCalls);
+  model.ResetProfile();
+  counters.Start();
+  for (long i = 0; i < numCalls; i++)
+  {
+    nextBlock();
     auto t1 = high_resolution_clock::now();
+    model.process(block.data(), buffer, blockSize);
+    model.finalize_(blockSize);
+    auto t2 = high_resolution_clock::now();
+    result.latencies[i] = duration<double, std::micro>(t2 - t1).count();
+  }
+  result.counters = counters.Stop();
+  result.totalSeconds = 0.0;
+  for (const double latency : result.latencies)
+    result.totalSeconds += latency * 1.0e-6;
+  result.audioSeconds = (double)numCalls * blockSize / sampleRate;
+  std::sort(result.latencies.begin(), result.latencies.end());
+  return result;
+}
+
+// Nearest-rank percentile, `q` in (0, 1]; latencies must be sorted.
+double percentile(const std::vector<double>& latencies, const double q)
+{
+  const long rank = (long)std::ceil(q * latencies.size());
+  return latencies[std::clamp(rank - 1, 0L, (long)latencies.size() - 1)];
+}
+
+// Run the model over a noise burst that decays exponentially deep into the subnormal range, as a note's tail does.
+// Returns the wall time in milliseconds.
+double benchmarkDecayingTail(nam::DSP& model, const bool flushDenormals)
+{
+  model.SetFlushDenormals(flushDenormals);
+
+  const size_t numBuffers = (48000 / AUDIO_BUFFER_SIZE) * 2;
+  const size_t numSamples = numBuffers * AUDIO_BUFFER_SIZE;
+  // Decay from 1e-30 to 1e-45 over the run so that most of it is below FLT_MIN (1.2e-38)
+  const double decay = std::pow(10.0, -15.0 / numSamples);
+  std::vector<NAM_SAMPLE> tail(numSamples);
+  double gain = 1.0e-30;
+  unsigned int seed = 1;
+  for (size_t i = 0; i < numSamples; i++)
+  {
+    seed = seed * 1664525u + 1013904223u;
+    const double noise = (double)(seed >> 8) / (double)(1u << 24) * 2.0 - 1.0;
+    tail[i] = (NAM_SAMPLE)(gain * noise);
+    gain *= decay;
+  }
+
+  // Only the model's own setting decides, even if flushing is already on for the whole process (as it is in -Ofast
+  // builds).
+  const nam::denormal::ScopedAllowDenormals allowDenormals;
+  auto t1 = high_resolution_clock::now();
+  for (size_t i = 0; i < numBuffers; i++)
+  {
+    NAM_SAMPLE* block = tail.data() + i * AUDIO_BUFFER_SIZE;
+    model.process(block, buffer, AUDIO_BUFFER_SIZE);
+    model.finalize_(AUDIO_BUFFER_SIZE);
+  }
+  auto t2 = high_resolution_clock::now();
+  duration<double, std::milli> ms_double = t2 - t1;
+  return ms_double.count();
+}
+
+int main(int argc, char* argv[])
+{
+  BenchmarkOptions options;
+  if (!parseArgs(argc, argv, options))
+  {
+    printUsage();
+    exit(1);
+  }
+  // Keep stdout clean for the JSON report
+  std::ostream& log = options.jsonPath == "-" ? std::cerr : std::cout;
+
+  log << "Loading model " << options.modelPath << " with " << nam::activations::get_precision_name(options.precision)
+      << " activations" << (options.plan ? " as a plan" : "") << "\n";
 
-    size_t bufferSize = 64;
-    size_t numBuffers = (48000 / 64) * 2;
+  std::unique_ptr<nam::DSP> model;
 
-    std::cout << "Running benchmark\n";
+  model.reset();
+  if (options.plan)
+  {
+    nam::dspData data;
+    nam::get_dsp(options.modelPath, data);
+    model = nam::plan::get_dsp(data, options.precision);
+  }
+  else
+    model = std::move(nam::get_dsp(options.modelPath, options.precision));
 
-    for (size_t i = 0; i < numBuffers; i++)
+  if (model == nullptr)
+  {
+    std::cerr << "Failed to load model\n";
+
+    exit(1);
+  }
+
+  double sampleRate = model->GetExpectedSampleRate() > 0.0 ? model->GetExpectedSampleRate() : 48000.0;
+  // The same conversions around a model that does nothing, to time them on their own
+  std::unique_ptr<nam::ResamplingDSP> resamplingOnly;
+  if (options.sampleRate > 0.0)
+  {
+    auto resampling = std::make_unique<nam::ResamplingDSP>(std::move(model), options.sampleRate);
+    const double modelSampleRate = resampling->GetModelSampleRate();
+    sampleRate = options.sampleRate;
+    if (resampling->IsResampling())
+    {
+      log << "Resampling from " << sampleRate << " Hz to the model's " << modelSampleRate
+          << " Hz and back (latency " << resampling->GetLatency() << " samples)\n";
+      resamplingOnly = std::make_unique<nam::ResamplingDSP>(std::make_unique<nam::DSP>(modelSampleRate), sampleRate);
+    }
+    model = std::move(resampling);
+  }
+  std::vector<NAM_SAMPLE> input;
+  if (!options.inputPath.empty())
+  {
+    std::vector<float> audio;
+    double fileSampleRate;
+    const auto rc = dsp::wav::Load(options.inputPath.c_str(), audio, fileSampleRate);
+    if (rc != dsp::wav::LoadReturnCode::SUCCESS || audio.empty())
     {
-      model->process(buffer, buffer, AUDIO_BUFFER_SIZE);
-      model->finalize_(AUDIO_BUFFER_SIZE);
+      std::cerr << "Failed to load input " << options.inputPath << ": " << dsp::wav::GetMsgForLoadReturnCode(rc)
+                << "\n";
+      exit(1);
     }
+    input.assign(audio.begin(), audio.end());
+  }
+  else
+  {
+    log << "No --input given; using a synthetic plucked signal\n";
+    input = makeSyntheticInput(sampleRate);
+  }
 
-    std::cout << "Finished\n";
+  const int cpu = pinToCpu(options.cpu);
+  if (cpu >= 0)
+    log << "Pinned to CPU " << cpu << "\n";
+  else
+    log << "Not pinned to a CPU\n";
 
-    auto t2 = high_resolution_clock::now();
+  // Opened after pinning, on this thread, so that they count the model.
+  PerfCounters counters;
+  if (!counters.IsAnyAvailable())
+    log << "Hardware counters unavailable (" << counters.GetError() << "); reporting wall time only\n";
+  else if (!counters.GetError().empty())
+    log << "Some hardware counters unavailable (" << counters.GetError() << ")\n";
+  // Per-sample hardware counter table, printed at the end
+  std::stringstream counterTable;
+  // Same for the resampling on its own
+  std::stringstream resamplingTable;
 
-    /* Getting number of milliseconds as an integer. */
-    auto ms_int = duration_cast<milliseconds>(t2 - t1);
+  log << "Running benchmark\n";
+  log << std::setw(10) << "block" << std::setw(10) << "RTF" << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+      << std::setw(12) << "p99.9 us" << std::setw(12) << "max us" << std::setw(12) << "budget us" << "\n";
 
-    /* Getting number of milliseconds as a double. */
-    duration<double, std::milli> ms_double = t2 - t1;
+  nlohmann::json report;
+  report["model"] = options.modelPath;
+  report["input"] = options.inputPath.empty() ? "synthetic" : options.inputPath;
+  report["sample_rate"] = sampleRate;
+  report["cpu"] = cpu;
+  report["precision"] = nam::activations::get_precision_name(options.precision);
+  report["model_sample_rate"] = resamplingOnly ? resamplingOnly->GetModelSampleRate() : sampleRate;
+  report["seconds_per_block_size"] = options.seconds;
+  report["warmup_seconds"] = options.warmupSeconds;
+  report["results"] = nlohmann::json::array();
 
-    std::cout << ms_int.count() << "ms\n";
-    std::cout << ms_double.count() << "ms\n";
+  for (const int blockSize : options.blockSizes)
+  {
+    const BlockSizeResult result = benchmarkBlockSize(*model, input, sampleRate, blockSize, options, counters);
+    // Real-time factor: wall time over audio time. Below 1 keeps up with real time.
+    const double rtf = result.totalSeconds / result.audioSeconds;
+    const double budget = 1.0e6 * blockSize / sampleRate;
+    const double p50 = percentile(result.latencies, 0.5);
+    const double p99 = percentile(result.latencies, 0.99);
+    const double p999 = percentile(result.latencies, 0.999);
+    const double max = result.latencies.back();
+    log << std::fixed << std::setprecision(3) << std::setw(10) << blockSize << std::setw(10) << rtf
+        << std::setprecision(1) << std::setw(12) << p50 << std::setw(12) << p99 << std::setw(12) << p999
+        << std::setw(12) << max << std::setw(12) << budget << "\n";
+
+    nlohmann::json entry;
+    entry["block_size"] = blockSize;
+    entry["calls"] = result.numCalls;
+    entry["audio_seconds"] = result.audioSeconds;
+    entry["wall_seconds"] = result.totalSeconds;
+    entry["rtf"] = rtf;
+    entry["budget_us"] = budget;
+    entry["latency_us"] = {{"p50", p50}, {"p99", p99}, {"p99_9", p999}, {"max", max}};
+    if (counters.IsAnyAvailable())
+    {
+      const PerfCounters::Readings& c = result.counters;
+      const double numSamples = (double)result.numCalls * blockSize;
+      // Empty (shown as "n/a", written as null) where a counter is missing
+      auto perSample = [&](const PerfCounters::Counter counter) -> std::optional<double> {
+        if (!c.has(counter))
+          return std::nullopt;
+        return c.get(counter) / numSamples;
+      };
+      std::optional<double> ipc;
+      if (c.has(PerfCounters::kInstructions) && c.has(PerfCounters::kCycles) && c.get(PerfCounters::kCycles) > 0.0)
+        ipc = c.get(PerfCounters::kInstructions) / c.get(PerfCounters::kCycles);
+      const std::optional<double> cyclesPerSample = perSample(PerfCounters::kCycles);
+      const std::optional<double> l1dPerSample = perSample(PerfCounters::kL1DMisses);
+      const std::optional<double> llcPerSample = perSample(PerfCounters::kLLCMisses);
+      const std::optional<double> branchPerSample = perSample(PerfCounters::kBranchMisses);
+      std::optional<double> pageFaults;
+      if (c.has(PerfCounters::kPageFaults))
+        pageFaults = c.get(PerfCounters::kPageFaults);
+      auto cell = [&](const std::optional<double>& value, const int precision) {
+        std::stringstream ss;
+        if (!value)
+          ss << "n/a";
+        else
+          ss << std::fixed << std::setprecision(precision) << *value;
+        return ss.str();
+      };
+      counterTable << std::setw(10) << blockSize << std::setw(8) << cell(ipc, 2) << std::setw(14)
+                   << cell(cyclesPerSample, 1) << std::setw(14) << cell(l1dPerSample, 3) << std::setw(14)
+                   << cell(llcPerSample, 4) << std::setw(14) << cell(branchPerSample, 4) << std::setw(12)
+                   << cell(pageFaults, 0) << "\n";
+
+      auto value = [](const std::optional<double>& x) { return x ? nlohmann::json(*x) : nlohmann::json(nullptr); };
+      nlohmann::json raw;
+      for (int i = 0; i < PerfCounters::kNumCounters; i++)
+      {
+        const PerfCounters::Counter counter = (PerfCounters::Counter)i;
+        raw[PerfCounters::GetName(counter)] = c.has(counter) ? nlohmann::json(c.get(counter)) : nlohmann::json(nullptr);
+      }
+      entry["counters"] = raw;
+      entry["ipc"] = value(ipc);
+      entry["per_sample"] = {{"cycles", value(cyclesPerSample)},
+                             {"l1d_misses", value(l1dPerSample)},
+                             {"llc_misses", value(llcPerSample)},
+                             {"branch_misses", value(branchPerSample)}};
+    }
+    if (resamplingOnly)
+    {
+      const BlockSizeResult resampling =
+        benchmarkBlockSize(*resamplingOnly, input, sampleRate, blockSize, options, counters);
+      const double resamplingRtf = resampling.totalSeconds / resampling.audioSeconds;
+      const double share = 100.0 * resamplingRtf / rtf;
+      resamplingTable << std::fixed << std::setw(10) << blockSize << std::setprecision(4) << std::setw(10)
+                      << resamplingRtf << std::setprecision(1) << std::setw(12) << percentile(resampling.latencies, 0.5)
+                      << std::setw(12) << share << "\n";
+      entry["resampling"] = {{"rtf", resamplingRtf},
+                             {"latency_us", {{"p50", percentile(resampling.latencies, 0.5)}}},
+                             {"share_percent", share}};
+    }
+    if (options.profile)
+    {
+      const nam::profiler::Report profile = model->GetProfile();
+      log << profile.to_string();
+      if (profile.enabled)
+      {
+        nlohmann::json stages;
+        for (int i = 0; i < nam::profiler::kNumStages; i++)
+          if (profile.stages[i].calls > 0)
+            stages[nam::profiler::get_stage_name((nam::profiler::Stage)i)] = {
+              {"calls", profile.stages[i].calls}, {"nanoseconds", profile.stages[i].nanoseconds}};
+        entry["profile"] = stages;
+      }
+    }
+    report["results"].push_back(entry);
   }
-  else
+
+  if (counters.IsAnyAvailable())
   {
-    std::cerr << "Usage: loadmodel <model_path>\n";
+    log << "\nHardware counters (per sample, except page faults, which are totals)\n";
+    log << std::setw(10) << "block" << std::setw(8) << "IPC" << std::setw(14) << "cycles" << std::setw(14)
+        << "L1D misses" << std::setw(14) << "LLC misses" << std::setw(14) << "branch miss" << std::setw(12)
+        << "page faults" << "\n";
+    log << counterTable.str();
+  }
+
+  if (resamplingOnly)
+  {
+    log << "\nResampling alone (share is of the total above)\n";
+    log << std::setw(10) << "block" << std::setw(10) << "RTF" << std::setw(12) << "p50 us" << std::setw(12)
+        << "share %" << "\n";
+    log << resamplingTable.str();
+  }
+
+  if (options.denormalTail)
+  {
+    log << "Running decaying tail benchmark\n";
+    const double msDenormals = benchmarkDecayingTail(*model, false);
+    const double msFlushed = benchmarkDecayingTail(*model, true);
+    log << "Decaying tail, denormals:       " << msDenormals << "ms\n";
+    log << "Decaying tail, flushed to zero: " << msFlushed << "ms\n";
+    report["denormal_tail_ms"] = {{"denormals", msDenormals}, {"flushed", msFlushed}};
+  }
+
+  if (!options.jsonPath.empty())
+  {
+    if (options.jsonPath == "-")
+      std::cout << report.dump(2) << "\n";
+    else
+    {
+      std::ofstream out(options.jsonPath);
+      out << report.dump(2) << "\n";
+    }
   }
 
   exit(0);
-}
\ No newline at end of file
+}
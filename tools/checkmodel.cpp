@@ -0,0 +1,440 @@
+// Differential correctness check: runs a model through each of the core's optimized modes and compares the output
+// against a double-precision scalar reference implementation (reference_dsp.h), on real audio and on synthetic stress
+// signals. Exits with a non-zero status if any mode exceeds its error thresholds.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "NAM/dsp.h"
+#include "NAM/plan.h"
+#include "NAM/reblocking.h"
+#include "NAM/wav.h"
+#include "NAM/wavenet.h"
+#include "reference_dsp.h"
+
+struct Signal
+{
+  std::string name;
+  std::vector<NAM_SAMPLE> samples;
+};
+
+// One way of running the model that we want to be able to turn on in production
+struct Mode
+{
+  std::string name;
+  // Process in blocks of these sizes, cycling through them
+  std::vector<int> blockSizes;
+  // Pass if the error is at most these
+  double maxAbsError;
+  double maxEsr;
+  // What the model is loaded with
+  nam::activations::Precision precision = nam::activations::Precision::kAccurate;
+  // Run the model as an execution plan (plan.h) instead of through its own class
+  bool plan = false;
+  // Run the model through a ReblockingDSP with blocks of this size, if positive (its latency is compensated for)
+  int reblockSize = 0;
+  nam::ReblockingDSP::Mode reblockMode = nam::ReblockingDSP::Mode::kFixedLatency;
+  // Applied to each freshly loaded model (before pre-warming); return false if the mode doesn't apply to it.
+  std::function<bool(nam::DSP&)> configure = [](nam::DSP&) { return true; };
+};
+
+struct Comparison
+{
+  double maxAbsError = 0.0;
+  double esr = 0.0;
+  double snrDb = 0.0;
+  bool finite = true;
+};
+
+void printUsage()
+{
+  std::cerr << "Usage: checkmodel <model_path> [--input <wav>] [--modes <name,name,...>] [--json <path|->]\n";
+}
+
+std::vector<Mode> getModes()
+{
+  std::vector<Mode> modes;
+  // Float vs. double, and how the blocks fall, should only cost rounding error.
+  modes.push_back({"accurate", {64}, 1.0e-4, 1.0e-8});
+  modes.push_back({"block-1", {1}, 1.0e-4, 1.0e-8});
+  modes.push_back({"ragged-blocks", {1, 37, 64, 511, 2048, 3}, 1.0e-4, 1.0e-8});
+  {
+    Mode mode{"flush-denormals", {64}, 1.0e-4, 1.0e-8};
+    mode.configure = [](nam::DSP& model) {
+      model.SetFlushDenormals(true);
+      return true;
+    };
+    modes.push_back(mode);
+  }
+  {
+    // Split big buffers into many small time tiles
+    Mode mode{"wavenet-tile-32", {4096}, 1.0e-4, 1.0e-8};
+    mode.configure = [](nam::DSP& model) {
+      auto* wavenet = dynamic_cast<nam::wavenet::WaveNet*>(&model);
+      if (wavenet == nullptr)
+        return false;
+      wavenet->set_tile_size_(32);
+      return true;
+    };
+    modes.push_back(mode);
+  }
+  {
+    Mode mode{"plan", {64}, 1.0e-4, 1.0e-8};
+    mode.plan = true;
+    modes.push_back(mode);
+  }
+  {
+    Mode mode{"plan-ragged", {1, 37, 64, 511, 2048, 3}, 1.0e-4, 1.0e-8};
+    mode.plan = true;
+    modes.push_back(mode);
+  }
+  {
+    Mode mode{"reblock-fixed", {1, 37, 64, 511, 2048, 3}, 1.0e-4, 1.0e-8};
+    mode.reblockSize = 256;
+    modes.push_back(mode);
+  }
+  {
+    Mode mode{"reblock-zero", {1, 37, 64, 511, 2048, 3}, 1.0e-4, 1.0e-8};
+    mode.reblockSize = 256;
+    mode.reblockMode = nam::ReblockingDSP::Mode::kZeroLatency;
+    modes.push_back(mode);
+  }
+  // The approximations are good to about 1e-4 (fast) and 5e-6 (LUT) per activation; that compounds through deep
+  // models. (Hard clipping isn't an approximation, so there's nothing to bound.)
+  {
+    Mode mode{"fast", {64}, 2.0e-2, 5.0e-4};
+    mode.precision = nam::activations::Precision::kFast;
+    modes.push_back(mode);
+  }
+  {
+    Mode mode{"lut", {64}, 1.0e-3, 1.0e-7};
+    mode.precision = nam::activations::Precision::kLUT;
+    modes.push_back(mode);
+  }
+  return modes;
+}
+
+std::vector<Signal> getSyntheticSignals(const double sampleRate)
+{
+  const size_t second = (size_t)sampleRate;
+  std::vector<Signal> signals;
+  {
+    // Exponential sine sweep, 20 Hz to just below Nyquist
+    Signal sweep{"sweep", std::vector<NAM_SAMPLE>(2 * second)};
+    const double f0 = 20.0;
+    const double f1 = std::min(20000.0, 0.45 * sampleRate);
+    const double duration = 2.0;
+    const double k = std::log(f1 / f0);
+    for (size_t i = 0; i < sweep.samples.size(); i++)
+    {
+      const double t = (double)i / sampleRate;
+      const double phase = 2.0 * M_PI * f0 * duration / k * (std::exp(t / duration * k) - 1.0);
+      sweep.samples[i] = (NAM_SAMPLE)(0.5 * std::sin(phase));
+    }
+    signals.push_back(sweep);
+  }
+  {
+    Signal impulses{"impulses", std::vector<NAM_SAMPLE>(second, 0.0)};
+    for (size_t i = 0; i < impulses.samples.size(); i += second / 4)
+      impulses.samples[i] = 1.0;
+    signals.push_back(impulses);
+  }
+  signals.push_back({"dc", std::vector<NAM_SAMPLE>(second, 0.5)});
+  {
+    // Half a second of silence, then full scale
+    Signal loud{"silence-to-loud", std::vector<NAM_SAMPLE>(second, 0.0)};
+    unsigned int seed = 1;
+    for (size_t i = second / 2; i < loud.samples.size(); i++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      const double noise = (double)(seed >> 8) / (double)(1u << 24) * 2.0 - 1.0;
+      const double t = (double)i / sampleRate;
+      loud.samples[i] = (NAM_SAMPLE)std::max(-1.0, std::min(1.0, 0.8 * std::sin(2.0 * M_PI * 110.0 * t) + 0.2 * noise));
+    }
+    signals.push_back(loud);
+  }
+  return signals;
+}
+
+std::vector<double> runReference(const nam::dspData& data, const Signal& signal)
+{
+  // In full, even if flushing is on for the whole process (as it is in -Ofast builds)
+  const nam::denormal::ScopedAllowDenormals allowDenormals;
+  std::unique_ptr<reference::Model> model = reference::GetModel(data);
+  model->Prewarm();
+  std::vector<double> output(signal.samples.size());
+  for (size_t i = 0; i < output.size(); i++)
+    output[i] = model->Process(signal.samples[i]);
+  return output;
+}
+
+// Returns false if the mode doesn't apply to this model
+bool runMode(const std::string& modelPath, const nam::dspData& data, const Mode& mode, const Signal& signal,
+             std::vector<NAM_SAMPLE>& output)
+{
+  // Only the mode decides whether subnormals are flushed (e.g. flush-denormals vs. accurate), whatever the process's
+  // default.
+  const nam::denormal::ScopedAllowDenormals allowDenormals;
+  std::unique_ptr<nam::DSP> model =
+    mode.plan ? nam::plan::get_dsp(data, mode.precision) : nam::get_dsp(modelPath, mode.precision);
+  const bool applies = mode.configure(*model);
+  if (applies)
+  {
+    // Settle again from the configured state (some settings reset it).
+    model->prewarm();
+    if (mode.reblockSize > 0)
+      model = std::make_unique<nam::ReblockingDSP>(std::move(model), mode.reblockSize, mode.reblockMode);
+    // Run on through the latency and line the output back up with the input.
+    const size_t latency = model->GetLatency();
+    std::vector<NAM_SAMPLE> input(signal.samples);
+    input.resize(input.size() + latency, 0.0);
+    output.assign(input.size(), 0.0);
+    size_t position = 0;
+    for (size_t call = 0; position < input.size(); call++)
+    {
+      const size_t maxBlockSize = mode.blockSizes[call % mode.blockSizes.size()];
+      const size_t blockSize = std::min(maxBlockSize, input.size() - position);
+      const int numFrames = (int)blockSize;
+      model->process(input.data() + position, output.data() + position, numFrames);
+      model->finalize_(numFrames);
+      position += blockSize;
+    }
+    output.erase(output.begin(), output.begin() + latency);
+  }
+  return applies;
+}
+
+// From the bit pattern rather than std::isfinite(), which fast-math builds (the tools' Release build is -Ofast) are
+// free to fold to true
+bool isFinite(const double x)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  return (bits & 0x7ff0000000000000ull) != 0x7ff0000000000000ull;
+}
+
+Comparison compare(const std::vector<double>& reference, const std::vector<NAM_SAMPLE>& output)
+{
+  Comparison result;
+  double signalEnergy = 0.0;
+  double errorEnergy = 0.0;
+  for (size_t i = 0; i < reference.size(); i++)
+  {
+    if (!isFinite((double)output[i]))
+      result.finite = false;
+    const double error = (double)output[i] - reference[i];
+    result.maxAbsError = std::max(result.maxAbsError, std::fabs(error));
+    signalEnergy += reference[i] * reference[i];
+    errorEnergy += error * error;
+  }
+  // NaN doesn't survive std::max() or the comparisons against the thresholds, so don't leave it to them.
+  if (!result.finite)
+  {
+    result.maxAbsError = INFINITY;
+    result.esr = INFINITY;
+    result.snrDb = -INFINITY;
+    return result;
+  }
+  // Error-to-signal ratio; a silent reference only matches a silent output.
+  if (signalEnergy > 0.0)
+    result.esr = errorEnergy / signalEnergy;
+  else
+    result.esr = errorEnergy > 0.0 ? INFINITY : 0.0;
+  result.snrDb = result.esr > 0.0 ? -10.0 * std::log10(result.esr) : INFINITY;
+  return result;
+}
+
+bool isPassing(const Comparison& c, const Mode& mode)
+{
+  return c.finite && c.maxAbsError <= mode.maxAbsError && c.esr <= mode.maxEsr;
+}
+
+// A checker that passes NaN is worse than none. Make sure this build's doesn't.
+bool checkNanFails()
+{
+  const std::vector<double> reference = {0.0, 0.5, -0.5, 0.25};
+  std::vector<NAM_SAMPLE> output(reference.begin(), reference.end());
+  output[1] = (NAM_SAMPLE)std::nan("");
+  for (const Mode& mode : getModes())
+    if (isPassing(compare(reference, output), mode))
+      return false;
+  return true;
+}
+
+// Lowering a model to a plan has to reject a config that's missing a key with an exception, not read past it. Drops
+// each key in turn (and, for WaveNets, each key of each layer array) and returns the ones that got through.
+std::vector<std::string> getMissingKeysPlanAccepts(const nam::dspData& data)
+{
+  std::vector<std::string> accepted;
+  auto check = [&](const nam::dspData& broken, const std::string& key) {
+    try
+    {
+      nam::plan::get_dsp(broken, nam::activations::Precision::kAccurate, false);
+      accepted.push_back(key);
+    }
+    catch (const std::exception&)
+    {
+    }
+  };
+  for (const auto& item : data.config.items())
+  {
+    // A WaveNet without a head leaves "head" out, and its head scale is read from the weights.
+    if (item.key() == "head" || item.key() == "head_scale")
+      continue;
+    nam::dspData broken = data;
+    broken.config.erase(item.key());
+    check(broken, item.key());
+  }
+  if (data.architecture == "WaveNet")
+    for (size_t i = 0; i < data.config.at("layers").size(); i++)
+      for (const auto& item : data.config.at("layers").at(i).items())
+      {
+        nam::dspData broken = data;
+        broken.config.at("layers").at(i).erase(item.key());
+        check(broken, "layers[" + std::to_string(i) + "]." + item.key());
+      }
+  return accepted;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 2)
+  {
+    printUsage();
+    exit(1);
+  }
+  const std::string modelPath = argv[1];
+  std::string inputPath;
+  std::string jsonPath;
+  std::vector<std::string> modeNames;
+  for (int i = 2; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc)
+    {
+      printUsage();
+      exit(1);
+    }
+    if (arg == "--input")
+      inputPath = argv[++i];
+    else if (arg == "--json")
+      jsonPath = argv[++i];
+    else if (arg == "--modes")
+    {
+      std::stringstream ss(argv[++i]);
+      std::string item;
+      while (std::getline(ss, item, ','))
+        modeNames.push_back(item);
+    }
+    else
+    {
+      printUsage();
+      exit(1);
+    }
+  }
+  // Keep stdout clean for the JSON report
+  std::ostream& log = jsonPath == "-" ? std::cerr : std::cout;
+  if (!checkNanFails())
+  {
+    std::cerr << "This build of checkmodel passes NaN output; build it without -ffinite-math-only\n";
+    exit(1);
+  }
+
+  nam::dspData data;
+  std::unique_ptr<nam::DSP> probe = nam::get_dsp(modelPath, data, nam::activations::Precision::kAccurate);
+  const double sampleRate = probe->GetExpectedSampleRate() > 0.0 ? probe->GetExpectedSampleRate() : 48000.0;
+  probe.reset();
+
+  std::vector<Mode> modes;
+  for (const Mode& mode : getModes())
+    if (modeNames.empty() || std::find(modeNames.begin(), modeNames.end(), mode.name) != modeNames.end())
+      modes.push_back(mode);
+  if (modes.empty())
+  {
+    std::cerr << "No such modes. Known modes are:";
+    for (const Mode& mode : getModes())
+      std::cerr << " " << mode.name;
+    std::cerr << "\n";
+    exit(1);
+  }
+
+  std::vector<Signal> signals;
+  if (!inputPath.empty())
+  {
+    std::vector<float> audio;
+    double fileSampleRate;
+    const auto rc = dsp::wav::Load(inputPath.c_str(), audio, fileSampleRate);
+    if (rc != dsp::wav::LoadReturnCode::SUCCESS)
+    {
+      std::cerr << "Failed to load input " << inputPath << ": " << dsp::wav::GetMsgForLoadReturnCode(rc) << "\n";
+      exit(1);
+    }
+    signals.push_back({"input", std::vector<NAM_SAMPLE>(audio.begin(), audio.end())});
+  }
+  for (const Signal& signal : getSyntheticSignals(sampleRate))
+    signals.push_back(signal);
+
+  log << "Checking " << modelPath << " (" << data.architecture << ")\n";
+  log << std::left << std::setw(18) << "mode" << std::setw(18) << "signal" << std::right << std::setw(14) << "max abs"
+      << std::setw(14) << "ESR" << std::setw(10) << "SNR dB" << "  result\n";
+
+  nlohmann::json report;
+  report["model"] = modelPath;
+  report["architecture"] = data.architecture;
+  report["results"] = nlohmann::json::array();
+  bool allPassed = true;
+  for (const Signal& signal : signals)
+  {
+    const std::vector<double> expected = runReference(data, signal);
+    for (const Mode& mode : modes)
+    {
+      std::vector<NAM_SAMPLE> output;
+      if (!runMode(modelPath, data, mode, signal, output))
+        continue;
+      const Comparison c = compare(expected, output);
+      const bool passed = isPassing(c, mode);
+      allPassed = allPassed && passed;
+      log << std::left << std::setw(18) << mode.name << std::setw(18) << signal.name << std::right << std::scientific
+          << std::setprecision(2) << std::setw(14) << c.maxAbsError << std::setw(14) << c.esr << std::fixed
+          << std::setprecision(1) << std::setw(10) << c.snrDb << "  " << (passed ? "ok" : "FAIL") << "\n";
+
+      nlohmann::json entry;
+      entry["mode"] = mode.name;
+      entry["signal"] = signal.name;
+      entry["max_abs_error"] = isFinite(c.maxAbsError) ? nlohmann::json(c.maxAbsError) : nlohmann::json(nullptr);
+      entry["esr"] = isFinite(c.esr) ? nlohmann::json(c.esr) : nlohmann::json(nullptr);
+      entry["snr_db"] = isFinite(c.snrDb) ? nlohmann::json(c.snrDb) : nlohmann::json(nullptr);
+      entry["thresholds"] = {{"max_abs_error", mode.maxAbsError}, {"esr", mode.maxEsr}};
+      entry["passed"] = passed;
+      report["results"].push_back(entry);
+    }
+  }
+  const std::vector<std::string> acceptedKeys = getMissingKeysPlanAccepts(data);
+  for (const std::string& key : acceptedKeys)
+    log << "plan accepted a config without " << key << "\n";
+  allPassed = allPassed && acceptedKeys.empty();
+  nlohmann::json missingKeys = acceptedKeys;
+  report["plan_accepted_missing_keys"] = missingKeys;
+  report["passed"] = allPassed;
+  log << (allPassed ? "All modes within thresholds\n" : "Some modes exceeded their thresholds\n");
+
+  if (jsonPath == "-")
+    std::cout << report.dump(2) << "\n";
+  else if (!jsonPath.empty())
+  {
+    std::ofstream out(jsonPath);
+    out << report.dump(2) << "\n";
+  }
+
+  exit(allPassed ? 0 : 1);
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "NAM/dsp.h"
+#include "NAM/resampler.h"
+
+struct CostOptions
+{
+  std::string modelPath;
+  // Estimate at this rate, converting to and from the model's; 0 means at the model's rate.
+  double sampleRate = 0.0;
+  // Run a block of this size first so that the state is what it'd be in a host; 0 means as loaded.
+  int blockSize = 0;
+  bool json = false;
+};
+
+void printUsage()
+{
+  std::cerr << "Usage: costmodel <model_path> [--sample-rate <hz>] [--block-size <n>] [--json]\n";
+}
+
+bool parseArgs(int argc, char* argv[], CostOptions& options)
+{
+  if (argc < 2)
+    return false;
+  options.modelPath = argv[1];
+  for (int i = 2; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    // Numbers that don't parse throw.
+    try
+    {
+      if (arg == "--sample-rate" && hasValue)
+        options.sampleRate = std::stod(argv[++i]);
+      else if (arg == "--block-size" && hasValue)
+        options.blockSize = std::stoi(argv[++i]);
+      else if (arg == "--json")
+        options.json = true;
+      else
+      {
+        std::cerr << "Unknown argument: " << arg << "\n";
+        return false;
+      }
+    }
+    catch (const std::exception&)
+    {
+      std::cerr << "Invalid value for " << arg << ": " << argv[i] << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  CostOptions options;
+  if (!parseArgs(argc, argv, options))
+  {
+    printUsage();
+    return 1;
+  }
+
+  nam::dspData data;
+  std::unique_ptr<nam::DSP> model;
+  try
+  {
+    model = nam::get_dsp(options.modelPath, data);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Failed to load " << options.modelPath << ": " << e.what() << "\n";
+    return 1;
+  }
+  double modelSampleRate = model->GetExpectedSampleRate() > 0.0 ? model->GetExpectedSampleRate() : 48000.0;
+  double sampleRate = modelSampleRate;
+  if (options.sampleRate > 0.0)
+  {
+    auto resampling = std::make_unique<nam::ResamplingDSP>(std::move(model), options.sampleRate);
+    modelSampleRate = resampling->GetModelSampleRate();
+    sampleRate = options.sampleRate;
+    model = std::move(resampling);
+  }
+  if (options.blockSize > 0)
+  {
+    std::vector<NAM_SAMPLE> input(options.blockSize, 0.0), output(options.blockSize);
+    model->process(input.data(), output.data(), options.blockSize);
+    model->finalize_(options.blockSize);
+  }
+
+  const nam::CostEstimate estimate = model->GetCostEstimate();
+  const double megaMultiplyAddsPerSecond = 1.0e-6 * estimate.multiply_adds_per_sample * sampleRate;
+  if (options.json)
+  {
+    nlohmann::json report;
+    report["model"] = options.modelPath;
+    report["architecture"] = data.architecture;
+    report["sample_rate"] = sampleRate;
+    report["model_sample_rate"] = modelSampleRate;
+    report["multiply_adds_per_sample"] = estimate.multiply_adds_per_sample;
+    report["mega_multiply_adds_per_second"] = megaMultiplyAddsPerSecond;
+    report["activations_per_sample"] = estimate.activations_per_sample;
+    report["weight_bytes"] = estimate.weight_bytes;
+    report["state_bytes"] = estimate.state_bytes;
+    report["receptive_field"] =
+      estimate.receptive_field >= 0 ? nlohmann::json(estimate.receptive_field) : nlohmann::json(nullptr);
+    std::cout << report.dump(2) << "\n";
+    return 0;
+  }
+
+  std::cout << "Model:               " << options.modelPath << " (" << data.architecture << ")\n";
+  std::cout << "Sample rate:         " << sampleRate << " Hz";
+  if (sampleRate != modelSampleRate)
+    std::cout << " (model runs at " << modelSampleRate << " Hz)";
+  std::cout << "\n";
+  std::cout << "Receptive field:     ";
+  if (estimate.receptive_field >= 0)
+    std::cout << estimate.receptive_field << " samples (" << 1000.0 * estimate.receptive_field / sampleRate
+              << " ms)\n";
+  else
+    std::cout << "unbounded (recurrent)\n";
+  std::cout << "Multiply-adds:       " << estimate.multiply_adds_per_sample << " per sample, "
+            << megaMultiplyAddsPerSecond << " M/s\n";
+  std::cout << "Activations:         " << estimate.activations_per_sample << " per sample\n";
+  std::cout << "Weights:             " << estimate.weight_bytes << " bytes\n";
+  std::cout << "State:               " << estimate.state_bytes << " bytes";
+  if (options.blockSize > 0)
+    std::cout << " (after a block of " << options.blockSize << ")";
+  std::cout << "\n";
+  return 0;
+}
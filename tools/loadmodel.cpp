@@ -1,13 +1,62 @@
 #include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
 #include "NAM/dsp.h"
+#include "NAM/loader.h"
+
+void printUsage()
+{
+  fprintf(stderr, "Usage: loadmodel <model_path> [<model_path> ...] [--threads <n>] [--prewarm now|lazy|background]\n");
+}
 
 int main(int argc, char* argv[])
 {
-  if (argc > 1)
+  std::vector<std::filesystem::path> modelPaths;
+  int numThreads = 0;
+  nam::PrewarmMode prewarm = nam::PrewarmMode::kNow;
+  for (int i = 1; i < argc; i++)
   {
-    char* modelPath = argv[1];
+    const std::string arg = argv[i];
+    if (arg == "--threads" && i + 1 < argc)
+    {
+      try
+      {
+        numThreads = std::stoi(argv[++i]);
+      }
+      catch (const std::exception&)
+      {
+        fprintf(stderr, "Invalid value for --threads: %s\n", argv[i]);
+        printUsage();
+        exit(1);
+      }
+    }
+    else if (arg == "--prewarm" && i + 1 < argc)
+    {
+      const std::string mode = argv[++i];
+      if (mode == "now")
+        prewarm = nam::PrewarmMode::kNow;
+      else if (mode == "lazy")
+        prewarm = nam::PrewarmMode::kLazy;
+      else if (mode == "background")
+        prewarm = nam::PrewarmMode::kBackground;
+      else
+      {
+        fprintf(stderr, "Unknown prewarm mode: %s\n", mode.c_str());
+        printUsage();
+        exit(1);
+      }
+    }
+    else
+      modelPaths.push_back(arg);
+  }
+
+  if (modelPaths.size() == 1)
+  {
+    const std::filesystem::path& modelPath = modelPaths[0];
 
-    fprintf(stderr, "Loading model [%s]\n", modelPath);
+    fprintf(stderr, "Loading model [%s]\n", modelPath.string().c_str());
 
     auto model = nam::get_dsp(modelPath);
 
@@ -22,9 +71,42 @@ int main(int argc, char* argv[])
       exit(1);
     }
   }
+  else if (modelPaths.size() > 1)
+  {
+    // Many at once, in parallel
+    nam::Executor executor(numThreads);
+    nam::LoadOptions options;
+    options.prewarm = prewarm;
+    options.on_progress = [](const nam::LoadResult& result, const size_t numDone, const size_t numFiles) {
+      if (result.model != nullptr)
+        fprintf(stderr, "[%zu/%zu] Loaded [%s] in %.1f ms\n", numDone, numFiles, result.path.string().c_str(),
+                1000.0 * result.seconds);
+      else
+        fprintf(stderr, "[%zu/%zu] Failed to load [%s]: %s\n", numDone, numFiles, result.path.string().c_str(),
+                result.error.c_str());
+    };
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<nam::LoadResult> results = nam::load_many(modelPaths, executor, options);
+    const double loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t failures = 0;
+    for (nam::LoadResult& result : results)
+    {
+      if (result.model == nullptr)
+        failures++;
+      else if (result.prewarmed.valid())
+        result.prewarmed.wait();
+    }
+    fprintf(stderr, "Loaded %zu of %zu models on %d threads in %.1f ms\n", results.size() - failures, results.size(),
+            executor.get_num_threads(), 1000.0 * loadSeconds);
+    if (prewarm == nam::PrewarmMode::kBackground)
+      fprintf(stderr, "Prewarmed in the background by %.1f ms\n",
+              1000.0 * std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (failures > 0)
+      exit(1);
+  }
   else
   {
-    fprintf(stderr, "Usage: loadmodel <model_path>\n");
+    printUsage();
   }
 
   exit(0);
@@ -0,0 +1,527 @@
+// Ahead-of-time model compiler: turns a .nam file into a C++ translation unit that implements nam::DSP for that one
+// model, with its weights baked in as constexpr arrays and every shape, dilation and activation a compile-time
+// constant, so that the compiler can unroll and vectorize each layer for exactly its sizes.
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "NAM/dsp.h"
+
+struct CompileOptions
+{
+  std::string modelPath;
+  // Where to write the C++ ("-" is stdout)
+  std::string outputPath = "-";
+  // Goes into the factory's name (make_<name>()); the model file's name if empty
+  std::string name;
+  nam::activations::Precision precision = nam::activations::Precision::kAccurate;
+};
+
+void printUsage()
+{
+  std::cerr << "Usage: nam2cpp <model_path> [--output <path|->] [--name <identifier>]\n"
+            << "               [--precision <accurate|fast|lut|hard-clip>]\n";
+}
+
+bool parseArgs(int argc, char* argv[], CompileOptions& options)
+{
+  if (argc < 2)
+    return false;
+  options.modelPath = argv[1];
+  for (int i = 2; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc)
+      return false;
+    if (arg == "--output")
+      options.outputPath = argv[++i];
+    else if (arg == "--name")
+      options.name = argv[++i];
+    else if (arg == "--precision")
+    {
+      try
+      {
+        options.precision = nam::activations::get_precision(argv[++i]);
+      }
+      catch (const std::exception&)
+      {
+        std::cerr << "Invalid value for " << arg << ": " << argv[i] << "\n";
+        return false;
+      }
+    }
+    else
+    {
+      std::cerr << "Unknown argument: " << arg << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// A C++ identifier from a file name
+std::string getIdentifier(const std::string& name)
+{
+  std::string identifier;
+  for (const char c : name)
+    identifier += std::isalnum((unsigned char)c) ? (char)c : '_';
+  if (identifier.empty() || std::isdigit((unsigned char)identifier[0]))
+    identifier = "_" + identifier;
+  return identifier;
+}
+
+// Exactly the float, as a literal
+std::string getLiteral(const float x)
+{
+  if (!std::isfinite(x))
+    throw std::runtime_error("The model has a weight that isn't finite");
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.9g", x);
+  std::string literal = buffer;
+  if (literal.find_first_of(".e") == std::string::npos)
+    literal += ".0";
+  return literal + "f";
+}
+
+// Smallest power of two that's at least `n`
+long getPowerOfTwo(const long n)
+{
+  long size = 1;
+  while (size < n)
+    size *= 2;
+  return size;
+}
+
+// Float offsets of the state buffers, each rounded up to the arena's alignment
+class StateLayout
+{
+public:
+  long add_(const long num_floats)
+  {
+    const long offset = this->_size;
+    const long alignment = (long)(nam::Arena::kAlignment / sizeof(float));
+    this->_size += (num_floats + alignment - 1) / alignment * alignment;
+    return offset;
+  };
+  long get_size() const { return this->_size; };
+
+private:
+  long _size = 0;
+};
+
+// Writes the model's weights out as constexpr arrays, taking them from the file in order.
+class WeightWriter
+{
+public:
+  WeightWriter(std::ostream& out, const std::vector<float>& weights)
+  : _out(out)
+  , _weights(weights)
+  {
+  }
+  // The next rows x cols matrix, stored (transposed) one column at a time. In the file, each matrix is row by row;
+  // convolutions interleave their taps within each row, and `num_taps` of them are split out, one after another.
+  void matrix_(const std::string& name, const long rows, const long cols, const long num_taps = 1)
+  {
+    std::vector<float> values(num_taps * rows * cols);
+    for (long i = 0; i < rows; i++)
+      for (long j = 0; j < cols; j++)
+        for (long k = 0; k < num_taps; k++)
+          values[(k * cols + j) * rows + i] = this->_next();
+    this->_write_(name, values);
+  };
+  // The next `size` weights, as they are
+  void vector_(const std::string& name, const long size)
+  {
+    std::vector<float> values(size);
+    for (long i = 0; i < size; i++)
+      values[i] = this->_next();
+    this->_write_(name, values);
+  };
+  float scalar_() { return this->_next(); };
+  // Bytes written so far
+  size_t get_bytes() const { return this->_bytes; };
+  void check_done() const
+  {
+    if (this->_position != this->_weights.size())
+    {
+      std::stringstream ss;
+      ss << "Weight mismatch: used " << this->_position << " weights, but " << this->_weights.size()
+         << " were provided.";
+      throw std::runtime_error(ss.str());
+    }
+  };
+
+private:
+  std::ostream& _out;
+  const std::vector<float>& _weights;
+  size_t _position = 0;
+  size_t _bytes = 0;
+
+  float _next()
+  {
+    if (this->_position >= this->_weights.size())
+      throw std::runtime_error("Weight mismatch: the model expects more weights than were provided.");
+    return this->_weights[this->_position++];
+  };
+  void _write_(const std::string& name, const std::vector<float>& values)
+  {
+    // An empty array isn't allowed.
+    const size_t size = std::max(values.size(), (size_t)1);
+    this->_out << "alignas(64) constexpr float " << name << "[" << size << "] = {";
+    for (size_t i = 0; i < values.size(); i++)
+      this->_out << (i % 8 == 0 ? "\n  " : " ") << getLiteral(values[i]) << (i + 1 < values.size() ? "," : "");
+    this->_out << "};\n";
+    this->_bytes += values.size() * sizeof(float);
+  };
+};
+
+// The activation as a type with a static apply(float*, int) that the kernels take as a template parameter
+std::string getActivationType(const std::string& name, const nam::activations::Precision precision)
+{
+  using nam::activations::Precision;
+  if (name == "Tanh")
+    switch (precision)
+    {
+      case Precision::kFast: return "Scalar<nam::activations::fast_tanh>";
+      case Precision::kLUT: return "Table<0>";
+      case Precision::kHardClip: return "Scalar<nam::activations::hard_tanh>";
+      default: return "Scalar<accurate_tanh>";
+    }
+  if (name == "Sigmoid")
+    switch (precision)
+    {
+      case Precision::kFast: return "Scalar<nam::activations::fast_sigmoid>";
+      case Precision::kLUT: return "Table<1>";
+      case Precision::kHardClip: return "Scalar<nam::activations::hard_sigmoid>";
+      default: return "Scalar<nam::activations::sigmoid>";
+    }
+  if (name == "Hardtanh")
+    return "Scalar<nam::activations::hard_tanh>";
+  if (name == "Fasttanh")
+    return "Scalar<nam::activations::fast_tanh>";
+  if (name == "ReLU")
+    return "Scalar<nam::activations::relu>";
+  if (name == "LUTtanh")
+    return "Table<0>";
+  if (name == "LUTsigmoid")
+    return "Table<1>";
+  throw std::runtime_error("nam2cpp doesn't know the activation " + name);
+}
+
+// Frames that the generated models push through all of their layers at once (kTile in the kernels)
+#define TILE_SIZE 32
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// Everything that the generated models share. In an anonymous namespace, so that any number of them can be linked
+// together.
+const char* kKernels = R"(namespace
+{
+// Frames that go through all of the layers at once
+constexpr int kTile = )" STRINGIFY(TILE_SIZE) R"(;
+
+// The weights are stored column by column, and the audio one frame of channels after another.
+template <int Rows, int Cols>
+using Weights = Eigen::Map<const Eigen::Matrix<float, Rows, Cols>>;
+template <int Rows>
+using Frames = Eigen::Map<Eigen::Matrix<float, Rows, Eigen::Dynamic>>;
+template <int Rows>
+using ConstFrames = Eigen::Map<const Eigen::Matrix<float, Rows, Eigen::Dynamic>>;
+
+inline float accurate_tanh(const float x)
+{
+  return std::tanh(x);
+}
+
+template <float (*F)(float)>
+struct Scalar
+{
+  static void apply(float* x, const int n)
+  {
+    for (int i = 0; i < n; i++)
+      x[i] = F(x[i]);
+  }
+};
+
+// The table-based tanh (0) or sigmoid (1), from the library
+template <int Function>
+struct Table
+{
+  static void apply(float* x, const int n)
+  {
+    using nam::activations::Activation;
+    static Activation* const activation =
+      Activation::get_activation(Function == 0 ? "Tanh" : "Sigmoid", nam::activations::Precision::kLUT);
+    activation->apply(x, n);
+  }
+};
+
+// One WaveNet layer, over the n <= kTile frames from time t on. `x` is its input and becomes its output; its
+// activations are added to `head`. `history` keeps the last Size inputs (Size is a power of two, at least the
+// lookback plus a tile) for the dilated convolution to look back on. Each frame goes in twice, Size frames apart, so
+// that what each tap reads for a tile is all in one piece.
+template <int C, int K, int D, int Size, bool Gated, class Activation, class Gate>
+inline void layer(const float* conv, const float* conv_bias, const float* mixin, const float* out,
+                  const float* out_bias, float* history, const long t, const int n, const float* condition, float* x,
+                  float* head)
+{
+  constexpr int Z = Gated ? 2 * C : C;
+  for (int j = 0; j < n; j++)
+  {
+    const long position = (t + j) & (Size - 1);
+    std::memcpy(history + position * C, x + j * C, C * sizeof(float));
+    std::memcpy(history + (position + Size) * C, x + j * C, C * sizeof(float));
+  }
+  alignas(64) float z_data[kTile * Z];
+  Frames<Z> z(z_data, Z, n);
+  z.noalias() = Weights<Z, 1>(mixin) * ConstFrames<1>(condition, 1, n);
+  z.colwise() += Weights<Z, 1>(conv_bias);
+  for (int k = 0; k < K; k++)
+  {
+    const float* taps = history + ((t - D * (K - 1 - k)) & (Size - 1)) * C;
+    z.noalias() += Weights<Z, C>(conv + k * Z * C) * ConstFrames<C>(taps, C, n);
+  }
+  Activation::apply(z_data, n * Z);
+  if (Gated)
+    for (int j = 0; j < n; j++)
+    {
+      Gate::apply(z_data + j * Z + C, C);
+      for (int c = 0; c < C; c++)
+        z_data[j * Z + c] *= z_data[j * Z + C + c];
+    }
+  Frames<C>(head, C, n) += z.template topRows<C>();
+  Frames<C> output(x, C, n);
+  output.noalias() += Weights<C, C>(out) * z.template topRows<C>();
+  output.colwise() += Weights<C, 1>(out_bias);
+}
+}; // namespace
+)";
+
+struct CompiledModel
+{
+  // The constexpr arrays
+  std::string weights;
+  // The body of process()'s loop over tiles: the n frames from `start` (time `t`) of `input` to `output`, with the
+  // layers' histories in `state`
+  std::string tile;
+  StateLayout state;
+  int prewarmSamples = 0;
+  size_t weightBytes = 0;
+};
+
+void compileWaveNet(const nam::dspData& data, const nam::activations::Precision precision, CompiledModel& model)
+{
+  if (data.config.find("head") != data.config.end() && !data.config.at("head").is_null())
+    throw std::runtime_error("Head not implemented!");
+  std::stringstream weights, tile;
+  WeightWriter writer(weights, data.weights);
+  const nlohmann::json& layerArrays = data.config.at("layers");
+  int prewarmSamples = 1;
+  tile << "    alignas(64) float condition[kTile];\n"
+       << "    for (int j = 0; j < n; j++)\n"
+       << "      condition[j] = (float)input[start + j];\n";
+  // Where the previous layer array's outputs and head outputs are
+  std::string previousOutput = "condition", previousHead;
+  int previousChannels = 1, previousHeadSize = 0;
+  for (size_t a = 0; a < layerArrays.size(); a++)
+  {
+    const nlohmann::json& config = layerArrays[a];
+    const int inputSize = config.at("input_size");
+    const int conditionSize = config.at("condition_size");
+    const int headSize = config.at("head_size");
+    const int channels = config.at("channels");
+    const int kernelSize = config.at("kernel_size");
+    const std::vector<int> dilations = config.at("dilations");
+    const std::string activation = config.at("activation");
+    const bool gated = config.at("gated");
+    const bool headBias = config.at("head_bias");
+    if (conditionSize != 1)
+      throw std::runtime_error("WaveNet's condition is the input, so its size must be 1");
+    if (inputSize != previousChannels)
+      throw std::runtime_error("Layer array " + std::to_string(a) + "'s input size doesn't match what comes into it");
+    if (a > 0 && channels != previousHeadSize)
+      throw std::runtime_error("channels of layer " + std::to_string(a)
+                               + " doesn't match head_size of preceding layer");
+    const int z = gated ? 2 * channels : channels;
+    const std::string prefix = "kArray" + std::to_string(a);
+    const std::string x = "x" + std::to_string(a), head = a == 0 ? "head0" : previousHead;
+
+    tile << "    // Layer array " << a << "\n";
+    writer.matrix_(prefix + "Rechannel", channels, inputSize);
+    tile << "    alignas(64) float " << x << "[kTile * " << channels << "];\n"
+         << "    Frames<" << channels << ">(" << x << ", " << channels << ", n).noalias() = Weights<" << channels
+         << ", " << inputSize << ">(" << prefix << "Rechannel) * ConstFrames<" << inputSize << ">(" << previousOutput
+         << ", " << inputSize << ", n);\n";
+    if (a == 0)
+      tile << "    alignas(64) float head0[kTile * " << channels << "] = {};\n";
+    for (size_t l = 0; l < dilations.size(); l++)
+    {
+      const std::string layer = prefix + "Layer" + std::to_string(l);
+      writer.matrix_(layer + "Conv", z, channels, kernelSize);
+      writer.vector_(layer + "ConvBias", z);
+      writer.matrix_(layer + "Mixin", z, conditionSize);
+      writer.matrix_(layer + "Out", channels, channels);
+      writer.vector_(layer + "OutBias", channels);
+      const long lookback = (long)dilations[l] * (kernelSize - 1);
+      const long size = getPowerOfTwo(lookback + TILE_SIZE);
+      const long history = model.state.add_(2 * size * channels);
+      prewarmSamples += lookback;
+      tile << "    layer<" << channels << ", " << kernelSize << ", " << dilations[l] << ", " << size << ", "
+           << (gated ? "true" : "false") << ", " << getActivationType(activation, precision) << ", "
+           << getActivationType("Sigmoid", precision) << ">(\n"
+           << "      " << layer << "Conv, " << layer << "ConvBias, " << layer << "Mixin, " << layer << "Out, "
+           << layer << "OutBias, state + " << history << ", t,\n"
+           << "      n, condition, " << x << ", " << head << ");\n";
+    }
+    writer.matrix_(prefix + "HeadRechannel", headSize, channels);
+    const std::string headOutput = "head" + std::to_string(a + 1);
+    tile << "    alignas(64) float " << headOutput << "[kTile * " << headSize << "];\n"
+         << "    Frames<" << headSize << ">(" << headOutput << ", " << headSize << ", n).noalias() = Weights<"
+         << headSize << ", " << channels << ">(" << prefix << "HeadRechannel) * ConstFrames<" << channels << ">("
+         << head << ", " << channels << ", n);\n";
+    if (headBias)
+    {
+      writer.vector_(prefix + "HeadBias", headSize);
+      tile << "    Frames<" << headSize << ">(" << headOutput << ", " << headSize << ", n).colwise() += Weights<"
+           << headSize << ", 1>(" << prefix << "HeadBias);\n";
+    }
+    previousOutput = x;
+    previousChannels = channels;
+    previousHead = headOutput;
+    previousHeadSize = headSize;
+  }
+  if (previousHeadSize != 1)
+    throw std::runtime_error("WaveNet's last head must have a single output");
+  const float headScale = writer.scalar_();
+  writer.check_done();
+  tile << "    for (int j = 0; j < n; j++)\n"
+       << "      output[start + j] = (NAM_SAMPLE)(" << getLiteral(headScale) << " * " << previousHead << "[j]);\n";
+  model.weights = weights.str();
+  model.tile = tile.str();
+  model.prewarmSamples = prewarmSamples;
+  model.weightBytes = writer.get_bytes();
+}
+
+void writeModel(std::ostream& out, const CompileOptions& options, const nam::dspData& data,
+                const CompiledModel& model, const nam::CostEstimate& cost, const bool hasLoudness,
+                const double loudness)
+{
+  const std::string factory = "make_" + options.name;
+  out << std::setprecision(17);
+  out << "// Generated by nam2cpp from " << options.modelPath << " (" << data.architecture << ", "
+      << nam::activations::get_precision_name(options.precision) << " activations). Don't edit.\n"
+      << "//\n"
+      << "// Build it with the NAM sources, and create instances with\n"
+      << "//   namespace nam { namespace compiled { std::unique_ptr<DSP> " << factory << "(); }; };\n"
+      << "// instead of get_dsp(). The rest of the DSP interface works as usual.\n\n"
+      << "#include <algorithm>\n#include <cmath>\n#include <cstring>\n#include <memory>\n\n#include <Eigen/Dense>\n\n"
+      << "#include \"NAM/activations.h\"\n#include \"NAM/denormal.h\"\n#include \"NAM/dsp.h\"\n\n"
+      << kKernels << "\nnamespace\n{\n"
+      << model.weights << "\n"
+      << "class Model : public nam::DSP\n{\npublic:\n"
+      << "  Model()\n  : DSP(" << data.expected_sample_rate << ")\n  , _state(nullptr, 0)\n  {\n"
+      << "    this->mActivationPrecision = nam::activations::Precision::"
+      << (options.precision == nam::activations::Precision::kFast       ? "kFast"
+          : options.precision == nam::activations::Precision::kLUT      ? "kLUT"
+          : options.precision == nam::activations::Precision::kHardClip ? "kHardClip"
+                                                                       : "kAccurate")
+      << ";\n"
+      << "    this->_prewarm_samples = " << model.prewarmSamples << ";\n"
+      << "    this->mCostEstimate.multiply_adds_per_sample = " << cost.multiply_adds_per_sample << ";\n"
+      << "    this->mCostEstimate.activations_per_sample = " << cost.activations_per_sample << ";\n"
+      << "    this->mCostEstimate.receptive_field = " << cost.receptive_field << ";\n";
+  if (hasLoudness)
+    out << "    this->SetLoudness(" << loudness << ");\n";
+  out << "    this->_layout_arena_();\n  };\n\n"
+      << "  void process(NAM_SAMPLE* input, NAM_SAMPLE* output, const int num_frames) override\n  {\n"
+      << "    this->_prewarm_if_pending_();\n"
+      << "    const nam::denormal::ScopedFlushToZero flushToZero(this->mFlushDenormals);\n"
+      << "    float* state = this->_state.data();\n"
+      << "    for (int start = 0; start < num_frames; start += kTile)\n    {\n"
+      << "      const int n = std::min(kTile, num_frames - start);\n"
+      << "      const long t = this->_t + start;\n";
+  // The tile's code is indented for a function body; it goes one level deeper here.
+  std::stringstream tile(model.tile);
+  std::string line;
+  while (std::getline(tile, line))
+    out << "  " << line << "\n";
+  out << "    }\n  };\n\n"
+      << "  void finalize_(const int num_frames) override\n  {\n"
+      << "    this->DSP::finalize_(num_frames);\n"
+      << "    this->_t += num_frames;\n  };\n\n"
+      << "  nam::CostEstimate GetCostEstimate() const override\n  {\n"
+      << "    nam::CostEstimate estimate = this->DSP::GetCostEstimate();\n"
+      << "    estimate.weight_bytes = " << model.weightBytes << ";\n"
+      << "    return estimate;\n  };\n\n"
+      << "private:\n"
+      << "  // Every layer's history, in one block of the arena\n"
+      << "  nam::VectorMap _state;\n"
+      << "  // Frames processed so far\n"
+      << "  long _t = 0;\n\n"
+      << "  void _carve_(nam::Arena& arena) override { arena.carve_state_(this->_state, " << model.state.get_size()
+      << "); };\n"
+      << "};\n"
+      << "}; // namespace\n\n"
+      << "namespace nam\n{\nnamespace compiled\n{\n"
+      << "std::unique_ptr<DSP> " << factory << "();\n\n"
+      << "std::unique_ptr<DSP> " << factory << "()\n{\n"
+      << "  auto model = std::make_unique<Model>();\n"
+      << "  model->prewarm();\n"
+      << "  return model;\n}\n"
+      << "}; // namespace compiled\n}; // namespace nam\n";
+}
+
+int main(int argc, char* argv[])
+{
+  CompileOptions options;
+  if (!parseArgs(argc, argv, options))
+  {
+    printUsage();
+    return 1;
+  }
+  if (options.name.empty())
+  {
+    std::string stem = options.modelPath.substr(options.modelPath.find_last_of("/\\") + 1);
+    options.name = stem.substr(0, stem.find_last_of('.'));
+  }
+  options.name = getIdentifier(options.name);
+
+  try
+  {
+    nam::dspData data;
+    // Loading it also checks that it's a model we can run, and gives us its costs.
+    std::unique_ptr<nam::DSP> reference = nam::get_dsp(options.modelPath, data, options.precision);
+    const nam::CostEstimate cost = reference->GetCostEstimate();
+    CompiledModel model;
+    if (data.architecture != "WaveNet")
+      throw std::runtime_error("nam2cpp only compiles WaveNet models, not " + data.architecture);
+    compileWaveNet(data, options.precision, model);
+
+    if (options.outputPath == "-")
+      writeModel(std::cout, options, data, model, cost, reference->HasLoudness(),
+                 reference->HasLoudness() ? reference->GetLoudness() : 0.0);
+    else
+    {
+      std::ofstream out(options.outputPath);
+      if (!out)
+        throw std::runtime_error("Can't write " + options.outputPath);
+      writeModel(out, options, data, model, cost, reference->HasLoudness(),
+                 reference->HasLoudness() ? reference->GetLoudness() : 0.0);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "nam2cpp: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,488 @@
+// namd: serves many model streams to local clients from one process.
+//
+// Clients control streams through a Unix domain socket and move audio through shared memory (see namd_protocol.h).
+// A fixed pool of workers, each pinned to its own core, runs whichever waiting block is due soonest. Each model file
+// is parsed once, and every stream of it is an instance made from those weights.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "NAM/dsp.h"
+#include "NAM/executor.h"
+#include "NAM/model_cache.h"
+#include "NAM/resampler.h"
+#include "namd_protocol.h"
+
+#define DEFAULT_SOCKET_PATH "/tmp/namd.sock"
+#define DEFAULT_SLOTS 8
+#define MAX_SLOTS 1024
+#define MAX_BLOCK_SIZE 65536
+// Idle workers spin this many times before they start sleeping
+#define SPIN_LIMIT 64
+#define SLEEP_MICROSECONDS 50
+// How often blocked calls look up to see if the server is stopping
+#define POLL_MILLISECONDS 200
+
+namespace
+{
+std::atomic<bool> sStopping{false};
+
+void onSignal(int)
+{
+  sStopping.store(true);
+}
+
+struct Stream
+{
+  int id = 0;
+  int connection = 0;
+  std::string modelPath;
+  std::string shmName;
+  void* memory = nullptr;
+  size_t size = 0;
+  namd::SharedStream shared;
+  std::unique_ptr<nam::ResamplingDSP> model;
+  uint64_t deadlineNanoseconds = 0;
+  // Held by the worker running it, so that its blocks go through the model one at a time and in order
+  std::atomic<bool> busy{false};
+  // Scratch at the DSP's sample type
+  std::vector<NAM_SAMPLE> input;
+  std::vector<NAM_SAMPLE> output;
+  std::atomic<uint64_t> busyNanoseconds{0};
+
+  ~Stream()
+  {
+    if (memory != nullptr)
+      munmap(memory, size);
+    if (!shmName.empty())
+      shm_unlink(shmName.c_str());
+  }
+};
+
+class Server
+{
+public:
+  Server(const int numWorkers, const bool pin)
+  {
+    // Placed like nam::Executor's workers, filling one NUMA node before the next
+    const std::vector<nam::executor::CPU> cpus =
+      pin ? nam::executor::place_workers(numWorkers, nam::executor::Placement::kCompact)
+          : std::vector<nam::executor::CPU>();
+    mPinned = !cpus.empty();
+    for (int i = 0; i < numWorkers; i++)
+    {
+      mWorkers.emplace_back([this]() { RunWorker(); });
+      if (!cpus.empty())
+        mPinned = nam::executor::pin_thread(mWorkers.back(), cpus[i].id) && mPinned;
+    }
+  }
+
+  ~Server()
+  {
+    mStopping.store(true);
+    for (std::thread& worker : mWorkers)
+      worker.join();
+  }
+
+  bool IsPinned() const { return mPinned; }
+
+  nlohmann::json Open(const nlohmann::json& request, const int connection)
+  {
+    const std::string modelPath = request.value("model", "");
+    const double sampleRate = request.value("sample_rate", 48000.0);
+    const int blockSize = request.value("block_size", 0);
+    const int numSlots = request.value("slots", DEFAULT_SLOTS);
+    if (blockSize <= 0 || blockSize > MAX_BLOCK_SIZE)
+      return Error("block_size must be between 1 and " + std::to_string(MAX_BLOCK_SIZE));
+    if (numSlots < 2 || numSlots > MAX_SLOTS)
+      return Error("slots must be between 2 and " + std::to_string(MAX_SLOTS));
+    if (sampleRate <= 0.0)
+      return Error("sample_rate must be positive");
+    // One block's worth of time, unless the client says otherwise
+    const double deadlineMicroseconds = request.value("deadline_us", 1.0e6 * blockSize / sampleRate);
+
+    // Models already in use (by any stream, or by anything else in the process) aren't parsed again.
+    std::unique_ptr<nam::DSP> instance;
+    try
+    {
+      instance = nam::ModelCache::get_global().get_dsp(modelPath, nam::activations::Precision::kFast);
+    }
+    catch (const std::exception& e)
+    {
+      return Error("Failed to load " + modelPath + ": " + e.what());
+    }
+
+    auto stream = std::make_shared<Stream>();
+    stream->id = mNextId++;
+    stream->connection = connection;
+    stream->modelPath = modelPath;
+    stream->model = std::make_unique<nam::ResamplingDSP>(std::move(instance), sampleRate);
+    stream->model->SetFlushDenormals(true);
+    stream->deadlineNanoseconds = (uint64_t)(1000.0 * deadlineMicroseconds);
+    stream->input.resize(blockSize);
+    stream->output.resize(blockSize);
+
+    // The client maps this by name.
+    stream->shmName = "/namd." + std::to_string(getpid()) + "." + std::to_string(stream->id);
+    stream->size = namd::SharedStream::GetSize(blockSize, numSlots);
+    const int file = shm_open(stream->shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (file < 0)
+    {
+      stream->shmName.clear();
+      return Error("Failed to create shared memory");
+    }
+    const bool sized = ftruncate(file, (off_t)stream->size) == 0;
+    void* memory = sized ? mmap(nullptr, stream->size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+    close(file);
+    if (memory == MAP_FAILED)
+      return Error("Failed to map shared memory");
+    stream->memory = memory;
+    namd::StreamHeader* header = new (memory) namd::StreamHeader();
+    header->magic = namd::kMagic;
+    header->version = namd::kVersion;
+    header->blockSize = blockSize;
+    header->numSlots = numSlots;
+    stream->shared = namd::SharedStream(memory, blockSize, numSlots);
+
+    {
+      std::lock_guard<std::mutex> lock(mStreamsMutex);
+      mStreams.push_back(stream);
+      mGeneration++;
+    }
+    return {{"ok", true},
+            {"stream", stream->id},
+            {"shm", stream->shmName},
+            {"block_size", blockSize},
+            {"slots", numSlots},
+            {"latency", stream->model->GetLatency()},
+            {"model_sample_rate", stream->model->GetModelSampleRate()}};
+  }
+
+  // The stream only goes away once no worker is running it.
+  bool Close(const int id, const int connection)
+  {
+    std::lock_guard<std::mutex> lock(mStreamsMutex);
+    const auto match = [&](const std::shared_ptr<Stream>& stream) {
+      return stream->connection == connection && (id < 0 || stream->id == id);
+    };
+    const auto removed = std::remove_if(mStreams.begin(), mStreams.end(), match);
+    const bool any = removed != mStreams.end();
+    mStreams.erase(removed, mStreams.end());
+    mGeneration++;
+    return any;
+  }
+
+  nlohmann::json GetStats()
+  {
+    nlohmann::json streams = nlohmann::json::array();
+    {
+      std::lock_guard<std::mutex> lock(mStreamsMutex);
+      for (const auto& stream : mStreams)
+      {
+        const namd::StreamHeader& header = stream->shared.GetHeader();
+        streams.push_back({{"stream", stream->id},
+                           {"model", stream->modelPath},
+                           {"blocks", header.processed.load()},
+                           {"deadline_misses", header.deadlineMisses.load()},
+                           {"busy_seconds", 1.0e-9 * stream->busyNanoseconds.load()}});
+      }
+    }
+    const nam::ModelCache::Stats cache = nam::ModelCache::get_global().get_stats();
+    return {{"ok", true},
+            {"workers", mWorkers.size()},
+            {"pinned", mPinned},
+            {"blocks", mBlocks.load()},
+            {"deadline_misses", mDeadlineMisses.load()},
+            {"cache",
+             {{"models", cache.num_entries},
+              {"bytes", cache.bytes},
+              {"hits", cache.hits},
+              {"misses", cache.misses},
+              {"evictions", cache.evictions}}},
+            {"streams", streams}};
+  }
+
+private:
+  std::vector<std::thread> mWorkers;
+  std::atomic<bool> mStopping{false};
+  bool mPinned = false;
+
+  std::mutex mStreamsMutex;
+  std::vector<std::shared_ptr<Stream>> mStreams;
+  // Bumped whenever mStreams changes, so that workers know to take a new copy
+  std::atomic<uint64_t> mGeneration{0};
+  std::atomic<int> mNextId{1};
+
+  std::atomic<uint64_t> mBlocks{0};
+  std::atomic<uint64_t> mDeadlineMisses{0};
+
+  static nlohmann::json Error(const std::string& message) { return {{"ok", false}, {"error", message}}; }
+
+  // How many blocks of `stream` are waiting, from `processed` on. The client writes `submitted`, so it's only
+  // believed as far as there are slots.
+  static uint64_t GetWaiting(const Stream& stream, const uint64_t processed)
+  {
+    const uint64_t submitted = stream.shared.GetHeader().submitted.load(std::memory_order_acquire);
+    return submitted > processed ? std::min<uint64_t>(submitted - processed, stream.shared.GetNumSlots()) : 0;
+  }
+
+  // Earliest deadline first: the stream whose next waiting block is due soonest, claimed. nullptr if nothing's
+  // waiting. (Its output slot is always free: clients can't submit more blocks than there are slots.)
+  std::shared_ptr<Stream> Claim(const std::vector<std::shared_ptr<Stream>>& streams)
+  {
+    std::shared_ptr<Stream> best;
+    uint64_t bestDeadline = std::numeric_limits<uint64_t>::max();
+    for (const auto& stream : streams)
+    {
+      if (stream->busy.load(std::memory_order_relaxed))
+        continue;
+      const namd::StreamHeader& header = stream->shared.GetHeader();
+      const uint64_t next = header.processed.load(std::memory_order_acquire);
+      if (GetWaiting(*stream, next) == 0)
+        continue;
+      const uint64_t deadline = stream->shared.GetSubmittedAt(next) + stream->deadlineNanoseconds;
+      if (deadline < bestDeadline)
+      {
+        best = stream;
+        bestDeadline = deadline;
+      }
+    }
+    if (best == nullptr || best->busy.exchange(true, std::memory_order_acquire))
+      return nullptr;
+    return best;
+  }
+
+  void Process(Stream& stream)
+  {
+    namd::StreamHeader& header = stream.shared.GetHeader();
+    // Not the header's, which the client could have changed
+    const int blockSize = (int)stream.shared.GetBlockSize();
+    // Another worker may have run it between the look and the claim.
+    const uint64_t block = header.processed.load(std::memory_order_acquire);
+    if (GetWaiting(stream, block) > 0)
+    {
+      const uint64_t start = namd::Now();
+      const float* input = stream.shared.GetInput(block);
+      std::copy(input, input + blockSize, stream.input.begin());
+      stream.model->process(stream.input.data(), stream.output.data(), blockSize);
+      stream.model->finalize_(blockSize);
+      std::copy(stream.output.begin(), stream.output.end(), stream.shared.GetOutput(block));
+      const uint64_t end = namd::Now();
+      if (end > stream.shared.GetSubmittedAt(block) + stream.deadlineNanoseconds)
+      {
+        header.deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+        mDeadlineMisses++;
+      }
+      stream.busyNanoseconds += end - start;
+      mBlocks++;
+      header.processed.store(block + 1, std::memory_order_release);
+    }
+    stream.busy.store(false, std::memory_order_release);
+  }
+
+  void RunWorker()
+  {
+    std::vector<std::shared_ptr<Stream>> streams;
+    uint64_t generation = std::numeric_limits<uint64_t>::max();
+    int spins = 0;
+    while (!mStopping.load(std::memory_order_relaxed))
+    {
+      if (mGeneration.load(std::memory_order_acquire) != generation)
+      {
+        std::lock_guard<std::mutex> lock(mStreamsMutex);
+        streams = mStreams;
+        generation = mGeneration.load();
+      }
+      std::shared_ptr<Stream> stream = Claim(streams);
+      if (stream != nullptr)
+      {
+        Process(*stream);
+        spins = 0;
+      }
+      else if (spins++ < SPIN_LIMIT)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(SLEEP_MICROSECONDS));
+    }
+  }
+};
+
+// Answers one client until it hangs up, then closes its streams.
+void serveConnection(Server& server, const int socket, const int connection)
+{
+  std::string received;
+  while (!sStopping.load())
+  {
+    pollfd ready{socket, POLLIN, 0};
+    if (poll(&ready, 1, POLL_MILLISECONDS) <= 0)
+      continue;
+    char buffer[4096];
+    const ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+    if (n <= 0)
+      break;
+    received.append(buffer, n);
+    size_t newline;
+    while ((newline = received.find('\n')) != std::string::npos)
+    {
+      const std::string message = received.substr(0, newline);
+      received.erase(0, newline + 1);
+      // Blank lines are harmless (e.g. from someone typing at the socket)
+      if (message.find_first_not_of(" \t\r") == std::string::npos)
+        continue;
+      const nlohmann::json request = nlohmann::json::parse(message, nullptr, false);
+      nlohmann::json reply;
+      // A field of the wrong type (e.g. "block_size": "64") throws, and has to cost the client its reply, not the
+      // server every stream.
+      try
+      {
+        const std::string op = request.is_object() ? request.value("op", "") : "";
+        if (op == "open")
+          reply = server.Open(request, connection);
+        else if (op == "close")
+          reply = {{"ok", server.Close(request.value("stream", 0), connection)}};
+        else if (op == "stats")
+          reply = server.GetStats();
+        else
+          reply = {{"ok", false}, {"error", "Unknown request"}};
+      }
+      catch (const std::exception& e)
+      {
+        reply = {{"ok", false}, {"error", std::string("Bad request: ") + e.what()}};
+      }
+      const std::string line = reply.dump() + "\n";
+      for (size_t sent = 0; sent < line.size();)
+      {
+        const ssize_t written = send(socket, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0)
+          break;
+        sent += written;
+      }
+    }
+  }
+  server.Close(-1, connection);
+  close(socket);
+}
+
+void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [--socket <path>] [--workers <n>] [--no-pin] [--cache-mb <n>]\n"
+            << "  --socket    where to listen (default " << DEFAULT_SOCKET_PATH << ")\n"
+            << "  --workers   inference threads (default: one per core)\n"
+            << "  --no-pin    don't pin each worker to its own core\n"
+            << "  --cache-mb  parsed model data to keep, in MB (default "
+            << (nam::ModelCache::kDefaultBudgetBytes >> 20) << ")" << std::endl;
+}
+}; // namespace
+
+int main(int argc, char* argv[])
+{
+  std::string socketPath = DEFAULT_SOCKET_PATH;
+  int numWorkers = std::max(1, (int)nam::executor::get_allowed_cpus().size());
+  bool pin = true;
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    // Numbers that don't parse throw.
+    try
+    {
+      if (arg == "--socket" && i + 1 < argc)
+        socketPath = argv[++i];
+      else if (arg == "--workers" && i + 1 < argc)
+        numWorkers = std::max(1, std::stoi(argv[++i]));
+      else if (arg == "--no-pin")
+        pin = false;
+      else if (arg == "--cache-mb" && i + 1 < argc)
+        nam::ModelCache::get_global().set_budget_((size_t)std::stoul(argv[++i]) << 20);
+      else
+      {
+        printUsage(argv[0]);
+        return 1;
+      }
+    }
+    catch (const std::exception&)
+    {
+      std::cerr << "Invalid value for " << arg << ": " << argv[i] << "\n";
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path))
+  {
+    std::cerr << "Socket path is too long" << std::endl;
+    return 1;
+  }
+  strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  // A socket left behind by a server that didn't get to clean up
+  unlink(socketPath.c_str());
+  if (listener < 0 || bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+  {
+    std::cerr << "Failed to listen on " << socketPath << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  // Each connection's thread, and whether it's finished and can be joined
+  std::vector<std::pair<std::thread, std::shared_ptr<std::atomic<bool>>>> connections;
+  {
+    Server server(numWorkers, pin);
+    std::cout << "namd listening on " << socketPath << " with " << numWorkers << " workers"
+              << (server.IsPinned() ? ", each pinned to a core" : "") << std::endl;
+    int nextConnection = 1;
+    while (!sStopping.load())
+    {
+      pollfd ready{listener, POLLIN, 0};
+      if (poll(&ready, 1, POLL_MILLISECONDS) <= 0)
+        continue;
+      const int client = accept(listener, nullptr, nullptr);
+      if (client < 0)
+        continue;
+      auto done = std::make_shared<std::atomic<bool>>(false);
+      std::thread thread([&server, client, done, connection = nextConnection++]() {
+        serveConnection(server, client, connection);
+        done->store(true);
+      });
+      connections.emplace_back(std::move(thread), done);
+      // Tidy up after the clients that have gone
+      for (auto& finished : connections)
+        if (finished.second->load() && finished.first.joinable())
+          finished.first.join();
+      connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                       [](const auto& connection) { return !connection.first.joinable(); }),
+                        connections.end());
+    }
+    for (auto& connection : connections)
+      connection.first.join();
+    const nlohmann::json stats = server.GetStats();
+    std::cout << "Stopping after " << stats["blocks"] << " blocks (" << stats["deadline_misses"]
+              << " past their deadline)" << std::endl;
+  }
+  close(listener);
+  unlink(socketPath.c_str());
+  return 0;
+}
@@ -0,0 +1,272 @@
+#pragma once
+// What namd and its clients share: the control messages on its Unix domain socket, the layout of each stream's
+// shared memory, and a client.
+//
+// Control is one JSON object per line in each direction. A client opens a stream with
+//
+//   {"op": "open", "model": "/path/to/model.nam", "sample_rate": 48000, "block_size": 128, "deadline_us": 2000}
+//
+// ("deadline_us" defaults to one block's duration and "slots" to 8) and gets back
+//
+//   {"ok": true, "stream": 3, "shm": "/namd.1234.3", "block_size": 128, "slots": 8, "latency": 0,
+//    "model_sample_rate": 48000}
+//
+// or {"ok": false, "error": "..."}. {"op": "close", "stream": 3} ends a stream, and so does hanging up.
+// {"op": "stats"} describes the server and its streams.
+//
+// Audio never goes through the socket. Each stream is mono and moves in blocks of block_size frames through a ring of
+// `slots` slots in the shared memory that "shm" names. The client writes input block k into slot k % slots and bumps
+// `submitted`; a worker runs it through the stream's model, writes output block k to the same slot and bumps
+// `processed`; the client reads it and bumps `consumed`. Output lags input by "latency" frames (non-zero only when
+// the server resamples to the model's rate).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+namespace namd
+{
+// "namd", little-endian
+constexpr uint32_t kMagic = 0x646d616e;
+constexpr uint32_t kVersion = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared counters have to work across processes");
+
+// Nanoseconds on the clock that clients and server share
+inline uint64_t Now()
+{
+  const auto sinceEpoch = std::chrono::steady_clock::now().time_since_epoch();
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch).count();
+}
+
+// At the start of a stream's shared memory. The counters are in blocks and only go up; each is written by one side
+// and sits on its own cache line.
+struct StreamHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t blockSize;
+  uint32_t numSlots;
+  // Client
+  alignas(64) std::atomic<uint64_t> submitted;
+  // Server
+  alignas(64) std::atomic<uint64_t> processed;
+  std::atomic<uint64_t> deadlineMisses;
+  // Client
+  alignas(64) std::atomic<uint64_t> consumed;
+};
+
+// A view of a stream's shared memory, from either side. After the header come the slots, each a cache line holding
+// the time its input was submitted, then the input block, then the output block, each starting on a cache line.
+//
+// The view keeps its own copy of the stream's geometry rather than reading it from the header, which the client can
+// write: the server's comes from the "open" request it checked, and the client's from the reply.
+class SharedStream
+{
+public:
+  static size_t GetBlockBytes(const uint32_t blockSize) { return (blockSize * sizeof(float) + 63) / 64 * 64; }
+  static size_t GetSlotBytes(const uint32_t blockSize) { return 64 + 2 * GetBlockBytes(blockSize); }
+  static size_t GetHeaderBytes() { return (sizeof(StreamHeader) + 63) / 64 * 64; }
+  static size_t GetSize(const uint32_t blockSize, const uint32_t numSlots)
+  {
+    return GetHeaderBytes() + numSlots * GetSlotBytes(blockSize);
+  }
+
+  SharedStream() = default;
+  SharedStream(void* memory, const uint32_t blockSize, const uint32_t numSlots)
+  : mHeader((StreamHeader*)memory)
+  , mSlots((uint8_t*)memory + GetHeaderBytes())
+  , mBlockSize(blockSize)
+  , mNumSlots(numSlots)
+  {
+  }
+
+  StreamHeader& GetHeader() const { return *mHeader; }
+  uint64_t& GetSubmittedAt(const uint64_t block) const { return *(uint64_t*)GetSlot(block); }
+  float* GetInput(const uint64_t block) const { return (float*)(GetSlot(block) + 64); }
+  float* GetOutput(const uint64_t block) const { return (float*)(GetSlot(block) + 64 + GetBlockBytes(mBlockSize)); }
+  uint32_t GetBlockSize() const { return mBlockSize; }
+  uint32_t GetNumSlots() const { return mNumSlots; }
+
+private:
+  StreamHeader* mHeader = nullptr;
+  uint8_t* mSlots = nullptr;
+  uint32_t mBlockSize = 0;
+  uint32_t mNumSlots = 1;
+
+  uint8_t* GetSlot(const uint64_t block) const { return mSlots + (block % mNumSlots) * GetSlotBytes(mBlockSize); }
+};
+
+// A connection to namd
+class Client
+{
+public:
+  Client() = default;
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+  // Hanging up closes every stream opened through this connection.
+  ~Client()
+  {
+    if (mSocket >= 0)
+      close(mSocket);
+  }
+
+  bool Connect(const std::string& socketPath)
+  {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+      return false;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    mSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mSocket < 0)
+      return false;
+    if (connect(mSocket, (const sockaddr*)&address, sizeof(address)) != 0)
+    {
+      close(mSocket);
+      mSocket = -1;
+      return false;
+    }
+    return true;
+  }
+
+  // Sends one message and waits for the reply. Returns {"ok": false, ...} if the connection fails.
+  nlohmann::json Request(const nlohmann::json& message)
+  {
+    const std::string line = message.dump() + "\n";
+    for (size_t sent = 0; sent < line.size();)
+    {
+      const ssize_t n = send(mSocket, line.data() + sent, line.size() - sent, 0);
+      if (n <= 0)
+        return {{"ok", false}, {"error", "Lost the connection to namd"}};
+      sent += n;
+    }
+    size_t newline;
+    while ((newline = mReceived.find('\n')) == std::string::npos)
+    {
+      char buffer[4096];
+      const ssize_t n = recv(mSocket, buffer, sizeof(buffer), 0);
+      if (n <= 0)
+        return {{"ok", false}, {"error", "Lost the connection to namd"}};
+      mReceived.append(buffer, n);
+    }
+    const std::string reply = mReceived.substr(0, newline);
+    mReceived.erase(0, newline + 1);
+    return nlohmann::json::parse(reply, nullptr, false);
+  }
+
+private:
+  int mSocket = -1;
+  // Read but not yet returned
+  std::string mReceived;
+};
+
+// The client's end of a stream
+class ClientStream
+{
+public:
+  ClientStream() = default;
+  ClientStream(const ClientStream&) = delete;
+  ClientStream& operator=(const ClientStream&) = delete;
+  ~ClientStream() { Unmap(); }
+
+  // Sends an "open" request and maps the stream's memory. On failure, `error` says why.
+  bool Open(Client& client, const nlohmann::json& request, std::string& error)
+  {
+    nlohmann::json message = request;
+    message["op"] = "open";
+    const nlohmann::json reply = client.Request(message);
+    if (!reply.is_object() || !reply.value("ok", false))
+    {
+      error = reply.is_object() ? reply.value("error", "Unknown error") : "Unreadable reply";
+      return false;
+    }
+    mId = reply["stream"];
+    mLatency = reply["latency"];
+    const std::string name = reply["shm"];
+    const int file = shm_open(name.c_str(), O_RDWR, 0);
+    if (file < 0)
+    {
+      error = "Failed to open shared memory " + name;
+      return false;
+    }
+    const uint32_t blockSize = reply["block_size"];
+    const uint32_t numSlots = reply["slots"];
+    mSize = SharedStream::GetSize(blockSize, numSlots);
+    void* memory = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
+    if (memory == MAP_FAILED)
+    {
+      error = "Failed to map shared memory " + name;
+      return false;
+    }
+    mMemory = memory;
+    mShared = SharedStream(memory, blockSize, numSlots);
+    const StreamHeader& header = mShared.GetHeader();
+    if (header.magic != kMagic || header.version != kVersion || header.blockSize != blockSize
+        || header.numSlots != numSlots)
+    {
+      Unmap();
+      error = "namd speaks a different version";
+      return false;
+    }
+    return true;
+  }
+
+  int GetId() const { return mId; }
+  int GetBlockSize() const { return (int)mShared.GetBlockSize(); }
+  int GetLatency() const { return mLatency; }
+  uint64_t GetDeadlineMisses() const { return mShared.GetHeader().deadlineMisses.load(std::memory_order_relaxed); }
+
+  // Queues one block of input. Returns false (and does nothing) if every slot is in use.
+  bool Submit(const float* block)
+  {
+    StreamHeader& header = mShared.GetHeader();
+    const uint64_t submitted = header.submitted.load(std::memory_order_relaxed);
+    if (submitted - header.consumed.load(std::memory_order_relaxed) >= mShared.GetNumSlots())
+      return false;
+    std::copy(block, block + mShared.GetBlockSize(), mShared.GetInput(submitted));
+    mShared.GetSubmittedAt(submitted) = Now();
+    header.submitted.store(submitted + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Takes the next block of output. Returns false (and does nothing) if it isn't ready.
+  bool Receive(float* block)
+  {
+    StreamHeader& header = mShared.GetHeader();
+    const uint64_t consumed = header.consumed.load(std::memory_order_relaxed);
+    if (consumed >= header.processed.load(std::memory_order_acquire))
+      return false;
+    const float* output = mShared.GetOutput(consumed);
+    std::copy(output, output + mShared.GetBlockSize(), block);
+    header.consumed.store(consumed + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  SharedStream mShared;
+  void* mMemory = nullptr;
+  size_t mSize = 0;
+  int mId = -1;
+  int mLatency = 0;
+
+  void Unmap()
+  {
+    if (mMemory != nullptr)
+      munmap(mMemory, mSize);
+    mMemory = nullptr;
+  }
+};
+}; // namespace namd
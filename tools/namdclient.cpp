@@ -0,0 +1,195 @@
+// namdclient: reamps a WAV file through a running namd, to try the server out and to load it up.
+//
+// Every channel of the input goes through its own stream. --copies opens that many streams per channel (only the first
+// one's output is written) to see how the server does with more streams; --realtime paces the blocks as an audio
+// interface would instead of sending them as fast as the server takes them.
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "NAM/wav.h"
+#include "namd_protocol.h"
+
+#define DEFAULT_SOCKET_PATH "/tmp/namd.sock"
+#define DEFAULT_BLOCK_SIZE 128
+#define SLEEP_MICROSECONDS 20
+
+void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program << " <model_filename> <input_filename> <output_filename> [options]\n"
+            << "  --socket <path>       namd's socket (default " << DEFAULT_SOCKET_PATH << ")\n"
+            << "  --block-size <n>      frames per block (default " << DEFAULT_BLOCK_SIZE << ")\n"
+            << "  --deadline-us <us>    per-block deadline (default: one block's duration)\n"
+            << "  --copies <n>          streams per channel (default 1)\n"
+            << "  --realtime            send blocks no faster than real time" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  std::vector<std::string> positional;
+  std::string socketPath = DEFAULT_SOCKET_PATH;
+  int blockSize = DEFAULT_BLOCK_SIZE;
+  double deadlineMicroseconds = -1.0;
+  int copies = 1;
+  bool realtime = false;
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    // Numbers that don't parse throw.
+    try
+    {
+      if (arg == "--socket" && hasValue)
+        socketPath = argv[++i];
+      else if (arg == "--block-size" && hasValue)
+        blockSize = std::stoi(argv[++i]);
+      else if (arg == "--deadline-us" && hasValue)
+        deadlineMicroseconds = std::stod(argv[++i]);
+      else if (arg == "--copies" && hasValue)
+        copies = std::max(1, std::stoi(argv[++i]));
+      else if (arg == "--realtime")
+        realtime = true;
+      else if (arg.size() > 1 && arg[0] == '-')
+      {
+        printUsage(argv[0]);
+        return 1;
+      }
+      else
+        positional.push_back(arg);
+    }
+    catch (const std::exception&)
+    {
+      std::cerr << "Invalid value for " << arg << ": " << argv[i] << "\n";
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
+  if (positional.size() != 3)
+  {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  dsp::wav::Reader input;
+  const auto rc = input.Open(positional[1].c_str());
+  if (rc != dsp::wav::LoadReturnCode::SUCCESS)
+  {
+    std::cerr << "Failed to read " << positional[1] << ": " << dsp::wav::GetMsgForLoadReturnCode(rc) << std::endl;
+    return 1;
+  }
+  const int numChannels = input.GetNumChannels();
+  const int64_t numFrames = input.GetNumFrames();
+  std::vector<float> interleaved(numFrames * numChannels);
+  input.Read(interleaved.data(), numFrames);
+
+  namd::Client client;
+  if (!client.Connect(socketPath))
+  {
+    std::cerr << "Failed to connect to namd at " << socketPath << std::endl;
+    return 1;
+  }
+  nlohmann::json request = {
+    {"model", positional[0]}, {"sample_rate", input.GetSampleRate()}, {"block_size", blockSize}};
+  if (deadlineMicroseconds > 0.0)
+    request["deadline_us"] = deadlineMicroseconds;
+  std::vector<std::unique_ptr<namd::ClientStream>> streams;
+  for (int i = 0; i < numChannels * copies; i++)
+  {
+    auto stream = std::make_unique<namd::ClientStream>();
+    std::string error;
+    if (!stream->Open(client, request, error))
+    {
+      std::cerr << "Failed to open a stream: " << error << std::endl;
+      return 1;
+    }
+    streams.push_back(std::move(stream));
+  }
+
+  // Enough blocks for the input and, after it, the silence that brings out the server's resampling delay
+  const int latency = streams[0]->GetLatency();
+  const int64_t numBlocks = (numFrames + latency + blockSize - 1) / blockSize;
+  std::vector<float> output(numBlocks * blockSize * numChannels, 0.0f);
+  std::vector<int64_t> submitted(streams.size(), 0);
+  std::vector<int64_t> received(streams.size(), 0);
+  std::vector<float> block(blockSize);
+  std::vector<double> roundTrips;
+  std::vector<uint64_t> submittedAt(numBlocks);
+  const double blockSeconds = blockSize / input.GetSampleRate();
+  const auto start = std::chrono::steady_clock::now();
+
+  bool done = false;
+  while (!done)
+  {
+    done = true;
+    bool progress = false;
+    for (size_t s = 0; s < streams.size(); s++)
+    {
+      const int channel = (int)(s % numChannels);
+      const bool first = s < (size_t)numChannels;
+      // Submit what's due
+      while (submitted[s] < numBlocks)
+      {
+        const std::chrono::duration<double> due(submitted[s] * blockSeconds);
+        if (realtime && std::chrono::steady_clock::now() - start < due)
+          break;
+        const int64_t frame = submitted[s] * blockSize;
+        for (int i = 0; i < blockSize; i++)
+          block[i] = frame + i < numFrames ? interleaved[(frame + i) * numChannels + channel] : 0.0f;
+        if (!streams[s]->Submit(block.data()))
+          break;
+        if (s == 0)
+          submittedAt[submitted[s]] = namd::Now();
+        submitted[s]++;
+        progress = true;
+      }
+      // Collect what's ready
+      while (received[s] < submitted[s] && streams[s]->Receive(block.data()))
+      {
+        if (s == 0)
+          roundTrips.push_back(1.0e-3 * (namd::Now() - submittedAt[received[s]]));
+        if (first)
+          for (int i = 0; i < blockSize; i++)
+            output[(received[s] * blockSize + i) * numChannels + channel] = block[i];
+        received[s]++;
+        progress = true;
+      }
+      if (received[s] < numBlocks)
+        done = false;
+    }
+    if (!progress)
+      std::this_thread::sleep_for(std::chrono::microseconds(SLEEP_MICROSECONDS));
+  }
+  const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Drop the delay
+  dsp::wav::Writer writer;
+  if (!writer.Open(positional[2].c_str(), input.GetSampleRate(), numChannels, input.GetFormat(), numFrames)
+      || !writer.Write(output.data() + (size_t)latency * numChannels, numFrames) || !writer.Close())
+  {
+    std::cerr << "Failed to write " << positional[2] << std::endl;
+    return 1;
+  }
+
+  uint64_t misses = 0;
+  for (const auto& stream : streams)
+    misses += stream->GetDeadlineMisses();
+  std::sort(roundTrips.begin(), roundTrips.end());
+  const auto percentile = [&](const double p) { return roundTrips[(size_t)(p * (roundTrips.size() - 1))]; };
+  const double audioSeconds = (double)numFrames / input.GetSampleRate() * streams.size();
+  std::cout << std::fixed << std::setprecision(1) << streams.size() << " streams of " << numBlocks << " blocks in "
+            << wallSeconds << " s (" << audioSeconds / wallSeconds << "x real time); ";
+  // Nothing to time if no block made it there and back (e.g. an empty input at the model's own rate).
+  if (roundTrips.empty())
+    std::cout << "no round trips; ";
+  else
+    std::cout << "round trip p50 " << percentile(0.5) << " us, p99 " << percentile(0.99) << " us, max "
+              << roundTrips.back() << " us; ";
+  std::cout << misses << " blocks past their deadline" << std::endl;
+  return 0;
+}
@@ -0,0 +1,160 @@
+#pragma once
+// Hardware performance counters for the benchmark tools, via Linux perf_event_open(2).
+//
+// Each counter is opened on its own so that one that's missing (common in containers and VMs, or with a strict
+// kernel.perf_event_paranoid) doesn't take the others with it. Counters that can't be opened read as unavailable
+// and everything else carries on. On other platforms, nothing is available.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+  #include <cerrno>
+#endif
+
+class PerfCounters
+{
+public:
+  enum Counter
+  {
+    kCycles = 0,
+    kInstructions,
+    kL1DMisses,
+    kLLCMisses,
+    kBranchMisses,
+    kPageFaults,
+    kNumCounters
+  };
+
+  // What was counted between start() and stop(). Unavailable counters are flagged as such (not marked with NaN, which
+  // fast-math builds can't be trusted to notice) and read as 0.
+  struct Readings
+  {
+    double values[kNumCounters] = {};
+    bool valid[kNumCounters] = {};
+
+    double get(const Counter counter) const { return values[counter]; };
+    bool has(const Counter counter) const { return valid[counter]; };
+  };
+
+  // Counts the calling thread (and any threads it starts later), user space only where the kernel insists.
+  PerfCounters()
+  {
+    for (int i = 0; i < kNumCounters; i++)
+      mFds[i] = -1;
+#ifdef __linux__
+    mFds[kCycles] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    mFds[kInstructions] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    mFds[kL1DMisses] = Open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    // The "generic" cache miss event is last-level cache misses on x86 and ARM.
+    mFds[kLLCMisses] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    mFds[kBranchMisses] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    mFds[kPageFaults] = Open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+#else
+    mError = "perf_event_open is Linux-only";
+#endif
+  };
+  ~PerfCounters()
+  {
+#ifdef __linux__
+    for (int i = 0; i < kNumCounters; i++)
+      if (mFds[i] >= 0)
+        close(mFds[i]);
+#endif
+  };
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool IsAvailable(const Counter counter) const { return mFds[counter] >= 0; };
+  bool IsAnyAvailable() const
+  {
+    for (int i = 0; i < kNumCounters; i++)
+      if (IsAvailable((Counter)i))
+        return true;
+    return false;
+  };
+  // Why the first counter that couldn't be opened couldn't be (empty if they all opened)
+  const std::string& GetError() const { return mError; };
+
+  void Start()
+  {
+#ifdef __linux__
+    for (int i = 0; i < kNumCounters; i++)
+      if (mFds[i] >= 0)
+      {
+        ioctl(mFds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(mFds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+  };
+
+  Readings Stop()
+  {
+    Readings readings;
+#ifdef __linux__
+    for (int i = 0; i < kNumCounters; i++)
+    {
+      if (mFds[i] < 0)
+        continue;
+      ioctl(mFds[i], PERF_EVENT_IOC_DISABLE, 0);
+      // value, time enabled, time running
+      uint64_t data[3];
+      if (read(mFds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+        continue;
+      // The kernel multiplexes counters when there are more events than hardware counters; scale up to estimate.
+      readings.values[i] = (double)data[0] * ((double)data[1] / (double)data[2]);
+      readings.valid[i] = true;
+    }
+#endif
+    return readings;
+  };
+
+  static const char* GetName(const Counter counter)
+  {
+    switch (counter)
+    {
+      case kCycles: return "cycles";
+      case kInstructions: return "instructions";
+      case kL1DMisses: return "l1d_misses";
+      case kLLCMisses: return "llc_misses";
+      case kBranchMisses: return "branch_misses";
+      case kPageFaults: return "page_faults";
+      default: return "unknown";
+    }
+  };
+
+private:
+  int mFds[kNumCounters];
+  std::string mError;
+
+#ifdef __linux__
+  int Open(const uint32_t type, const uint64_t config)
+  {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0 && errno == EACCES)
+    {
+      // perf_event_paranoid >= 2 only allows user-space counting.
+      attr.exclude_kernel = 1;
+      fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fd < 0 && mError.empty())
+      mError = std::string("perf_event_open: ") + std::strerror(errno);
+    return fd;
+  };
+#endif
+};
@@ -4,16 +4,54 @@
   #include <malloc.h> // For other platforms
 #endif
 
+#ifdef _WIN32
+  #include <fcntl.h> // _O_BINARY
+  #include <io.h> // _setmode
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
 #include <fstream>
 
 #include <sndfile.h>
 
+#include "json.hpp"
 #include "NAM/wav.h"
+#include "NAM/autotune.h"
 #include "NAM/dsp.h"
+#include "NAM/executor.h"
+#include "NAM/model_cache.h"
+#include "NAM/resampler.h"
+#include "NAM/ring_buffer.h"
 #include "NAM/wavenet.h"
 
+// Frames per call to the model without tuning (and per read from a file)
+#define BUFFER_SIZE 8192
+// The tuner picks frames per call from the powers of two in this range.
+#define MIN_TUNED_BUFFER_SIZE 1024
+#define MAX_TUNED_BUFFER_SIZE 16384
+
+// Decoding, inference and encoding each run on their own thread, connected by rings this many blocks long, so a
+// momentarily slow stage doesn't stall the others.
+#define RING_BLOCKS 8
+// Waiting stages spin this many times before they start sleeping
+#define SPIN_LIMIT 64
+#define SLEEP_MICROSECONDS 100
+
 void printProgressBar(int current, int total, int width = 40)
 {
   float progress = static_cast<float>(current) / total;
@@ -42,95 +80,850 @@ void printProgressBar(int current, int total, int width = 40)
   }
 }
 
+// Called by a stage that's waiting on another. Yields at first, since the wait is usually short, then sleeps so that
+// a stage that's far ahead doesn't take a core from the one it's waiting on.
+void waitForOtherStage(int& spins)
+{
+  if (spins++ < SPIN_LIMIT)
+    std::this_thread::yield();
+  else
+    std::this_thread::sleep_for(std::chrono::microseconds(SLEEP_MICROSECONDS));
+}
+
+// Writes all of `count` values, waiting for the consumer to make room as needed
+void writeAll(nam::SPSCRingBuffer<NAM_SAMPLE>& ring, const NAM_SAMPLE* data, size_t count)
+{
+  int spins = 0;
+  while (count > 0)
+  {
+    const size_t written = ring.write_(data, count);
+    data += written;
+    count -= written;
+    if (written > 0)
+      spins = 0;
+    else
+      waitForOtherStage(spins);
+  }
+}
+
+// Reads up to `count` values, waiting until there are `count` or the producer has closed the ring. Returns 0 once
+// everything has been read.
+size_t readBlock(nam::SPSCRingBuffer<NAM_SAMPLE>& ring, NAM_SAMPLE* data, const size_t count)
+{
+  int spins = 0;
+  while (true)
+  {
+    const bool closed = ring.is_closed();
+    const size_t available = ring.get_read_available();
+    if (available >= count || closed)
+      return ring.read_(data, count);
+    waitForOtherStage(spins);
+  }
+}
+
+// Runs the model at the rate it was trained at, whatever the file's rate
+std::unique_ptr<nam::ResamplingDSP> atSampleRate(std::unique_ptr<nam::DSP> model, const double sampleRate)
+{
+  auto resampling = std::make_unique<nam::ResamplingDSP>(std::move(model), sampleRate);
+  resampling->SetFlushDenormals(true);
+  return resampling;
+}
+
+// libsndfile's name for a sample format that dsp::wav also knows
+int toSndfileFormat(const dsp::wav::SampleFormat format)
+{
+  switch (format)
+  {
+    case dsp::wav::SampleFormat::PCM16: return SF_FORMAT_PCM_16;
+    case dsp::wav::SampleFormat::PCM24: return SF_FORMAT_PCM_24;
+    case dsp::wav::SampleFormat::PCM32: return SF_FORMAT_PCM_32;
+    default: return SF_FORMAT_FLOAT;
+  }
+}
+
+bool toWavFormat(const int sndfileFormat, dsp::wav::SampleFormat& format)
+{
+  switch (sndfileFormat & SF_FORMAT_SUBMASK)
+  {
+    case SF_FORMAT_PCM_16: format = dsp::wav::SampleFormat::PCM16; return true;
+    case SF_FORMAT_PCM_24: format = dsp::wav::SampleFormat::PCM24; return true;
+    case SF_FORMAT_PCM_32: format = dsp::wav::SampleFormat::PCM32; return true;
+    case SF_FORMAT_FLOAT: format = dsp::wav::SampleFormat::FLOAT32; return true;
+    default: return false;
+  }
+}
+
+// Names for raw PCM formats on the command line
+bool parseRawFormat(const std::string& name, dsp::wav::SampleFormat& format)
+{
+  if (name == "f32")
+    format = dsp::wav::SampleFormat::FLOAT32;
+  else if (name == "s16")
+    format = dsp::wav::SampleFormat::PCM16;
+  else if (name == "s24")
+    format = dsp::wav::SampleFormat::PCM24;
+  else if (name == "s32")
+    format = dsp::wav::SampleFormat::PCM32;
+  else
+    return false;
+  return true;
+}
+
+// Raw PCM has no header to say what it is.
+void setBinary(FILE* stream)
+{
+#ifdef _WIN32
+  _setmode(_fileno(stream), _O_BINARY);
+#else
+  (void)stream;
+#endif
+}
+
+// Reads WAV files with dsp::wav, which maps them and converts a block at a time, raw PCM from a stream (like stdin),
+// and anything else with libsndfile
+class AudioReader
+{
+public:
+  ~AudioReader()
+  {
+    if (mSndfile != nullptr)
+      sf_close(mSndfile);
+  }
+
+  // Fills in `info` as sf_open() would
+  bool Open(const char* path, SF_INFO& info)
+  {
+    const dsp::wav::LoadReturnCode wavCode = mWav.Open(path);
+    if (wavCode == dsp::wav::LoadReturnCode::SUCCESS)
+    {
+      info = SF_INFO();
+      info.frames = mWav.GetNumFrames();
+      info.samplerate = (int)mWav.GetSampleRate();
+      info.channels = mWav.GetNumChannels();
+      info.format = SF_FORMAT_WAV | toSndfileFormat(mWav.GetFormat());
+      info.sections = 1;
+      info.seekable = 1;
+      return true;
+    }
+    mSndfile = sf_open(path, SFM_READ, &info);
+    if (mSndfile == nullptr)
+    {
+      // A WAV file that neither could read is best explained by dsp::wav; anything else by libsndfile.
+      const bool isWav = wavCode != dsp::wav::LoadReturnCode::ERROR_OPENING
+                         && wavCode != dsp::wav::LoadReturnCode::ERROR_NOT_RIFF
+                         && wavCode != dsp::wav::LoadReturnCode::ERROR_NOT_WAVE;
+      mError = isWav ? dsp::wav::GetMsgForLoadReturnCode(wavCode) : sf_strerror(NULL);
+      return false;
+    }
+    return true;
+  }
+
+  // Interleaved little-endian samples, whose length isn't known until they stop. `info` describes them as a WAV file
+  // (of unknown length).
+  bool OpenRaw(FILE* stream, const dsp::wav::SampleFormat format, const int numChannels, const int sampleRate,
+               SF_INFO& info)
+  {
+    if (numChannels <= 0 || sampleRate <= 0)
+    {
+      mError = "Raw input needs a positive number of channels and sample rate";
+      return false;
+    }
+    setBinary(stream);
+    mRaw = stream;
+    mRawFormat = format;
+    mRawChannels = numChannels;
+    info = SF_INFO();
+    info.samplerate = sampleRate;
+    info.channels = numChannels;
+    info.format = SF_FORMAT_WAV | toSndfileFormat(format);
+    info.sections = 1;
+    return true;
+  }
+
+  // Interleaved; returns how many frames there were
+  sf_count_t ReadFrames(float* interleaved, const sf_count_t numFrames)
+  {
+    if (mSndfile != nullptr)
+      return sf_readf_float(mSndfile, interleaved, numFrames);
+    if (mRaw != nullptr)
+    {
+      const size_t frameBytes = mRawChannels * dsp::wav::GetBytesPerSample(mRawFormat);
+      if (mRawBytes.size() < numFrames * frameBytes)
+        mRawBytes.resize(numFrames * frameBytes);
+      // Only whole frames; a partial one at the very end is dropped.
+      const size_t got = fread(mRawBytes.data(), frameBytes, numFrames, mRaw);
+      dsp::wav::DecodeSamples(mRawBytes.data(), mRawFormat, got * mRawChannels, interleaved);
+      return (sf_count_t)got;
+    }
+    return mWav.Read(interleaved, numFrames);
+  }
+
+  bool Failed()
+  {
+    if (mRaw != nullptr && ferror(mRaw) != 0)
+      mError = strerror(errno);
+    else if (mSndfile != nullptr && sf_error(mSndfile) != SF_ERR_NO_ERROR)
+      mError = sf_strerror(mSndfile);
+    else
+      return false;
+    return true;
+  }
+
+  // Why Open() or OpenRaw() returned false, or Failed() true
+  const std::string& GetError() const { return mError; }
+
+private:
+  dsp::wav::Reader mWav;
+  SNDFILE* mSndfile = nullptr;
+  FILE* mRaw = nullptr;
+  dsp::wav::SampleFormat mRawFormat = dsp::wav::SampleFormat::FLOAT32;
+  int mRawChannels = 0;
+  std::vector<uint8_t> mRawBytes;
+  std::string mError;
+};
+
+// Writes WAV files in the formats dsp::wav knows with it (sized for the input up front), raw PCM to a stream (like
+// stdout), and anything else with libsndfile
+class AudioWriter
+{
+public:
+  ~AudioWriter() { Close(); }
+
+  // In the format `info` describes, for as many frames as it says are coming
+  bool Open(const char* path, const SF_INFO& info)
+  {
+    dsp::wav::SampleFormat format;
+    if ((info.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_WAV && toWavFormat(info.format, format))
+    {
+      errno = 0;
+      if (mWav.Open(path, info.samplerate, info.channels, format, std::max<sf_count_t>(info.frames, 0)))
+        return true;
+      mError = errno != 0 ? strerror(errno) : "Invalid number of channels or sample rate";
+      return false;
+    }
+    SF_INFO sndfileInfo = info;
+    mSndfile = sf_open(path, SFM_WRITE, &sndfileInfo);
+    if (mSndfile == nullptr)
+    {
+      mError = sf_strerror(NULL);
+      return false;
+    }
+    return true;
+  }
+
+  // Interleaved little-endian samples, with nothing else
+  bool OpenRaw(FILE* stream, const dsp::wav::SampleFormat format, const int numChannels)
+  {
+    setBinary(stream);
+    mRaw = stream;
+    mRawFormat = format;
+    mRawChannels = numChannels;
+    return true;
+  }
+
+  bool WriteFrames(const float* interleaved, const sf_count_t numFrames)
+  {
+    if (mSndfile != nullptr)
+      return sf_writef_float(mSndfile, interleaved, numFrames) == numFrames;
+    if (mRaw != nullptr)
+    {
+      const size_t numSamples = numFrames * mRawChannels;
+      const size_t bytesPerSample = dsp::wav::GetBytesPerSample(mRawFormat);
+      if (mRawBytes.size() < numSamples * bytesPerSample)
+        mRawBytes.resize(numSamples * bytesPerSample);
+      dsp::wav::EncodeSamples(interleaved, mRawFormat, numSamples, mRawBytes.data());
+      return fwrite(mRawBytes.data(), bytesPerSample, numSamples, mRaw) == numSamples;
+    }
+    return mWav.Write(interleaved, numFrames);
+  }
+
+  // Returns false if anything failed to make it to the file
+  bool Close()
+  {
+    if (mSndfile != nullptr)
+    {
+      const bool ok = sf_close(mSndfile) == 0;
+      mSndfile = nullptr;
+      return ok;
+    }
+    if (mRaw != nullptr)
+    {
+      // The stream isn't ours to close.
+      const bool ok = fflush(mRaw) == 0 && ferror(mRaw) == 0;
+      mRaw = nullptr;
+      return ok;
+    }
+    return !mWav.IsOpen() || mWav.Close();
+  }
+
+  // Why Open() returned false
+  const std::string& GetError() const { return mError; }
+
+private:
+  dsp::wav::Writer mWav;
+  SNDFILE* mSndfile = nullptr;
+  FILE* mRaw = nullptr;
+  dsp::wav::SampleFormat mRawFormat = dsp::wav::SampleFormat::FLOAT32;
+  int mRawChannels = 0;
+  std::vector<uint8_t> mRawBytes;
+  std::string mError;
+};
+
+std::vector<int> getBufferSizeCandidates()
+{
+  std::vector<int> candidates;
+  for (int size = MIN_TUNED_BUFFER_SIZE; size <= MAX_TUNED_BUFFER_SIZE; size *= 2)
+    candidates.push_back(size);
+  return candidates;
+}
+
+void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program << " <model_filename> <input_filename> <output_filename> [raw options]\n"
+            << "       " << program << " --batch <manifest.json> [--threads <n>]\n"
+            << "\n"
+            << "Frames per call and the model's tile size are tuned for this machine on first use and cached (see\n"
+            << "nam::Tuner). --no-tune runs with the defaults instead.\n"
+            << "\n"
+            << "An input or output of - is raw interleaved little-endian PCM on stdin or stdout:\n"
+            << "  --format <f32|s16|s24|s32>  sample format of raw PCM (default f32)\n"
+            << "  --output-format <...>       if raw output should differ from --format\n"
+            << "  --rate <hz>                 sample rate of raw input (default 48000)\n"
+            << "  --channels <n>              channels of raw input (default 1)" << std::endl;
+}
+
+// Each channel of an audio file. On failure, `error` says why.
+bool decodeChannels(const std::filesystem::path& path, std::vector<std::vector<NAM_SAMPLE>>& channels, SF_INFO& info,
+                    std::string& error)
+{
+  AudioReader file;
+  if (!file.Open(path.string().c_str(), info))
+  {
+    error = file.GetError();
+    return false;
+  }
+  channels.assign(info.channels, std::vector<NAM_SAMPLE>());
+  for (auto& channel : channels)
+    channel.reserve((size_t)std::max<sf_count_t>(info.frames, 0));
+  std::vector<float> interleaved(BUFFER_SIZE * info.channels);
+  sf_count_t numFrames;
+  while ((numFrames = file.ReadFrames(interleaved.data(), BUFFER_SIZE)) > 0)
+    for (sf_count_t i = 0; i < numFrames; ++i)
+      for (int c = 0; c < info.channels; c++)
+        channels[c].push_back((NAM_SAMPLE)interleaved[i * info.channels + c]);
+  if (file.Failed())
+  {
+    error = file.GetError();
+    return false;
+  }
+  return true;
+}
+
+// In the input's format, with one channel per entry of `channels` (which are all the same length). If the file
+// can't be created, `error` says why.
+bool writeChannels(const std::filesystem::path& path, const std::vector<std::vector<NAM_SAMPLE>>& channels,
+                   const SF_INFO& inputInfo, std::string& error)
+{
+  SF_INFO info = inputInfo;
+  info.channels = (int)channels.size();
+  info.frames = (sf_count_t)channels[0].size();
+  AudioWriter file;
+  if (!file.Open(path.string().c_str(), info))
+  {
+    error = file.GetError();
+    return false;
+  }
+  const size_t length = channels[0].size();
+  std::vector<float> interleaved(BUFFER_SIZE * channels.size());
+  bool ok = true;
+  for (size_t start = 0; start < length && ok; start += BUFFER_SIZE)
+  {
+    const size_t numFrames = std::min((size_t)BUFFER_SIZE, length - start);
+    for (size_t i = 0; i < numFrames; i++)
+      for (size_t c = 0; c < channels.size(); c++)
+        interleaved[i * channels.size() + c] = (float)channels[c][start + i];
+    ok = file.WriteFrames(interleaved.data(), numFrames);
+  }
+  return file.Close() && ok;
+}
+
+// Reamps every input in a manifest through every model in it:
+//
+//   {
+//     "inputs": ["di/riff.wav", "di/chords.flac"],
+//     "models": ["captures/plexi.nam", "captures/recto.nam"],
+//     "output_dir": "reamped"
+//   }
+//
+// Relative paths are relative to the manifest. Each output goes to <output_dir>/<model name>/<input file name>, with
+// every channel of the input run through its own instance of the model.
+//
+// Each model file is parsed once and each input is decoded once; the (input, model) pairs then run in parallel on a
+// work-stealing pool, each with its own model instance. An input's pairs are queued by the worker that decoded it,
+// so they start on the core that has it in cache and spread out as other workers run dry.
+int reampBatch(const std::filesystem::path& manifestPath, const int numThreads, const bool tune)
+{
+  nlohmann::json manifest;
+  try
+  {
+    std::ifstream file(manifestPath);
+    if (!file)
+      throw std::runtime_error("can't open it");
+    file >> manifest;
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Failed to read manifest " << manifestPath << ": " << e.what() << std::endl;
+    return 1;
+  }
+  const std::filesystem::path base = manifestPath.parent_path();
+  auto resolve = [&](const std::string& path) {
+    const std::filesystem::path p(path);
+    return p.is_absolute() ? p : base / p;
+  };
+  std::vector<std::filesystem::path> inputPaths;
+  std::vector<std::filesystem::path> modelPaths;
+  for (const auto& input : manifest.value("inputs", nlohmann::json::array()))
+    inputPaths.push_back(resolve(input.get<std::string>()));
+  for (const auto& model : manifest.value("models", nlohmann::json::array()))
+    modelPaths.push_back(resolve(model.get<std::string>()));
+  const std::filesystem::path outputDir = resolve(manifest.value("output_dir", std::string("reamped")));
+  if (inputPaths.empty() || modelPaths.empty())
+  {
+    std::cerr << "The manifest needs at least one input and one model" << std::endl;
+    return 1;
+  }
+  // Outputs are named after these, so they have to be unique.
+  {
+    std::set<std::filesystem::path> inputNames;
+    for (const auto& path : inputPaths)
+      if (!inputNames.insert(path.filename()).second)
+      {
+        std::cerr << "More than one input is called " << path.filename() << std::endl;
+        return 1;
+      }
+    std::set<std::filesystem::path> modelNames;
+    for (const auto& path : modelPaths)
+      if (!modelNames.insert(path.stem()).second)
+      {
+        std::cerr << "More than one model is called " << path.stem() << std::endl;
+        return 1;
+      }
+  }
+
+  // Parse each model once; instances are made from the parsed data. Tuning happens here too, before the pool is
+  // busy, and the instances get the same settings from the tuner's cache.
+  std::vector<std::shared_ptr<const nam::dspData>> models(modelPaths.size());
+  std::vector<int> bufferSizes(modelPaths.size(), BUFFER_SIZE);
+  for (size_t m = 0; m < modelPaths.size(); m++)
+  {
+    std::cout << "Loading model " << modelPaths[m] << std::endl;
+    try
+    {
+      models[m] = nam::ModelCache::get_global().get_data(modelPaths[m]);
+      std::filesystem::create_directories(outputDir / modelPaths[m].stem());
+      if (tune)
+      {
+        nam::Tuner& tuner = nam::Tuner::get_global();
+        const nam::activations::Precision precision = nam::activations::Precision::kFast;
+        bufferSizes[m] = tuner.tune_block_size(*models[m], precision, 0.0, getBufferSizeCandidates());
+        const long tileSize = tuner.tune_tile_size_(*nam::get_dsp(*models[m], precision), *models[m], bufferSizes[m]);
+        std::cout << "  " << bufferSizes[m] << " frames per call";
+        if (tileSize > 0)
+          std::cout << ", tiles of " << tileSize;
+        std::cout << std::endl;
+      }
+    }
+    catch (const std::exception& e)
+    {
+      std::cerr << "Failed to load model " << modelPaths[m] << ": " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  nam::Executor executor(numThreads);
+  std::mutex logMutex;
+  std::atomic<size_t> pairsDone{0};
+  std::atomic<size_t> failures{0};
+  // Seconds of audio reamped, summed over pairs and channels, and seconds spent in the models, summed over workers
+  double audioSeconds = 0.0;
+  double modelSeconds = 0.0;
+  const size_t numPairs = inputPaths.size() * modelPaths.size();
+  std::cout << "Reamping " << inputPaths.size() << " inputs through " << modelPaths.size() << " models on "
+            << executor.get_num_threads() << " threads" << std::endl;
+
+  auto runPair = [&](const std::shared_ptr<const std::vector<std::vector<NAM_SAMPLE>>>& input, const SF_INFO& info,
+                     const std::filesystem::path& inputPath, const size_t m) {
+    const std::filesystem::path outputPath = outputDir / modelPaths[m].stem() / inputPath.filename();
+    const size_t length = (*input)[0].size();
+    std::vector<std::vector<NAM_SAMPLE>> output(input->size());
+    const size_t bufferSize = bufferSizes[m];
+    std::vector<NAM_SAMPLE> block(bufferSize);
+    double seconds = 0.0;
+    // The pool already keeps every core busy, so the channels take turns, each with a fresh instance.
+    for (size_t c = 0; c < input->size(); c++)
+    {
+      std::unique_ptr<nam::DSP> instance = nam::get_dsp(*models[m], nam::activations::Precision::kFast);
+      if (tune)
+        nam::Tuner::get_global().tune_tile_size_(*instance, *models[m], (int)bufferSize);
+      std::unique_ptr<nam::ResamplingDSP> model = atSampleRate(std::move(instance), info.samplerate);
+      const std::vector<NAM_SAMPLE>& channel = (*input)[c];
+      // Run the silence that brings out the resampler's delay too, then drop as much from the start.
+      const size_t latency = model->GetLatency();
+      output[c].resize(length + latency);
+      const auto t0 = std::chrono::steady_clock::now();
+      for (size_t start = 0; start < length + latency; start += bufferSize)
+      {
+        const int numFrames = (int)std::min(bufferSize, length + latency - start);
+        // process() wants a mutable input, and the input is shared with the other models.
+        const size_t numInput = start < length ? std::min((size_t)numFrames, length - start) : 0;
+        std::copy(channel.begin() + start, channel.begin() + start + numInput, block.begin());
+        std::fill(block.begin() + numInput, block.begin() + numFrames, 0.0);
+        model->process(block.data(), output[c].data() + start, numFrames);
+        model->finalize_(numFrames);
+      }
+      seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      output[c].erase(output[c].begin(), output[c].begin() + latency);
+    }
+    std::string error;
+    const bool ok = writeChannels(outputPath, output, info, error);
+    if (!ok)
+      failures++;
+    const size_t done = ++pairsDone;
+    const double pairAudioSeconds = (double)(length * input->size()) / info.samplerate;
+    std::lock_guard<std::mutex> lock(logMutex);
+    audioSeconds += pairAudioSeconds;
+    modelSeconds += seconds;
+    std::cout << "[" << done << "/" << numPairs << "] " << (ok ? "" : "FAILED to write ") << outputPath;
+    if (ok)
+      std::cout << std::fixed << std::setprecision(1) << " (" << pairAudioSeconds / seconds << "x real time)";
+    else if (!error.empty())
+      std::cout << ": " << error;
+    std::cout << std::endl;
+  };
+
+  // Biggest inputs first, so that the last pairs to finish are short ones
+  std::vector<size_t> order(inputPaths.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  auto sizeOf = [&](const size_t i) {
+    std::error_code error;
+    const auto size = std::filesystem::file_size(inputPaths[i], error);
+    return error ? 0 : size;
+  };
+  std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b) { return sizeOf(a) > sizeOf(b); });
+
+  const auto start = std::chrono::steady_clock::now();
+  for (const size_t i : order)
+  {
+    executor.submit([&, i]() {
+      auto channels = std::make_shared<std::vector<std::vector<NAM_SAMPLE>>>();
+      SF_INFO info;
+      std::string error;
+      if (!decodeChannels(inputPaths[i], *channels, info, error))
+      {
+        failures += modelPaths.size();
+        pairsDone += modelPaths.size();
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << "Failed to decode " << inputPaths[i] << ": " << error << std::endl;
+        return;
+      }
+      std::shared_ptr<const std::vector<std::vector<NAM_SAMPLE>>> input = std::move(channels);
+      for (size_t m = 0; m < modelPaths.size(); m++)
+        executor.submit([&, input, info, i, m]() { runPair(input, info, inputPaths[i], m); });
+    });
+  }
+  executor.wait();
+  const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << std::fixed << std::setprecision(2) << "Reamped " << numPairs - failures << " of " << numPairs
+            << " pairs (" << audioSeconds << " s of audio) in " << wallSeconds << " s: " << std::setprecision(1)
+            << audioSeconds / wallSeconds << "x real time overall, " << audioSeconds / modelSeconds
+            << "x per thread in the models (" << executor.get_num_steals() << " tasks stolen)" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[])
 {
-  const int bufferSize = 8192;
+  int bufferSize = BUFFER_SIZE;
+  bool tune = true;
 
-  std::cout << "Version 1.0.0" << std::endl;
+  std::vector<std::string> positional;
+  std::string manifestPath;
+  int numThreads = 0;
+  dsp::wav::SampleFormat rawFormat = dsp::wav::SampleFormat::FLOAT32;
+  std::optional<dsp::wav::SampleFormat> rawOutputFormat;
+  int rawSampleRate = 48000;
+  int rawChannels = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    bool ok = true;
+    // Numbers that don't parse throw.
+    try
+    {
+      if (arg == "--batch" && hasValue)
+        manifestPath = argv[++i];
+      else if (arg == "--threads" && hasValue)
+        numThreads = std::stoi(argv[++i]);
+      else if (arg == "--format" && hasValue)
+        ok = parseRawFormat(argv[++i], rawFormat);
+      else if (arg == "--output-format" && hasValue)
+        ok = parseRawFormat(argv[++i], rawOutputFormat.emplace());
+      else if (arg == "--rate" && hasValue)
+        rawSampleRate = std::stoi(argv[++i]);
+      else if (arg == "--channels" && hasValue)
+        rawChannels = std::stoi(argv[++i]);
+      else if (arg == "--no-tune")
+        tune = false;
+      else if (arg.size() > 1 && arg[0] == '-')
+        ok = false;
+      else
+        positional.push_back(arg);
+    }
+    catch (const std::exception&)
+    {
+      std::cerr << "Invalid value for " << arg << ": " << argv[i] << "\n";
+      ok = false;
+    }
+    if (!ok)
+    {
+      printUsage(argv[0]);
+      return 1;
+    }
+  }
 
-  // Turn on fast tanh approximation
-  nam::activations::Activation::enable_fast_tanh();
+  if (!manifestPath.empty() && positional.empty())
+  {
+    std::cout << "Version 1.0.0" << std::endl;
+    return reampBatch(manifestPath, numThreads, tune);
+  }
 
   // Check if the correct number of command-line arguments is provided
-  if (argc != 4)
+  if (!manifestPath.empty() || positional.size() != 3)
   {
-    std::cerr << "Usage: " << argv[0] << " <model_filename> <input_filename> <output_filename>" << std::endl;
+    printUsage(argv[0]);
     return 1;
   }
 
-  const char* modelPath = argv[1];
+  const bool rawInput = positional[1] == "-";
+  const bool rawOutput = positional[2] == "-";
+  // stdout is for the audio, so everything else goes to stderr.
+  if (rawOutput)
+    std::cout.rdbuf(std::cerr.rdbuf());
+  std::cout << "Version 1.0.0" << std::endl;
+
+  const char* modelPath = positional[0].c_str();
   std::cout << "Loading model " << modelPath << std::endl;
-  std::unique_ptr<nam::DSP> model;
-  model.reset();
-  model = std::move(nam::get_dsp(modelPath));
+  // One instance per channel, each with its own state; the first load's data makes the rest.
+  nam::dspData modelData;
+  // Fast tanh approximation
+  std::unique_ptr<nam::DSP> firstModel = nam::get_dsp(modelPath, modelData, nam::activations::Precision::kFast);
 
-  if (model == nullptr)
+  if (firstModel == nullptr)
   {
     std::cerr << "Failed to load model" << std::endl;
     exit(1);
   }
 
-  const char* inputFilename = argv[2];
-  const char* outputFilename = argv[3];
+  const char* inputFilename = positional[1].c_str();
+  const char* outputFilename = positional[2].c_str();
 
   // Open the input WAV file
   SF_INFO sfInfo;
-  SNDFILE* inputFilePtr = sf_open(inputFilename, SFM_READ, &sfInfo);
-  if (!inputFilePtr)
+  AudioReader inputFile;
+  const bool inputOpened = rawInput ? inputFile.OpenRaw(stdin, rawFormat, rawChannels, rawSampleRate, sfInfo)
+                                    : inputFile.Open(inputFilename, sfInfo);
+  if (!inputOpened)
   {
-    std::cerr << "Error opening input file: " << sf_strerror(NULL) << std::endl;
+    std::cerr << "Error opening input file: " << inputFile.GetError() << std::endl;
     return 1;
   }
+  const int numChannels = sfInfo.channels;
+  // Each at the model's own rate, with decaying tails kept out of (slow) subnormal arithmetic
+  std::vector<std::unique_ptr<nam::ResamplingDSP>> models;
+  models.push_back(atSampleRate(std::move(firstModel), sfInfo.samplerate));
+  while ((int)models.size() < numChannels)
+    models.push_back(atSampleRate(nam::get_dsp(modelData, nam::activations::Precision::kFast), sfInfo.samplerate));
+  if (models[0]->IsResampling())
+    std::cout << "Resampling from " << sfInfo.samplerate << " Hz to the model's " << models[0]->GetModelSampleRate()
+              << " Hz and back" << std::endl;
+  if (tune)
+  {
+    nam::Tuner& tuner = nam::Tuner::get_global();
+    bufferSize = tuner.tune_block_size(modelData, nam::activations::Precision::kFast, sfInfo.samplerate,
+                                       getBufferSizeCandidates());
+    // The models see about as many frames per call at their own rate.
+    const int modelBufferSize = (int)std::ceil(bufferSize * models[0]->GetModelSampleRate() / sfInfo.samplerate);
+    long tileSize = 0;
+    for (auto& model : models)
+      tileSize = tuner.tune_tile_size_(model->GetModel(), modelData, modelBufferSize);
+    std::cout << "Tuned to " << bufferSize << " frames per call";
+    if (tileSize > 0)
+      std::cout << " and tiles of " << tileSize;
+    std::cout << std::endl;
+  }
 
-  // Open the output WAV file for writing
+  // Open the output WAV file for writing, with as many channels as the input
   SF_INFO outputInfo = sfInfo; // Copy input file info
-  outputInfo.channels = 1;
-  SNDFILE* outputFilePtr = sf_open(outputFilename, SFM_WRITE, &outputInfo);
-  if (!outputFilePtr)
+  AudioWriter outputFile;
+  const bool outputOpened = rawOutput ? outputFile.OpenRaw(stdout, rawOutputFormat.value_or(rawFormat), numChannels)
+                                      : outputFile.Open(outputFilename, outputInfo);
+  if (!outputOpened)
   {
-    std::cerr << "Error opening output file: " << sf_strerror(NULL) << std::endl;
-    sf_close(inputFilePtr);
+    std::cerr << "Error opening output file: " << outputFile.GetError() << std::endl;
     return 1;
   }
 
-  std::vector<NAM_SAMPLE> buffer(bufferSize * sfInfo.channels);
-  std::vector<NAM_SAMPLE> processedBuffer(bufferSize * sfInfo.channels);
-  std::vector<NAM_SAMPLE> leftChannelData(bufferSize);
-
-  sf_count_t numChunks = sfInfo.frames / bufferSize;
-
-  for (sf_count_t chunkIndex = 0; chunkIndex <= numChunks; ++chunkIndex)
+  // Each channel runs through its own model, between its own pair of rings.
+  std::vector<std::unique_ptr<nam::SPSCRingBuffer<NAM_SAMPLE>>> inputRings;
+  std::vector<std::unique_ptr<nam::SPSCRingBuffer<NAM_SAMPLE>>> outputRings;
+  for (int c = 0; c < numChannels; c++)
   {
-    leftChannelData.clear();
-
-    sf_count_t num_frames = sf_readf_double(inputFilePtr, buffer.data(), bufferSize);
+    inputRings.push_back(std::make_unique<nam::SPSCRingBuffer<NAM_SAMPLE>>(RING_BLOCKS * bufferSize));
+    outputRings.push_back(std::make_unique<nam::SPSCRingBuffer<NAM_SAMPLE>>(RING_BLOCKS * bufferSize));
+  }
+  std::atomic<sf_count_t> framesWritten{0};
+  std::atomic<bool> encoderDone{false};
+  // How long each inference thread spent in its model, in seconds
+  std::vector<double> inferenceSeconds(numChannels, 0.0);
+  bool readFailed = false;
+  bool writeFailed = false;
+  const auto start = std::chrono::steady_clock::now();
 
-    if (num_frames <= 0)
+  // Decoder: splits the channels up
+  std::thread decoder([&]() {
+    std::vector<float> interleaved(bufferSize * numChannels);
+    std::vector<NAM_SAMPLE> block(bufferSize);
+    while (true)
     {
-      break;
+      const sf_count_t numFrames = inputFile.ReadFrames(interleaved.data(), bufferSize);
+      if (numFrames <= 0)
+        break;
+      for (int c = 0; c < numChannels; c++)
+      {
+        for (sf_count_t i = 0; i < numFrames; ++i)
+          block[i] = (NAM_SAMPLE)interleaved[i * numChannels + c];
+        writeAll(*inputRings[c], block.data(), numFrames);
+      }
     }
+    readFailed = inputFile.Failed();
+    for (auto& ring : inputRings)
+      ring->close_();
+  });
 
-    for (sf_count_t i = 0; i < num_frames; ++i)
+  // No more inference threads than the machine has hardware threads: with more channels than that, each thread takes
+  // every numInferenceThreads-th channel and runs them a block at a time in turn, in the order the decoder fills them.
+  const int numInferenceThreads = std::min(numChannels, std::max(1, (int)std::thread::hardware_concurrency()));
+  std::vector<std::thread> inference;
+  for (int t = 0; t < numInferenceThreads; t++)
+  {
+    inference.emplace_back([&, t]() {
+      std::vector<NAM_SAMPLE> input(bufferSize);
+      std::vector<NAM_SAMPLE> output(bufferSize);
+      struct ChannelState
+      {
+        int channel;
+        // The first outputs of a resampled model are the filters' delay: drop that many, and bring out the end with
+        // as much silence.
+        int toSkip;
+        int tail;
+        bool done;
+      };
+      std::vector<ChannelState> channels;
+      for (int c = t; c < numChannels; c += numInferenceThreads)
+        channels.push_back({c, models[c]->GetLatency(), models[c]->GetLatency(), false});
+      size_t numDone = 0;
+      while (numDone < channels.size())
+      {
+        for (ChannelState& state : channels)
+        {
+          if (state.done)
+            continue;
+          const int c = state.channel;
+          int numFrames = (int)readBlock(*inputRings[c], input.data(), bufferSize);
+          if (numFrames == 0)
+          {
+            if (state.tail == 0)
+            {
+              state.done = true;
+              numDone++;
+              outputRings[c]->close_();
+              continue;
+            }
+            numFrames = std::min(state.tail, bufferSize);
+            state.tail -= numFrames;
+            std::fill(input.begin(), input.begin() + numFrames, 0.0);
+          }
+          const auto t0 = std::chrono::steady_clock::now();
+          models[c]->process(input.data(), output.data(), numFrames);
+          models[c]->finalize_(numFrames);
+          const int skipped = std::min(state.toSkip, numFrames);
+          state.toSkip -= skipped;
+          inferenceSeconds[c] += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+          writeAll(*outputRings[c], output.data() + skipped, numFrames - skipped);
+        }
+      }
+    });
+  }
+
+  // Encoder: takes whatever the first channel has ready (so it never holds up inference) and the same from the
+  // others, which run in step with it.
+  std::thread encoder([&]() {
+    std::vector<NAM_SAMPLE> block(bufferSize);
+    std::vector<float> interleaved(bufferSize * numChannels);
+    while (true)
     {
-      NAM_SAMPLE leftSample = buffer[i * sfInfo.channels];
-      leftChannelData.push_back(leftSample);
+      size_t numFrames = readBlock(*outputRings[0], block.data(), 1);
+      if (numFrames == 0)
+        break;
+      numFrames += outputRings[0]->read_(block.data() + numFrames, bufferSize - numFrames);
+      for (int c = 0; c < numChannels; c++)
+      {
+        if (c > 0 && readBlock(*outputRings[c], block.data(), numFrames) != numFrames)
+          writeFailed = true;
+        for (size_t i = 0; i < numFrames; ++i)
+          interleaved[i * numChannels + c] = (float)block[i];
+      }
+      if (!outputFile.WriteFrames(interleaved.data(), numFrames))
+        writeFailed = true;
+      framesWritten.fetch_add(numFrames, std::memory_order_relaxed);
     }
+    encoderDone.store(true, std::memory_order_release);
+  });
 
-    model->process(leftChannelData.data(), processedBuffer.data(), num_frames);
-    model->finalize_(num_frames);
-
-    printProgressBar(chunkIndex, numChunks);
-
-    sf_writef_double(outputFilePtr, processedBuffer.data(), num_frames);
+  // Progress from here, so the pipeline never waits on the terminal. It stays short of 100% (which ends the line)
+  // until the end.
+  while (!encoderDone.load(std::memory_order_acquire))
+  {
+    if (sfInfo.frames > 0)
+      printProgressBar((int)(99 * framesWritten.load(std::memory_order_relaxed) / sfInfo.frames), 100);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
   }
+  decoder.join();
+  for (std::thread& thread : inference)
+    thread.join();
+  encoder.join();
 
   // Just make the progress bar show 100%
   printProgressBar(100, 100);
 
-  // Close the input and output files
-  sf_close(inputFilePtr);
-  sf_close(outputFilePtr);
+  // Finish the output's header
+  if (!outputFile.Close())
+    writeFailed = true;
+
+  if (readFailed || writeFailed)
+  {
+    std::cerr << "Error " << (readFailed ? "reading the input" : "writing the output") << std::endl;
+    exit(1);
+  }
 
+  const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << std::fixed << std::setprecision(2) << "Processed " << framesWritten.load() << " frames of "
+            << numChannels << " channel(s) in " << wallSeconds << " s (the busiest channel spent "
+            << *std::max_element(inferenceSeconds.begin(), inferenceSeconds.end()) << " s in its model)"
+            << std::endl;
   std::cout << "Audio file successfully processed and written." << std::endl;
 
   exit(0);
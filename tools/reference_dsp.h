@@ -0,0 +1,484 @@
+#pragma once
+// Plain, double-precision, one-sample-at-a-time reference implementations of the NAM architectures.
+//
+// These are written for obviousness, not speed: no Eigen, no buffers shared between stages, no block processing.
+// checkmodel runs them alongside the real models to bound the error of the optimized code paths. They follow the
+// weight layouts and the semantics of the C++ core (see the comments where those are surprising), not the trainer's.
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "NAM/dsp.h"
+
+namespace reference
+{
+inline double fastTanh(const double x)
+{
+  // Same rational approximation as nam::activations::fast_tanh()
+  const double ax = std::fabs(x);
+  const double x2 = x * x;
+  return (x * (2.45550750702956 + 2.45550750702956 * ax + (0.893229853513558 + 0.821226666969744 * ax) * x2)
+          / (2.44506634652299 + (2.44506634652299 + x2) * std::fabs(x + 0.814642734961073 * x * ax)));
+}
+
+inline double sigmoid(const double x)
+{
+  return 1.0 / (1.0 + std::exp(-x));
+}
+
+inline double activation(const std::string& name, const double x)
+{
+  // The table-based ones approximate the exact functions to within ~5e-6.
+  if (name == "Tanh" || name == "LUTtanh")
+    return std::tanh(x);
+  if (name == "Fasttanh")
+    return fastTanh(x);
+  if (name == "Hardtanh")
+    return std::min(1.0, std::max(-1.0, x));
+  if (name == "ReLU")
+    return x > 0.0 ? x : 0.0;
+  if (name == "Sigmoid" || name == "LUTsigmoid")
+    return sigmoid(x);
+  throw std::runtime_error("Reference: unknown activation " + name);
+}
+
+// Reads the flat weight vector in order
+class WeightReader
+{
+public:
+  WeightReader(const std::vector<float>& weights)
+  : mWeights(weights)
+  {
+  }
+  double Next()
+  {
+    if (mPosition >= mWeights.size())
+      throw std::runtime_error("Reference: ran out of weights");
+    return mWeights[mPosition++];
+  }
+  bool Done() const { return mPosition == mWeights.size(); }
+
+private:
+  const std::vector<float>& mWeights;
+  size_t mPosition = 0;
+};
+
+// y = W x (+ b), W stored row-major (out, in)
+struct Dense
+{
+  int inChannels = 0;
+  int outChannels = 0;
+  std::vector<double> weight;
+  std::vector<double> bias;
+
+  void Read(WeightReader& reader, const int in, const int out, const bool doBias)
+  {
+    inChannels = in;
+    outChannels = out;
+    weight.resize((size_t)in * out);
+    for (double& w : weight)
+      w = reader.Next();
+    bias.assign(doBias ? out : 0, 0.0);
+    for (double& b : bias)
+      b = reader.Next();
+  }
+  void Apply(const double* x, double* y) const
+  {
+    for (int i = 0; i < outChannels; i++)
+    {
+      double sum = bias.empty() ? 0.0 : bias[i];
+      for (int j = 0; j < inChannels; j++)
+        sum += weight[(size_t)i * inChannels + j] * x[j];
+      y[i] = sum;
+    }
+  }
+};
+
+// The last `length` frames of a multichannel signal; frame 0 is the newest. Starts out all zeros.
+class History
+{
+public:
+  void Resize(const int channels, const int length)
+  {
+    mChannels = channels;
+    mLength = std::max(1, length);
+    mData.assign((size_t)mChannels * mLength, 0.0);
+    mNewest = 0;
+  }
+  void Push(const double* frame)
+  {
+    mNewest = (mNewest + 1) % mLength;
+    std::copy(frame, frame + mChannels, &mData[(size_t)mNewest * mChannels]);
+  }
+  // `delay` frames ago (0 is the newest)
+  const double* Get(const int delay) const
+  {
+    return &mData[(size_t)((mNewest - delay + mLength) % mLength) * mChannels];
+  }
+
+private:
+  int mChannels = 0;
+  int mLength = 1;
+  int mNewest = 0;
+  std::vector<double> mData;
+};
+
+// Causal dilated convolution. Weights are flattened as (out, in, kernel) and tap k looks back
+// dilation * (kernel - 1 - k) frames.
+struct DilatedConv
+{
+  int inChannels = 0;
+  int outChannels = 0;
+  int kernelSize = 0;
+  int dilation = 1;
+  std::vector<double> weight; // [k][out][in]
+  std::vector<double> bias;
+
+  void Read(WeightReader& reader, const int in, const int out, const int kernel, const bool doBias, const int dil)
+  {
+    inChannels = in;
+    outChannels = out;
+    kernelSize = kernel;
+    dilation = dil;
+    weight.assign((size_t)kernel * out * in, 0.0);
+    for (int i = 0; i < out; i++)
+      for (int j = 0; j < in; j++)
+        for (int k = 0; k < kernel; k++)
+          weight[((size_t)k * out + i) * in + j] = reader.Next();
+    bias.assign(doBias ? out : 0, 0.0);
+    for (double& b : bias)
+      b = reader.Next();
+  }
+  int GetLookback() const { return dilation * (kernelSize - 1); }
+  // `input` must hold at least GetLookback() + 1 frames, the newest being the current one.
+  void Apply(const History& input, double* y) const
+  {
+    for (int i = 0; i < outChannels; i++)
+      y[i] = bias.empty() ? 0.0 : bias[i];
+    for (int k = 0; k < kernelSize; k++)
+    {
+      const double* x = input.Get(dilation * (kernelSize - 1 - k));
+      for (int i = 0; i < outChannels; i++)
+        for (int j = 0; j < inChannels; j++)
+          y[i] += weight[((size_t)k * outChannels + i) * inChannels + j] * x[j];
+    }
+  }
+};
+
+class Model
+{
+public:
+  virtual ~Model() = default;
+  virtual double Process(const double x) = 0;
+  // Samples of silence that the real model runs through at load (see DSP::prewarm())
+  int prewarmSamples = 0;
+
+  void Prewarm()
+  {
+    for (int i = 0; i < prewarmSamples; i++)
+      Process(0.0);
+  }
+};
+
+// y[n] = b + sum_k w[k] x[n - k]
+class Linear : public Model
+{
+public:
+  Linear(const nlohmann::json& config, const std::vector<float>& weights)
+  {
+    const int receptiveField = config["receptive_field"];
+    const bool doBias = config["bias"];
+    WeightReader reader(weights);
+    mWeight.resize(receptiveField);
+    for (double& w : mWeight)
+      w = reader.Next();
+    mBias = doBias ? reader.Next() : 0.0;
+    mInput.Resize(1, receptiveField);
+  }
+  double Process(const double x) override
+  {
+    mInput.Push(&x);
+    double y = mBias;
+    for (size_t k = 0; k < mWeight.size(); k++)
+      y += mWeight[k] * mInput.Get((int)k)[0];
+    return y;
+  }
+
+private:
+  std::vector<double> mWeight;
+  double mBias;
+  History mInput;
+};
+
+// Blocks of (kernel-2 dilated conv, batchnorm or bias, activation), then a linear head
+class ConvNet : public Model
+{
+public:
+  ConvNet(const nlohmann::json& config, const std::vector<float>& weights)
+  {
+    const int channels = config["channels"];
+    const bool batchnorm = config["batchnorm"];
+    mActivation = config["activation"];
+    WeightReader reader(weights);
+    prewarmSamples = 1;
+    for (size_t i = 0; i < config["dilations"].size(); i++)
+    {
+      const int dilation = config["dilations"][i];
+      Block block;
+      block.conv.Read(reader, i == 0 ? 1 : channels, channels, 2, !batchnorm, dilation);
+      if (batchnorm)
+      {
+        std::vector<double> mean(channels), var(channels), weight(channels), bias(channels);
+        for (double& v : mean)
+          v = reader.Next();
+        for (double& v : var)
+          v = reader.Next();
+        for (double& v : weight)
+          v = reader.Next();
+        for (double& v : bias)
+          v = reader.Next();
+        const double eps = reader.Next();
+        for (int c = 0; c < channels; c++)
+        {
+          block.scale.push_back(weight[c] / std::sqrt(eps + var[c]));
+          block.loc.push_back(bias[c] - block.scale[c] * mean[c]);
+        }
+      }
+      block.input.Resize(block.conv.inChannels, block.conv.GetLookback() + 1);
+      mBlocks.push_back(block);
+      prewarmSamples += dilation;
+    }
+    mHeadWeight.resize(channels);
+    for (double& w : mHeadWeight)
+      w = reader.Next();
+    mHeadBias = reader.Next();
+    if (!reader.Done())
+      throw std::runtime_error("Reference ConvNet: too many weights");
+  }
+  double Process(const double x) override
+  {
+    std::vector<double> value(1, x);
+    for (Block& block : mBlocks)
+    {
+      block.input.Push(value.data());
+      std::vector<double> out(block.conv.outChannels);
+      block.conv.Apply(block.input, out.data());
+      for (size_t c = 0; c < out.size(); c++)
+      {
+        if (!block.scale.empty())
+          out[c] = out[c] * block.scale[c] + block.loc[c];
+        out[c] = activation(mActivation, out[c]);
+      }
+      value = out;
+    }
+    double y = mHeadBias;
+    for (size_t c = 0; c < value.size(); c++)
+      y += mHeadWeight[c] * value[c];
+    return y;
+  }
+
+private:
+  struct Block
+  {
+    DilatedConv conv;
+    std::vector<double> scale;
+    std::vector<double> loc;
+    History input;
+  };
+  std::string mActivation;
+  std::vector<Block> mBlocks;
+  std::vector<double> mHeadWeight;
+  double mHeadBias;
+};
+
+// Stacked LSTM cells (gates in PyTorch's i, f, g, o order) and a linear head
+class LSTM : public Model
+{
+public:
+  LSTM(const nlohmann::json& config, const std::vector<float>& weights)
+  {
+    const int numLayers = config["num_layers"];
+    const int inputSize = config["input_size"];
+    const int hiddenSize = config["hidden_size"];
+    WeightReader reader(weights);
+    for (int l = 0; l < numLayers; l++)
+    {
+      Cell cell;
+      cell.inputSize = l == 0 ? inputSize : hiddenSize;
+      cell.hiddenSize = hiddenSize;
+      cell.gates.Read(reader, cell.inputSize + hiddenSize, 4 * hiddenSize, true);
+      // The initial hidden and cell states are stored with the weights.
+      cell.h.resize(hiddenSize);
+      for (double& v : cell.h)
+        v = reader.Next();
+      cell.c.resize(hiddenSize);
+      for (double& v : cell.c)
+        v = reader.Next();
+      mCells.push_back(cell);
+    }
+    mHeadWeight.resize(hiddenSize);
+    for (double& w : mHeadWeight)
+      w = reader.Next();
+    mHeadBias = reader.Next();
+    if (!reader.Done())
+      throw std::runtime_error("Reference LSTM: too many weights");
+  }
+  double Process(const double x) override
+  {
+    std::vector<double> input(1, x);
+    for (Cell& cell : mCells)
+    {
+      const int h = cell.hiddenSize;
+      std::vector<double> xh(input);
+      xh.insert(xh.end(), cell.h.begin(), cell.h.end());
+      std::vector<double> ifgo(4 * h);
+      cell.gates.Apply(xh.data(), ifgo.data());
+      for (int i = 0; i < h; i++)
+      {
+        cell.c[i] = sigmoid(ifgo[h + i]) * cell.c[i] + sigmoid(ifgo[i]) * std::tanh(ifgo[2 * h + i]);
+        cell.h[i] = sigmoid(ifgo[3 * h + i]) * std::tanh(cell.c[i]);
+      }
+      input = cell.h;
+    }
+    double y = mHeadBias;
+    for (size_t i = 0; i < input.size(); i++)
+      y += mHeadWeight[i] * input[i];
+    return y;
+  }
+
+private:
+  struct Cell
+  {
+    int inputSize;
+    int hiddenSize;
+    Dense gates;
+    std::vector<double> h;
+    std::vector<double> c;
+  };
+  std::vector<Cell> mCells;
+  std::vector<double> mHeadWeight;
+  double mHeadBias;
+};
+
+// Layer arrays of gated/ungated residual dilated convolutions with a summed head, as in the C++ core:
+// * The activation is applied to all of a gated layer's conv outputs before the bottom half is gated by a sigmoid.
+// * A layer array's head accumulator starts from the previous array's head output.
+class WaveNet : public Model
+{
+public:
+  WaveNet(const nlohmann::json& config, const std::vector<float>& weights)
+  {
+    WeightReader reader(weights);
+    prewarmSamples = 1;
+    for (size_t a = 0; a < config["layers"].size(); a++)
+    {
+      const nlohmann::json& arrayConfig = config["layers"][a];
+      LayerArray array;
+      const int inputSize = arrayConfig["input_size"];
+      const int conditionSize = arrayConfig["condition_size"];
+      const int headSize = arrayConfig["head_size"];
+      array.channels = arrayConfig["channels"];
+      const int kernelSize = arrayConfig["kernel_size"];
+      array.activation = arrayConfig["activation"];
+      array.gated = arrayConfig["gated"];
+      const bool headBias = arrayConfig["head_bias"];
+      const int convChannels = array.gated ? 2 * array.channels : array.channels;
+
+      array.rechannel.Read(reader, inputSize, array.channels, false);
+      for (size_t l = 0; l < arrayConfig["dilations"].size(); l++)
+      {
+        Layer layer;
+        layer.conv.Read(reader, array.channels, convChannels, kernelSize, true, arrayConfig["dilations"][l]);
+        layer.mixin.Read(reader, conditionSize, convChannels, false);
+        layer.oneByOne.Read(reader, array.channels, array.channels, true);
+        layer.input.Resize(array.channels, layer.conv.GetLookback() + 1);
+        prewarmSamples += layer.conv.GetLookback();
+        array.layers.push_back(layer);
+      }
+      array.headRechannel.Read(reader, array.channels, headSize, headBias);
+      mArrays.push_back(array);
+    }
+    mHeadScale = reader.Next();
+    if (!reader.Done())
+      throw std::runtime_error("Reference WaveNet: too many weights");
+  }
+  double Process(const double x) override
+  {
+    const std::vector<double> condition(1, x);
+    std::vector<double> arrayInput = condition;
+    std::vector<double> head;
+    for (LayerArray& array : mArrays)
+    {
+      const int channels = array.channels;
+      std::vector<double> h(channels);
+      array.rechannel.Apply(arrayInput.data(), h.data());
+      std::vector<double> headInput = head.empty() ? std::vector<double>(channels, 0.0) : head;
+      for (Layer& layer : array.layers)
+      {
+        layer.input.Push(h.data());
+        std::vector<double> z(layer.conv.outChannels);
+        std::vector<double> mixin(layer.conv.outChannels);
+        layer.conv.Apply(layer.input, z.data());
+        layer.mixin.Apply(condition.data(), mixin.data());
+        for (size_t i = 0; i < z.size(); i++)
+          z[i] = activation(array.activation, z[i] + mixin[i]);
+        if (array.gated)
+          for (int i = 0; i < channels; i++)
+            z[i] *= sigmoid(z[channels + i]);
+        z.resize(channels);
+        for (int i = 0; i < channels; i++)
+          headInput[i] += z[i];
+        std::vector<double> residual(channels);
+        layer.oneByOne.Apply(z.data(), residual.data());
+        for (int i = 0; i < channels; i++)
+          h[i] += residual[i];
+      }
+      head.assign(array.headRechannel.outChannels, 0.0);
+      array.headRechannel.Apply(headInput.data(), head.data());
+      arrayInput = h;
+    }
+    return mHeadScale * head[0];
+  }
+
+private:
+  struct Layer
+  {
+    DilatedConv conv;
+    Dense mixin;
+    Dense oneByOne;
+    History input;
+  };
+  struct LayerArray
+  {
+    int channels;
+    std::string activation;
+    bool gated;
+    Dense rechannel;
+    std::vector<Layer> layers;
+    Dense headRechannel;
+  };
+  std::vector<LayerArray> mArrays;
+  double mHeadScale;
+};
+
+// Build the reference for a model loaded with nam::get_dsp(path, data). Throws for unsupported architectures.
+inline std::unique_ptr<Model> GetModel(const nam::dspData& data)
+{
+  std::unique_ptr<Model> model;
+  if (data.architecture == "Linear")
+    model = std::make_unique<Linear>(data.config, data.weights);
+  else if (data.architecture == "ConvNet")
+    model = std::make_unique<ConvNet>(data.config, data.weights);
+  else if (data.architecture == "LSTM")
+    model = std::make_unique<LSTM>(data.config, data.weights);
+  else if (data.architecture == "WaveNet")
+    model = std::make_unique<WaveNet>(data.config, data.weights);
+  else
+    throw std::runtime_error("No reference implementation for architecture " + data.architecture);
+  return model;
+}
+}; // namespace reference